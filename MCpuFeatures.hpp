@@ -0,0 +1,168 @@
+// MCpuFeatures.hpp -- run-time CPU feature detection           -*- C++ -*-
+// This file is part of MZC4.  See file "ReadMe.txt" and "License.txt".
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef MZC4_MCPUFEATURES_HPP_
+#define MZC4_MCPUFEATURES_HPP_      1   /* Version 1 */
+
+// mcpu_... functions
+
+////////////////////////////////////////////////////////////////////////////
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+    #define MCPU_X86
+    #ifdef _MSC_VER
+        #include <intrin.h>     // for __cpuid, __cpuidex, _xgetbv
+    #else
+        #include <cpuid.h>      // for __get_cpuid, __get_cpuid_count
+    #endif
+    #include <immintrin.h>      // for SSE2, SSSE3, AVX2 intrinsics
+#endif
+#if defined(_MSC_VER)
+    #include <intrin.h>         // for _InterlockedOr, _InterlockedExchange
+#endif
+
+// MCPU_TARGET(x) allows the intrinsics of x in a function without
+// compiling the whole file for x. Call such a function only if
+// mcpu_features() says the CPU has x.
+#if defined(__GNUC__) || defined(__clang__)
+    #define MCPU_TARGET(x)  __attribute__((target(x)))
+#else
+    #define MCPU_TARGET(x)
+#endif
+
+enum MCpuFeature
+{
+    MCPU_SSE2   = 0x01,
+    MCPU_SSSE3  = 0x02,
+    MCPU_SSE41  = 0x04,
+    MCPU_AVX2   = 0x08,
+    MCPU_FMA    = 0x10
+};
+
+// the MCpuFeature flags of this CPU. any thread can call it at any time
+unsigned int mcpu_features(void);
+
+////////////////////////////////////////////////////////////////////////////
+
+#ifdef MCPU_X86
+    inline void mcpu_cpuid(unsigned int leaf, unsigned int subleaf,
+                           unsigned int regs[4])
+    {
+    #ifdef _MSC_VER
+        int info[4];
+        __cpuidex(info, int(leaf), int(subleaf));
+        for (int i = 0; i < 4; ++i)
+            regs[i] = unsigned(info[i]);
+    #else
+        regs[0] = regs[1] = regs[2] = regs[3] = 0;
+        __get_cpuid_count(leaf, subleaf, &regs[0], &regs[1], &regs[2], &regs[3]);
+    #endif
+    }
+
+    inline unsigned long long mcpu_xgetbv(unsigned int index)
+    {
+    #ifdef _MSC_VER
+        return _xgetbv(index);
+    #else
+        unsigned int eax, edx;
+        __asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(index));
+        return ((unsigned long long)edx << 32) | eax;
+    #endif
+    }
+
+    inline unsigned int mcpu_detect_features(void)
+    {
+        unsigned int regs[4];
+        mcpu_cpuid(0, 0, regs);
+        unsigned int max_leaf = regs[0];
+        if (max_leaf < 1)
+            return 0;
+
+        unsigned int ret = 0;
+        mcpu_cpuid(1, 0, regs);
+        if (regs[3] & (1u << 26))
+            ret |= MCPU_SSE2;
+        if (regs[2] & (1u << 9))
+            ret |= MCPU_SSSE3;
+        if (regs[2] & (1u << 19))
+            ret |= MCPU_SSE41;
+
+        // the OS has to save the YMM registers
+        bool avx = (regs[2] & (1u << 27)) && (regs[2] & (1u << 28)) &&
+                   (mcpu_xgetbv(0) & 6) == 6;
+        if (avx && (regs[2] & (1u << 12)))
+            ret |= MCPU_FMA;
+        if (avx && max_leaf >= 7)
+        {
+            mcpu_cpuid(7, 0, regs);
+            if (regs[1] & (1u << 5))
+                ret |= MCPU_AVX2;
+        }
+        return ret;
+    }
+#else
+    inline unsigned int mcpu_detect_features(void)
+    {
+        return 0;
+    }
+#endif
+
+// the cache of mcpu_features is a zero-initialized static without the
+// guard of the initialization, which isn't thread-safe before C++11. it is
+// read and written atomically, so the threads may race to detect the same
+// features, but never see a torn value.
+#if defined(_MSC_VER)
+    typedef volatile long mcpu_cache_t;
+
+    inline unsigned int mcpu_cache_load(mcpu_cache_t *cache)
+    {
+        return (unsigned int)_InterlockedOr(cache, 0);
+    }
+
+    inline void mcpu_cache_store(mcpu_cache_t *cache, unsigned int value)
+    {
+        _InterlockedExchange(cache, long(value));
+    }
+#elif defined(__ATOMIC_RELAXED)
+    typedef unsigned int mcpu_cache_t;
+
+    inline unsigned int mcpu_cache_load(mcpu_cache_t *cache)
+    {
+        return __atomic_load_n(cache, __ATOMIC_RELAXED);
+    }
+
+    inline void mcpu_cache_store(mcpu_cache_t *cache, unsigned int value)
+    {
+        __atomic_store_n(cache, value, __ATOMIC_RELAXED);
+    }
+#else
+    typedef volatile unsigned int mcpu_cache_t;
+
+    inline unsigned int mcpu_cache_load(mcpu_cache_t *cache)
+    {
+        return __sync_fetch_and_or(cache, 0);
+    }
+
+    inline void mcpu_cache_store(mcpu_cache_t *cache, unsigned int value)
+    {
+        __sync_lock_test_and_set(cache, value);
+    }
+#endif
+
+inline unsigned int mcpu_features(void)
+{
+    const unsigned int detected = 0x80000000;   // not an MCpuFeature
+    static mcpu_cache_t s_cache;                // zero
+    unsigned int features = mcpu_cache_load(&s_cache);
+    if (!(features & detected))
+    {
+        features = mcpu_detect_features() | detected;
+        mcpu_cache_store(&s_cache, features);
+    }
+    return features & ~detected;
+}
+
+////////////////////////////////////////////////////////////////////////////
+
+#endif  // ndef MZC4_MCPUFEATURES_HPP_
@@ -0,0 +1,293 @@
+// MFileCache.hpp -- content-addressed file cache with LRU      -*- C++ -*-
+// This file is part of MZC4.  See file "ReadMe.txt" and "License.txt".
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef MZC4_MFILECACHE_HPP_
+#define MZC4_MFILECACHE_HPP_        2   /* Version 2 */
+
+// class MFileCache;
+
+////////////////////////////////////////////////////////////////////////////
+
+#if __cplusplus >= 201103L          /* C++11 */
+    #include <cstdint>
+#else
+    #include "pstdint.h"
+#endif
+
+#include <cstdio>       // for FILE, std::fwrite, std::remove
+#include <ctime>        // for std::time
+#include <string>       // for std::string
+#include <vector>       // for std::vector
+#include <algorithm>    // for std::sort
+#include "MFileUtils.hpp"
+#include "MFileMapping.hpp"
+#include "MMd5.hpp"
+
+////////////////////////////////////////////////////////////////////////////
+
+// MFileCache keeps files in a directory under the names of the MD5 of their
+// keys. Many processes can share the directory:
+//
+// - a new entry is written into the temporary file of begin_store(), and
+//   commit() renames it to the entry. the others see either no entry or a
+//   whole one.
+// - fetch() sets the last write time of the entry to now. When the total
+//   size exceeds the limit, store() removes the entries of the oldest times
+//   (the least recently used) first.
+// - the counters are of this object only.
+class MFileCache
+{
+public:
+    MFileCache() : m_max_size(0), m_hits(0), m_misses(0), m_stores(0),
+                   m_evictions(0)
+    {
+    }
+
+    // max_size is the limit of the total bytes of the entries, or zero for
+    // no limit. creates the directory if needed.
+    bool open(const char *dirname, uint64_t max_size = 0);
+    void close()
+    {
+        m_dir.clear();
+    }
+
+    bool is_open() const
+    {
+        return !m_dir.empty();
+    }
+
+    // the entry name of a key: the MD5 in hex and the suffix such as ".wav"
+    static std::string make_name(const std::string& key, const char *suffix = "");
+
+    // copy the entry into filename (by reflink if possible). false if no
+    // such entry.
+    bool fetch(const std::string& name, const char *filename);
+    // write the mapped entry into fp
+    bool fetch(const std::string& name, FILE *fp);
+    // map the entry
+    bool fetch(const std::string& name, MFileMapping& mapping);
+
+    // the temporary file to write the entry into. then call commit() or
+    // cancel().
+    std::string begin_store(const std::string& name) const
+    {
+        return mfile_temp_name(get_path(name).c_str());
+    }
+    bool commit(const std::string& temp, const std::string& name);
+    void cancel(const std::string& temp)
+    {
+        std::remove(temp.c_str());
+    }
+
+    uint64_t hits() const
+    {
+        return m_hits;
+    }
+    uint64_t misses() const
+    {
+        return m_misses;
+    }
+    uint64_t stores() const
+    {
+        return m_stores;
+    }
+    uint64_t evictions() const
+    {
+        return m_evictions;
+    }
+
+protected:
+    std::string m_dir;
+    uint64_t m_max_size;
+    uint64_t m_hits;
+    uint64_t m_misses;
+    uint64_t m_stores;
+    uint64_t m_evictions;
+
+    std::string get_path(const std::string& name) const;
+    void trim();
+
+    static bool is_entry(const std::string& name);
+    static bool is_temp(const std::string& name);
+
+    struct entry
+    {
+        uint64_t mtime;
+        uint64_t size;
+        std::string path;
+
+        bool operator<(const entry& other) const
+        {
+            return mtime < other.mtime;
+        }
+    };
+};
+
+////////////////////////////////////////////////////////////////////////////
+
+inline bool MFileCache::open(const char *dirname, uint64_t max_size)
+{
+    m_dir.clear();
+    if (!dirname || !*dirname || !mfile_make_dir(dirname))
+        return false;
+    m_dir = dirname;
+    m_max_size = max_size;
+    return true;
+}
+
+inline std::string MFileCache::make_name(const std::string& key, const char *suffix)
+{
+    MMd5 md5;
+    md5.update(key.data(), key.size());
+    unsigned char digest[MMd5::DIGEST_SIZE];
+    md5.final(digest);
+
+    static const char s_hex[] = "0123456789abcdef";
+    std::string name;
+    for (int i = 0; i < MMd5::DIGEST_SIZE; ++i)
+    {
+        name += s_hex[digest[i] >> 4];
+        name += s_hex[digest[i] & 0xF];
+    }
+    return name + suffix;
+}
+
+inline std::string MFileCache::get_path(const std::string& name) const
+{
+#if defined(_WIN32) && !defined(WONVER)
+    return m_dir + '\\' + name;
+#else
+    return m_dir + '/' + name;
+#endif
+}
+
+inline bool MFileCache::fetch(const std::string& name, const char *filename)
+{
+    if (!is_open())
+        return false;
+
+    std::string path = get_path(name);
+    uint64_t size, mtime;
+    if (!mfile_get_stat(path.c_str(), size, mtime))
+    {
+        ++m_misses;
+        return false;
+    }
+
+    // the output appears whole, too
+    if (!mfile_copy_atomic(path.c_str(), filename))
+    {
+        ++m_misses;
+        return false;
+    }
+
+    mfile_touch(path.c_str());
+    ++m_hits;
+    return true;
+}
+
+inline bool MFileCache::fetch(const std::string& name, FILE *fp)
+{
+    MFileMapping mapping;
+    if (!fetch(name, mapping))
+        return false;
+    return std::fwrite(mapping.data(), 1, mapping.size(), fp) == mapping.size() &&
+           std::fflush(fp) == 0;
+}
+
+inline bool MFileCache::fetch(const std::string& name, MFileMapping& mapping)
+{
+    if (!is_open())
+        return false;
+
+    std::string path = get_path(name);
+    if (!mapping.open(path.c_str()) || mapping.size() == 0)
+    {
+        mapping.close();
+        ++m_misses;
+        return false;
+    }
+
+    mfile_touch(path.c_str());
+    ++m_hits;
+    return true;
+}
+
+inline bool MFileCache::commit(const std::string& temp, const std::string& name)
+{
+    if (!is_open() || !mfile_replace(temp.c_str(), get_path(name).c_str()))
+    {
+        std::remove(temp.c_str());
+        return false;
+    }
+
+    ++m_stores;
+    if (m_max_size)
+        trim();
+    return true;
+}
+
+// remove the least recently used entries beyond the limit, and the
+// temporary files left for an hour
+inline void MFileCache::trim()
+{
+    std::vector<std::string> names;
+    if (!mfile_list_dir(m_dir.c_str(), names))
+        return;
+
+    const uint64_t now = uint64_t(std::time(NULL));
+    std::vector<entry> entries;
+    uint64_t total = 0;
+    for (size_t i = 0; i < names.size(); ++i)
+    {
+        entry ent;
+        ent.path = get_path(names[i]);
+        if (!mfile_get_stat(ent.path.c_str(), ent.size, ent.mtime))
+            continue;
+
+        if (is_entry(names[i]))
+        {
+            entries.push_back(ent);
+            total += ent.size;
+        }
+        else if (is_temp(names[i]) && ent.mtime + 3600 < now)
+        {
+            std::remove(ent.path.c_str());
+        }
+    }
+    if (total <= m_max_size)
+        return;
+
+    std::sort(entries.begin(), entries.end());
+    for (size_t i = 0; i < entries.size() && total > m_max_size; ++i)
+    {
+        if (std::remove(entries[i].path.c_str()) == 0)
+            ++m_evictions;
+        total -= entries[i].size;
+    }
+}
+
+// 32 hex digits and a suffix without a dot
+inline bool MFileCache::is_entry(const std::string& name)
+{
+    if (name.size() < 32)
+        return false;
+    for (size_t i = 0; i < 32; ++i)
+    {
+        char ch = name[i];
+        if (!(('0' <= ch && ch <= '9') || ('a' <= ch && ch <= 'f')))
+            return false;
+    }
+    return name.size() == 32 || (name[32] == '.' && name.find('.', 33) == std::string::npos);
+}
+
+inline bool MFileCache::is_temp(const std::string& name)
+{
+    return name.size() > 36 && name.compare(name.size() - 4, 4, ".tmp") == 0 &&
+           is_entry(name.substr(0, name.find('.', 33)));
+}
+
+////////////////////////////////////////////////////////////////////////////
+
+#endif  // ndef MZC4_MFILECACHE_HPP_
@@ -0,0 +1,182 @@
+// MFileMapping.hpp -- read-only file mapping                   -*- C++ -*-
+// This file is part of MZC4.  See file "ReadMe.txt" and "License.txt".
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef MZC4_MFILEMAPPING_HPP_
+#define MZC4_MFILEMAPPING_HPP_      1   /* Version 1 */
+
+// class MFileMapping;
+
+////////////////////////////////////////////////////////////////////////////
+
+#include <cstddef>      // for size_t
+
+#if defined(_WIN32) && !defined(WONVER)
+    #ifndef _INC_WINDOWS
+        #include <windows.h>
+    #endif
+#else
+    #include <sys/types.h>
+    #include <sys/stat.h>
+    #include <sys/mman.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
+
+////////////////////////////////////////////////////////////////////////////
+
+// MFileMapping maps a whole regular file into memory for reading.
+// open() fails for anything but a regular file (pipes, consoles, devices),
+// so the caller can fall back to reading the stream.
+class MFileMapping
+{
+public:
+    MFileMapping() : m_data(NULL), m_size(0), m_is_open(false)
+    {
+    }
+
+    ~MFileMapping()
+    {
+        close();
+    }
+
+    bool open(const char *filename);
+    void close();
+
+    bool is_open() const
+    {
+        return m_is_open;
+    }
+
+    // NULL if the file is empty
+    const void *data() const
+    {
+        return m_data;
+    }
+
+    size_t size() const
+    {
+        return m_size;
+    }
+
+protected:
+    void *m_data;
+    size_t m_size;
+    bool m_is_open;
+
+private:
+    // not copyable
+    MFileMapping(const MFileMapping&);
+    MFileMapping& operator=(const MFileMapping&);
+};
+
+////////////////////////////////////////////////////////////////////////////
+
+#if defined(_WIN32) && !defined(WONVER)
+    inline bool MFileMapping::open(const char *filename)
+    {
+        close();
+
+        HANDLE hFile = ::CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ,
+                                     NULL, OPEN_EXISTING,
+                                     FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (hFile == INVALID_HANDLE_VALUE)
+            return false;
+
+        LARGE_INTEGER size;
+        if (::GetFileType(hFile) != FILE_TYPE_DISK ||
+            !::GetFileSizeEx(hFile, &size) ||
+            ULONGLONG(size.QuadPart) > ULONGLONG(size_t(-1)))
+        {
+            ::CloseHandle(hFile);
+            return false;
+        }
+
+        if (size.QuadPart == 0)
+        {
+            ::CloseHandle(hFile);
+            m_is_open = true;
+            return true;
+        }
+
+        HANDLE hMapping = ::CreateFileMappingA(hFile, NULL, PAGE_READONLY,
+                                               0, 0, NULL);
+        ::CloseHandle(hFile);
+        if (hMapping == NULL)
+            return false;
+
+        m_data = ::MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+        ::CloseHandle(hMapping);
+        if (m_data == NULL)
+            return false;
+
+        m_size = size_t(size.QuadPart);
+        m_is_open = true;
+        return true;
+    }
+
+    inline void MFileMapping::close()
+    {
+        if (m_data)
+        {
+            ::UnmapViewOfFile(m_data);
+            m_data = NULL;
+        }
+        m_size = 0;
+        m_is_open = false;
+    }
+#else
+    inline bool MFileMapping::open(const char *filename)
+    {
+        close();
+
+        int fd = ::open(filename, O_RDONLY);
+        if (fd == -1)
+            return false;
+
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+            (unsigned long long)st.st_size > (unsigned long long)size_t(-1))
+        {
+            ::close(fd);
+            return false;
+        }
+
+        if (st.st_size == 0)
+        {
+            ::close(fd);
+            m_is_open = true;
+            return true;
+        }
+
+        void *ptr = ::mmap(NULL, size_t(st.st_size), PROT_READ, MAP_PRIVATE,
+                           fd, 0);
+        ::close(fd);
+        if (ptr == MAP_FAILED)
+            return false;
+
+    #ifdef MADV_SEQUENTIAL
+        ::madvise(ptr, size_t(st.st_size), MADV_SEQUENTIAL);
+    #endif
+
+        m_data = ptr;
+        m_size = size_t(st.st_size);
+        m_is_open = true;
+        return true;
+    }
+
+    inline void MFileMapping::close()
+    {
+        if (m_data)
+        {
+            ::munmap(m_data, m_size);
+            m_data = NULL;
+        }
+        m_size = 0;
+        m_is_open = false;
+    }
+#endif
+
+////////////////////////////////////////////////////////////////////////////
+
+#endif  // ndef MZC4_MFILEMAPPING_HPP_
@@ -0,0 +1,304 @@
+// MFileUtils.hpp -- file utilities                             -*- C++ -*-
+// This file is part of MZC4.  See file "ReadMe.txt" and "License.txt".
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef MZC4_MFILEUTILS_HPP_
+#define MZC4_MFILEUTILS_HPP_        3   /* Version 3 */
+
+// mfile_... functions
+
+////////////////////////////////////////////////////////////////////////////
+
+#if __cplusplus >= 201103L          /* C++11 */
+    #include <cstdint>
+#else
+    #include "pstdint.h"
+#endif
+
+#include <cstdio>       // for FILE, std::rename, std::remove
+#include <string>       // for std::string
+#include <vector>       // for std::vector
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#if defined(_WIN32) && !defined(WONVER)
+    #ifndef _INC_WINDOWS
+        #include <windows.h>
+    #endif
+    #include <process.h>    // for _getpid
+#else
+    #include <unistd.h>     // for getpid
+    #include <fcntl.h>      // for open
+    #include <dirent.h>     // for opendir
+    #include <sys/time.h>   // for utimes
+    #include <cerrno>
+    #ifdef __linux__
+        #include <sys/ioctl.h>
+        #ifndef FICLONE
+            #define FICLONE _IOW(0x94, 9, int)
+        #endif
+    #endif
+#endif
+
+////////////////////////////////////////////////////////////////////////////
+
+// get the size and the last write time of a file
+bool mfile_get_stat(const char *filename, uint64_t& size, uint64_t& mtime);
+
+// get the size and the last write time of a file in nanoseconds, to tell
+// the writes in the same second apart
+bool mfile_get_stat_ns(const char *filename, uint64_t& size, uint64_t& mtime_ns);
+
+// a temporary file name next to filename, unique to this process
+std::string mfile_temp_name(const char *filename);
+
+// replace dest with src atomically. other processes see either the old
+// file or the new one, never a partial one.
+bool mfile_replace(const char *src, const char *dest);
+
+// write the data to filename atomically
+bool mfile_write_atomic(const char *filename, const void *data, size_t size);
+
+// create a directory. true if it exists already.
+bool mfile_make_dir(const char *dirname);
+
+// copy src to dest. the file system may share the blocks of them
+// (reflink) instead of copying the data.
+bool mfile_copy(const char *src, const char *dest);
+
+// copy src to dest atomically
+bool mfile_copy_atomic(const char *src, const char *dest);
+
+// set the last write time of a file to now
+bool mfile_touch(const char *filename);
+
+// the names of the files in a directory, without "." and ".."
+bool mfile_list_dir(const char *dirname, std::vector<std::string>& names);
+
+////////////////////////////////////////////////////////////////////////////
+
+inline bool mfile_get_stat(const char *filename, uint64_t& size, uint64_t& mtime)
+{
+#if defined(_WIN32) && !defined(WONVER)
+    struct _stat64 st;
+    if (_stat64(filename, &st) != 0)
+        return false;
+#else
+    struct stat st;
+    if (stat(filename, &st) != 0)
+        return false;
+#endif
+    size = uint64_t(st.st_size);
+    mtime = uint64_t(st.st_mtime);
+    return true;
+}
+
+inline bool mfile_get_stat_ns(const char *filename, uint64_t& size, uint64_t& mtime_ns)
+{
+#if defined(_WIN32) && !defined(WONVER)
+    WIN32_FILE_ATTRIBUTE_DATA attrs;
+    if (!::GetFileAttributesExA(filename, GetFileExInfoStandard, &attrs))
+        return false;
+    size = (uint64_t(attrs.nFileSizeHigh) << 32) | attrs.nFileSizeLow;
+    // in 100 nanoseconds since 1601
+    uint64_t ft = (uint64_t(attrs.ftLastWriteTime.dwHighDateTime) << 32) |
+                  attrs.ftLastWriteTime.dwLowDateTime;
+    mtime_ns = ft * 100;
+#else
+    struct stat st;
+    if (stat(filename, &st) != 0)
+        return false;
+    size = uint64_t(st.st_size);
+    mtime_ns = uint64_t(st.st_mtime) * 1000000000;
+    #if defined(__APPLE__)
+        mtime_ns += uint64_t(st.st_mtimespec.tv_nsec);
+    #elif defined(__linux__)
+        mtime_ns += uint64_t(st.st_mtim.tv_nsec);
+    #endif
+#endif
+    return true;
+}
+
+// a unique name in the process, even on many threads at the same time
+inline std::string mfile_temp_name(const char *filename)
+{
+    // zero-initialized without the guard of a static initializer
+#if defined(_WIN32) && !defined(WONVER)
+    static volatile LONG s_count;
+    unsigned long pid = (unsigned long)_getpid();
+    unsigned long count = (unsigned long)::InterlockedIncrement(&s_count) - 1;
+#else
+    static unsigned long s_count;
+    unsigned long pid = (unsigned long)getpid();
+    #ifdef __ATOMIC_RELAXED
+        unsigned long count = __atomic_fetch_add(&s_count, 1, __ATOMIC_RELAXED);
+    #else
+        unsigned long count = __sync_fetch_and_add(&s_count, 1);
+    #endif
+#endif
+    char buf[64];
+    std::sprintf(buf, ".%lu.%lu.tmp", pid, count);
+    return std::string(filename) + buf;
+}
+
+inline bool mfile_replace(const char *src, const char *dest)
+{
+#if defined(_WIN32) && !defined(WONVER)
+    return !!::MoveFileExA(src, dest, MOVEFILE_REPLACE_EXISTING);
+#else
+    return std::rename(src, dest) == 0;
+#endif
+}
+
+inline bool mfile_write_atomic(const char *filename, const void *data, size_t size)
+{
+    std::string temp = mfile_temp_name(filename);
+    FILE *fp = std::fopen(temp.c_str(), "wb");
+    if (!fp)
+        return false;
+
+    bool ok = (std::fwrite(data, 1, size, fp) == size);
+    ok = (std::fclose(fp) == 0) && ok;
+    if (ok)
+        ok = mfile_replace(temp.c_str(), filename);
+    if (!ok)
+        std::remove(temp.c_str());
+    return ok;
+}
+
+inline bool mfile_make_dir(const char *dirname)
+{
+#if defined(_WIN32) && !defined(WONVER)
+    if (::CreateDirectoryA(dirname, NULL))
+        return true;
+    DWORD attrs = ::GetFileAttributesA(dirname);
+    return attrs != INVALID_FILE_ATTRIBUTES && (attrs & FILE_ATTRIBUTE_DIRECTORY);
+#else
+    if (mkdir(dirname, 0777) == 0)
+        return true;
+    struct stat st;
+    return stat(dirname, &st) == 0 && S_ISDIR(st.st_mode);
+#endif
+}
+
+inline bool mfile_copy_atomic(const char *src, const char *dest)
+{
+    std::string temp = mfile_temp_name(dest);
+    bool ok = mfile_copy(src, temp.c_str()) && mfile_replace(temp.c_str(), dest);
+    if (!ok)
+        std::remove(temp.c_str());
+    return ok;
+}
+
+#if defined(_WIN32) && !defined(WONVER)
+    inline bool mfile_copy(const char *src, const char *dest)
+    {
+        return !!::CopyFileA(src, dest, FALSE);
+    }
+
+    inline bool mfile_touch(const char *filename)
+    {
+        HANDLE hFile = ::CreateFileA(filename, FILE_WRITE_ATTRIBUTES,
+                                     FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                     NULL, OPEN_EXISTING, 0, NULL);
+        if (hFile == INVALID_HANDLE_VALUE)
+            return false;
+        FILETIME ft;
+        ::GetSystemTimeAsFileTime(&ft);
+        BOOL ret = ::SetFileTime(hFile, NULL, NULL, &ft);
+        ::CloseHandle(hFile);
+        return !!ret;
+    }
+
+    inline bool mfile_list_dir(const char *dirname, std::vector<std::string>& names)
+    {
+        names.clear();
+        std::string pattern = dirname;
+        pattern += "\\*";
+        WIN32_FIND_DATAA find;
+        HANDLE hFind = ::FindFirstFileA(pattern.c_str(), &find);
+        if (hFind == INVALID_HANDLE_VALUE)
+            return false;
+        do
+        {
+            if (!(find.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+                names.push_back(find.cFileName);
+        } while (::FindNextFileA(hFind, &find));
+        ::FindClose(hFind);
+        return true;
+    }
+#else
+    inline bool mfile_copy(const char *src, const char *dest)
+    {
+        int in = ::open(src, O_RDONLY);
+        if (in == -1)
+            return false;
+        int out = ::open(dest, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (out == -1)
+        {
+            ::close(in);
+            return false;
+        }
+
+        bool ok = false;
+    #ifdef __linux__
+        // share the blocks on Btrfs, XFS and so on
+        ok = (::ioctl(out, FICLONE, in) == 0);
+    #endif
+        if (!ok)
+        {
+            std::vector<char> buf(64 * 1024);
+            ok = true;
+            for (;;)
+            {
+                ssize_t len = ::read(in, &buf[0], buf.size());
+                if (len < 0 && errno == EINTR)
+                    continue;
+                if (len <= 0)
+                {
+                    ok = (len == 0);
+                    break;
+                }
+                for (ssize_t pos = 0; ok && pos < len; )
+                {
+                    ssize_t ret = ::write(out, &buf[pos], size_t(len - pos));
+                    if (ret < 0 && errno == EINTR)
+                        continue;
+                    ok = (ret > 0);
+                    pos += ret;
+                }
+                if (!ok)
+                    break;
+            }
+        }
+
+        ::close(in);
+        ok = (::close(out) == 0) && ok;
+        return ok;
+    }
+
+    inline bool mfile_touch(const char *filename)
+    {
+        return utimes(filename, NULL) == 0;
+    }
+
+    inline bool mfile_list_dir(const char *dirname, std::vector<std::string>& names)
+    {
+        names.clear();
+        DIR *dir = opendir(dirname);
+        if (!dir)
+            return false;
+        while (struct dirent *ent = readdir(dir))
+        {
+            std::string name = ent->d_name;
+            if (name != "." && name != "..")
+                names.push_back(name);
+        }
+        closedir(dir);
+        return true;
+    }
+#endif
+
+////////////////////////////////////////////////////////////////////////////
+
+#endif  // ndef MZC4_MFILEUTILS_HPP_
@@ -0,0 +1,1377 @@
+// MFlacWriter.hpp -- multithreaded FLAC encoder and writer      -*- C++ -*-
+// This file is part of MZC4.  See file "ReadMe.txt" and "License.txt".
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef MZC4_MFLACWRITER_HPP_
+#define MZC4_MFLACWRITER_HPP_       3   /* Version 3 */
+
+// class MFlacWriter;
+
+////////////////////////////////////////////////////////////////////////////
+
+#if __cplusplus >= 201103L          /* C++11 */
+    #include <cstdint>
+#else
+    #include "pstdint.h"
+#endif
+
+#include <cmath>        // for std::log, std::cos, std::frexp, std::floor
+#include <cstddef>      // for size_t
+#include <cstring>      // for std::memcpy
+#include <vector>       // for std::vector
+#include "MWaveWriter.hpp"
+#include "MThread.hpp"
+#include "MMd5.hpp"
+
+////////////////////////////////////////////////////////////////////////////
+
+namespace flac
+{
+    enum
+    {
+        MAX_CHANNELS = 8,
+        MAX_LPC_ORDER = 12,
+        MAX_PARTITION_ORDER = 8,
+        MAX_PRECISION = 15
+    };
+
+    // the parameters of the compression levels 0 to 8, as the flac tool
+    struct level_type
+    {
+        int block_size;
+        int stereo;             // 0: independent, 1: estimated, 2: exhaustive
+        int max_lpc_order;      // 0 for the fixed predictors only
+        int max_partition_order;
+        bool exhaustive_order;  // try every LPC order
+    };
+
+    inline const level_type& get_level(int level)
+    {
+        static const level_type s_levels[9] =
+        {
+            { 1152, 0, 0, 3, false },
+            { 1152, 1, 0, 3, false },
+            { 1152, 2, 0, 3, false },
+            { 4096, 0, 6, 4, false },
+            { 4096, 1, 8, 4, false },
+            { 4096, 2, 8, 5, false },
+            { 4096, 2, 8, 6, false },
+            { 4096, 2, 12, 6, false },
+            { 4096, 2, 12, 6, true },
+        };
+        if (level < 0)
+            level = 0;
+        if (level > 8)
+            level = 8;
+        return s_levels[level];
+    }
+
+    inline unsigned int crc8(const unsigned char *data, size_t size)
+    {
+        static unsigned char s_table[256];
+        static bool s_init = false;
+        if (!s_init)
+        {
+            for (int i = 0; i < 256; ++i)
+            {
+                unsigned int crc = i;
+                for (int k = 0; k < 8; ++k)
+                    crc = (crc & 0x80) ? ((crc << 1) ^ 0x07) : (crc << 1);
+                s_table[i] = (unsigned char)crc;
+            }
+            s_init = true;
+        }
+
+        unsigned int crc = 0;
+        for (size_t i = 0; i < size; ++i)
+            crc = s_table[(crc ^ data[i]) & 0xFF];
+        return crc;
+    }
+
+    inline unsigned int crc16(const unsigned char *data, size_t size)
+    {
+        static uint16_t s_table[256];
+        static bool s_init = false;
+        if (!s_init)
+        {
+            for (int i = 0; i < 256; ++i)
+            {
+                unsigned int crc = i << 8;
+                for (int k = 0; k < 8; ++k)
+                    crc = (crc & 0x8000) ? ((crc << 1) ^ 0x8005) : (crc << 1);
+                s_table[i] = uint16_t(crc);
+            }
+            s_init = true;
+        }
+
+        unsigned int crc = 0;
+        for (size_t i = 0; i < size; ++i)
+            crc = ((crc << 8) ^ s_table[((crc >> 8) ^ data[i]) & 0xFF]) & 0xFFFF;
+        return crc;
+    }
+
+    // writes the bits from the most significant
+    class bit_writer
+    {
+    public:
+        bit_writer() : m_acc(0), m_bits(0)
+        {
+        }
+
+        void clear()
+        {
+            m_data.clear();
+            m_acc = 0;
+            m_bits = 0;
+        }
+
+        // bits is up to 32
+        void put(uint32_t value, int bits)
+        {
+            if (bits == 0)
+                return;
+            m_acc = (m_acc << bits) | (value & (0xFFFFFFFFu >> (32 - bits)));
+            m_bits += bits;
+            while (m_bits >= 8)
+            {
+                m_bits -= 8;
+                m_data.push_back((unsigned char)(m_acc >> m_bits));
+            }
+        }
+
+        void put_signed(int32_t value, int bits)
+        {
+            put(uint32_t(value), bits);
+        }
+
+        void put_unary(uint32_t zeros)
+        {
+            for (; zeros >= 32; zeros -= 32)
+                put(0, 32);
+            put(1, zeros + 1);
+        }
+
+        void put_rice(uint32_t value, int k)
+        {
+            put_unary(value >> k);
+            put(value, k);
+        }
+
+        // pad with zero bits to a byte boundary
+        void align()
+        {
+            if (m_bits)
+                put(0, 8 - m_bits);
+        }
+
+        std::vector<unsigned char>& data()
+        {
+            return m_data;
+        }
+
+    protected:
+        std::vector<unsigned char> m_data;
+        uint64_t m_acc;
+        int m_bits;
+    };
+
+    enum subframe_type
+    {
+        SUBFRAME_CONSTANT,
+        SUBFRAME_VERBATIM,
+        SUBFRAME_FIXED,
+        SUBFRAME_LPC
+    };
+
+    // a subframe ready to write
+    struct subframe
+    {
+        subframe_type type;
+        int bps;                // the bits per sample after the wasted bits
+        int wasted;
+        int order;
+        int precision;          // of the LPC coefficients
+        int shift;
+        int32_t coefs[MAX_LPC_ORDER];
+        const int32_t *samples; // the shifted samples
+        std::vector<int32_t> residual;
+        int partition_order;
+        int params[1 << MAX_PARTITION_ORDER];
+        bool rice2;
+        uint64_t bits;
+    };
+
+    // encodes a frame. each task has its own.
+    class frame_encoder
+    {
+    public:
+        // samples are planar; a channel at every stride
+        void encode(const level_type& level, int bits_per_sample,
+                    int samples_per_sec, int channels, const int32_t *samples,
+                    size_t stride, int block_size, uint32_t frame_number,
+                    std::vector<unsigned char>& out);
+
+    protected:
+        std::vector<int32_t> m_shifted[MAX_CHANNELS];
+        std::vector<int32_t> m_side[2];     // side and mid
+        std::vector<double> m_window;
+        std::vector<double> m_windowed;
+        subframe m_subframes[MAX_CHANNELS];
+        subframe m_candidate;
+        bit_writer m_writer;
+
+        void analyze(const level_type& level, const int32_t *x, int n,
+                     int bps, int slot, subframe& sub);
+        void try_fixed(const level_type& level, const int32_t *x, int n,
+                       int bps, subframe& best);
+        void try_lpc(const level_type& level, const int32_t *x, int n,
+                     int bps, subframe& best);
+        bool lpc_residual(const int32_t *x, int n, int order,
+                          const int32_t *coefs, int shift, int bps,
+                          int precision, std::vector<int32_t>& residual);
+        uint64_t rice_bits(const level_type& level, int order, int n,
+                           const std::vector<int32_t>& residual, subframe& sub);
+        void write_subframe(const subframe& sub, int n);
+
+        static void swap_subframes(subframe& a, subframe& b);
+        static uint64_t estimate_fixed(const int32_t *x, int n);
+    };
+} // namespace flac
+
+////////////////////////////////////////////////////////////////////////////
+
+// MFlacWriter encodes PCM into a FLAC file. The blocks are encoded as
+// independent frames on a pool of threads, and written in order.
+//
+// The input is the interleaved little-endian signed PCM of 8, 16 or 24
+// bits, as WAVE files except that 8-bit samples are signed.
+//
+// It writes through MWaveWriter in the raw mode, so the buffering, the
+// preallocation and the standard output work in the same way. The
+// STREAMINFO block is patched at close, unless the output is a stream.
+class MFlacWriter
+{
+public:
+    enum { DEFAULT_LEVEL = 5, STREAMINFO_OFFSET = 4, HEADER_SIZE = 42 };
+
+    MFlacWriter();
+    ~MFlacWriter();
+
+    // level is the compression level from 0 (fastest) to 8 (smallest).
+    // threads is the number of the threads, or 0 for one per processor.
+    void set_level(int level, int threads = 0)
+    {
+        m_level = level;
+        m_threads = threads;
+    }
+
+    bool open(const char *filename, int samples_per_sec, int channels,
+              int bits_per_sample, uint64_t expected_size = 0);
+    bool open_stdout(int samples_per_sec, int channels, int bits_per_sample,
+                     uint64_t expected_size = 0);
+    // see MWaveWriter::open_stream
+    bool open_stream(MWaveWriter::write_proc_t proc,
+                     MWaveWriter::write_at_proc_t write_at_proc, void *context,
+                     int samples_per_sec, int channels, int bits_per_sample);
+    bool write(const void *data, size_t size);
+    bool close();
+
+    bool is_open() const
+    {
+        return m_writer.is_open();
+    }
+
+    // the total sample frames written
+    uint64_t total_frames() const
+    {
+        return m_total_frames;
+    }
+
+protected:
+    // a frame being encoded
+    struct task_type : public MTask
+    {
+        const flac::level_type *level;
+        MFlacWriter *writer;
+        std::vector<int32_t> samples;   // planar
+        int block_size;                 // the sample frames in samples
+        uint32_t frame_number;
+        bool busy;
+        std::vector<unsigned char> output;
+        flac::frame_encoder encoder;
+
+        virtual void run()
+        {
+            encoder.encode(*level, writer->m_bits_per_sample,
+                           writer->m_samples_per_sec, writer->m_channels,
+                           &samples[0], writer->m_block_size, block_size,
+                           frame_number, output);
+        }
+    };
+
+    MWaveWriter m_writer;
+    MThreadPool m_pool;
+    MMd5 m_md5;
+    std::vector<task_type *> m_tasks;   // a ring in the order of the frames
+    size_t m_current;
+    int m_filled;                       // the sample frames in the current
+    std::vector<unsigned char> m_partial;
+    int m_level;
+    int m_threads;
+    int m_samples_per_sec;
+    int m_channels;
+    int m_bits_per_sample;
+    int m_block_size;
+    uint32_t m_frame_number;
+    uint64_t m_total_frames;
+    uint32_t m_min_frame_size;
+    uint32_t m_max_frame_size;
+    bool m_failed;
+
+    bool start(int samples_per_sec, int channels, int bits_per_sample);
+    void make_header(unsigned char *header, const unsigned char *md5) const;
+    void put_samples(const unsigned char *data, size_t frames);
+    bool submit();
+    bool finish(task_type *task);
+    void free_tasks();
+
+private:
+    // NOTE: MFlacWriter is not copyable.
+    MFlacWriter(const MFlacWriter&);
+    MFlacWriter& operator=(const MFlacWriter&);
+};
+
+////////////////////////////////////////////////////////////////////////////
+
+namespace flac
+{
+    inline uint32_t fold(int32_t value)
+    {
+        return (uint32_t(value) << 1) ^ uint32_t(value >> 31);
+    }
+
+    // the autocorrelation of LAGS lags. x has LAGS - 1 zeros before it.
+    // the lags are the inner loop, so they are independent sums.
+    template <int LAGS>
+    inline void autocorrelate(const double *x, int n, double *autoc)
+    {
+        double sums[LAGS];
+        for (int lag = 0; lag < LAGS; ++lag)
+            sums[lag] = 0;
+        for (int i = 0; i < n; ++i)
+        {
+            const double value = x[i];
+            for (int lag = 0; lag < LAGS; ++lag)
+                sums[lag] += value * x[i - lag];
+        }
+        for (int lag = 0; lag < LAGS; ++lag)
+            autoc[lag] = sums[lag];
+    }
+
+    // the sum of the absolute residuals of the fixed predictor of order 2,
+    // to compare the channel assignments cheaply
+    inline uint64_t frame_encoder::estimate_fixed(const int32_t *x, int n)
+    {
+        uint64_t sum = 0;
+        for (int i = 2; i < n; ++i)
+        {
+            int64_t r = int64_t(x[i]) - 2 * int64_t(x[i - 1]) + x[i - 2];
+            sum += uint64_t(r < 0 ? -r : r);
+        }
+        return sum;
+    }
+
+    // swap without copying the residuals
+    inline void frame_encoder::swap_subframes(subframe& a, subframe& b)
+    {
+        std::vector<int32_t> ra, rb;
+        ra.swap(a.residual);
+        rb.swap(b.residual);
+        subframe temp = a;
+        a = b;
+        b = temp;
+        a.residual.swap(rb);
+        b.residual.swap(ra);
+    }
+
+    // choose the partitions and the Rice parameters. returns the bits of
+    // the residual.
+    inline uint64_t
+    frame_encoder::rice_bits(const level_type& level, int order, int n,
+                             const std::vector<int32_t>& residual, subframe& sub)
+    {
+        // the highest partition order for the block size and the predictor
+        int max_order = 0;
+        while (max_order < level.max_partition_order &&
+               (n & ((1 << (max_order + 1)) - 1)) == 0 &&
+               (n >> (max_order + 1)) > order)
+        {
+            ++max_order;
+        }
+
+        // the sums of the folded residuals in the partitions of max_order
+        uint64_t sums[1 << MAX_PARTITION_ORDER];
+        const int parts = 1 << max_order;
+        const int part_size = n >> max_order;
+        const int32_t *r = residual.empty() ? NULL : &residual[0];
+        for (int p = 0, i = 0; p < parts; ++p)
+        {
+            int end = (p + 1) * part_size - order;
+            uint64_t sum = 0;
+            for (; i < end; ++i)
+                sum += fold(r[i]);
+            sums[p] = sum;
+        }
+
+        uint64_t best_bits = ~uint64_t(0);
+        for (int porder = max_order; porder >= 0; --porder)
+        {
+            const int count = 1 << porder;
+            const int size = n >> porder;
+            uint64_t total = 0;
+            int params[1 << MAX_PARTITION_ORDER];
+            bool rice2 = false;
+            for (int p = 0; p < count; ++p)
+            {
+                uint64_t sum = sums[p];
+                uint64_t samples = uint64_t(size - (p == 0 ? order : 0));
+
+                // k from the mean, and the next one
+                int k = 0;
+                while (k < 30 && (samples << (k + 1)) <= sum)
+                    ++k;
+                uint64_t bits = samples * (k + 1) + (sum >> k);
+                if (k < 30)
+                {
+                    uint64_t bits2 = samples * (k + 2) + (sum >> (k + 1));
+                    if (bits2 < bits)
+                    {
+                        bits = bits2;
+                        ++k;
+                    }
+                }
+                params[p] = k;
+                if (k > 14)
+                    rice2 = true;
+                total += bits;
+            }
+            total += 2 + 4 + uint64_t(count) * (rice2 ? 5 : 4);
+
+            if (total < best_bits)
+            {
+                best_bits = total;
+                sub.partition_order = porder;
+                sub.rice2 = rice2;
+                std::memcpy(sub.params, params, count * sizeof(int));
+            }
+
+            // merge the pairs for the next order
+            for (int p = 0; p < count / 2; ++p)
+                sums[p] = sums[p * 2] + sums[p * 2 + 1];
+        }
+        return best_bits;
+    }
+
+    inline void
+    frame_encoder::try_fixed(const level_type& level, const int32_t *x, int n,
+                             int bps, subframe& best)
+    {
+        // the order of the least absolute residuals
+        uint64_t sums[5] = { 0, 0, 0, 0, 0 };
+        for (int i = 4; i < n; ++i)
+        {
+            int64_t e0 = x[i];
+            int64_t e1 = e0 - x[i - 1];
+            int64_t e2 = e1 - (int64_t(x[i - 1]) - x[i - 2]);
+            int64_t e3 = e2 - (int64_t(x[i - 1]) - 2 * int64_t(x[i - 2]) + x[i - 3]);
+            int64_t e4 = e3 - (int64_t(x[i - 1]) - 3 * int64_t(x[i - 2]) +
+                               3 * int64_t(x[i - 3]) - x[i - 4]);
+            sums[0] += uint64_t(e0 < 0 ? -e0 : e0);
+            sums[1] += uint64_t(e1 < 0 ? -e1 : e1);
+            sums[2] += uint64_t(e2 < 0 ? -e2 : e2);
+            sums[3] += uint64_t(e3 < 0 ? -e3 : e3);
+            sums[4] += uint64_t(e4 < 0 ? -e4 : e4);
+        }
+        int order = 0;
+        for (int k = 1; k <= 4 && k < n; ++k)
+        {
+            if (sums[k] < sums[order])
+                order = k;
+        }
+
+        subframe& sub = m_candidate;
+        sub.residual.resize(n - order);
+        for (int i = order; i < n; ++i)
+        {
+            int64_t r;
+            switch (order)
+            {
+            case 0: r = x[i]; break;
+            case 1: r = int64_t(x[i]) - x[i - 1]; break;
+            case 2: r = int64_t(x[i]) - 2 * int64_t(x[i - 1]) + x[i - 2]; break;
+            case 3: r = int64_t(x[i]) - 3 * int64_t(x[i - 1]) +
+                        3 * int64_t(x[i - 2]) - x[i - 3]; break;
+            default: r = int64_t(x[i]) - 4 * int64_t(x[i - 1]) +
+                         6 * int64_t(x[i - 2]) - 4 * int64_t(x[i - 3]) + x[i - 4]; break;
+            }
+            if (r > 0x3FFFFFFF || r < -0x40000000)
+                return;     // too large for the Rice codes
+            sub.residual[i - order] = int32_t(r);
+        }
+
+        sub.type = SUBFRAME_FIXED;
+        sub.order = order;
+        sub.bits = 6 + uint64_t(order) * bps +
+                   rice_bits(level, order, n, sub.residual, sub);
+        if (sub.bits < best.bits)
+            swap_subframes(sub, best);
+    }
+
+    inline bool
+    frame_encoder::lpc_residual(const int32_t *x, int n, int order,
+                                const int32_t *coefs, int shift, int bps,
+                                int precision, std::vector<int32_t>& residual)
+    {
+        residual.resize(n - order);
+        int32_t *r = &residual[0];
+
+        // 32-bit sums if they can't overflow
+        int sum_bits = bps + precision;
+        for (int k = order; k > 1; k >>= 1)
+            ++sum_bits;
+
+        if (sum_bits <= 32)
+        {
+            for (int i = order; i < n; ++i)
+            {
+                int32_t sum = 0;
+                for (int j = 0; j < order; ++j)
+                    sum += coefs[j] * x[i - j - 1];
+                int64_t value = int64_t(x[i]) - (sum >> shift);
+                if (value > 0x3FFFFFFF || value < -0x40000000)
+                    return false;
+                r[i - order] = int32_t(value);
+            }
+        }
+        else
+        {
+            for (int i = order; i < n; ++i)
+            {
+                int64_t sum = 0;
+                for (int j = 0; j < order; ++j)
+                    sum += int64_t(coefs[j]) * x[i - j - 1];
+                int64_t value = int64_t(x[i]) - (sum >> shift);
+                if (value > 0x3FFFFFFF || value < -0x40000000)
+                    return false;
+                r[i - order] = int32_t(value);
+            }
+        }
+        return true;
+    }
+
+    inline void
+    frame_encoder::try_lpc(const level_type& level, const int32_t *x, int n,
+                           int bps, subframe& best)
+    {
+        int max_order = level.max_lpc_order;
+        if (max_order >= n)
+            max_order = n - 1;
+        if (max_order < 1)
+            return;
+
+        // the Tukey window of 0.5
+        if (int(m_window.size()) != n)
+        {
+            m_window.assign(n, 1.0);
+            const int taper = n / 4;
+            for (int i = 0; i < taper; ++i)
+            {
+                double w = 0.5 - 0.5 * std::cos(3.14159265358979323846 * i / taper);
+                m_window[i] = m_window[n - 1 - i] = w;
+            }
+        }
+
+        m_windowed.assign(MAX_LPC_ORDER + n, 0.0);
+        double *windowed = &m_windowed[MAX_LPC_ORDER];
+        for (int i = 0; i < n; ++i)
+            windowed[i] = x[i] * m_window[i];
+
+        double autoc[MAX_LPC_ORDER + 1];
+        if (max_order <= 6)
+            autocorrelate<7>(windowed, n, autoc);
+        else if (max_order <= 8)
+            autocorrelate<9>(windowed, n, autoc);
+        else
+            autocorrelate<MAX_LPC_ORDER + 1>(windowed, n, autoc);
+        if (autoc[0] <= 0)
+            return;
+
+        // Levinson-Durbin recursion
+        double lpc[MAX_LPC_ORDER][MAX_LPC_ORDER];
+        double error[MAX_LPC_ORDER];
+        double a[MAX_LPC_ORDER];
+        double err = autoc[0];
+        for (int i = 0; i < max_order; ++i)
+        {
+            double k = -autoc[i + 1];
+            for (int j = 0; j < i; ++j)
+                k -= a[j] * autoc[i - j];
+            k /= err;
+
+            a[i] = k;
+            for (int j = 0; j < i / 2; ++j)
+            {
+                double temp = a[j];
+                a[j] += k * a[i - 1 - j];
+                a[i - 1 - j] += k * temp;
+            }
+            if (i & 1)
+                a[i / 2] += a[i / 2] * k;
+
+            err *= 1.0 - k * k;
+            for (int j = 0; j <= i; ++j)
+                lpc[i][j] = -a[j];
+            error[i] = err;
+            if (err <= 0)
+            {
+                max_order = i + 1;
+                break;
+            }
+        }
+
+        // the precision of the coefficients by the block size
+        int precision = 12;
+        if (n <= 192)
+            precision = 7;
+        else if (n <= 384)
+            precision = 8;
+        else if (n <= 576)
+            precision = 9;
+        else if (n <= 1152)
+            precision = 10;
+        else if (n <= 2304)
+            precision = 11;
+        else if (n > 4608)
+            precision = 13;
+
+        // the orders to try: every one, or the best by the estimate
+        int first = 1, last = max_order;
+        if (!level.exhaustive_order)
+        {
+            double best_estimate = 0;
+            int best_order = max_order;
+            for (int order = 1; order <= max_order; ++order)
+            {
+                double e = error[order - 1] * 0.5 / n;
+                double bits = (e > 0) ? 0.5 * std::log(e) / std::log(2.0) : 0;
+                if (bits < 0)
+                    bits = 0;
+                double estimate = bits * (n - order) + order * (precision + bps);
+                if (order == 1 || estimate < best_estimate)
+                {
+                    best_estimate = estimate;
+                    best_order = order;
+                }
+            }
+            first = last = best_order;
+        }
+
+        for (int order = first; order <= last; ++order)
+        {
+            const double *c = lpc[order - 1];
+
+            // quantize with the error feedback
+            double cmax = 0;
+            for (int j = 0; j < order; ++j)
+            {
+                double v = (c[j] < 0) ? -c[j] : c[j];
+                if (v > cmax)
+                    cmax = v;
+            }
+            if (cmax <= 0)
+                continue;
+
+            // cmax < 2 ** log2cmax. a bit is for the sign
+            int log2cmax;
+            std::frexp(cmax, &log2cmax);
+            int shift = precision - 1 - log2cmax;
+            if (shift > MAX_PRECISION)
+                shift = MAX_PRECISION;
+            if (shift < 0)
+                shift = 0;
+
+            subframe& sub = m_candidate;
+            const int32_t qmax = (1 << (precision - 1)) - 1, qmin = -qmax - 1;
+            double carry = 0;
+            for (int j = 0; j < order; ++j)
+            {
+                carry += c[j] * (1 << shift);
+                double q = std::floor(carry + 0.5);
+                if (q > qmax)
+                    q = qmax;
+                if (q < qmin)
+                    q = qmin;
+                carry -= q;
+                sub.coefs[j] = int32_t(q);
+            }
+
+            if (!lpc_residual(x, n, order, sub.coefs, shift, bps, precision,
+                              sub.residual))
+            {
+                continue;
+            }
+
+            sub.type = SUBFRAME_LPC;
+            sub.order = order;
+            sub.precision = precision;
+            sub.shift = shift;
+            sub.bits = 6 + uint64_t(order) * bps + 4 + 5 +
+                       uint64_t(order) * precision +
+                       rice_bits(level, order, n, sub.residual, sub);
+            if (sub.bits < best.bits)
+                swap_subframes(sub, best);
+        }
+    }
+
+    // choose the best subframe of x. slot is the buffer for the shifted
+    // samples.
+    inline void
+    frame_encoder::analyze(const level_type& level, const int32_t *x, int n,
+                           int bps, int slot, subframe& sub)
+    {
+        // the wasted bits, the zero bits at the bottom of every sample
+        uint32_t any = 0;
+        for (int i = 0; i < n; ++i)
+            any |= uint32_t(x[i]);
+        int wasted = 0;
+        if (any)
+        {
+            while (!(any & (1u << wasted)))
+                ++wasted;
+        }
+
+        if (wasted)
+        {
+            m_shifted[slot].resize(n);
+            for (int i = 0; i < n; ++i)
+                m_shifted[slot][i] = x[i] >> wasted;
+            x = &m_shifted[slot][0];
+        }
+        const int ebps = bps - wasted;
+        const uint64_t header = 8 + uint64_t(wasted);
+
+        sub.samples = x;
+        sub.bps = ebps;
+        sub.wasted = wasted;
+
+        // a constant
+        bool constant = true;
+        for (int i = 1; i < n && constant; ++i)
+            constant = (x[i] == x[0]);
+        if (constant)
+        {
+            sub.type = SUBFRAME_CONSTANT;
+            sub.bits = header + ebps;
+            return;
+        }
+
+        sub.type = SUBFRAME_VERBATIM;
+        sub.bits = header + uint64_t(n) * ebps;
+
+        m_candidate.samples = x;
+        m_candidate.bps = ebps;
+        m_candidate.wasted = wasted;
+        try_fixed(level, x, n, ebps, sub);
+        if (level.max_lpc_order > 0)
+            try_lpc(level, x, n, ebps, sub);
+        sub.samples = x;
+        sub.bps = ebps;
+        sub.wasted = wasted;
+    }
+
+    inline void frame_encoder::write_subframe(const subframe& sub, int n)
+    {
+        bit_writer& w = m_writer;
+        const int32_t *x = sub.samples;
+
+        int type;
+        switch (sub.type)
+        {
+        case SUBFRAME_CONSTANT: type = 0x00; break;
+        case SUBFRAME_VERBATIM: type = 0x01; break;
+        case SUBFRAME_FIXED:    type = 0x08 | sub.order; break;
+        default:                type = 0x20 | (sub.order - 1); break;
+        }
+        w.put(0, 1);
+        w.put(type, 6);
+        if (sub.wasted)
+        {
+            w.put(1, 1);
+            w.put_unary(sub.wasted - 1);
+        }
+        else
+        {
+            w.put(0, 1);
+        }
+
+        switch (sub.type)
+        {
+        case SUBFRAME_CONSTANT:
+            w.put_signed(x[0], sub.bps);
+            return;
+
+        case SUBFRAME_VERBATIM:
+            for (int i = 0; i < n; ++i)
+                w.put_signed(x[i], sub.bps);
+            return;
+
+        default:
+            break;
+        }
+
+        for (int i = 0; i < sub.order; ++i)
+            w.put_signed(x[i], sub.bps);
+
+        if (sub.type == SUBFRAME_LPC)
+        {
+            w.put(sub.precision - 1, 4);
+            w.put_signed(sub.shift, 5);
+            for (int j = 0; j < sub.order; ++j)
+                w.put_signed(sub.coefs[j], sub.precision);
+        }
+
+        // the residual
+        w.put(sub.rice2 ? 1 : 0, 2);
+        w.put(sub.partition_order, 4);
+        const int parts = 1 << sub.partition_order;
+        const int part_size = n >> sub.partition_order;
+        const int32_t *r = sub.residual.empty() ? NULL : &sub.residual[0];
+        for (int p = 0, i = 0; p < parts; ++p)
+        {
+            const int k = sub.params[p];
+            w.put(k, sub.rice2 ? 5 : 4);
+            int end = (p + 1) * part_size - sub.order;
+            for (; i < end; ++i)
+                w.put_rice(fold(r[i]), k);
+        }
+    }
+
+    inline void
+    frame_encoder::encode(const level_type& level, int bits_per_sample,
+                          int samples_per_sec, int channels,
+                          const int32_t *samples, size_t stride, int n,
+                          uint32_t frame_number, std::vector<unsigned char>& out)
+    {
+        // the channel assignment
+        int assignment = channels - 1;
+        if (channels == 2 && level.stereo)
+        {
+            const int32_t *left = samples, *right = samples + stride;
+            m_side[0].resize(n);
+            m_side[1].resize(n);
+            for (int i = 0; i < n; ++i)
+            {
+                m_side[0][i] = left[i] - right[i];
+                m_side[1][i] = (left[i] + right[i]) >> 1;
+            }
+
+            if (level.stereo == 1)
+            {
+                // estimate by the fixed predictor of order 2
+                uint64_t l = estimate_fixed(left, n), r = estimate_fixed(right, n);
+                uint64_t s = estimate_fixed(&m_side[0][0], n);
+                uint64_t m = estimate_fixed(&m_side[1][0], n);
+                uint64_t best = l + r;
+                assignment = 1;
+                if (l + s < best)
+                {
+                    best = l + s;
+                    assignment = 8;
+                }
+                if (r + s < best)
+                {
+                    best = r + s;
+                    assignment = 9;
+                }
+                if (m + s < best)
+                    assignment = 10;
+
+                switch (assignment)
+                {
+                case 1:
+                    analyze(level, left, n, bits_per_sample, 0, m_subframes[0]);
+                    analyze(level, right, n, bits_per_sample, 1, m_subframes[1]);
+                    break;
+                case 8:
+                    analyze(level, left, n, bits_per_sample, 0, m_subframes[0]);
+                    analyze(level, &m_side[0][0], n, bits_per_sample + 1, 1, m_subframes[1]);
+                    break;
+                case 9:
+                    analyze(level, &m_side[0][0], n, bits_per_sample + 1, 0, m_subframes[0]);
+                    analyze(level, right, n, bits_per_sample, 1, m_subframes[1]);
+                    break;
+                default:
+                    analyze(level, &m_side[1][0], n, bits_per_sample, 0, m_subframes[0]);
+                    analyze(level, &m_side[0][0], n, bits_per_sample + 1, 1, m_subframes[1]);
+                    break;
+                }
+            }
+            else
+            {
+                // encode all the four and take the best pair
+                analyze(level, left, n, bits_per_sample, 0, m_subframes[0]);
+                analyze(level, right, n, bits_per_sample, 1, m_subframes[1]);
+                analyze(level, &m_side[0][0], n, bits_per_sample + 1, 2, m_subframes[2]);
+                analyze(level, &m_side[1][0], n, bits_per_sample, 3, m_subframes[3]);
+                uint64_t l = m_subframes[0].bits, r = m_subframes[1].bits;
+                uint64_t s = m_subframes[2].bits, m = m_subframes[3].bits;
+                uint64_t best = l + r;
+                assignment = 1;
+                if (l + s < best)
+                {
+                    best = l + s;
+                    assignment = 8;
+                }
+                if (r + s < best)
+                {
+                    best = r + s;
+                    assignment = 9;
+                }
+                if (m + s < best)
+                    assignment = 10;
+
+                switch (assignment)
+                {
+                case 8:
+                    swap_subframes(m_subframes[1], m_subframes[2]);
+                    break;
+                case 9:
+                    swap_subframes(m_subframes[0], m_subframes[2]);
+                    break;
+                case 10:
+                    swap_subframes(m_subframes[0], m_subframes[3]);
+                    swap_subframes(m_subframes[1], m_subframes[2]);
+                    break;
+                default:
+                    break;
+                }
+            }
+        }
+        else
+        {
+            for (int ch = 0; ch < channels; ++ch)
+            {
+                analyze(level, samples + ch * stride, n, bits_per_sample, ch,
+                        m_subframes[ch]);
+            }
+        }
+
+        bit_writer& w = m_writer;
+        w.clear();
+
+        // the frame header
+        w.put(0x3FFE, 14);
+        w.put(0, 1);        // reserved
+        w.put(0, 1);        // the fixed block size
+
+        int size_code, rate_code, bps_code;
+        switch (n)
+        {
+        case 192:   size_code = 1; break;
+        case 576:   size_code = 2; break;
+        case 1152:  size_code = 3; break;
+        case 2304:  size_code = 4; break;
+        case 4608:  size_code = 5; break;
+        case 256:   size_code = 8; break;
+        case 512:   size_code = 9; break;
+        case 1024:  size_code = 10; break;
+        case 2048:  size_code = 11; break;
+        case 4096:  size_code = 12; break;
+        case 8192:  size_code = 13; break;
+        case 16384: size_code = 14; break;
+        case 32768: size_code = 15; break;
+        default:    size_code = (n <= 256) ? 6 : 7; break;
+        }
+        switch (samples_per_sec)
+        {
+        case 88200:     rate_code = 1; break;
+        case 176400:    rate_code = 2; break;
+        case 192000:    rate_code = 3; break;
+        case 8000:      rate_code = 4; break;
+        case 16000:     rate_code = 5; break;
+        case 22050:     rate_code = 6; break;
+        case 24000:     rate_code = 7; break;
+        case 32000:     rate_code = 8; break;
+        case 44100:     rate_code = 9; break;
+        case 48000:     rate_code = 10; break;
+        case 96000:     rate_code = 11; break;
+        default:
+            if (samples_per_sec % 1000 == 0 && samples_per_sec <= 255000)
+                rate_code = 12;
+            else if (samples_per_sec <= 65535)
+                rate_code = 13;
+            else if (samples_per_sec % 10 == 0 && samples_per_sec <= 655350)
+                rate_code = 14;
+            else
+                rate_code = 0;  // see STREAMINFO
+            break;
+        }
+        switch (bits_per_sample)
+        {
+        case 8:     bps_code = 1; break;
+        case 12:    bps_code = 2; break;
+        case 16:    bps_code = 4; break;
+        case 20:    bps_code = 5; break;
+        case 24:    bps_code = 6; break;
+        default:    bps_code = 0; break;
+        }
+        w.put(size_code, 4);
+        w.put(rate_code, 4);
+        w.put(assignment, 4);
+        w.put(bps_code, 3);
+        w.put(0, 1);        // reserved
+
+        // the frame number in the UTF-8 way
+        if (frame_number < 0x80)
+        {
+            w.put(frame_number, 8);
+        }
+        else
+        {
+            // the leading ones of the first byte are the count of the bytes
+            int bytes = 2;
+            while (bytes < 6 && frame_number >= (1u << (5 * bytes + 1)))
+                ++bytes;
+            w.put(((0xFF00 >> bytes) & 0xFF) | (frame_number >> (6 * (bytes - 1))), 8);
+            for (int i = bytes - 2; i >= 0; --i)
+                w.put(0x80 | ((frame_number >> (6 * i)) & 0x3F), 8);
+        }
+
+        if (size_code == 6)
+            w.put(n - 1, 8);
+        else if (size_code == 7)
+            w.put(n - 1, 16);
+        if (rate_code == 12)
+            w.put(samples_per_sec / 1000, 8);
+        else if (rate_code == 13)
+            w.put(samples_per_sec, 16);
+        else if (rate_code == 14)
+            w.put(samples_per_sec / 10, 16);
+
+        w.put(crc8(&w.data()[0], w.data().size()), 8);
+
+        // the subframes
+        for (int ch = 0; ch < channels; ++ch)
+            write_subframe(m_subframes[ch], n);
+
+        w.align();
+        unsigned int crc = crc16(&w.data()[0], w.data().size());
+        w.put(crc, 16);
+        out.swap(w.data());
+    }
+} // namespace flac
+
+////////////////////////////////////////////////////////////////////////////
+
+inline MFlacWriter::MFlacWriter()
+    : m_current(0), m_filled(0), m_level(DEFAULT_LEVEL), m_threads(0),
+      m_samples_per_sec(0), m_channels(0), m_bits_per_sample(0),
+      m_block_size(0), m_frame_number(0), m_total_frames(0),
+      m_min_frame_size(0), m_max_frame_size(0), m_failed(false)
+{
+}
+
+inline MFlacWriter::~MFlacWriter()
+{
+    close();
+}
+
+inline bool
+MFlacWriter::open(const char *filename, int samples_per_sec, int channels,
+                  int bits_per_sample, uint64_t expected_size)
+{
+    close();
+    m_writer.set_raw(true);
+    if (!m_writer.open(filename, samples_per_sec, channels, bits_per_sample,
+                       1, expected_size))
+    {
+        return false;
+    }
+    return start(samples_per_sec, channels, bits_per_sample);
+}
+
+inline bool
+MFlacWriter::open_stdout(int samples_per_sec, int channels,
+                         int bits_per_sample, uint64_t expected_size)
+{
+    close();
+    m_writer.set_raw(true);
+    if (!m_writer.open_stdout(samples_per_sec, channels, bits_per_sample,
+                              1, expected_size))
+    {
+        return false;
+    }
+    return start(samples_per_sec, channels, bits_per_sample);
+}
+
+inline bool
+MFlacWriter::open_stream(MWaveWriter::write_proc_t proc,
+                         MWaveWriter::write_at_proc_t write_at_proc, void *context,
+                         int samples_per_sec, int channels, int bits_per_sample)
+{
+    close();
+    m_writer.set_raw(true);
+    if (!m_writer.open_stream(proc, write_at_proc, context, samples_per_sec,
+                              channels, bits_per_sample))
+    {
+        return false;
+    }
+    return start(samples_per_sec, channels, bits_per_sample);
+}
+
+inline bool
+MFlacWriter::start(int samples_per_sec, int channels, int bits_per_sample)
+{
+    m_samples_per_sec = samples_per_sec;
+    m_channels = channels;
+    m_bits_per_sample = bits_per_sample;
+    m_failed = false;
+    m_filled = 0;
+    m_current = 0;
+    m_frame_number = 0;
+    m_total_frames = 0;
+    m_min_frame_size = 0;
+    m_max_frame_size = 0;
+    m_partial.clear();
+    m_md5.init();
+
+    if (channels < 1 || channels > flac::MAX_CHANNELS ||
+        (bits_per_sample != 8 && bits_per_sample != 16 && bits_per_sample != 24) ||
+        samples_per_sec < 1 || samples_per_sec > 655350)
+    {
+        m_writer.close();
+        return false;
+    }
+
+    const flac::level_type& level = flac::get_level(m_level);
+    m_block_size = level.block_size;
+
+    // fill the tables of the CRCs before the threads use them
+    flac::crc8(NULL, 0);
+    flac::crc16(NULL, 0);
+
+    // two frames per thread keep the threads busy while one is written
+    int threads = m_threads ? m_threads : mthread_cpu_count();
+    if (threads > 1)
+        m_pool.start(threads);
+    size_t count = (threads > 1) ? size_t(threads) * 2 : 1;
+    for (size_t i = 0; i < count; ++i)
+    {
+        task_type *task = new task_type;
+        task->level = &level;
+        task->writer = this;
+        task->samples.resize(size_t(m_block_size) * channels);
+        task->block_size = 0;
+        task->frame_number = 0;
+        task->busy = false;
+        m_tasks.push_back(task);
+    }
+
+    // the sizes and the MD5 are unknown until close
+    unsigned char header[HEADER_SIZE];
+    make_header(header, NULL);
+    return m_writer.write(header, sizeof(header));
+}
+
+inline void
+MFlacWriter::make_header(unsigned char *header, const unsigned char *md5) const
+{
+    std::memset(header, 0, HEADER_SIZE);
+    std::memcpy(&header[0], "fLaC", 4);
+
+    // the last metadata block, STREAMINFO of 34 bytes
+    header[4] = 0x80;
+    header[7] = 34;
+
+    unsigned char *info = &header[8];
+    info[0] = (unsigned char)(m_block_size >> 8);
+    info[1] = (unsigned char)m_block_size;
+    info[2] = (unsigned char)(m_block_size >> 8);
+    info[3] = (unsigned char)m_block_size;
+    info[4] = (unsigned char)(m_min_frame_size >> 16);
+    info[5] = (unsigned char)(m_min_frame_size >> 8);
+    info[6] = (unsigned char)m_min_frame_size;
+    info[7] = (unsigned char)(m_max_frame_size >> 16);
+    info[8] = (unsigned char)(m_max_frame_size >> 8);
+    info[9] = (unsigned char)m_max_frame_size;
+
+    // 20 bits of the rate, 3 of the channels, 5 of the bits and
+    // 36 of the total samples
+    info[10] = (unsigned char)(m_samples_per_sec >> 12);
+    info[11] = (unsigned char)(m_samples_per_sec >> 4);
+    info[12] = (unsigned char)(((m_samples_per_sec & 0x0F) << 4) |
+                               ((m_channels - 1) << 1) |
+                               ((m_bits_per_sample - 1) >> 4));
+    info[13] = (unsigned char)((((m_bits_per_sample - 1) & 0x0F) << 4) |
+                               (uint32_t(m_total_frames >> 32) & 0x0F));
+    info[14] = (unsigned char)(m_total_frames >> 24);
+    info[15] = (unsigned char)(m_total_frames >> 16);
+    info[16] = (unsigned char)(m_total_frames >> 8);
+    info[17] = (unsigned char)m_total_frames;
+
+    if (md5)
+        std::memcpy(&info[18], md5, MMd5::DIGEST_SIZE);
+}
+
+inline bool MFlacWriter::write(const void *data, size_t size)
+{
+    if (!m_writer.is_open() || m_failed)
+        return false;
+
+    m_md5.update(data, size);
+
+    // keep a partial frame for the next time
+    const size_t frame_size = size_t(m_channels) * (m_bits_per_sample / 8);
+    const unsigned char *ptr = (const unsigned char *)data;
+    if (m_partial.size())
+    {
+        size_t count = frame_size - m_partial.size();
+        if (count > size)
+            count = size;
+        m_partial.insert(m_partial.end(), ptr, ptr + count);
+        ptr += count;
+        size -= count;
+        if (m_partial.size() < frame_size)
+            return true;
+        put_samples(&m_partial[0], 1);
+        m_partial.clear();
+    }
+
+    size_t frames = size / frame_size;
+    put_samples(ptr, frames);
+    m_partial.assign(ptr + frames * frame_size, ptr + size);
+    return !m_failed;
+}
+
+// deinterleave the frames into the current task
+inline void MFlacWriter::put_samples(const unsigned char *data, size_t frames)
+{
+    const int bytes = m_bits_per_sample / 8;
+    while (frames > 0 && !m_failed)
+    {
+        task_type *task = m_tasks[m_current];
+        size_t count = size_t(m_block_size - m_filled);
+        if (count > frames)
+            count = frames;
+
+        for (int ch = 0; ch < m_channels; ++ch)
+        {
+            int32_t *dst = &task->samples[size_t(ch) * m_block_size + m_filled];
+            const unsigned char *src = data + ch * bytes;
+            const size_t step = size_t(m_channels) * bytes;
+            switch (bytes)
+            {
+            case 1:
+                for (size_t i = 0; i < count; ++i, src += step)
+                    dst[i] = (signed char)src[0];
+                break;
+            case 2:
+                for (size_t i = 0; i < count; ++i, src += step)
+                    dst[i] = int16_t(src[0] | (src[1] << 8));
+                break;
+            default:
+                for (size_t i = 0; i < count; ++i, src += step)
+                {
+                    uint32_t value = src[0] | (src[1] << 8) | (uint32_t(src[2]) << 16);
+                    dst[i] = int32_t(value << 8) >> 8;
+                }
+                break;
+            }
+        }
+
+        data += count * m_channels * bytes;
+        frames -= count;
+        m_filled += int(count);
+        if (m_filled == m_block_size)
+            submit();
+    }
+}
+
+// encode the current task, and make the next one free
+inline bool MFlacWriter::submit()
+{
+    task_type *task = m_tasks[m_current];
+    task->block_size = m_filled;
+    task->frame_number = m_frame_number++;
+    task->busy = true;
+    m_total_frames += m_filled;
+    m_filled = 0;
+    m_pool.submit(task);
+
+    m_current = (m_current + 1) % m_tasks.size();
+    task = m_tasks[m_current];
+    if (task->busy)
+        return finish(task);
+    return true;
+}
+
+// wait for the task and write the frame
+inline bool MFlacWriter::finish(task_type *task)
+{
+    m_pool.wait(task);
+    task->busy = false;
+
+    const uint32_t size = uint32_t(task->output.size());
+    if (m_min_frame_size == 0 || size < m_min_frame_size)
+        m_min_frame_size = size;
+    if (size > m_max_frame_size)
+        m_max_frame_size = size;
+
+    if (!m_writer.write(&task->output[0], task->output.size()))
+        m_failed = true;
+    return !m_failed;
+}
+
+inline bool MFlacWriter::close()
+{
+    if (!m_writer.is_open())
+        return true;
+
+    if (m_filled)
+        submit();
+
+    // the rest in the order of the frames
+    for (size_t i = 1; i <= m_tasks.size(); ++i)
+    {
+        task_type *task = m_tasks[(m_current + i) % m_tasks.size()];
+        if (task->busy)
+            finish(task);
+    }
+    m_pool.stop();
+
+    bool ok = !m_failed && m_partial.empty();
+    if (!m_writer.is_streaming())
+    {
+        unsigned char md5[MMd5::DIGEST_SIZE];
+        m_md5.final(md5);
+
+        unsigned char header[HEADER_SIZE];
+        make_header(header, md5);
+        ok = m_writer.write_at(0, header, sizeof(header)) && ok;
+    }
+
+    ok = m_writer.close() && ok;
+    free_tasks();
+    return ok;
+}
+
+inline void MFlacWriter::free_tasks()
+{
+    for (size_t i = 0; i < m_tasks.size(); ++i)
+        delete m_tasks[i];
+    m_tasks.clear();
+}
+
+////////////////////////////////////////////////////////////////////////////
+
+#endif  // ndef MZC4_MFLACWRITER_HPP_
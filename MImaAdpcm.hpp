@@ -0,0 +1,206 @@
+// MImaAdpcm.hpp -- IMA ADPCM encoder of WAVE files             -*- C++ -*-
+// This file is part of MZC4.  See file "ReadMe.txt" and "License.txt".
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef MZC4_MIMAADPCM_HPP_
+#define MZC4_MIMAADPCM_HPP_     1   /* Version 1 */
+
+// class MImaAdpcmEncoder;
+
+////////////////////////////////////////////////////////////////////////////
+
+#if __cplusplus >= 201103L          /* C++11 */
+    #include <cstdint>
+#else
+    #include "pstdint.h"
+#endif
+
+#include <cstddef>      // for size_t
+
+////////////////////////////////////////////////////////////////////////////
+
+// MImaAdpcmEncoder encodes 16-bit interleaved PCM into the blocks of
+// WAVE_FORMAT_IMA_ADPCM (4 bits per sample).
+//
+// A block begins with a header of 4 bytes per channel: the first sample
+// and the step index. The other samples follow in the groups of 4 bytes
+// per channel, 8 samples of a channel in a group, the low nibble first.
+// The first sample of each block resets the predictor, so an error doesn't
+// last beyond the block. The step index goes on to the next block.
+//
+// The last block may be shorter; its samples are padded to a group by
+// repeating the last sample.
+class MImaAdpcmEncoder
+{
+public:
+    enum { MAX_CHANNELS = 8 };
+
+    MImaAdpcmEncoder() : m_channels(0), m_block_align(0), m_frames_per_block(0)
+    {
+    }
+
+    // the common block size for the rate: 256 bytes per channel up to
+    // 11025 Hz, 512 up to 22050 Hz, and 1024 above
+    static int standard_block_align(int samples_per_sec, int channels)
+    {
+        int size = 256;
+        if (samples_per_sec > 11025)
+            size = 512;
+        if (samples_per_sec > 22050)
+            size = 1024;
+        return size * channels;
+    }
+
+    bool init(int channels, int block_align);
+
+    int block_align() const
+    {
+        return m_block_align;
+    }
+
+    // the sample frames of a full block
+    int frames_per_block() const
+    {
+        return m_frames_per_block;
+    }
+
+    // the bytes of a block of frames, up to frames_per_block()
+    size_t block_size(size_t frames) const
+    {
+        const size_t groups = (frames + 6) / 8;     // the first one is in the header
+        return size_t(m_channels) * 4 * (1 + groups);
+    }
+
+    // encode a block of frames, up to frames_per_block(), into dst of
+    // block_size(frames) bytes
+    void encode(const int16_t *src, size_t frames, unsigned char *dst);
+
+protected:
+    int m_channels;
+    int m_block_align;
+    int m_frames_per_block;
+    int m_index[MAX_CHANNELS];      // the step index of each channel
+
+    // encode a sample, updating the predicted value and the step index as
+    // the decoder does
+    static int encode_sample(int sample, int& predicted, int& index);
+};
+
+////////////////////////////////////////////////////////////////////////////
+
+inline bool MImaAdpcmEncoder::init(int channels, int block_align)
+{
+    if (channels <= 0 || channels > MAX_CHANNELS ||
+        block_align <= channels * 4 || block_align % (channels * 4) != 0)
+    {
+        return false;
+    }
+
+    m_channels = channels;
+    m_block_align = block_align;
+    m_frames_per_block = (block_align - channels * 4) * 2 / channels + 1;
+    for (int ch = 0; ch < MAX_CHANNELS; ++ch)
+        m_index[ch] = 0;
+    return true;
+}
+
+inline int MImaAdpcmEncoder::encode_sample(int sample, int& predicted, int& index)
+{
+    static const int16_t s_steps[89] =
+    {
+        7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31,
+        34, 37, 41, 45, 50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143,
+        157, 173, 190, 209, 230, 253, 279, 307, 337, 371, 408, 449, 494, 544,
+        598, 658, 724, 796, 876, 963, 1060, 1166, 1282, 1411, 1552, 1707,
+        1878, 2066, 2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871,
+        5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+        15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+    };
+    static const signed char s_index_delta[8] =
+    {
+        -1, -1, -1, -1, 2, 4, 6, 8
+    };
+
+    int step = s_steps[index];
+    int diff = sample - predicted;
+    int code = 0;
+    if (diff < 0)
+    {
+        code = 8;
+        diff = -diff;
+    }
+
+    // the same sum of the steps as the decoder
+    int delta = step >> 3;
+    if (diff >= step)
+    {
+        code |= 4;
+        diff -= step;
+        delta += step;
+    }
+    step >>= 1;
+    if (diff >= step)
+    {
+        code |= 2;
+        diff -= step;
+        delta += step;
+    }
+    step >>= 1;
+    if (diff >= step)
+    {
+        code |= 1;
+        delta += step;
+    }
+
+    predicted += (code & 8) ? -delta : delta;
+    predicted = (predicted < -32768) ? -32768 : predicted;
+    predicted = (predicted > 32767) ? 32767 : predicted;
+
+    index += s_index_delta[code & 7];
+    index = (index < 0) ? 0 : index;
+    index = (index > 88) ? 88 : index;
+    return code;
+}
+
+inline void
+MImaAdpcmEncoder::encode(const int16_t *src, size_t frames, unsigned char *dst)
+{
+    if (frames == 0)
+        return;
+    if (frames > size_t(m_frames_per_block))
+        frames = m_frames_per_block;
+
+    const int channels = m_channels;
+    const size_t groups = (frames + 6) / 8;
+    for (int ch = 0; ch < channels; ++ch)
+    {
+        // the header
+        int predicted = src[ch];
+        int index = m_index[ch];
+        unsigned char *header = dst + ch * 4;
+        header[0] = (unsigned char)predicted;
+        header[1] = (unsigned char)(predicted >> 8);
+        header[2] = (unsigned char)index;
+        header[3] = 0;
+
+        // the groups of 8 samples
+        size_t i = 1;
+        for (size_t g = 0; g < groups; ++g)
+        {
+            unsigned char *group = dst + ((1 + g) * channels + ch) * 4;
+            for (int k = 0; k < 8; k += 2, i += 2)
+            {
+                const size_t i0 = (i < frames) ? i : frames - 1;
+                const size_t i1 = (i + 1 < frames) ? i + 1 : frames - 1;
+                int lo = encode_sample(src[i0 * channels + ch], predicted, index);
+                int hi = encode_sample(src[i1 * channels + ch], predicted, index);
+                group[k / 2] = (unsigned char)(lo | (hi << 4));
+            }
+        }
+        m_index[ch] = index;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////
+
+#endif  // ndef MZC4_MIMAADPCM_HPP_
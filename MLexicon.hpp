@@ -0,0 +1,596 @@
+// MLexicon.hpp -- pronunciation lexicon                        -*- C++ -*-
+// This file is part of MZC4.  See file "ReadMe.txt" and "License.txt".
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef MZC4_MLEXICON_HPP_
+#define MZC4_MLEXICON_HPP_          2   /* Version 2 */
+
+// class MLexicon;
+
+////////////////////////////////////////////////////////////////////////////
+
+#include "MString.hpp"
+#include "MFileMapping.hpp"
+#include "MFileUtils.hpp"
+#include <vector>       // for std::vector
+#include <map>          // for std::map
+#include <cstring>      // for std::memcmp, std::memcpy
+
+////////////////////////////////////////////////////////////////////////////
+// the compiled lexicon
+//
+// The cache file is the header followed by the states, the edges, the
+// entries and the replacement pool, in the native byte order. Every section
+// starts at a multiple of four bytes, so the file is used in place after
+// mapping it.
+
+#define MLEXICON_MAGIC      "MLEX"
+#define MLEXICON_VERSION    2
+
+struct MLexiconHeader
+{
+    char        magic[4];       // MLEXICON_MAGIC
+    uint32_t    version;        // MLEXICON_VERSION
+    uint64_t    source_size;    // the size of the lexicon file
+    uint64_t    source_time;    // the last write time in nanoseconds
+    uint32_t    char_size;      // sizeof(WCHAR)
+    uint32_t    state_count;
+    uint32_t    edge_count;
+    uint32_t    entry_count;
+    uint32_t    pool_count;     // in WCHARs
+    uint32_t    reserved;
+};
+
+struct MLexiconState
+{
+    uint32_t    edge_first;     // the index of the first edge
+    uint32_t    edge_count;     // the edges are sorted by ch
+    uint32_t    fail;           // the state of the longest proper suffix
+    uint32_t    output;         // the nearest suffix state with an entry, or 0
+    uint32_t    entry;          // the entry index plus one, or 0
+    uint32_t    depth;          // the length of the prefix
+};
+
+struct MLexiconEdge
+{
+    uint32_t    ch;
+    uint32_t    next;
+};
+
+struct MLexiconEntry
+{
+    uint32_t    length;         // the length of the word
+    uint32_t    replace_first;  // the index in the pool
+    uint32_t    replace_count;
+};
+
+////////////////////////////////////////////////////////////////////////////
+
+// MLexicon replaces words with their pronunciations. The lexicon file has
+// one "word<TAB>pronunciation" entry per line. Empty lines and lines
+// starting with '#' are ignored, and the later one of duplicated words wins.
+//
+// All the words are matched in a single pass with an Aho-Corasick
+// automaton. The leftmost match wins, then the longest one. A word that
+// starts or ends with a letter or a digit matches only at word boundaries,
+// so "US" does not match in "BUS".
+class MLexicon
+{
+public:
+    MLexicon()
+    {
+        clear();
+    }
+
+    // load the lexicon file. the compiled automaton is cached in the file
+    // filename + ".cache" and used while the lexicon file is unchanged.
+    bool load(const char *filename);
+
+    bool compile(const MStringW& source);
+    bool load_cache(const char *cache_file,
+                    uint64_t source_size, uint64_t source_time);
+    bool save_cache(const char *cache_file,
+                    uint64_t source_size, uint64_t source_time) const;
+
+    // replace the words in text. returns false if nothing was replaced.
+    bool apply(const MStringW& text, MStringW& out) const;
+    bool apply(MStringW& text) const;
+
+    bool empty() const
+    {
+        return m_entry_count == 0;
+    }
+
+    size_t size() const
+    {
+        return m_entry_count;
+    }
+
+    void clear();
+
+    static bool is_word_char(WCHAR ch);
+
+protected:
+    // the compiled tables, either in the vectors or in the mapping
+    const MLexiconState *m_states;
+    const MLexiconEdge  *m_edges;
+    const MLexiconEntry *m_entries;
+    const WCHAR         *m_pool;
+    uint32_t m_state_count;
+    uint32_t m_edge_count;
+    uint32_t m_entry_count;
+    uint32_t m_pool_count;
+
+    std::vector<MLexiconState>  m_state_vec;
+    std::vector<MLexiconEdge>   m_edge_vec;
+    std::vector<MLexiconEntry>  m_entry_vec;
+    MStringW                    m_pool_str;
+    MFileMapping                m_mapping;
+
+    struct node_type
+    {
+        std::map<WCHAR, uint32_t> next;
+        uint32_t entry;
+        uint32_t depth;
+    };
+
+    uint32_t find_edge(uint32_t state, WCHAR ch) const;
+    uint32_t next_state(uint32_t state, WCHAR ch) const;
+    bool validate() const;
+    void use_vectors();
+
+private:
+    // not copyable
+    MLexicon(const MLexicon&);
+    MLexicon& operator=(const MLexicon&);
+};
+
+////////////////////////////////////////////////////////////////////////////
+
+inline void MLexicon::clear()
+{
+    m_states = NULL;
+    m_edges = NULL;
+    m_entries = NULL;
+    m_pool = NULL;
+    m_state_count = m_edge_count = m_entry_count = m_pool_count = 0;
+    m_state_vec.clear();
+    m_edge_vec.clear();
+    m_entry_vec.clear();
+    m_pool_str.clear();
+    m_mapping.close();
+}
+
+inline void MLexicon::use_vectors()
+{
+    m_states = m_state_vec.empty() ? NULL : &m_state_vec[0];
+    m_edges = m_edge_vec.empty() ? NULL : &m_edge_vec[0];
+    m_entries = m_entry_vec.empty() ? NULL : &m_entry_vec[0];
+    m_pool = m_pool_str.c_str();
+    m_state_count = uint32_t(m_state_vec.size());
+    m_edge_count = uint32_t(m_edge_vec.size());
+    m_entry_count = uint32_t(m_entry_vec.size());
+    m_pool_count = uint32_t(m_pool_str.size());
+}
+
+inline bool MLexicon::is_word_char(WCHAR ch)
+{
+    if (mchr_is_alnum(ch) || ch == WCHAR('_'))
+        return true;
+    // Latin-1 Supplement and Latin Extended-A/B letters
+    return (0xC0 <= ch && ch <= 0x24F && ch != 0xD7 && ch != 0xF7);
+}
+
+inline uint32_t MLexicon::find_edge(uint32_t state, WCHAR ch) const
+{
+    const MLexiconState& st = m_states[state];
+    const MLexiconEdge *first = m_edges + st.edge_first;
+    size_t count = st.edge_count;
+    while (count > 0)
+    {
+        size_t half = count / 2;
+        if (first[half].ch < uint32_t(ch))
+        {
+            first += half + 1;
+            count -= half + 1;
+        }
+        else
+        {
+            count = half;
+        }
+    }
+    if (first != m_edges + st.edge_first + st.edge_count &&
+        first->ch == uint32_t(ch))
+    {
+        return first->next;
+    }
+    return 0;   // the root is nobody's child
+}
+
+inline uint32_t MLexicon::next_state(uint32_t state, WCHAR ch) const
+{
+    for (;;)
+    {
+        uint32_t next = find_edge(state, ch);
+        if (next || state == 0)
+            return next;
+        state = m_states[state].fail;
+    }
+}
+
+inline bool MLexicon::compile(const MStringW& source)
+{
+    clear();
+
+    // the trie under construction
+    std::vector<node_type> nodes(1);
+    nodes[0].entry = nodes[0].depth = 0;
+    std::vector<MStringW> replaces;
+    std::vector<uint32_t> lengths;
+
+    MStringSplitterW lines(source, WIDE("\n"));
+    MStringViewW line;
+    while (lines.next(line))
+    {
+        size_t tab = line.find(WCHAR('\t'));
+        if (tab == MStringViewW::npos || line[0] == WCHAR('#'))
+            continue;
+
+        MStringViewW word = mstr_trim_view(line.substr(0, tab));
+        MStringViewW replace = mstr_trim_view(line.substr(tab + 1));
+        if (word.empty())
+            continue;
+
+        uint32_t s = 0;
+        for (size_t m = 0; m < word.size(); ++m)
+        {
+            std::map<WCHAR, uint32_t>::iterator it = nodes[s].next.find(word[m]);
+            if (it != nodes[s].next.end())
+            {
+                s = it->second;
+                continue;
+            }
+            uint32_t t = uint32_t(nodes.size());
+            nodes.push_back(node_type());
+            nodes[t].entry = 0;
+            nodes[t].depth = nodes[s].depth + 1;
+            nodes[s].next[word[m]] = t;
+            s = t;
+        }
+
+        if (nodes[s].entry)
+        {
+            replaces[nodes[s].entry - 1] = replace.str();
+        }
+        else
+        {
+            replaces.push_back(replace.str());
+            lengths.push_back(uint32_t(word.size()));
+            nodes[s].entry = uint32_t(replaces.size());
+        }
+    }
+
+    // flatten the trie in breadth-first order
+    std::vector<uint32_t> order(1, 0), index(nodes.size());
+    m_state_vec.resize(nodes.size());
+    for (size_t n = 0; n < order.size(); ++n)
+    {
+        const node_type& node = nodes[order[n]];
+        index[order[n]] = uint32_t(n);
+
+        MLexiconState& st = m_state_vec[n];
+        st.edge_first = uint32_t(m_edge_vec.size());
+        st.edge_count = uint32_t(node.next.size());
+        st.fail = st.output = 0;
+        st.entry = node.entry;
+        st.depth = node.depth;
+
+        std::map<WCHAR, uint32_t>::const_iterator it, end = node.next.end();
+        for (it = node.next.begin(); it != end; ++it)
+        {
+            MLexiconEdge edge;
+            edge.ch = uint32_t(it->first);
+            edge.next = it->second;     // renumbered below
+            m_edge_vec.push_back(edge);
+            order.push_back(it->second);
+        }
+    }
+    for (size_t n = 0; n < m_edge_vec.size(); ++n)
+    {
+        m_edge_vec[n].next = index[m_edge_vec[n].next];
+    }
+
+    for (size_t n = 0; n < replaces.size(); ++n)
+    {
+        MLexiconEntry entry;
+        entry.length = lengths[n];
+        entry.replace_first = uint32_t(m_pool_str.size());
+        entry.replace_count = uint32_t(replaces[n].size());
+        m_entry_vec.push_back(entry);
+        m_pool_str += replaces[n];
+    }
+
+    use_vectors();
+
+    // the failure links. a parent comes before its children.
+    for (uint32_t s = 0; s < m_state_count; ++s)
+    {
+        const MLexiconState& st = m_state_vec[s];
+        for (uint32_t e = st.edge_first; e < st.edge_first + st.edge_count; ++e)
+        {
+            WCHAR ch = WCHAR(m_edge_vec[e].ch);
+            MLexiconState& child = m_state_vec[m_edge_vec[e].next];
+            if (s != 0)
+            {
+                uint32_t f = st.fail;
+                for (;;)
+                {
+                    uint32_t next = find_edge(f, ch);
+                    if (next || f == 0)
+                    {
+                        child.fail = next;
+                        break;
+                    }
+                    f = m_state_vec[f].fail;
+                }
+            }
+            const MLexiconState& fail = m_state_vec[child.fail];
+            child.output = fail.entry ? child.fail : fail.output;
+        }
+    }
+
+    return true;
+}
+
+inline bool MLexicon::apply(const MStringW& text, MStringW& out) const
+{
+    out.clear();
+    if (empty())
+    {
+        out = text;
+        return false;
+    }
+
+    const size_t len = text.size();
+    out.reserve(len);
+
+    size_t done = 0;            // text[0 .. done) is processed
+    bool pending = false;       // the best match so far
+    size_t match_first = 0, match_last = 0;
+    uint32_t match_entry = 0;
+    bool replaced = false;
+
+    // a match dropped for the pending one may start after the pending one
+    // ends. then scan again from there. that happens only with overlapping
+    // words, so the pass stays linear in practice.
+    bool rescan = false;
+
+    uint32_t s = 0;
+    for (size_t i = 0; i <= len; ++i)
+    {
+        if (i < len)
+        {
+            s = next_state(s, text[i]);
+
+            // the longest acceptable word ending here.
+            // the output chain goes from longer words to shorter ones.
+            uint32_t t = m_states[s].entry ? s : m_states[s].output;
+            for (; t; t = m_states[t].output)
+            {
+                const MLexiconEntry& entry = m_entries[m_states[t].entry - 1];
+                size_t first = i + 1 - entry.length, last = i + 1;
+                if (first < done)
+                    continue;
+                if (first > 0 && is_word_char(text[first]) &&
+                    is_word_char(text[first - 1]))
+                {
+                    continue;
+                }
+                if (last < len && is_word_char(text[i]) &&
+                    is_word_char(text[last]))
+                {
+                    continue;
+                }
+                if (!pending || first < match_first)
+                {
+                    pending = true;
+                    match_first = first;
+                    match_last = last;
+                    match_entry = m_states[t].entry - 1;
+                }
+                else if (first == match_first)
+                {
+                    match_last = last;
+                    match_entry = m_states[t].entry - 1;
+                }
+                else
+                {
+                    rescan = true;
+                }
+                break;
+            }
+
+            // any later match starts after match_first?
+            if (!pending || m_states[s].depth >= i + 1 - match_first)
+                continue;
+        }
+        else if (!pending)
+        {
+            break;
+        }
+
+        const MLexiconEntry& entry = m_entries[match_entry];
+        out.append(text, done, match_first - done);
+        out.append(m_pool + entry.replace_first, entry.replace_count);
+        done = match_last;
+        pending = false;
+        replaced = true;
+
+        if (rescan)
+        {
+            rescan = false;
+            s = 0;
+            i = done - 1;
+        }
+    }
+
+    out.append(text, done, MStringW::npos);
+    return replaced;
+}
+
+inline bool MLexicon::apply(MStringW& text) const
+{
+    MStringW out;
+    if (!apply(text, out))
+        return false;
+    text.swap(out);
+    return true;
+}
+
+inline bool MLexicon::validate() const
+{
+    for (uint32_t s = 0; s < m_state_count; ++s)
+    {
+        const MLexiconState& st = m_states[s];
+        if (st.edge_first > m_edge_count ||
+            st.edge_count > m_edge_count - st.edge_first ||
+            st.fail >= m_state_count || st.output >= m_state_count ||
+            st.entry > m_entry_count)
+        {
+            return false;
+        }
+    }
+    for (uint32_t e = 0; e < m_edge_count; ++e)
+    {
+        if (m_edges[e].next == 0 || m_edges[e].next >= m_state_count)
+            return false;
+    }
+    for (uint32_t n = 0; n < m_entry_count; ++n)
+    {
+        const MLexiconEntry& entry = m_entries[n];
+        if (entry.length == 0 ||
+            entry.replace_first > m_pool_count ||
+            entry.replace_count > m_pool_count - entry.replace_first)
+        {
+            return false;
+        }
+    }
+    return m_state_count > 0;
+}
+
+inline bool MLexicon::load_cache(const char *cache_file,
+                                 uint64_t source_size, uint64_t source_time)
+{
+    clear();
+
+    if (!m_mapping.open(cache_file) ||
+        m_mapping.size() < sizeof(MLexiconHeader))
+    {
+        clear();
+        return false;
+    }
+
+    const char *data = (const char *)m_mapping.data();
+    const MLexiconHeader *header = (const MLexiconHeader *)data;
+    if (std::memcmp(header->magic, MLEXICON_MAGIC, 4) != 0 ||
+        header->version != MLEXICON_VERSION ||
+        header->char_size != sizeof(WCHAR) ||
+        header->source_size != source_size ||
+        header->source_time != source_time)
+    {
+        clear();
+        return false;
+    }
+
+    uint64_t size = sizeof(MLexiconHeader);
+    size += uint64_t(header->state_count) * sizeof(MLexiconState);
+    size += uint64_t(header->edge_count) * sizeof(MLexiconEdge);
+    size += uint64_t(header->entry_count) * sizeof(MLexiconEntry);
+    size += uint64_t(header->pool_count) * sizeof(WCHAR);
+    if (size != m_mapping.size())
+    {
+        clear();
+        return false;
+    }
+
+    data += sizeof(MLexiconHeader);
+    m_states = (const MLexiconState *)data;
+    data += header->state_count * sizeof(MLexiconState);
+    m_edges = (const MLexiconEdge *)data;
+    data += header->edge_count * sizeof(MLexiconEdge);
+    m_entries = (const MLexiconEntry *)data;
+    data += header->entry_count * sizeof(MLexiconEntry);
+    m_pool = (const WCHAR *)data;
+    m_state_count = header->state_count;
+    m_edge_count = header->edge_count;
+    m_entry_count = header->entry_count;
+    m_pool_count = header->pool_count;
+
+    if (!validate())
+    {
+        clear();
+        return false;
+    }
+    return true;
+}
+
+inline bool MLexicon::save_cache(const char *cache_file,
+                                 uint64_t source_size, uint64_t source_time) const
+{
+    MLexiconHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, MLEXICON_MAGIC, 4);
+    header.version = MLEXICON_VERSION;
+    header.source_size = source_size;
+    header.source_time = source_time;
+    header.char_size = sizeof(WCHAR);
+    header.state_count = m_state_count;
+    header.edge_count = m_edge_count;
+    header.entry_count = m_entry_count;
+    header.pool_count = m_pool_count;
+
+    std::string bin((const char *)&header, sizeof(header));
+    bin.append((const char *)m_states, m_state_count * sizeof(MLexiconState));
+    bin.append((const char *)m_edges, m_edge_count * sizeof(MLexiconEdge));
+    bin.append((const char *)m_entries, m_entry_count * sizeof(MLexiconEntry));
+    bin.append((const char *)m_pool, m_pool_count * sizeof(WCHAR));
+
+    return mfile_write_atomic(cache_file, bin.data(), bin.size());
+}
+
+inline bool MLexicon::load(const char *filename)
+{
+    clear();
+
+    // a second is too coarse to see an edit just after the last load
+    uint64_t source_size, source_time;
+    if (!mfile_get_stat_ns(filename, source_size, source_time))
+        return false;
+
+    std::string cache_file = filename;
+    cache_file += ".cache";
+    if (load_cache(cache_file.c_str(), source_size, source_time))
+        return true;
+
+    MStringW source;
+    {
+        MFileMapping mapping;
+        if (!mapping.open(filename))
+            return false;
+        MTextType type;
+        type.nNewLine = MNEWLINE_NOCHANGE;
+        source = mstr_from_bin(mapping.data(), mapping.size(), &type);
+    }
+    mstr_normalize_newlines(source, MNEWLINE_LF);
+
+    if (!compile(source))
+        return false;
+
+    // the cache is only an optimization
+    save_cache(cache_file.c_str(), source_size, source_time);
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////
+
+#endif  // ndef MZC4_MLEXICON_HPP_
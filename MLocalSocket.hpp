@@ -0,0 +1,282 @@
+// MLocalSocket.hpp -- local stream sockets (Unix domain)       -*- C++ -*-
+// This file is part of MZC4.  See file "ReadMe.txt" and "License.txt".
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef MZC4_MLOCALSOCKET_HPP_
+#define MZC4_MLOCALSOCKET_HPP_      1   /* Version 1 */
+
+// class MLocalSocket;
+
+////////////////////////////////////////////////////////////////////////////
+
+#include <cstddef>      // for size_t
+#include <cstring>      // for std::memset, std::strlen
+#include <cstdio>       // for std::remove
+#include <string>       // for std::string
+
+#if defined(_WIN32) && !defined(WONVER)
+    // NOTE: include this before <windows.h>, or <winsock.h> conflicts.
+    #include <winsock2.h>
+    #include <afunix.h>     // needs Windows 10 1803 or later
+#else
+    #include <sys/types.h>
+    #include <sys/socket.h>
+    #include <sys/un.h>
+    #include <unistd.h>     // for close
+    #include <errno.h>
+#endif
+
+////////////////////////////////////////////////////////////////////////////
+
+// MLocalSocket is a stream socket of the local machine, named by a path.
+// listen() takes the path over from a dead server, but fails if a server
+// is alive there. The listener removes the path at close().
+class MLocalSocket
+{
+public:
+    MLocalSocket();
+    ~MLocalSocket();
+
+    bool listen(const char *path, int backlog = 8);
+    bool accept(MLocalSocket& client);
+    bool connect(const char *path);
+    void close();
+
+    bool is_open() const;
+
+    // all the bytes or false
+    bool send(const void *data, size_t size);
+    // all the bytes or false, such as at the end of the stream
+    bool recv(void *data, size_t size);
+
+protected:
+#if defined(_WIN32) && !defined(WONVER)
+    SOCKET m_sock;
+#else
+    int m_sock;
+#endif
+    std::string m_path;     // of the listener
+
+    bool create();
+    static bool make_address(const char *path, sockaddr_un& addr);
+
+private:
+    // NOTE: MLocalSocket is not copyable.
+    MLocalSocket(const MLocalSocket&);
+    MLocalSocket& operator=(const MLocalSocket&);
+};
+
+////////////////////////////////////////////////////////////////////////////
+
+inline MLocalSocket::~MLocalSocket()
+{
+    close();
+}
+
+inline bool MLocalSocket::make_address(const char *path, sockaddr_un& addr)
+{
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    const size_t len = std::strlen(path);
+    if (len == 0 || len >= sizeof(addr.sun_path))
+        return false;
+    std::memcpy(addr.sun_path, path, len + 1);
+    return true;
+}
+
+inline bool MLocalSocket::listen(const char *path, int backlog)
+{
+    close();
+
+    sockaddr_un addr;
+    if (!make_address(path, addr))
+        return false;
+
+    // a live server answers
+    {
+        MLocalSocket other;
+        if (other.connect(path))
+            return false;
+    }
+    std::remove(path);
+
+    if (!create())
+        return false;
+    if (::bind(m_sock, (const sockaddr *)&addr, sizeof(addr)) != 0 ||
+        ::listen(m_sock, backlog) != 0)
+    {
+        close();
+        return false;
+    }
+    m_path = path;
+    return true;
+}
+
+inline bool MLocalSocket::connect(const char *path)
+{
+    close();
+
+    sockaddr_un addr;
+    if (!make_address(path, addr) || !create())
+        return false;
+    if (::connect(m_sock, (const sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        close();
+        return false;
+    }
+    return true;
+}
+
+#if defined(_WIN32) && !defined(WONVER)
+    inline MLocalSocket::MLocalSocket() : m_sock(INVALID_SOCKET)
+    {
+    }
+
+    inline bool MLocalSocket::create()
+    {
+        static bool s_started = false;
+        if (!s_started)
+        {
+            WSADATA wsa;
+            if (::WSAStartup(MAKEWORD(2, 2), &wsa) != 0)
+                return false;
+            s_started = true;
+        }
+        m_sock = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        return m_sock != INVALID_SOCKET;
+    }
+
+    inline bool MLocalSocket::is_open() const
+    {
+        return m_sock != INVALID_SOCKET;
+    }
+
+    inline bool MLocalSocket::accept(MLocalSocket& client)
+    {
+        client.close();
+        client.m_sock = ::accept(m_sock, NULL, NULL);
+        return client.m_sock != INVALID_SOCKET;
+    }
+
+    inline void MLocalSocket::close()
+    {
+        if (m_sock != INVALID_SOCKET)
+            ::closesocket(m_sock);
+        m_sock = INVALID_SOCKET;
+        if (m_path.size())
+            std::remove(m_path.c_str());
+        m_path.clear();
+    }
+
+    inline bool MLocalSocket::send(const void *data, size_t size)
+    {
+        const char *ptr = (const char *)data;
+        while (size > 0)
+        {
+            int len = (size > 0x40000000) ? 0x40000000 : int(size);
+            int ret = ::send(m_sock, ptr, len, 0);
+            if (ret <= 0)
+                return false;
+            ptr += ret;
+            size -= size_t(ret);
+        }
+        return true;
+    }
+
+    inline bool MLocalSocket::recv(void *data, size_t size)
+    {
+        char *ptr = (char *)data;
+        while (size > 0)
+        {
+            int len = (size > 0x40000000) ? 0x40000000 : int(size);
+            int ret = ::recv(m_sock, ptr, len, 0);
+            if (ret <= 0)
+                return false;
+            ptr += ret;
+            size -= size_t(ret);
+        }
+        return true;
+    }
+#else
+    inline MLocalSocket::MLocalSocket() : m_sock(-1)
+    {
+    }
+
+    inline bool MLocalSocket::create()
+    {
+        m_sock = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    #ifdef SO_NOSIGPIPE
+        // no SIGPIPE when the peer is gone
+        int on = 1;
+        if (m_sock != -1)
+            ::setsockopt(m_sock, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+    #endif
+        return m_sock != -1;
+    }
+
+    inline bool MLocalSocket::is_open() const
+    {
+        return m_sock != -1;
+    }
+
+    inline bool MLocalSocket::accept(MLocalSocket& client)
+    {
+        client.close();
+        do
+        {
+            client.m_sock = ::accept(m_sock, NULL, NULL);
+        } while (client.m_sock == -1 && errno == EINTR);
+        return client.m_sock != -1;
+    }
+
+    inline void MLocalSocket::close()
+    {
+        if (m_sock != -1)
+            ::close(m_sock);
+        m_sock = -1;
+        if (m_path.size())
+            ::unlink(m_path.c_str());
+        m_path.clear();
+    }
+
+    inline bool MLocalSocket::send(const void *data, size_t size)
+    {
+    #ifdef MSG_NOSIGNAL
+        const int flags = MSG_NOSIGNAL;
+    #else
+        const int flags = 0;
+    #endif
+        const char *ptr = (const char *)data;
+        while (size > 0)
+        {
+            ssize_t ret = ::send(m_sock, ptr, size, flags);
+            if (ret < 0 && errno == EINTR)
+                continue;
+            if (ret <= 0)
+                return false;
+            ptr += ret;
+            size -= size_t(ret);
+        }
+        return true;
+    }
+
+    inline bool MLocalSocket::recv(void *data, size_t size)
+    {
+        char *ptr = (char *)data;
+        while (size > 0)
+        {
+            ssize_t ret = ::recv(m_sock, ptr, size, 0);
+            if (ret < 0 && errno == EINTR)
+                continue;
+            if (ret <= 0)
+                return false;
+            ptr += ret;
+            size -= size_t(ret);
+        }
+        return true;
+    }
+#endif
+
+////////////////////////////////////////////////////////////////////////////
+
+#endif  // ndef MZC4_MLOCALSOCKET_HPP_
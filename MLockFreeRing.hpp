@@ -0,0 +1,205 @@
+// MLockFreeRing.hpp -- lock-free ring of two threads           -*- C++ -*-
+// This file is part of MZC4.  See file "ReadMe.txt" and "License.txt".
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef MZC4_MLOCKFREERING_HPP_
+#define MZC4_MLOCKFREERING_HPP_     2   /* Version 2 */
+
+// template <typename T> class MLockFreeRing;
+
+////////////////////////////////////////////////////////////////////////////
+
+#if __cplusplus >= 201103L          /* C++11 */
+    #include <cstdint>
+#else
+    #include "pstdint.h"
+#endif
+
+#include <cstddef>      // for size_t
+
+#if defined(_MSC_VER)
+    #include <intrin.h>     // for _InterlockedOr, _InterlockedExchange
+#endif
+
+////////////////////////////////////////////////////////////////////////////
+
+// MLockFreeRing passes the items from a producer thread to a consumer
+// thread without locking, so the producer never waits for the consumer.
+// push() fails if the ring is full, and pop() fails if it's empty.
+//
+// The producer only writes the tail and the consumer only writes the
+// head. The item is stored before the tail is released, and loaded before
+// the head is released. The indexes are on their own cache lines.
+//
+// To let the consumer sleep, push(item, was_empty) tells the producer
+// that the ring was empty, so it wakes the consumer. The consumer checks
+// empty() under the lock of its condition before it waits. Both put a
+// full barrier between their stores and the loads of the other index, so
+// either empty() sees the item or push() sees the ring empty.
+template <typename T>
+class MLockFreeRing
+{
+public:
+    MLockFreeRing() : m_items(NULL), m_mask(0), m_head(0), m_tail(0)
+    {
+    }
+    ~MLockFreeRing()
+    {
+        delete[] m_items;
+    }
+
+    // the capacity is rounded up to a power of two. call before the
+    // threads use the ring.
+    bool init(size_t capacity);
+
+    // of the producer
+    bool push(const T& item);
+    bool push(const T& item, bool& was_empty);
+    // of the consumer
+    bool pop(T& item);
+
+    bool empty() const
+    {
+        full_barrier();
+        return load_acquire(&m_tail) == load_acquire(&m_head);
+    }
+
+protected:
+    T *m_items;
+    uint32_t m_mask;
+    char m_pad0[64];
+    volatile uint32_t m_head;   // the next item to pop
+    char m_pad1[64];
+    volatile uint32_t m_tail;   // the next item to push
+    char m_pad2[64];
+
+    static uint32_t load_acquire(const volatile uint32_t *ptr);
+    static void store_release(volatile uint32_t *ptr, uint32_t value);
+    static void full_barrier();
+
+private:
+    // NOTE: MLockFreeRing is not copyable.
+    MLockFreeRing(const MLockFreeRing&);
+    MLockFreeRing& operator=(const MLockFreeRing&);
+};
+
+////////////////////////////////////////////////////////////////////////////
+
+#if defined(_MSC_VER)
+    template <typename T>
+    inline uint32_t MLockFreeRing<T>::load_acquire(const volatile uint32_t *ptr)
+    {
+        return uint32_t(_InterlockedOr((volatile long *)ptr, 0));
+    }
+
+    template <typename T>
+    inline void MLockFreeRing<T>::store_release(volatile uint32_t *ptr, uint32_t value)
+    {
+        _InterlockedExchange((volatile long *)ptr, long(value));
+    }
+
+    template <typename T>
+    inline void MLockFreeRing<T>::full_barrier()
+    {
+        volatile long dummy = 0;
+        _InterlockedExchange(&dummy, 0);
+    }
+#elif defined(__ATOMIC_ACQUIRE)
+    template <typename T>
+    inline uint32_t MLockFreeRing<T>::load_acquire(const volatile uint32_t *ptr)
+    {
+        return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+    }
+
+    template <typename T>
+    inline void MLockFreeRing<T>::store_release(volatile uint32_t *ptr, uint32_t value)
+    {
+        __atomic_store_n(ptr, value, __ATOMIC_RELEASE);
+    }
+
+    template <typename T>
+    inline void MLockFreeRing<T>::full_barrier()
+    {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+#else
+    template <typename T>
+    inline uint32_t MLockFreeRing<T>::load_acquire(const volatile uint32_t *ptr)
+    {
+        uint32_t value = *ptr;
+        __sync_synchronize();
+        return value;
+    }
+
+    template <typename T>
+    inline void MLockFreeRing<T>::store_release(volatile uint32_t *ptr, uint32_t value)
+    {
+        __sync_synchronize();
+        *ptr = value;
+    }
+
+    template <typename T>
+    inline void MLockFreeRing<T>::full_barrier()
+    {
+        __sync_synchronize();
+    }
+#endif
+
+template <typename T>
+inline bool MLockFreeRing<T>::init(size_t capacity)
+{
+    if (capacity == 0 || capacity > 0x80000000)
+        return false;
+
+    uint32_t size = 1;
+    while (size < capacity)
+        size <<= 1;
+
+    delete[] m_items;
+    m_items = new T[size];
+    m_mask = size - 1;
+    m_head = m_tail = 0;
+    return true;
+}
+
+template <typename T>
+inline bool MLockFreeRing<T>::push(const T& item)
+{
+    // the indexes wrap around at 2^32, so the difference is the count
+    const uint32_t tail = m_tail;
+    if (tail - load_acquire(&m_head) > m_mask)
+        return false;
+
+    m_items[tail & m_mask] = item;
+    store_release(&m_tail, tail + 1);
+    return true;
+}
+
+template <typename T>
+inline bool MLockFreeRing<T>::push(const T& item, bool& was_empty)
+{
+    const uint32_t tail = m_tail;
+    if (!push(item))
+        return false;
+
+    // the consumer hasn't taken the item yet, and may be waiting for it
+    full_barrier();
+    was_empty = (load_acquire(&m_head) == tail);
+    return true;
+}
+
+template <typename T>
+inline bool MLockFreeRing<T>::pop(T& item)
+{
+    const uint32_t head = m_head;
+    if (head == load_acquire(&m_tail))
+        return false;
+
+    item = m_items[head & m_mask];
+    store_release(&m_head, head + 1);
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////
+
+#endif  // ndef MZC4_MLOCKFREERING_HPP_
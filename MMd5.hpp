@@ -0,0 +1,169 @@
+// MMd5.hpp -- MD5 message digest (RFC 1321)                    -*- C++ -*-
+// This file is part of MZC4.  See file "ReadMe.txt" and "License.txt".
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef MZC4_MMD5_HPP_
+#define MZC4_MMD5_HPP_      1   /* Version 1 */
+
+// class MMd5;
+
+////////////////////////////////////////////////////////////////////////////
+
+#if __cplusplus >= 201103L          /* C++11 */
+    #include <cstdint>
+#else
+    #include "pstdint.h"
+#endif
+
+#include <cstddef>      // for size_t
+#include <cstring>      // for std::memcpy
+
+////////////////////////////////////////////////////////////////////////////
+
+// MMd5 computes the MD5 digest of the data given by update() in pieces.
+// FLAC keeps the MD5 of the PCM to verify the decoding.
+class MMd5
+{
+public:
+    enum { DIGEST_SIZE = 16 };
+
+    MMd5()
+    {
+        init();
+    }
+
+    void init();
+    void update(const void *data, size_t size);
+    void final(unsigned char digest[DIGEST_SIZE]);
+
+protected:
+    uint32_t m_state[4];
+    uint64_t m_size;
+    unsigned char m_block[64];
+
+    void transform(const unsigned char *block);
+
+    static uint32_t rotl(uint32_t x, int n)
+    {
+        return (x << n) | (x >> (32 - n));
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////
+
+inline void MMd5::init()
+{
+    m_state[0] = 0x67452301;
+    m_state[1] = 0xEFCDAB89;
+    m_state[2] = 0x98BADCFE;
+    m_state[3] = 0x10325476;
+    m_size = 0;
+}
+
+inline void MMd5::update(const void *data, size_t size)
+{
+    const unsigned char *ptr = (const unsigned char *)data;
+    size_t used = size_t(m_size & 63);
+    m_size += size;
+
+    if (used)
+    {
+        size_t count = 64 - used;
+        if (count > size)
+            count = size;
+        std::memcpy(m_block + used, ptr, count);
+        ptr += count;
+        size -= count;
+        if (used + count < 64)
+            return;
+        transform(m_block);
+    }
+
+    for (; size >= 64; ptr += 64, size -= 64)
+        transform(ptr);
+
+    std::memcpy(m_block, ptr, size);
+}
+
+inline void MMd5::final(unsigned char digest[DIGEST_SIZE])
+{
+    const uint64_t bits = m_size * 8;
+
+    unsigned char pad[72];
+    size_t used = size_t(m_size & 63);
+    size_t count = (used < 56) ? 56 - used : 120 - used;
+    std::memset(pad, 0, sizeof(pad));
+    pad[0] = 0x80;
+    for (int i = 0; i < 8; ++i)
+        pad[count + i] = (unsigned char)(bits >> (8 * i));
+    update(pad, count + 8);
+
+    for (int i = 0; i < 4; ++i)
+    {
+        for (int k = 0; k < 4; ++k)
+            digest[i * 4 + k] = (unsigned char)(m_state[i] >> (8 * k));
+    }
+    init();
+}
+
+inline void MMd5::transform(const unsigned char *block)
+{
+    static const uint32_t s_k[64] =
+    {
+        0xD76AA478, 0xE8C7B756, 0x242070DB, 0xC1BDCEEE,
+        0xF57C0FAF, 0x4787C62A, 0xA8304613, 0xFD469501,
+        0x698098D8, 0x8B44F7AF, 0xFFFF5BB1, 0x895CD7BE,
+        0x6B901122, 0xFD987193, 0xA679438E, 0x49B40821,
+        0xF61E2562, 0xC040B340, 0x265E5A51, 0xE9B6C7AA,
+        0xD62F105D, 0x02441453, 0xD8A1E681, 0xE7D3FBC8,
+        0x21E1CDE6, 0xC33707D6, 0xF4D50D87, 0x455A14ED,
+        0xA9E3E905, 0xFCEFA3F8, 0x676F02D9, 0x8D2A4C8A,
+        0xFFFA3942, 0x8771F681, 0x6D9D6122, 0xFDE5380C,
+        0xA4BEEA44, 0x4BDECFA9, 0xF6BB4B60, 0xBEBFBC70,
+        0x289B7EC6, 0xEAA127FA, 0xD4EF3085, 0x04881D05,
+        0xD9D4D039, 0xE6DB99E5, 0x1FA27CF8, 0xC4AC5665,
+        0xF4292244, 0x432AFF97, 0xAB9423A7, 0xFC93A039,
+        0x655B59C3, 0x8F0CCC92, 0xFFEFF47D, 0x85845DD1,
+        0x6FA87E4F, 0xFE2CE6E0, 0xA3014314, 0x4E0811A1,
+        0xF7537E82, 0xBD3AF235, 0x2AD7D2BB, 0xEB86D391
+    };
+    static const int s_shift[4][4] =
+    {
+        { 7, 12, 17, 22 }, { 5, 9, 14, 20 }, { 4, 11, 16, 23 }, { 6, 10, 15, 21 }
+    };
+
+    uint32_t w[16];
+    for (int i = 0; i < 16; ++i)
+    {
+        w[i] = uint32_t(block[i * 4]) | (uint32_t(block[i * 4 + 1]) << 8) |
+               (uint32_t(block[i * 4 + 2]) << 16) | (uint32_t(block[i * 4 + 3]) << 24);
+    }
+
+    uint32_t a = m_state[0], b = m_state[1], c = m_state[2], d = m_state[3];
+    for (int i = 0; i < 64; ++i)
+    {
+        uint32_t f;
+        int g;
+        switch (i >> 4)
+        {
+        case 0:  f = (b & c) | (~b & d); g = i;                 break;
+        case 1:  f = (d & b) | (~d & c); g = (5 * i + 1) & 15;  break;
+        case 2:  f = b ^ c ^ d;          g = (3 * i + 5) & 15;  break;
+        default: f = c ^ (b | ~d);       g = (7 * i) & 15;      break;
+        }
+        uint32_t temp = d;
+        d = c;
+        c = b;
+        b += rotl(a + f + s_k[i] + w[g], s_shift[i >> 4][i & 3]);
+        a = temp;
+    }
+
+    m_state[0] += a;
+    m_state[1] += b;
+    m_state[2] += c;
+    m_state[3] += d;
+}
+
+////////////////////////////////////////////////////////////////////////////
+
+#endif  // ndef MZC4_MMD5_HPP_
@@ -0,0 +1,341 @@
+// MResampler.hpp -- polyphase sample-rate converter             -*- C++ -*-
+// This file is part of MZC4.  See file "ReadMe.txt" and "License.txt".
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef MZC4_MRESAMPLER_HPP_
+#define MZC4_MRESAMPLER_HPP_        1   /* Version 1 */
+
+// class MResampler;
+
+////////////////////////////////////////////////////////////////////////////
+
+#if __cplusplus >= 201103L          /* C++11 */
+    #include <cstdint>
+#else
+    #include "pstdint.h"
+#endif
+
+#include <cmath>        // for std::sin, std::sqrt
+#include <cstddef>      // for size_t
+#include <vector>       // for std::vector
+#include "MCpuFeatures.hpp"
+
+////////////////////////////////////////////////////////////////////////////
+
+enum MResamplerQuality
+{
+    MRESAMPLER_LOW,         // 8 taps, passband 80%
+    MRESAMPLER_MEDIUM,      // 16 taps, passband 88%
+    MRESAMPLER_HIGH,        // 32 taps, passband 92%
+    MRESAMPLER_BEST         // 64 taps, passband 95%
+};
+
+////////////////////////////////////////////////////////////////////////////
+
+namespace resampler
+{
+    // the dot product of n floats. n is a multiple of 8.
+    inline float dot_scalar(const float *a, const float *b, size_t n)
+    {
+        float sum0 = 0, sum1 = 0, sum2 = 0, sum3 = 0;
+        for (size_t i = 0; i < n; i += 4)
+        {
+            sum0 += a[i + 0] * b[i + 0];
+            sum1 += a[i + 1] * b[i + 1];
+            sum2 += a[i + 2] * b[i + 2];
+            sum3 += a[i + 3] * b[i + 3];
+        }
+        return (sum0 + sum1) + (sum2 + sum3);
+    }
+
+#ifdef MCPU_X86
+    MCPU_TARGET("sse2")
+    inline float dot_sse2(const float *a, const float *b, size_t n)
+    {
+        __m128 sum0 = _mm_setzero_ps(), sum1 = _mm_setzero_ps();
+        for (size_t i = 0; i < n; i += 8)
+        {
+            sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+            sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+        }
+        sum0 = _mm_add_ps(sum0, sum1);
+        sum0 = _mm_add_ps(sum0, _mm_movehl_ps(sum0, sum0));
+        sum0 = _mm_add_ss(sum0, _mm_shuffle_ps(sum0, sum0, 1));
+        return _mm_cvtss_f32(sum0);
+    }
+
+    MCPU_TARGET("avx2,fma")
+    inline float dot_avx2(const float *a, const float *b, size_t n)
+    {
+        __m256 sum0 = _mm256_setzero_ps(), sum1 = _mm256_setzero_ps();
+        size_t i = 0;
+        for (; i + 16 <= n; i += 16)
+        {
+            sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), sum0);
+            sum1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), sum1);
+        }
+        if (i < n)
+            sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), sum0);
+        sum0 = _mm256_add_ps(sum0, sum1);
+        __m128 sum = _mm_add_ps(_mm256_castps256_ps128(sum0),
+                                _mm256_extractf128_ps(sum0, 1));
+        sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+        sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+        return _mm_cvtss_f32(sum);
+    }
+#endif  // def MCPU_X86
+
+    typedef float (*dot_fn_t)(const float *, const float *, size_t);
+
+    // no static pointer, whose initialization isn't thread-safe before C++11
+    inline dot_fn_t get_dot(void)
+    {
+#ifdef MCPU_X86
+        const unsigned int features = mcpu_features();
+        if ((features & MCPU_AVX2) && (features & MCPU_FMA))
+            return dot_avx2;
+        if (features & MCPU_SSE2)
+            return dot_sse2;
+#endif
+        return dot_scalar;
+    }
+
+    // the modified Bessel function of the first kind of order 0
+    inline double bessel_i0(double x)
+    {
+        double sum = 1, term = 1;
+        for (int k = 1; k < 64; ++k)
+        {
+            term *= (x / (2 * k)) * (x / (2 * k));
+            sum += term;
+            if (term < sum * 1e-12)
+                break;
+        }
+        return sum;
+    }
+} // namespace resampler
+
+////////////////////////////////////////////////////////////////////////////
+
+// MResampler converts the sample rate of interleaved 16-bit PCM with a
+// Kaiser-windowed sinc filter. The filter has one set of taps per phase,
+// i.e. per fraction of the input sample where an output sample falls.
+// The rate ratio out/in is reduced to L/M; there are L phases up to 4096,
+// or 4096 phases with the nearest one used beyond that.
+class MResampler
+{
+public:
+    MResampler() : m_in_rate(0), m_out_rate(0), m_channels(0)
+    {
+    }
+
+    bool init(int in_rate, int out_rate, int channels,
+              int quality = MRESAMPLER_HIGH);
+
+    // append the output of the frames of input to out
+    void process(const int16_t *input, size_t frames, std::vector<int16_t>& out);
+
+    // append the rest of the output at the end of the input
+    void flush(std::vector<int16_t>& out);
+
+    // the output frame at the time of the input frame
+    uint64_t output_frame(uint64_t input_frame) const
+    {
+        return input_frame * m_L / m_M;
+    }
+
+    int in_rate() const
+    {
+        return m_in_rate;
+    }
+    int out_rate() const
+    {
+        return m_out_rate;
+    }
+    int channels() const
+    {
+        return m_channels;
+    }
+
+    static const char *quality_name(int quality)
+    {
+        static const char *s_names[] = { "low", "medium", "high", "best" };
+        if (quality < 0 || quality > MRESAMPLER_BEST)
+            return NULL;
+        return s_names[quality];
+    }
+
+protected:
+    int m_in_rate;
+    int m_out_rate;
+    int m_channels;
+    uint64_t m_L;           // the ratio out/in is L/M
+    uint64_t m_M;
+    uint64_t m_phases;
+    size_t m_half;          // the half length of the filter
+    size_t m_taps;          // the taps per phase, a multiple of 8
+    std::vector<float> m_coeffs;    // m_phases * m_taps
+    std::vector<std::vector<float> > m_history;     // per channel
+    int64_t m_base;         // the input frame of m_history[ch][0]
+    uint64_t m_in_frames;   // the input frames so far
+    uint64_t m_out_frames;  // the output frames so far
+    resampler::dot_fn_t m_dot;
+
+    void make_filter(int quality);
+    void produce(std::vector<int16_t>& out, uint64_t limit);
+};
+
+////////////////////////////////////////////////////////////////////////////
+
+inline bool
+MResampler::init(int in_rate, int out_rate, int channels, int quality)
+{
+    if (in_rate <= 0 || out_rate <= 0 || channels <= 0 ||
+        quality < MRESAMPLER_LOW || quality > MRESAMPLER_BEST)
+    {
+        return false;
+    }
+
+    uint64_t a = uint64_t(out_rate), b = uint64_t(in_rate);
+    while (b)
+    {
+        uint64_t t = a % b;
+        a = b;
+        b = t;
+    }
+    m_L = uint64_t(out_rate) / a;
+    m_M = uint64_t(in_rate) / a;
+    m_phases = (m_L <= 4096) ? m_L : 4096;
+
+    m_in_rate = in_rate;
+    m_out_rate = out_rate;
+    m_channels = channels;
+    m_dot = resampler::get_dot();
+    make_filter(quality);
+
+    // zeros before the first input
+    m_history.assign(channels, std::vector<float>(m_half - 1, 0.0f));
+    m_base = -int64_t(m_half - 1);
+    m_in_frames = m_out_frames = 0;
+    return true;
+}
+
+inline void MResampler::make_filter(int quality)
+{
+    static const int s_half[] = { 4, 8, 16, 32 };
+    static const double s_passband[] = { 0.80, 0.88, 0.92, 0.95 };
+    static const double s_beta[] = { 5.0, 6.5, 8.0, 10.0 };
+    const double pi = 3.14159265358979323846;
+
+    // the cutoff is below the lower Nyquist frequency. the filter gets
+    // longer as the cutoff gets lower.
+    double ratio = (m_L < m_M) ? double(m_L) / double(m_M) : 1.0;
+    double cutoff = 0.5 * s_passband[quality] * ratio;
+    m_half = size_t(std::ceil(s_half[quality] / ratio));
+    m_taps = (2 * m_half + 7) / 8 * 8;
+
+    const double beta = s_beta[quality];
+    const double i0_beta = resampler::bessel_i0(beta);
+    m_coeffs.assign(size_t(m_phases) * m_taps, 0.0f);
+    for (size_t phase = 0; phase < m_phases; ++phase)
+    {
+        // the tap k is for the input (index - half + 1 + k) at (index + frac)
+        double frac = double(phase) / double(m_phases);
+        float *coeffs = &m_coeffs[phase * m_taps];
+        double sum = 0;
+        for (size_t k = 0; k < 2 * m_half; ++k)
+        {
+            double x = double(k) - double(m_half - 1) - frac;
+            double w = x / double(m_half);
+            if (w <= -1 || w >= 1)
+                continue;
+            double sinc = (x == 0) ? 2 * cutoff
+                                   : std::sin(2 * pi * cutoff * x) / (pi * x);
+            double value = sinc * resampler::bessel_i0(beta * std::sqrt(1 - w * w)) / i0_beta;
+            coeffs[k] = float(value);
+            sum += value;
+        }
+
+        // the gain at DC is one
+        for (size_t k = 0; k < 2 * m_half; ++k)
+            coeffs[k] = float(coeffs[k] / sum);
+    }
+}
+
+// make the output frames until the limit or the end of the history
+inline void MResampler::produce(std::vector<int16_t>& out, uint64_t limit)
+{
+    const size_t avail = m_history[0].size();
+    size_t first = avail;
+    for (; m_out_frames < limit; ++m_out_frames)
+    {
+        // the input time of the output frame is index + phase / phases
+        uint64_t time = m_out_frames * m_M;
+        uint64_t index = time / m_L;
+        uint64_t phase = ((time % m_L) * m_phases + m_L / 2) / m_L;
+        if (phase == m_phases)
+        {
+            ++index;
+            phase = 0;
+        }
+
+        size_t start = size_t(int64_t(index) - int64_t(m_half - 1) - m_base);
+        if (start + m_taps > avail)
+            break;
+        if (first == avail)
+            first = start;
+
+        const float *coeffs = &m_coeffs[size_t(phase) * m_taps];
+        for (int ch = 0; ch < m_channels; ++ch)
+        {
+            float value = m_dot(coeffs, &m_history[ch][start], m_taps);
+            value += (value < 0) ? -0.5f : 0.5f;
+            if (value > 32767)
+                value = 32767;
+            else if (value < -32768)
+                value = -32768;
+            out.push_back(int16_t(value));
+        }
+    }
+
+    // drop the history that is no longer needed
+    if (first != avail && first >= 4096)
+    {
+        for (int ch = 0; ch < m_channels; ++ch)
+            m_history[ch].erase(m_history[ch].begin(), m_history[ch].begin() + first);
+        m_base += int64_t(first);
+    }
+}
+
+inline void
+MResampler::process(const int16_t *input, size_t frames, std::vector<int16_t>& out)
+{
+    for (int ch = 0; ch < m_channels; ++ch)
+    {
+        std::vector<float>& history = m_history[ch];
+        size_t old_size = history.size();
+        history.resize(old_size + frames);
+        for (size_t i = 0; i < frames; ++i)
+            history[old_size + i] = input[i * m_channels + ch];
+    }
+    m_in_frames += frames;
+    out.reserve(out.size() + size_t(frames * m_L / m_M + 1) * m_channels);
+    produce(out, uint64_t(-1));
+}
+
+inline void MResampler::flush(std::vector<int16_t>& out)
+{
+    // zeros after the last input
+    for (int ch = 0; ch < m_channels; ++ch)
+        m_history[ch].resize(m_history[ch].size() + m_taps + m_half, 0.0f);
+    produce(out, (m_in_frames * m_L + m_M - 1) / m_M);
+
+    // ready for the next input
+    m_history.assign(m_channels, std::vector<float>(m_half - 1, 0.0f));
+    m_base = -int64_t(m_half - 1);
+    m_in_frames = m_out_frames = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////
+
+#endif  // ndef MZC4_MRESAMPLER_HPP_
@@ -0,0 +1,761 @@
+// MSampleConverter.hpp -- sample format and channel conversion -*- C++ -*-
+// This file is part of MZC4.  See file "ReadMe.txt" and "License.txt".
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef MZC4_MSAMPLECONVERTER_HPP_
+#define MZC4_MSAMPLECONVERTER_HPP_      3   /* Version 3 */
+
+// class MSampleConverter;
+// msample_parse_format, msample_format_name, msample_default_mix,
+// msample_decode
+
+////////////////////////////////////////////////////////////////////////////
+
+#if __cplusplus >= 201103L          /* C++11 */
+    #include <cstdint>
+#else
+    #include "pstdint.h"
+#endif
+
+#include <cstddef>      // for size_t
+#include <cstring>      // for std::memcpy, std::strcmp
+#include <string>       // for std::string
+#include <vector>       // for std::vector
+#include "MCpuFeatures.hpp"
+
+#if defined(MCPU_X86) || \
+    (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+    #define MSAMPLE_LITTLE_ENDIAN_HOST
+#endif
+
+////////////////////////////////////////////////////////////////////////////
+
+enum MSampleType
+{
+    MSAMPLE_UINT8,
+    MSAMPLE_INT8,
+    MSAMPLE_INT16,
+    MSAMPLE_INT24,
+    MSAMPLE_INT32,
+    MSAMPLE_FLOAT32,
+    MSAMPLE_MULAW,      // G.711 mu-law
+    MSAMPLE_ALAW        // G.711 A-law
+};
+
+struct MSampleFormat
+{
+    MSampleType type;
+    bool big_endian;
+
+    MSampleFormat(MSampleType type_ = MSAMPLE_INT16, bool big_endian_ = false)
+        : type(type_), big_endian(big_endian_)
+    {
+    }
+
+    int bits() const
+    {
+        static const int s_bits[] = { 8, 8, 16, 24, 32, 32, 8, 8 };
+        return s_bits[type];
+    }
+
+    bool is_float() const
+    {
+        return type == MSAMPLE_FLOAT32;
+    }
+
+    // companded, not linear?
+    bool is_g711() const
+    {
+        return type == MSAMPLE_MULAW || type == MSAMPLE_ALAW;
+    }
+};
+
+// parse a name such as "int16", "int24be", "float32le" or "mulaw".
+// the default byte order is little-endian.
+bool msample_parse_format(const char *name, MSampleFormat& format);
+
+// the name of the format, such as "int24be"
+std::string msample_format_name(const MSampleFormat& format);
+
+// the matrix to mix in_channels into out_channels. out_channels rows of
+// in_channels coefficients. the channels are in the order of WAVE files:
+// FL FR FC LFE BL BR (FLC FRC) BC SL SR.
+void msample_default_mix(int in_channels, int out_channels,
+                         std::vector<float>& matrix);
+
+// decode n samples of the format into floats of the 16-bit scale
+void msample_decode(const MSampleFormat& format, const unsigned char *src,
+                    size_t n, float *dst);
+
+////////////////////////////////////////////////////////////////////////////
+
+namespace sample_converter
+{
+    // round to the nearest in [lo, hi], without a branch
+    inline int32_t round_clamp(float value, float lo, float hi)
+    {
+        value = (value < lo) ? lo : value;
+        value = (value > hi) ? hi : value;
+        return int32_t(value + ((value < 0) ? -0.5f : 0.5f));
+    }
+
+    // store the lowest BYTES bytes of value in the byte order. BYTES and
+    // BIG are constants, so only one of the ways is compiled.
+    template <int BYTES, bool BIG>
+    inline void store(unsigned char *p, uint32_t value)
+    {
+#ifdef MSAMPLE_LITTLE_ENDIAN_HOST
+        if (BYTES == 2 || BYTES == 4)
+        {
+            if (BIG && BYTES == 2)
+                value = ((value >> 8) & 0xFF) | ((value & 0xFF) << 8);
+            else if (BIG)
+                value = (value >> 24) | ((value >> 8) & 0xFF00) |
+                        ((value & 0xFF00) << 8) | (value << 24);
+            if (BYTES == 2)
+            {
+                uint16_t half = uint16_t(value);
+                std::memcpy(p, &half, 2);
+            }
+            else
+            {
+                std::memcpy(p, &value, 4);
+            }
+            return;
+        }
+#endif
+        for (int i = 0; i < BYTES; ++i)
+            p[BIG ? BYTES - 1 - i : i] = (unsigned char)(value >> (8 * i));
+    }
+
+    // the destination types. put() takes a 16-bit sample and putf() takes
+    // a float of the 16-bit scale.
+    struct uint8_dst
+    {
+        enum { size = 1 };
+        static void put(unsigned char *p, int32_t s)
+        {
+            p[0] = (unsigned char)((s >> 8) + 128);
+        }
+        static void putf(unsigned char *p, float f)
+        {
+            p[0] = (unsigned char)(round_clamp(f * (1.0f / 256), -128.0f, 127.0f) + 128);
+        }
+    };
+
+    struct int8_dst
+    {
+        enum { size = 1 };
+        static void put(unsigned char *p, int32_t s)
+        {
+            p[0] = (unsigned char)(s >> 8);
+        }
+        static void putf(unsigned char *p, float f)
+        {
+            p[0] = (unsigned char)round_clamp(f * (1.0f / 256), -128.0f, 127.0f);
+        }
+    };
+
+    template <bool BIG>
+    struct int16_dst
+    {
+        enum { size = 2 };
+        static void put(unsigned char *p, int32_t s)
+        {
+            store<2, BIG>(p, uint32_t(s));
+        }
+        static void putf(unsigned char *p, float f)
+        {
+            store<2, BIG>(p, uint32_t(round_clamp(f, -32768.0f, 32767.0f)));
+        }
+    };
+
+    template <bool BIG>
+    struct int24_dst
+    {
+        enum { size = 3 };
+        static void put(unsigned char *p, int32_t s)
+        {
+            store<3, BIG>(p, uint32_t(s) << 8);
+        }
+        static void putf(unsigned char *p, float f)
+        {
+            store<3, BIG>(p, uint32_t(round_clamp(f * 256.0f, -8388608.0f, 8388607.0f)));
+        }
+    };
+
+    template <bool BIG>
+    struct int32_dst
+    {
+        enum { size = 4 };
+        static void put(unsigned char *p, int32_t s)
+        {
+            store<4, BIG>(p, uint32_t(s) << 16);
+        }
+        static void putf(unsigned char *p, float f)
+        {
+            // 2147483520 is the largest float in the range
+            store<4, BIG>(p, uint32_t(round_clamp(f * 65536.0f, -2147483648.0f,
+                                                  2147483520.0f)));
+        }
+    };
+
+    template <bool BIG>
+    struct float32_dst
+    {
+        enum { size = 4 };
+        static void put(unsigned char *p, int32_t s)
+        {
+            putf(p, float(s));
+        }
+        static void putf(unsigned char *p, float f)
+        {
+            f *= 1.0f / 32768;
+            uint32_t bits;
+            std::memcpy(&bits, &f, sizeof(bits));
+            store<4, BIG>(p, bits);
+        }
+    };
+
+    // the segment of G.711, the position of the highest bit of value
+    // (0 to 255) with 0 and 1 in the segment 0
+    inline int g711_segment(int32_t value)
+    {
+        static const unsigned char s_segment[256] =
+        {
+            0, 0, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3,
+            4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+            5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
+            5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
+            6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,
+            6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,
+            6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,
+            6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,
+            7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+            7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+            7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+            7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+            7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+            7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+            7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+            7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+        };
+        return s_segment[value];
+    }
+
+    // the 16-bit sample of the G.711 code
+    inline int32_t mulaw_decode(uint32_t code)
+    {
+        code = ~code;
+        int32_t value = int32_t(((code & 0xF) << 3) + 0x84) << ((code & 0x70) >> 4);
+        return (code & 0x80) ? (0x84 - value) : (value - 0x84);
+    }
+    inline int32_t alaw_decode(uint32_t code)
+    {
+        code ^= 0x55;
+        int32_t value = int32_t(code & 0xF) << 4;
+        int seg = int(code & 0x70) >> 4;
+        value += (seg == 0) ? 8 : 0x108;
+        if (seg > 1)
+            value <<= seg - 1;
+        return (code & 0x80) ? value : -value;
+    }
+
+    // ITU-T G.711 mu-law of the 14-bit magnitude with the bias of 33
+    struct mulaw_dst
+    {
+        enum { size = 1 };
+        static void put(unsigned char *p, int32_t s)
+        {
+            const int32_t mask = (s < 0) ? 0x7F : 0xFF;
+            int32_t value = s >> 2;
+            value = (value < 0) ? -value : value;
+            value += 33;
+            value = (value > 0x1FFF) ? 0x1FFF : value;
+            const int seg = g711_segment(value >> 5);
+            p[0] = (unsigned char)(((seg << 4) | ((value >> (seg + 1)) & 0xF)) ^ mask);
+        }
+        static void putf(unsigned char *p, float f)
+        {
+            put(p, round_clamp(f, -32768.0f, 32767.0f));
+        }
+    };
+
+    // ITU-T G.711 A-law of the 13-bit magnitude
+    struct alaw_dst
+    {
+        enum { size = 1 };
+        static void put(unsigned char *p, int32_t s)
+        {
+            const int32_t mask = (s < 0) ? 0x55 : 0xD5;
+            int32_t value = s >> 3;
+            value ^= (value >> 31);     // -value - 1 if negative
+            const int seg = g711_segment(value >> 4);
+            const int shift = seg ? seg : 1;
+            p[0] = (unsigned char)(((seg << 4) | ((value >> shift) & 0xF)) ^ mask);
+        }
+        static void putf(unsigned char *p, float f)
+        {
+            put(p, round_clamp(f, -32768.0f, 32767.0f));
+        }
+    };
+
+    // the kernels of n samples. each is compiled for one destination type,
+    // so there is no branch on the format in the loop.
+    template <typename T_DST>
+    inline void encode_s16(const int16_t *src, size_t n, unsigned char *dst)
+    {
+        for (size_t i = 0; i < n; ++i)
+            T_DST::put(dst + i * T_DST::size, src[i]);
+    }
+
+    template <typename T_DST>
+    inline void encode_f32(const float *src, size_t n, unsigned char *dst)
+    {
+        for (size_t i = 0; i < n; ++i)
+            T_DST::putf(dst + i * T_DST::size, src[i]);
+    }
+
+#if defined(MCPU_X86)
+    // x86 is little-endian
+    MCPU_TARGET("sse2")
+    inline void encode_s16_int16be_sse2(const int16_t *src, size_t n, unsigned char *dst)
+    {
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+            v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+            _mm_storeu_si128((__m128i *)(dst + i * 2), v);
+        }
+        encode_s16<int16_dst<true> >(src + i, n - i, dst + i * 2);
+    }
+
+    MCPU_TARGET("sse2")
+    inline void encode_s16_int32le_sse2(const int16_t *src, size_t n, unsigned char *dst)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+            _mm_storeu_si128((__m128i *)(dst + i * 4), _mm_unpacklo_epi16(zero, v));
+            _mm_storeu_si128((__m128i *)(dst + i * 4 + 16), _mm_unpackhi_epi16(zero, v));
+        }
+        encode_s16<int32_dst<false> >(src + i, n - i, dst + i * 4);
+    }
+
+    MCPU_TARGET("sse2")
+    inline void encode_s16_float32le_sse2(const int16_t *src, size_t n, unsigned char *dst)
+    {
+        const __m128 scale = _mm_set1_ps(1.0f / 32768);
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+            __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+            __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+            _mm_storeu_ps((float *)(dst + i * 4), _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+            _mm_storeu_ps((float *)(dst + i * 4 + 16), _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+        }
+        encode_s16<float32_dst<false> >(src + i, n - i, dst + i * 4);
+    }
+
+    // round half away from zero as round_clamp, and truncate
+    MCPU_TARGET("sse2")
+    inline __m128i round_clamp_sse2(__m128 value, __m128 lo, __m128 hi)
+    {
+        const __m128 sign = _mm_set1_ps(-0.0f);
+        const __m128 half = _mm_set1_ps(0.5f);
+        value = _mm_min_ps(_mm_max_ps(value, lo), hi);
+        return _mm_cvttps_epi32(_mm_add_ps(value,
+                                _mm_or_ps(_mm_and_ps(value, sign), half)));
+    }
+
+    MCPU_TARGET("sse2")
+    inline void encode_f32_int16le_sse2(const float *src, size_t n, unsigned char *dst)
+    {
+        const __m128 lo = _mm_set1_ps(-32768.0f), hi = _mm_set1_ps(32767.0f);
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8)
+        {
+            __m128i a = round_clamp_sse2(_mm_loadu_ps(src + i), lo, hi);
+            __m128i b = round_clamp_sse2(_mm_loadu_ps(src + i + 4), lo, hi);
+            _mm_storeu_si128((__m128i *)(dst + i * 2), _mm_packs_epi32(a, b));
+        }
+        encode_f32<int16_dst<false> >(src + i, n - i, dst + i * 2);
+    }
+
+    MCPU_TARGET("sse2")
+    inline void encode_f32_int32le_sse2(const float *src, size_t n, unsigned char *dst)
+    {
+        const __m128 scale = _mm_set1_ps(65536.0f);
+        const __m128 lo = _mm_set1_ps(-2147483648.0f), hi = _mm_set1_ps(2147483520.0f);
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            __m128 v = _mm_mul_ps(_mm_loadu_ps(src + i), scale);
+            _mm_storeu_si128((__m128i *)(dst + i * 4), round_clamp_sse2(v, lo, hi));
+        }
+        encode_f32<int32_dst<false> >(src + i, n - i, dst + i * 4);
+    }
+
+    MCPU_TARGET("sse2")
+    inline void encode_f32_float32le_sse2(const float *src, size_t n, unsigned char *dst)
+    {
+        const __m128 scale = _mm_set1_ps(1.0f / 32768);
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4)
+            _mm_storeu_ps((float *)(dst + i * 4), _mm_mul_ps(_mm_loadu_ps(src + i), scale));
+        encode_f32<float32_dst<false> >(src + i, n - i, dst + i * 4);
+    }
+#endif  // def MCPU_X86
+
+    typedef void (*encode_s16_t)(const int16_t *, size_t, unsigned char *);
+    typedef void (*encode_f32_t)(const float *, size_t, unsigned char *);
+
+    // the kernels of a format, indexed by the type and the byte order
+    inline void get_kernels(const MSampleFormat& format,
+                            encode_s16_t& s16, encode_f32_t& f32)
+    {
+        static const encode_s16_t s_s16[][2] =
+        {
+            { encode_s16<uint8_dst>, encode_s16<uint8_dst> },
+            { encode_s16<int8_dst>, encode_s16<int8_dst> },
+            { encode_s16<int16_dst<false> >, encode_s16<int16_dst<true> > },
+            { encode_s16<int24_dst<false> >, encode_s16<int24_dst<true> > },
+            { encode_s16<int32_dst<false> >, encode_s16<int32_dst<true> > },
+            { encode_s16<float32_dst<false> >, encode_s16<float32_dst<true> > },
+            { encode_s16<mulaw_dst>, encode_s16<mulaw_dst> },
+            { encode_s16<alaw_dst>, encode_s16<alaw_dst> },
+        };
+        static const encode_f32_t s_f32[][2] =
+        {
+            { encode_f32<uint8_dst>, encode_f32<uint8_dst> },
+            { encode_f32<int8_dst>, encode_f32<int8_dst> },
+            { encode_f32<int16_dst<false> >, encode_f32<int16_dst<true> > },
+            { encode_f32<int24_dst<false> >, encode_f32<int24_dst<true> > },
+            { encode_f32<int32_dst<false> >, encode_f32<int32_dst<true> > },
+            { encode_f32<float32_dst<false> >, encode_f32<float32_dst<true> > },
+            { encode_f32<mulaw_dst>, encode_f32<mulaw_dst> },
+            { encode_f32<alaw_dst>, encode_f32<alaw_dst> },
+        };
+
+        s16 = s_s16[format.type][format.big_endian];
+        f32 = s_f32[format.type][format.big_endian];
+
+#if defined(MCPU_X86)
+        if (mcpu_features() & MCPU_SSE2)
+        {
+            if (format.type == MSAMPLE_INT16 && format.big_endian)
+                s16 = encode_s16_int16be_sse2;
+            else if (format.type == MSAMPLE_INT32 && !format.big_endian)
+                s16 = encode_s16_int32le_sse2;
+            else if (format.type == MSAMPLE_FLOAT32 && !format.big_endian)
+                s16 = encode_s16_float32le_sse2;
+
+            if (format.type == MSAMPLE_INT16 && !format.big_endian)
+                f32 = encode_f32_int16le_sse2;
+            else if (format.type == MSAMPLE_INT32 && !format.big_endian)
+                f32 = encode_f32_int32le_sse2;
+            else if (format.type == MSAMPLE_FLOAT32 && !format.big_endian)
+                f32 = encode_f32_float32le_sse2;
+        }
+#endif
+    }
+
+    typedef void (*mix_t)(const int16_t *, size_t, const float *, int, int, float *);
+
+    // mix the frames of IN channels into OUT channels. the loops of the
+    // channels are unrolled.
+    template <int IN, int OUT>
+    inline void mix(const int16_t *src, size_t frames, const float *matrix,
+                    int /*in_channels*/, int /*out_channels*/, float *dst)
+    {
+        float m[IN * OUT];
+        for (int k = 0; k < IN * OUT; ++k)
+            m[k] = matrix[k];
+
+        for (size_t i = 0; i < frames; ++i, src += IN, dst += OUT)
+        {
+            float in[IN];
+            for (int k = 0; k < IN; ++k)
+                in[k] = src[k];
+            for (int ch = 0; ch < OUT; ++ch)
+            {
+                float sum = 0;
+                for (int k = 0; k < IN; ++k)
+                    sum += m[ch * IN + k] * in[k];
+                dst[ch] = sum;
+            }
+        }
+    }
+
+    // any numbers of channels
+    inline void mix_n(const int16_t *src, size_t frames, const float *matrix,
+                      int in_channels, int out_channels, float *dst)
+    {
+        for (size_t i = 0; i < frames; ++i)
+        {
+            const int16_t *in = src + i * in_channels;
+            const float *row = matrix;
+            for (int ch = 0; ch < out_channels; ++ch, row += in_channels)
+            {
+                float sum = 0;
+                for (int k = 0; k < in_channels; ++k)
+                    sum += row[k] * in[k];
+                *dst++ = sum;
+            }
+        }
+    }
+
+    inline mix_t get_mix(int in_channels, int out_channels)
+    {
+        static const mix_t s_mix[][8] =
+        {
+            {
+                mix<1, 1>, mix<1, 2>, mix<1, 3>, mix<1, 4>,
+                mix<1, 5>, mix<1, 6>, mix<1, 7>, mix<1, 8>
+            },
+            {
+                mix<2, 1>, mix<2, 2>, mix<2, 3>, mix<2, 4>,
+                mix<2, 5>, mix<2, 6>, mix<2, 7>, mix<2, 8>
+            },
+        };
+        if (in_channels <= 2 && out_channels <= 8)
+            return s_mix[in_channels - 1][out_channels - 1];
+        return mix_n;
+    }
+} // namespace sample_converter
+
+////////////////////////////////////////////////////////////////////////////
+
+// MSampleConverter converts 16-bit interleaved PCM into another sample
+// format, mixing the channels by a matrix if needed.
+class MSampleConverter
+{
+public:
+    MSampleConverter() : m_in_channels(0), m_out_channels(0), m_mixing(false)
+    {
+    }
+
+    // matrix is out_channels rows of in_channels coefficients, or empty
+    // for the default mix
+    bool init(int in_channels, int out_channels, const MSampleFormat& format,
+              const std::vector<float>& matrix = std::vector<float>());
+
+    // the bytes of the output of the frames
+    size_t output_size(size_t frames) const
+    {
+        return frames * m_out_channels * (m_format.bits() / 8);
+    }
+
+    // convert the frames. dst has output_size(frames) bytes.
+    void convert(const int16_t *src, size_t frames, unsigned char *dst);
+
+    // encode the samples of the 16-bit scale without mixing
+    void encode(const float *src, size_t samples, unsigned char *dst)
+    {
+        m_encode_f32(src, samples, dst);
+    }
+
+    // nothing to convert?
+    bool is_identity() const
+    {
+        return !m_mixing && m_format.type == MSAMPLE_INT16 &&
+               !m_format.big_endian;
+    }
+
+protected:
+    int m_in_channels;
+    int m_out_channels;
+    MSampleFormat m_format;
+    std::vector<float> m_matrix;
+    std::vector<float> m_mixed;
+    bool m_mixing;
+    sample_converter::encode_s16_t m_encode_s16;
+    sample_converter::encode_f32_t m_encode_f32;
+    sample_converter::mix_t m_mix;
+};
+
+////////////////////////////////////////////////////////////////////////////
+
+inline bool msample_parse_format(const char *name, MSampleFormat& format)
+{
+    static const char *s_names[] =
+    {
+        "uint8", "int8", "int16", "int24", "int32", "float32", "mulaw", "alaw"
+    };
+
+    std::string str = name;
+    bool big_endian = false;
+    if (str.size() > 2)
+    {
+        std::string suffix = str.substr(str.size() - 2);
+        if (suffix == "le" || suffix == "be")
+        {
+            big_endian = (suffix == "be");
+            str.erase(str.size() - 2);
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(s_names) / sizeof(s_names[0]); ++i)
+    {
+        if (str == s_names[i])
+        {
+            format = MSampleFormat(MSampleType(i), big_endian);
+            return true;
+        }
+    }
+    return false;
+}
+
+inline std::string msample_format_name(const MSampleFormat& format)
+{
+    static const char *s_names[] =
+    {
+        "uint8", "int8", "int16", "int24", "int32", "float32", "mulaw", "alaw"
+    };
+    std::string ret = s_names[format.type];
+    if (format.bits() > 8)
+        ret += (format.big_endian ? "be" : "le");
+    return ret;
+}
+
+inline void msample_default_mix(int in_channels, int out_channels,
+                                std::vector<float>& matrix)
+{
+    const float half = 0.70710678f;    // -3 dB
+    matrix.assign(size_t(in_channels) * out_channels, 0.0f);
+    float *m = matrix.empty() ? NULL : &matrix[0];
+
+    if (in_channels == out_channels)
+    {
+        for (int ch = 0; ch < out_channels; ++ch)
+            m[ch * in_channels + ch] = 1;
+    }
+    else if (in_channels == 1)
+    {
+        if (out_channels == 2)
+            m[0] = m[1] = 1;                // the same on both sides
+        else if (out_channels == 4)
+            m[0] = m[1] = half;             // the front of a quad
+        else
+            m[2] = 1;                       // the center
+    }
+    else if (in_channels == 2 && out_channels == 1)
+    {
+        m[0] = m[1] = 0.5f;
+    }
+    else
+    {
+        // the front left and right, or the average for the others
+        for (int ch = 0; ch < out_channels; ++ch)
+        {
+            for (int k = 0; k < in_channels; ++k)
+            {
+                if (out_channels >= 2 && in_channels >= 2)
+                    m[ch * in_channels + k] = (ch == k && ch < 2) ? 1.0f : 0.0f;
+                else
+                    m[ch * in_channels + k] = 1.0f / in_channels;
+            }
+        }
+    }
+}
+
+inline void msample_decode(const MSampleFormat& format, const unsigned char *src,
+                           size_t n, float *dst)
+{
+    const int bytes = format.bits() / 8;
+    for (size_t i = 0; i < n; ++i, src += bytes)
+    {
+        uint32_t value = 0;
+        for (int k = 0; k < bytes; ++k)
+            value |= uint32_t(src[format.big_endian ? bytes - 1 - k : k]) << (8 * k);
+
+        float f;
+        switch (format.type)
+        {
+        case MSAMPLE_UINT8:
+            f = (int32_t(value) - 128) * 256.0f;
+            break;
+        case MSAMPLE_INT8:
+            f = (int32_t(value ^ 0x80) - 128) * 256.0f;
+            break;
+        case MSAMPLE_INT16:
+            f = float(int32_t(value ^ 0x8000) - 0x8000);
+            break;
+        case MSAMPLE_INT24:
+            f = (int32_t(value ^ 0x800000) - 0x800000) * (1.0f / 256);
+            break;
+        case MSAMPLE_INT32:
+            f = float(int32_t(value)) * (1.0f / 65536);
+            break;
+        case MSAMPLE_FLOAT32:
+            std::memcpy(&f, &value, sizeof(f));
+            f *= 32768.0f;
+            break;
+        case MSAMPLE_MULAW:
+            f = float(sample_converter::mulaw_decode(value));
+            break;
+        default:
+            f = float(sample_converter::alaw_decode(value));
+            break;
+        }
+        dst[i] = f;
+    }
+}
+
+inline bool
+MSampleConverter::init(int in_channels, int out_channels,
+                       const MSampleFormat& format, const std::vector<float>& matrix)
+{
+    if (in_channels <= 0 || out_channels <= 0)
+        return false;
+
+    if (matrix.empty())
+        msample_default_mix(in_channels, out_channels, m_matrix);
+    else if (matrix.size() == size_t(in_channels) * out_channels)
+        m_matrix = matrix;
+    else
+        return false;
+
+    m_in_channels = in_channels;
+    m_out_channels = out_channels;
+    m_format = format;
+
+    // no mixing for the identity matrix
+    m_mixing = (in_channels != out_channels);
+    for (int ch = 0; !m_mixing && ch < out_channels; ++ch)
+    {
+        for (int k = 0; k < in_channels; ++k)
+        {
+            if (m_matrix[ch * in_channels + k] != (ch == k ? 1.0f : 0.0f))
+                m_mixing = true;
+        }
+    }
+
+    sample_converter::get_kernels(format, m_encode_s16, m_encode_f32);
+    m_mix = sample_converter::get_mix(in_channels, out_channels);
+    return true;
+}
+
+inline void
+MSampleConverter::convert(const int16_t *src, size_t frames, unsigned char *dst)
+{
+    if (!m_mixing)
+    {
+        m_encode_s16(src, frames * m_out_channels, dst);
+        return;
+    }
+
+    m_mixed.resize(frames * m_out_channels);
+    if (m_mixed.empty())
+        return;
+    m_mix(src, frames, &m_matrix[0], m_in_channels, m_out_channels, &m_mixed[0]);
+    m_encode_f32(&m_mixed[0], m_mixed.size(), dst);
+}
+
+////////////////////////////////////////////////////////////////////////////
+
+#endif  // ndef MZC4_MSAMPLECONVERTER_HPP_
@@ -3,11 +3,15 @@
 ////////////////////////////////////////////////////////////////////////////
 
 #ifndef MZC4_MSTRING_HPP_
-#define MZC4_MSTRING_HPP_       20  /* Version 20 */
+#define MZC4_MSTRING_HPP_       21  /* Version 21 */
 
 // class MString;
 // class MStringA;
 // class MStringW;
+// class MStringViewA;
+// class MStringViewW;
+// class MStringSplitterA;
+// class MStringSplitterW;
 // mstr_... functions
 // mbin_... functions
 
@@ -91,6 +95,221 @@ T_CHAR *mstrrchr(T_CHAR *str, T_CHAR ch);
 template <typename T_CHAR>
 const T_CHAR *mstrrchr(const T_CHAR *str, T_CHAR ch);
 
+////////////////////////////////////////////////////////////////////////////
+// string view
+
+// MStringViewT refers to the characters of another string without copying
+// them. The viewed string must outlive the view.
+template <typename T_CHAR>
+class MStringViewT
+{
+public:
+    typedef T_CHAR value_type;
+    typedef const T_CHAR *const_iterator;
+    typedef std::basic_string<T_CHAR> string_type;
+    typedef std::char_traits<T_CHAR> traits_type;
+    static const size_t npos = size_t(-1);
+
+    MStringViewT() : m_ptr(NULL), m_len(0)
+    {
+    }
+
+    MStringViewT(const T_CHAR *ptr, size_t len) : m_ptr(ptr), m_len(len)
+    {
+    }
+
+    MStringViewT(const T_CHAR *str)
+        : m_ptr(str), m_len(traits_type::length(str))
+    {
+    }
+
+    MStringViewT(const string_type& str) : m_ptr(str.data()), m_len(str.size())
+    {
+    }
+
+    const T_CHAR *data() const
+    {
+        return m_ptr;
+    }
+    size_t size() const
+    {
+        return m_len;
+    }
+    size_t length() const
+    {
+        return m_len;
+    }
+    bool empty() const
+    {
+        return m_len == 0;
+    }
+    const_iterator begin() const
+    {
+        return m_ptr;
+    }
+    const_iterator end() const
+    {
+        return m_ptr + m_len;
+    }
+    T_CHAR operator[](size_t index) const
+    {
+        return m_ptr[index];
+    }
+
+    // make a string. this allocates.
+    string_type str() const
+    {
+        return string_type(m_ptr, m_len);
+    }
+
+    MStringViewT substr(size_t pos, size_t count = npos) const
+    {
+        if (pos > m_len)
+            pos = m_len;
+        if (count > m_len - pos)
+            count = m_len - pos;
+        return MStringViewT(m_ptr + pos, count);
+    }
+
+    void remove_prefix(size_t count)
+    {
+        m_ptr += count;
+        m_len -= count;
+    }
+    void remove_suffix(size_t count)
+    {
+        m_len -= count;
+    }
+
+    size_t find(T_CHAR ch, size_t pos = 0) const
+    {
+        if (pos >= m_len)
+            return npos;
+        const T_CHAR *pch = traits_type::find(m_ptr + pos, m_len - pos, ch);
+        return pch ? size_t(pch - m_ptr) : npos;
+    }
+    size_t find_first_of(MStringViewT chars, size_t pos = 0) const
+    {
+        for (; pos < m_len; ++pos)
+        {
+            if (chars.contains(m_ptr[pos]))
+                return pos;
+        }
+        return npos;
+    }
+    size_t find_first_not_of(MStringViewT chars, size_t pos = 0) const
+    {
+        for (; pos < m_len; ++pos)
+        {
+            if (!chars.contains(m_ptr[pos]))
+                return pos;
+        }
+        return npos;
+    }
+    size_t find_last_not_of(MStringViewT chars) const
+    {
+        for (size_t pos = m_len; pos-- > 0; )
+        {
+            if (!chars.contains(m_ptr[pos]))
+                return pos;
+        }
+        return npos;
+    }
+    bool contains(T_CHAR ch) const
+    {
+        return m_len && traits_type::find(m_ptr, m_len, ch) != NULL;
+    }
+
+    int compare(MStringViewT other) const
+    {
+        size_t len = (m_len < other.m_len) ? m_len : other.m_len;
+        int ret = len ? traits_type::compare(m_ptr, other.m_ptr, len) : 0;
+        if (ret == 0 && m_len != other.m_len)
+            ret = (m_len < other.m_len) ? -1 : 1;
+        return ret;
+    }
+    bool operator==(MStringViewT other) const
+    {
+        return compare(other) == 0;
+    }
+    bool operator!=(MStringViewT other) const
+    {
+        return compare(other) != 0;
+    }
+
+protected:
+    const T_CHAR *m_ptr;
+    size_t m_len;
+};
+
+template <typename T_CHAR>
+const size_t MStringViewT<T_CHAR>::npos;
+
+typedef MStringViewT<char> MStringViewA;
+typedef MStringViewT<WCHAR> MStringViewW;
+#ifdef UNICODE
+    #define MStringView     MStringViewW
+#else
+    #define MStringView     MStringViewA
+#endif
+
+// MStringSplitterT splits a string at any of chars lazily. The tokens are
+// the same as mstr_split, but each one is a view into the string.
+//     MStringSplitterA splitter(str, ",");
+//     MStringViewA token;
+//     while (splitter.next(token)) { ... }
+template <typename T_CHAR>
+class MStringSplitterT
+{
+public:
+    typedef MStringViewT<T_CHAR> view_type;
+
+    MStringSplitterT(view_type str, view_type chars)
+        : m_str(str), m_chars(chars), m_pos(0), m_done(false)
+    {
+    }
+
+    // get the next token. returns false after the last one.
+    bool next(view_type& token)
+    {
+        if (m_done)
+            return false;
+
+        size_t k = m_str.find_first_of(m_chars, m_pos);
+        if (k == view_type::npos)
+        {
+            token = m_str.substr(m_pos);
+            m_done = true;
+        }
+        else
+        {
+            token = m_str.substr(m_pos, k - m_pos);
+            m_pos = k + 1;
+        }
+        return true;
+    }
+
+    // the text not split yet
+    view_type rest() const
+    {
+        return m_done ? view_type() : m_str.substr(m_pos);
+    }
+
+protected:
+    view_type m_str;
+    view_type m_chars;
+    size_t m_pos;
+    bool m_done;
+};
+
+typedef MStringSplitterT<char> MStringSplitterA;
+typedef MStringSplitterT<WCHAR> MStringSplitterW;
+#ifdef UNICODE
+    #define MStringSplitter     MStringSplitterW
+#else
+    #define MStringSplitter     MStringSplitterA
+#endif
+
 ////////////////////////////////////////////////////////////////////////////
 
 enum MTextEncoding
@@ -162,6 +381,7 @@ bool mstr_is_text_ascii(const T_CHAR *str, size_t len);
 
 template <typename T_CHAR>
 bool mstr_is_text_ascii(const std::basic_string<T_CHAR>& str);
+bool mstr_is_text_ascii(const char *str, size_t len);
 
 bool mstr_is_text_utf8(const char *str, size_t len);
 bool mstr_is_text_utf8(const std::string& str);
@@ -183,6 +403,28 @@ void mstr_trim_right(std::basic_string<T_CHAR>& str, const T_CHAR *spaces);
 template <typename T_CHAR, size_t siz>
 void mstr_trim_right(T_CHAR (&str)[siz], const T_CHAR *spaces);
 
+// the trimmed part of str, without copying
+template <typename T_CHAR>
+MStringViewT<T_CHAR>
+mstr_trim_view(MStringViewT<T_CHAR> str, const T_CHAR *spaces);
+template <typename T_CHAR>
+MStringViewT<T_CHAR>
+mstr_trim_view(const std::basic_string<T_CHAR>& str, const T_CHAR *spaces);
+
+template <typename T_CHAR>
+MStringViewT<T_CHAR>
+mstr_trim_left_view(MStringViewT<T_CHAR> str, const T_CHAR *spaces);
+template <typename T_CHAR>
+MStringViewT<T_CHAR>
+mstr_trim_left_view(const std::basic_string<T_CHAR>& str, const T_CHAR *spaces);
+
+template <typename T_CHAR>
+MStringViewT<T_CHAR>
+mstr_trim_right_view(MStringViewT<T_CHAR> str, const T_CHAR *spaces);
+template <typename T_CHAR>
+MStringViewT<T_CHAR>
+mstr_trim_right_view(const std::basic_string<T_CHAR>& str, const T_CHAR *spaces);
+
 template <typename T_CHAR>
 T_CHAR *mstr_skip_space(T_CHAR *pch, const T_CHAR *spaces);
 
@@ -237,6 +479,12 @@ void mstr_split(T_STR_CONTAINER& container,
                 const typename T_STR_CONTAINER::value_type& str,
                 const typename T_STR_CONTAINER::value_type& chars);
 
+// split str into a container of views, such as std::vector<MStringViewA>
+template <typename T_VIEW_CONTAINER>
+void mstr_split_view(T_VIEW_CONTAINER& container,
+                     typename T_VIEW_CONTAINER::value_type str,
+                     typename T_VIEW_CONTAINER::value_type chars);
+
 template <typename T_STR_CONTAINER>
 typename T_STR_CONTAINER::value_type
 mstr_join(const T_STR_CONTAINER& container,
@@ -248,6 +496,10 @@ mstr_join(const T_STR_CONTAINER& container,
 void mbin_swap_endian(void *ptr, size_t len);
 void mbin_swap_endian(std::string& bin);
 
+template <typename T_CHAR>
+MTextNewLineType
+mstr_normalize_newlines(std::basic_string<T_CHAR>& str, MTextNewLineType newline);
+
 MStringW
 mstr_from_bin(const void *bin, size_t len, MTextType *pType = NULL);
 MStringW
@@ -258,6 +510,7 @@ std::string mbin_from_str(const MStringW& str, const MTextType& type);
 ////////////////////////////////////////////////////////////////////////////
 
 #include "MTextToText.hpp"
+#include "MTextValidator.hpp"
 
 ////////////////////////////////////////////////////////////////////////////
 
@@ -537,6 +790,12 @@ inline bool mstr_is_text_ascii(const T_CHAR *str, size_t len)
     return true;
 }
 
+// the vectorized version for bytes
+inline bool mstr_is_text_ascii(const char *str, size_t len)
+{
+    return text_validator::is_ascii(str, len);
+}
+
 template <typename T_CHAR>
 inline bool mstr_is_text_ascii(const std::basic_string<T_CHAR>& str)
 {
@@ -557,13 +816,12 @@ inline bool mstr_is_text_utf8(const std::string& str)
         return !!::IsTextUnicode(ptr, int(len), NULL);
     }
 #else
-    #include "UTF16_validator.h"
     inline bool mstr_is_text_unicode(const void *ptr, size_t len)
     {
         if (len == 0)
             return true;
 
-        return UTF16_validate(ptr, len);
+        return text_validator::is_utf16(ptr, len);
     }
 #endif
 
@@ -579,17 +837,17 @@ inline void mstr_trim(std::basic_string<T_CHAR>& str, const T_CHAR *spaces)
     }
     else
     {
-        str = str.substr(i, j - i + 1);
+        str.erase(j + 1);
+        str.erase(0, i);
     }
 }
 
 template <typename T_CHAR, size_t siz>
 inline void mstr_trim(T_CHAR (&str)[siz], const T_CHAR *spaces)
 {
-    typedef std::basic_string<T_CHAR> string_type;
-    string_type s = str;
-    mstr_trim(s, spaces);
-    mstrcpy(str, s.c_str());
+    MStringViewT<T_CHAR> view = mstr_trim_view(MStringViewT<T_CHAR>(str), spaces);
+    std::char_traits<T_CHAR>::move(str, view.data(), view.size());
+    str[view.size()] = 0;
 }
 
 template <typename T_CHAR>
@@ -603,17 +861,16 @@ inline void mstr_trim_left(std::basic_string<T_CHAR>& str, const T_CHAR *spaces)
     }
     else
     {
-        str = str.substr(i);
+        str.erase(0, i);
     }
 }
 
 template <typename T_CHAR, size_t siz>
 inline void mstr_trim_left(T_CHAR (&str)[siz], const T_CHAR *spaces)
 {
-    typedef std::basic_string<T_CHAR> string_type;
-    string_type s = str;
-    mstr_trim_left(s, spaces);
-    mstrcpy(str, s.c_str());
+    MStringViewT<T_CHAR> view = mstr_trim_left_view(MStringViewT<T_CHAR>(str), spaces);
+    std::char_traits<T_CHAR>::move(str, view.data(), view.size());
+    str[view.size()] = 0;
 }
 
 template <typename T_CHAR>
@@ -627,17 +884,63 @@ inline void mstr_trim_right(std::basic_string<T_CHAR>& str, const T_CHAR *spaces
     }
     else
     {
-        str = str.substr(0, j + 1);
+        str.erase(j + 1);
     }
 }
 
 template <typename T_CHAR, size_t siz>
 inline void mstr_trim_right(T_CHAR (&str)[siz], const T_CHAR *spaces)
 {
-    typedef std::basic_string<T_CHAR> string_type;
-    string_type s = str;
-    mstr_trim_right(s, spaces);
-    mstrcpy(str, s.c_str());
+    MStringViewT<T_CHAR> view = mstr_trim_right_view(MStringViewT<T_CHAR>(str), spaces);
+    str[view.size()] = 0;
+}
+
+template <typename T_CHAR>
+inline MStringViewT<T_CHAR>
+mstr_trim_view(MStringViewT<T_CHAR> str, const T_CHAR *spaces)
+{
+    return mstr_trim_right_view(mstr_trim_left_view(str, spaces), spaces);
+}
+
+template <typename T_CHAR>
+inline MStringViewT<T_CHAR>
+mstr_trim_view(const std::basic_string<T_CHAR>& str, const T_CHAR *spaces)
+{
+    return mstr_trim_view(MStringViewT<T_CHAR>(str), spaces);
+}
+
+template <typename T_CHAR>
+inline MStringViewT<T_CHAR>
+mstr_trim_left_view(MStringViewT<T_CHAR> str, const T_CHAR *spaces)
+{
+    size_t i = str.find_first_not_of(spaces);
+    if (i == MStringViewT<T_CHAR>::npos)
+        i = str.size();
+    str.remove_prefix(i);
+    return str;
+}
+
+template <typename T_CHAR>
+inline MStringViewT<T_CHAR>
+mstr_trim_left_view(const std::basic_string<T_CHAR>& str, const T_CHAR *spaces)
+{
+    return mstr_trim_left_view(MStringViewT<T_CHAR>(str), spaces);
+}
+
+template <typename T_CHAR>
+inline MStringViewT<T_CHAR>
+mstr_trim_right_view(MStringViewT<T_CHAR> str, const T_CHAR *spaces)
+{
+    size_t j = str.find_last_not_of(spaces);
+    str.remove_suffix(str.size() - (j == MStringViewT<T_CHAR>::npos ? 0 : j + 1));
+    return str;
+}
+
+template <typename T_CHAR>
+inline MStringViewT<T_CHAR>
+mstr_trim_right_view(const std::basic_string<T_CHAR>& str, const T_CHAR *spaces)
+{
+    return mstr_trim_right_view(MStringViewT<T_CHAR>(str), spaces);
 }
 
 template <typename T_CHAR>
@@ -727,7 +1030,7 @@ mbin_swap_endian(void *ptr, size_t len)
 {
     char *pb = (char *)ptr;
     len /= 2;
-    while (--len)
+    while (len-- > 0)
     {
         char b = pb[0];
         pb[0] = pb[1];
@@ -742,6 +1045,115 @@ inline void mbin_swap_endian(std::string& bin)
     mbin_swap_endian(&bin[0], bin.size());
 }
 
+// Convert all the newlines in str to newline (MNEWLINE_CRLF, MNEWLINE_LF
+// or MNEWLINE_CR) in place, and return the type of the original newlines.
+// CRLF wins over CR, and CR wins over LF. Linear time.
+template <typename T_CHAR>
+inline MTextNewLineType
+mstr_normalize_newlines(std::basic_string<T_CHAR>& str, MTextNewLineType newline)
+{
+    const T_CHAR CR = T_CHAR('\r'), LF = T_CHAR('\n');
+    const size_t size = str.size();
+
+    // count the newlines
+    size_t crlf = 0, cr = 0, lf = 0;
+    for (size_t i = 0; i < size; ++i)
+    {
+        if (str[i] == CR)
+        {
+            if (i + 1 < size && str[i + 1] == LF)
+            {
+                ++crlf;
+                ++i;
+            }
+            else
+            {
+                ++cr;
+            }
+        }
+        else if (str[i] == LF)
+        {
+            ++lf;
+        }
+    }
+
+    MTextNewLineType ret = MNEWLINE_UNKNOWN;
+    if (crlf)
+        ret = MNEWLINE_CRLF;
+    else if (cr)
+        ret = MNEWLINE_CR;
+    else if (lf)
+        ret = MNEWLINE_LF;
+
+    switch (newline)
+    {
+    case MNEWLINE_CRLF:
+        if (cr + lf == 0)
+            return ret;
+        {
+            // it grows. fill it from the end
+            str.resize(size + cr + lf);
+            size_t k = str.size();
+            for (size_t i = size; i-- > 0; )
+            {
+                T_CHAR ch = str[i];
+                if (ch == LF)
+                {
+                    str[--k] = LF;
+                    if (i > 0 && str[i - 1] == CR)
+                        --i;
+                    str[--k] = CR;
+                }
+                else if (ch == CR)
+                {
+                    str[--k] = LF;
+                    str[--k] = CR;
+                }
+                else
+                {
+                    str[--k] = ch;
+                }
+            }
+        }
+        break;
+
+    case MNEWLINE_LF:
+    case MNEWLINE_CR:
+        if (crlf == 0 && (newline == MNEWLINE_LF ? cr : lf) == 0)
+            return ret;
+        {
+            // it shrinks or keeps the size. fill it from the start
+            const T_CHAR to = (newline == MNEWLINE_LF) ? LF : CR;
+            size_t k = 0;
+            for (size_t i = 0; i < size; ++i)
+            {
+                T_CHAR ch = str[i];
+                if (ch == CR)
+                {
+                    if (i + 1 < size && str[i + 1] == LF)
+                        ++i;
+                    str[k++] = to;
+                }
+                else if (ch == LF)
+                {
+                    str[k++] = to;
+                }
+                else
+                {
+                    str[k++] = ch;
+                }
+            }
+            str.resize(k);
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    return ret;
+}
+
 inline MStringW
 mstr_from_bin(const void *bin, size_t len, MTextType *pType/* = NULL*/)
 {
@@ -766,7 +1178,7 @@ mstr_from_bin(const void *bin, size_t len, MTextType *pType/* = NULL*/)
             pType->nEncoding = MTENC_UNICODE_LE;
             pType->bHasBOM = true;
         }
-        ret.assign((const WCHAR *)bin, len / sizeof(WCHAR));
+        ret.assign((const WCHAR *)bin + 1, len / sizeof(WCHAR) - 1);
     }
     else if (len >= 2 && std::memcmp(bin, "\xFE\xFF", 2) == 0)
     {
@@ -776,8 +1188,9 @@ mstr_from_bin(const void *bin, size_t len, MTextType *pType/* = NULL*/)
             pType->nEncoding = MTENC_UNICODE_BE;
             pType->bHasBOM = true;
         }
-        ret.assign((const WCHAR *)bin, len / sizeof(WCHAR));
-        mbin_swap_endian(&ret[0], len);
+        ret.assign((const WCHAR *)bin + 1, len / sizeof(WCHAR) - 1);
+        if (ret.size())
+            mbin_swap_endian(&ret[0], ret.size() * sizeof(WCHAR));
     }
     else
     {
@@ -790,8 +1203,7 @@ mstr_from_bin(const void *bin, size_t len, MTextType *pType/* = NULL*/)
                 pType->nEncoding = MTENC_UTF8;
                 pType->bHasBOM = true;
             }
-            std::string str(&pch[3], len - 3);
-            ret = MAnsiToWide(CP_UTF8, str);
+            text_transcoder::utf8_to_utf16(&pch[3], len - 3, ret);
         }
         else if (mstr_is_text_ascii((const char *)bin, len))
         {
@@ -801,8 +1213,7 @@ mstr_from_bin(const void *bin, size_t len, MTextType *pType/* = NULL*/)
                 pType->nEncoding = MTENC_ASCII;
                 pType->bHasBOM = false;
             }
-            std::string str(pch, len);
-            ret = MAnsiToWide(CP_ACP, str);
+            text_transcoder::utf8_to_utf16(pch, len, ret);
         }
         else if (mstr_is_text_utf8((const char *)bin, len))
         {
@@ -812,7 +1223,7 @@ mstr_from_bin(const void *bin, size_t len, MTextType *pType/* = NULL*/)
                 pType->nEncoding = MTENC_UTF8;
                 pType->bHasBOM = false;
             }
-            ret = MAnsiToWide(CP_UTF8, pch, int(len));
+            text_transcoder::utf8_to_utf16(pch, len, ret);
         }
         else if (mstr_is_text_unicode(bin, int(len)))
         {
@@ -832,37 +1243,16 @@ mstr_from_bin(const void *bin, size_t len, MTextType *pType/* = NULL*/)
                 pType->nEncoding = MTENC_ANSI;
                 pType->bHasBOM = false;
             }
-            std::string str(pch, len);
-            ret = MAnsiToWide(CP_ACP, str);
+            ret = MAnsiToWide(CP_ACP, pch, len).c_str();
         }
     }
 
     if (!pType || pType->nNewLine != MNEWLINE_NOCHANGE)
     {
+        MTextNewLineType newline = mstr_normalize_newlines(ret, MNEWLINE_CRLF);
         if (pType)
         {
-            pType->nNewLine = MNEWLINE_UNKNOWN;
-        }
-        if (mstr_replace_all(ret, WIDE("\r\n"), WIDE("\n")))
-        {
-            if (pType)
-            {
-                pType->nNewLine = MNEWLINE_CRLF;
-            }
-        }
-        if (mstr_replace_all(ret, WIDE("\r"), WIDE("\n")))
-        {
-            if (pType && pType->nNewLine != MNEWLINE_CRLF)
-            {
-                pType->nNewLine = MNEWLINE_CR;
-            }
-        }
-        if (mstr_replace_all(ret, WIDE("\n"), WIDE("\r\n")))
-        {
-            if (pType && pType->nNewLine != MNEWLINE_CRLF)
-            {
-                pType->nNewLine = MNEWLINE_LF;
-            }
+            pType->nNewLine = newline;
         }
     }
 
@@ -881,25 +1271,7 @@ mbin_from_str(const MStringW& str, const MTextType& type)
     std::string ret;
     MStringW str2 = str;
 
-    switch (type.nNewLine)
-    {
-    case MNEWLINE_UNKNOWN:
-    case MNEWLINE_NOCHANGE:
-        break;
-    case MNEWLINE_CRLF:
-        mstr_replace_all(str2, WIDE("\r\n"), WIDE("\n"));
-        mstr_replace_all(str2, WIDE("\r"), WIDE("\r\n"));
-        mstr_replace_all(str2, WIDE("\n"), WIDE("\r\n"));
-        break;
-    case MNEWLINE_LF:
-        mstr_replace_all(str2, WIDE("\r\n"), WIDE("\n"));
-        mstr_replace_all(str2, WIDE("\r"), WIDE("\n"));
-        break;
-    case MNEWLINE_CR:
-        mstr_replace_all(str2, WIDE("\r\n"), WIDE("\r"));
-        mstr_replace_all(str2, WIDE("\n"), WIDE("\r"));
-        break;
-    }
+    mstr_normalize_newlines(str2, type.nNewLine);
 
     switch (type.nEncoding)
     {
@@ -972,6 +1344,22 @@ mstr_split(T_STR_CONTAINER& container,
     container.push_back(str.substr(i));
 }
 
+template <typename T_VIEW_CONTAINER>
+inline void
+mstr_split_view(T_VIEW_CONTAINER& container,
+                typename T_VIEW_CONTAINER::value_type str,
+                typename T_VIEW_CONTAINER::value_type chars)
+{
+    typedef typename T_VIEW_CONTAINER::value_type view_type;
+    container.clear();
+    MStringSplitterT<typename view_type::value_type> splitter(str, chars);
+    view_type token;
+    while (splitter.next(token))
+    {
+        container.push_back(token);
+    }
+}
+
 template <typename T_STR_CONTAINER>
 inline typename T_STR_CONTAINER::value_type
 mstr_join(const T_STR_CONTAINER& container,
@@ -1098,28 +1486,43 @@ inline void mstr_trim_right(WCHAR (&str)[siz])
     mstr_trim_right(str, WIDE(" \t\n\r\f\v"));
 }
 
+inline MStringViewA mstr_trim_view(MStringViewA str)
+{
+    return mstr_trim_view(str, " \t\n\r\f\v");
+}
+inline MStringViewW mstr_trim_view(MStringViewW str)
+{
+    return mstr_trim_view(str, WIDE(" \t\n\r\f\v"));
+}
+
+inline MStringViewA mstr_trim_left_view(MStringViewA str)
+{
+    return mstr_trim_left_view(str, " \t\n\r\f\v");
+}
+inline MStringViewW mstr_trim_left_view(MStringViewW str)
+{
+    return mstr_trim_left_view(str, WIDE(" \t\n\r\f\v"));
+}
+
+inline MStringViewA mstr_trim_right_view(MStringViewA str)
+{
+    return mstr_trim_right_view(str, " \t\n\r\f\v");
+}
+inline MStringViewW mstr_trim_right_view(MStringViewW str)
+{
+    return mstr_trim_right_view(str, WIDE(" \t\n\r\f\v"));
+}
+
 ////////////////////////////////////////////////////////////////////////////
 // UTF-8 checking
 
-#if defined(_WIN32) && !defined(WONVER)
-    inline bool mstr_is_text_utf8(const char *str, size_t len)
-    {
-        if (len == 0)
-            return true;
-
-        len = ::MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, str, int(len), NULL, 0);
-        return len != 0;
-    }
-#else
-    #include "UTF8_validator.h"
-    inline bool mstr_is_text_utf8(const char *str, size_t len)
-    {
-        if (len == 0)
-            return true;
+inline bool mstr_is_text_utf8(const char *str, size_t len)
+{
+    if (len == 0)
+        return true;
 
-        return UTF8_validate(str, len);
-    }
-#endif
+    return text_validator::is_utf8(str, len);
+}
 
 ////////////////////////////////////////////////////////////////////////////
 
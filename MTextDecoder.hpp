@@ -0,0 +1,224 @@
+// MTextDecoder.hpp -- incremental text decoding                -*- C++ -*-
+// This file is part of MZC4.  See file "ReadMe.txt" and "License.txt".
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef MZC4_MTEXTDECODER_HPP_
+#define MZC4_MTEXTDECODER_HPP_      2   /* Version 2 */
+
+// class MTextDecoder;
+
+////////////////////////////////////////////////////////////////////////////
+
+#include "MString.hpp"
+
+////////////////////////////////////////////////////////////////////////////
+
+// MTextDecoder converts the binary text to MStringW piece by piece, in the
+// same way as mstr_from_bin does for the whole text. The encoding is
+// detected from the BOM, or from the pieces read so far. As mstr_from_bin,
+// the first piece that is neither ASCII nor UTF-8 may be UTF-16 LE without
+// a BOM. The newlines are not changed.
+class MTextDecoder
+{
+public:
+    MTextDecoder()
+    {
+        clear();
+    }
+
+    void clear()
+    {
+        m_pending.clear();
+        m_sniffed = false;
+        m_type.nEncoding = MTENC_UNKNOWN;
+        m_type.nNewLine = MNEWLINE_NOCHANGE;
+        m_type.bHasBOM = false;
+    }
+
+    const MTextType& type() const
+    {
+        return m_type;
+    }
+
+    // decode the next piece and append the text to str.
+    // the bytes of an incomplete character are kept until the next piece.
+    void decode(const void *bin, size_t len, MStringW& str, bool eof = false);
+
+protected:
+    std::string m_pending;
+    bool m_sniffed;
+    MTextType m_type;
+
+    size_t split_long(const char *pch, size_t len) const;
+    void decode_units(const char *pch, size_t len, MStringW& str);
+    void decode_bytes(const char *pch, size_t len, MStringW& str);
+};
+
+////////////////////////////////////////////////////////////////////////////
+
+inline void
+MTextDecoder::decode(const void *bin, size_t len, MStringW& str, bool eof)
+{
+    const char *pch = (const char *)bin;
+    if (m_pending.size())
+    {
+        m_pending.append(pch, len);
+        pch = m_pending.c_str();
+        len = m_pending.size();
+    }
+
+    if (!m_sniffed)
+    {
+        if (len < 3 && !eof)
+        {
+            if (m_pending.empty())
+                m_pending.assign(pch, len);
+            return;
+        }
+
+        m_sniffed = true;
+        if (len >= 2 && std::memcmp(pch, "\xFF\xFE", 2) == 0)
+        {
+            m_type.nEncoding = MTENC_UNICODE_LE;
+            m_type.bHasBOM = true;
+            pch += 2;
+            len -= 2;
+        }
+        else if (len >= 2 && std::memcmp(pch, "\xFE\xFF", 2) == 0)
+        {
+            m_type.nEncoding = MTENC_UNICODE_BE;
+            m_type.bHasBOM = true;
+            pch += 2;
+            len -= 2;
+        }
+        else if (len >= 3 && std::memcmp(pch, "\xEF\xBB\xBF", 3) == 0)
+        {
+            m_type.nEncoding = MTENC_UTF8;
+            m_type.bHasBOM = true;
+            pch += 3;
+            len -= 3;
+        }
+    }
+
+    // split the bytes after a byte less than 0x40, which is never a part
+    // of a multibyte character in UTF-8 nor in DBCS codepages
+    size_t count = len;
+    if (!eof)
+    {
+        while (count > 0 && (unsigned char)pch[count - 1] >= 0x40)
+            --count;
+        if (count == 0 && len >= 0x10000)
+            count = split_long(pch, len);
+    }
+
+    // UTF-16 LE without a BOM, as mstr_from_bin detects it
+    if (m_type.nEncoding == MTENC_UNKNOWN && count > 0 &&
+        !mstr_is_text_ascii(pch, count) && !mstr_is_text_utf8(pch, count) &&
+        mstr_is_text_unicode(pch, len & ~size_t(1)))
+    {
+        m_type.nEncoding = MTENC_UNICODE_LE;
+    }
+
+    // pch may point into m_pending
+    std::string rest;
+    if (m_type.nEncoding == MTENC_UNICODE_LE ||
+        m_type.nEncoding == MTENC_UNICODE_BE)
+    {
+        count = len & ~size_t(1);
+        decode_units(pch, count, str);
+    }
+    else
+    {
+        decode_bytes(pch, count, str);
+    }
+    rest.assign(pch + count, len - count);
+    m_pending.swap(rest);
+}
+
+// the complete characters of a long run of bytes of 0x40 or more
+inline size_t
+MTextDecoder::split_long(const char *pch, size_t len) const
+{
+    // UTF-8: before the lead byte of the last character
+    size_t count = len;
+    while (count > 0 && ((unsigned char)pch[count - 1] & 0xC0) == 0x80)
+        --count;
+    if (count > 0 && (unsigned char)pch[count - 1] >= 0xC0)
+        --count;
+    if (m_type.nEncoding == MTENC_UTF8 ||
+        (m_type.nEncoding != MTENC_ANSI && mstr_is_text_utf8(pch, count)))
+    {
+        return count ? count : len;
+    }
+
+#if defined(_WIN32) && !defined(WONVER)
+    // DBCS: count the characters from the start, which is a boundary
+    count = 0;
+    while (count < len)
+    {
+        size_t step = ::IsDBCSLeadByteEx(CP_ACP, BYTE(pch[count])) ? 2 : 1;
+        if (count + step > len)
+            break;
+        count += step;
+    }
+#endif
+    return count ? count : len;
+}
+
+inline void
+MTextDecoder::decode_units(const char *pch, size_t len, MStringW& str)
+{
+    size_t old_size = str.size();
+    str.append((const WCHAR *)pch, len / sizeof(WCHAR));
+    if (m_type.nEncoding == MTENC_UNICODE_BE && len)
+    {
+        mbin_swap_endian(&str[old_size], len);
+    }
+}
+
+inline void
+MTextDecoder::decode_bytes(const char *pch, size_t len, MStringW& str)
+{
+    if (len == 0)
+        return;
+
+    int codepage = CP_ACP;
+    switch (m_type.nEncoding)
+    {
+    case MTENC_UNKNOWN:
+    case MTENC_ASCII:
+        if (mstr_is_text_ascii(pch, len))
+        {
+            m_type.nEncoding = MTENC_ASCII;
+        }
+        else if (mstr_is_text_utf8(pch, len))
+        {
+            m_type.nEncoding = MTENC_UTF8;
+            codepage = CP_UTF8;
+        }
+        else
+        {
+            m_type.nEncoding = MTENC_ANSI;
+        }
+        break;
+    case MTENC_UTF8:
+        codepage = CP_UTF8;
+        break;
+    default:
+        break;
+    }
+
+    if (codepage == CP_UTF8 || m_type.nEncoding == MTENC_ASCII)
+    {
+        text_transcoder::utf8_to_utf16(pch, len, str);
+    }
+    else
+    {
+        MAnsiToWide wide(codepage, pch, len);
+        str.append(wide.c_str(), wide.size());
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////
+
+#endif  // ndef MZC4_MTEXTDECODER_HPP_
@@ -0,0 +1,243 @@
+// MTextSegmenter.hpp -- incremental text segmentation          -*- C++ -*-
+// This file is part of MZC4.  See file "ReadMe.txt" and "License.txt".
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef MZC4_MTEXTSEGMENTER_HPP_
+#define MZC4_MTEXTSEGMENTER_HPP_    1   /* Version 1 */
+
+// class MTextSegmenter<T_CHAR>;
+
+////////////////////////////////////////////////////////////////////////////
+
+#include "MString.hpp"
+
+////////////////////////////////////////////////////////////////////////////
+
+enum MTextSegmentMode
+{
+    MSEG_SENTENCE,
+    MSEG_PARAGRAPH
+};
+
+// MTextSegmenter splits the text at sentence or paragraph boundaries while
+// the text is being fed piece by piece. A segment is returned as soon as
+// its boundary is seen, so the caller doesn't have to wait for the whole
+// input. A segment longer than max_len is split at the last space.
+template <typename T_CHAR>
+class MTextSegmenter
+{
+public:
+    typedef std::basic_string<T_CHAR> string_type;
+
+    MTextSegmenter(MTextSegmentMode mode = MSEG_SENTENCE, size_t max_len = 4096)
+        : m_mode(mode), m_max_len(max_len)
+    {
+        clear();
+    }
+
+    void clear()
+    {
+        m_buf.clear();
+        m_head = m_scan = 0;
+        m_space = string_type::npos;
+    }
+
+    // append the text to be segmented
+    void feed(const T_CHAR *str, size_t len)
+    {
+        compact();
+        m_buf.append(str, len);
+    }
+    void feed(const string_type& str)
+    {
+        feed(str.c_str(), str.size());
+    }
+
+    // get the next complete segment. returns false if more text is needed.
+    bool next(string_type& segment)
+    {
+        size_t end = find_boundary(false);
+        if (end == string_type::npos)
+            return false;
+
+        take(segment, end);
+        return true;
+    }
+
+    // get the remaining segments at the end of the input.
+    // call this until it returns false.
+    bool flush(string_type& segment)
+    {
+        size_t end = find_boundary(true);
+        if (end == string_type::npos)
+            end = m_buf.size();
+        if (end == m_head)
+            return false;
+
+        take(segment, end);
+        return true;
+    }
+
+    bool empty() const
+    {
+        return m_head == m_buf.size();
+    }
+
+protected:
+    MTextSegmentMode m_mode;
+    size_t m_max_len;
+    string_type m_buf;      // the pending text
+    size_t m_head;          // the start of the current segment
+    size_t m_scan;          // the position to resume scanning
+    size_t m_space;         // the last space in the current segment
+
+    static unsigned long code_of(T_CHAR ch)
+    {
+        if (sizeof(T_CHAR) == 1)
+            return (unsigned char)ch;
+        return (unsigned long)ch;
+    }
+
+    static bool is_stop(T_CHAR ch)
+    {
+        return ch == T_CHAR('.') || ch == T_CHAR('!') || ch == T_CHAR('?');
+    }
+
+    // ideographic full stops don't need a space after them
+    static bool is_wide_stop(T_CHAR ch)
+    {
+        if (sizeof(T_CHAR) == 1)
+            return false;
+
+        unsigned long code = code_of(ch);
+        return code == 0x3002 || code == 0xFF01 || code == 0xFF0E ||
+               code == 0xFF1F;
+    }
+
+    static bool is_closing(T_CHAR ch)
+    {
+        switch (code_of(ch))
+        {
+        case '\"': case '\'': case ')': case ']':
+            return true;
+        case 0x2019: case 0x201D: case 0x300D: case 0x300F: case 0xFF09:
+            return sizeof(T_CHAR) > 1;
+        default:
+            return false;
+        }
+    }
+
+    void take(string_type& segment, size_t end)
+    {
+        segment.assign(m_buf, m_head, end - m_head);
+        m_head = m_scan = end;
+        m_space = string_type::npos;
+    }
+
+    // drop the consumed text. amortized linear time.
+    void compact()
+    {
+        if (m_head == 0 || m_head < m_buf.size() / 2)
+            return;
+
+        m_buf.erase(0, m_head);
+        m_scan -= m_head;
+        if (m_space != string_type::npos)
+            m_space -= m_head;
+        m_head = 0;
+    }
+
+    // the split point of an overlong segment
+    size_t cut(size_t i) const
+    {
+        if (m_space != string_type::npos && m_space > m_head)
+            return m_space + 1;
+
+        // don't split a multibyte sequence or a surrogate pair
+        if (sizeof(T_CHAR) == 1)
+        {
+            while (i > m_head + 1 && (code_of(m_buf[i]) & 0xC0) == 0x80)
+                --i;
+        }
+        else if (sizeof(T_CHAR) == 2)
+        {
+            unsigned long code = code_of(m_buf[i]);
+            if (i > m_head + 1 && 0xDC00 <= code && code <= 0xDFFF)
+                --i;
+        }
+        return i;
+    }
+
+    // returns the end of the next segment, or npos if more text is needed
+    size_t find_boundary(bool eof)
+    {
+        const size_t size = m_buf.size();
+        size_t i;
+        for (i = m_scan; i < size; ++i)
+        {
+            if (i - m_head >= m_max_len)
+                return cut(i);
+
+            T_CHAR ch = m_buf[i];
+            if (mchr_is_space(ch))
+                m_space = i;
+
+            if (ch == T_CHAR('\n'))
+            {
+                // a blank line ends the paragraph
+                size_t j = i + 1;
+                while (j < size && (m_buf[j] == T_CHAR(' ') ||
+                       m_buf[j] == T_CHAR('\t') || m_buf[j] == T_CHAR('\r')))
+                {
+                    ++j;
+                }
+                if (j == size)
+                {
+                    if (eof)
+                        return size;
+                    break;
+                }
+                if (m_buf[j] == T_CHAR('\n'))
+                    return j + 1;
+                continue;
+            }
+
+            if (m_mode != MSEG_SENTENCE)
+                continue;
+
+            if (is_wide_stop(ch))
+            {
+                size_t j = i + 1;
+                while (j < size && is_closing(m_buf[j]))
+                    ++j;
+                if (j == size && !eof)
+                    break;
+                return j;
+            }
+
+            if (is_stop(ch))
+            {
+                // a sentence ends with a stop and a space, like "Hi. "
+                size_t j = i + 1;
+                while (j < size && (is_stop(m_buf[j]) || is_closing(m_buf[j])))
+                    ++j;
+                if (j == size)
+                {
+                    if (eof)
+                        return size;
+                    break;
+                }
+                if (mchr_is_space(m_buf[j]))
+                    return j;
+                i = j - 1;
+            }
+        }
+
+        m_scan = i;
+        return string_type::npos;
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////
+
+#endif  // ndef MZC4_MTEXTSEGMENTER_HPP_
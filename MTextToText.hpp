@@ -3,7 +3,7 @@
 ////////////////////////////////////////////////////////////////////////////
 
 #ifndef MZC4_MTEXTTOTEXT_HPP_
-#define MZC4_MTEXTTOTEXT_HPP_       5       /* Version 5 */
+#define MZC4_MTEXTTOTEXT_HPP_       7       /* Version 7 */
 
 class MAnsiToWide;
 class MWideToAnsi;
@@ -11,6 +11,7 @@ class MWideToAnsi;
 ////////////////////////////////////////////////////////////////////////////
 
 #include "MString.hpp"
+#include "MTextTranscoder.hpp"
 
 #include <cassert>
 
@@ -132,6 +133,13 @@ protected:
 
 ////////////////////////////////////////////////////////////////////////////
 
+// convert str into buf. the capacity of buf is reused, so converting
+// many strings into the same buf doesn't allocate each time.
+bool mstr_ansi_to_wide(int codepage, const char *str, size_t count, MStringW& buf);
+bool mstr_wide_to_ansi(int codepage, const WCHAR *str, size_t count, MStringA& buf);
+
+////////////////////////////////////////////////////////////////////////////
+
 #define MAnsiToAnsi(cp,ansi)   MStringA(ansi)
 #define MWideToWide(cp,wide)   MStringW(wide)
 
@@ -152,32 +160,52 @@ protected:
 ////////////////////////////////////////////////////////////////////////////
 
 #if defined(_WIN32) && !defined(WONVER)
-    inline void
-    MAnsiToWide::do_it(int codepage, const char *str, size_t count)
+    inline bool
+    mstr_ansi_to_wide(int codepage, const char *str, size_t count, MStringW& buf)
     {
-        int len = int(count);
-        int cch = ::MultiByteToWideChar(codepage, 0, str, len, NULL, 0);
-        m_str.resize(cch);
-        if (!::MultiByteToWideChar(codepage, 0, str, len, &m_str[0], cch + 1))
+        buf.clear();
+        if (count == 0)
+            return true;
+
+        if (codepage == CP_UTF8)
         {
-            m_str.clear();
+            text_transcoder::utf8_to_utf16(str, count, buf);
+            return true;
         }
+
+        // a byte becomes a unit at most
+        buf.resize(count);
+        int cch = ::MultiByteToWideChar(codepage, 0, str, int(count),
+                                        &buf[0], int(count));
+        buf.resize(cch);
+        return cch != 0;
     }
 
-    inline void
-    MWideToAnsi::do_it(int codepage, const WCHAR *str, size_t count)
+    inline bool
+    mstr_wide_to_ansi(int codepage, const WCHAR *str, size_t count, MStringA& buf)
     {
-        int len = int(count);
-        int cch = ::WideCharToMultiByte(codepage, 0, str, len, NULL, 0, NULL, NULL);
-        m_str.resize(cch);
-        if (!::WideCharToMultiByte(codepage, 0, str, len, &m_str[0], cch + 1,
-                                   NULL, NULL))
+        buf.clear();
+        if (count == 0)
+            return true;
+
+        if (codepage == CP_UTF8)
         {
-            m_str.clear();
+            text_transcoder::utf16_to_utf8(str, count, buf);
+            return true;
         }
+
+        int len = int(count);
+        int cch = ::WideCharToMultiByte(codepage, 0, str, len, NULL, 0, NULL, NULL);
+        if (cch == 0)
+            return false;
+        buf.resize(cch);
+        cch = ::WideCharToMultiByte(codepage, 0, str, len, &buf[0], cch, NULL, NULL);
+        buf.resize(cch);
+        return cch != 0;
     }
 #else
     #include <iconv.h>
+    #include <cerrno>
 
     #ifndef WonGetACP
         #define WonGetACP()     1252
@@ -205,9 +233,9 @@ protected:
             case 1:
                 return "UTF-8";
             case 2:
-                return "UCS-2LE";
+                return "UTF-16LE";
             case 4:
-                return "UCS-4LE";
+                return "UTF-32LE";
             default:
                 assert(0);
                 return NULL;
@@ -239,79 +267,199 @@ protected:
             }
             return ret;
         }
-    }
 
-    inline void
-    MAnsiToWide::do_it(int codepage, const char *str, size_t count)
-    {
-        m_str.clear();
-        if (*str == 0)
-            return;
-
-        iconv_t ic = iconv_open(text2text::get_wide_encoding(),
-                                text2text::encoding_from_cp(codepage).c_str());
-        if ((iconv_t)-1 == ic)
-            return;
-
-        size_t ansi_len = count * sizeof(char);
-        #ifdef ICONV_SECOND_ARGUMENT_IS_CONST
-            const char *ansi_ptr  = str;
+        // The converter descriptors are kept per thread, keyed by the
+        // codepage and the direction, so that converting many short
+        // strings doesn't open and close a descriptor for each of them.
+        class iconv_cache
+        {
+        public:
+            iconv_cache() : m_count(0)
+            {
+            }
+
+            ~iconv_cache()
+            {
+                for (size_t i = 0; i < m_count; ++i)
+                {
+                    iconv_close(m_entries[i].ic);
+                }
+            }
+
+            iconv_t get(int codepage, bool to_wide)
+            {
+                for (size_t i = 0; i < m_count; ++i)
+                {
+                    entry& e = m_entries[i];
+                    if (e.codepage == codepage && e.to_wide == to_wide)
+                    {
+                        // reset the shift state
+                        iconv(e.ic, NULL, NULL, NULL, NULL);
+                        return e.ic;
+                    }
+                }
+
+                iconv_t ic = open(codepage, to_wide);
+                if (ic == (iconv_t)-1)
+                    return ic;
+
+                if (m_count == max_entries)
+                {
+                    // drop the oldest one
+                    iconv_close(m_entries[0].ic);
+                    for (size_t i = 1; i < m_count; ++i)
+                        m_entries[i - 1] = m_entries[i];
+                    --m_count;
+                }
+                entry& e = m_entries[m_count++];
+                e.codepage = codepage;
+                e.to_wide = to_wide;
+                e.ic = ic;
+                return ic;
+            }
+
+            static iconv_t open(int codepage, bool to_wide)
+            {
+                std::string encoding = encoding_from_cp(codepage);
+                if (to_wide)
+                    return iconv_open(get_wide_encoding(), encoding.c_str());
+                return iconv_open(encoding.c_str(), get_wide_encoding());
+            }
+
+        protected:
+            enum { max_entries = 8 };
+            struct entry
+            {
+                int codepage;
+                bool to_wide;
+                iconv_t ic;
+            };
+            entry m_entries[max_entries];
+            size_t m_count;
+        };
+
+        // a descriptor borrowed from the cache of this thread
+        class iconv_lease
+        {
+        public:
+            iconv_lease(int codepage, bool to_wide)
+            {
+        #if __cplusplus >= 201103L
+                static thread_local iconv_cache s_cache;
+                m_ic = s_cache.get(codepage, to_wide);
+                m_owned = false;
         #else
-            char *ansi_ptr  = const_cast<char *>(str);
+                m_ic = iconv_cache::open(codepage, to_wide);
+                m_owned = true;
         #endif
+            }
+
+            ~iconv_lease()
+            {
+                if (m_owned && m_ic != (iconv_t)-1)
+                    iconv_close(m_ic);
+            }
+
+            iconv_t get() const
+            {
+                return m_ic;
+            }
 
-        size_t buf_len = (count + 1) * sizeof(WCHAR);
-        if (char *buf = (char *)malloc(buf_len))
+        protected:
+            iconv_t m_ic;
+            bool m_owned;
+        };
+
+        // convert into buf of room characters, growing it if necessary
+        template <typename T_STR>
+        inline bool
+        convert(iconv_t ic, const char *in, size_t in_len, T_STR& buf, size_t room)
         {
-            size_t wide_len = buf_len;
-            char *wide_ptr = buf;
-            if (buf && (size_t)-1 != iconv(ic, &ansi_ptr, &ansi_len, &wide_ptr, &wide_len))
+            typedef typename T_STR::value_type char_type;
+
+            #ifdef ICONV_SECOND_ARGUMENT_IS_CONST
+                const char *in_ptr = in;
+            #else
+                char *in_ptr = const_cast<char *>(in);
+            #endif
+
+            buf.resize(room);
+            size_t used = 0;
+            for (;;)
             {
-                wide_len = buf_len - wide_len;
-                m_str.assign(reinterpret_cast<WCHAR *>(buf), wide_len / sizeof(WCHAR));
+                char *out_ptr = reinterpret_cast<char *>(&buf[used]);
+                size_t out_len = (buf.size() - used) * sizeof(char_type);
+                size_t ret = iconv(ic, &in_ptr, &in_len, &out_ptr, &out_len);
+                used = buf.size() - out_len / sizeof(char_type);
+                if (ret != (size_t)-1)
+                    break;
+
+                if (errno != E2BIG)
+                {
+                    buf.clear();
+                    return false;
+                }
+                buf.resize(buf.size() * 2);
             }
-            free(buf);
+            buf.resize(used);
+            return true;
+        }
+    }
+
+    inline bool
+    mstr_ansi_to_wide(int codepage, const char *str, size_t count, MStringW& buf)
+    {
+        buf.clear();
+        if (count == 0)
+            return true;
+
+        if (codepage == CP_UTF8)
+        {
+            text_transcoder::utf8_to_utf16(str, count, buf);
+            return true;
         }
 
-        iconv_close(ic);
+        text2text::iconv_lease ic(codepage, true);
+        if ((iconv_t)-1 == ic.get())
+            return false;
+
+        return text2text::convert(ic.get(), str, count, buf, count + 1);
     }
 
-    inline void
-    MWideToAnsi::do_it(int codepage, const WCHAR *str, size_t count)
+    inline bool
+    mstr_wide_to_ansi(int codepage, const WCHAR *str, size_t count, MStringA& buf)
     {
-        m_str.clear();
-        if (*str == 0)
-            return;
-
-        iconv_t ic = iconv_open(text2text::encoding_from_cp(codepage).c_str(),
-                                text2text::get_wide_encoding());
-        if ((iconv_t)-1 == ic)
-            return;
-
-        size_t wide_len = count * sizeof(WCHAR);
-        #ifdef ICONV_SECOND_ARGUMENT_IS_CONST
-            const char *wide_ptr  = reinterpret_cast<const char *>(str);
-        #else
-            char *wide_ptr  = reinterpret_cast<char *>(const_cast<WCHAR *>(str));
-        #endif
+        buf.clear();
+        if (count == 0)
+            return true;
 
-        size_t buf_len = (count + 1) * 3;
-        if (char *buf = (char *)malloc(buf_len))
+        if (codepage == CP_UTF8)
         {
-            size_t ansi_len = buf_len;
-            char *ansi_ptr = buf;
-            if (buf && (size_t)-1 != iconv(ic, &wide_ptr, &wide_len, &ansi_ptr, &ansi_len))
-            {
-                ansi_len = buf_len - ansi_len;
-                m_str.assign(buf, ansi_len / sizeof(char));
-            }
-            free(buf);
+            text_transcoder::utf16_to_utf8(str, count, buf);
+            return true;
         }
 
-        iconv_close(ic);
+        text2text::iconv_lease ic(codepage, false);
+        if ((iconv_t)-1 == ic.get())
+            return false;
+
+        return text2text::convert(ic.get(), reinterpret_cast<const char *>(str),
+                                  count * sizeof(WCHAR), buf, count * 2 + 1);
     }
 #endif
 
+inline void
+MAnsiToWide::do_it(int codepage, const char *str, size_t count)
+{
+    mstr_ansi_to_wide(codepage, str, count, m_str);
+}
+
+inline void
+MWideToAnsi::do_it(int codepage, const WCHAR *str, size_t count)
+{
+    mstr_wide_to_ansi(codepage, str, count, m_str);
+}
+
 ////////////////////////////////////////////////////////////////////////////
 
 #endif  // ndef MZC4_MTEXTTOTEXT_HPP_
@@ -0,0 +1,379 @@
+// MTextTranscoder.hpp -- UTF-8 <-> UTF-16 conversion           -*- C++ -*-
+// This file is part of MZC4.  See file "ReadMe.txt" and "License.txt".
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef MZC4_MTEXTTRANSCODER_HPP_
+#define MZC4_MTEXTTRANSCODER_HPP_   1   /* Version 1 */
+
+// text_transcoder::utf8_to_utf16
+// text_transcoder::utf16_to_utf8
+
+////////////////////////////////////////////////////////////////////////////
+
+#include "MCpuFeatures.hpp"
+#include <cstddef>      // for size_t
+
+////////////////////////////////////////////////////////////////////////////
+
+// The ASCII runs are converted 16 or 32 characters at a time. The other
+// characters are converted one by one, with the surrogate pairs for the
+// characters beyond U+FFFF. An ill-formed sequence becomes U+FFFD.
+// The converted text is written into the destination string directly.
+namespace text_transcoder
+{
+    // append the UTF-16 text of the UTF-8 text to str
+    template <typename T_WSTR>
+    void utf8_to_utf16(const char *src, size_t len, T_WSTR& str);
+
+    // append the UTF-8 text of the UTF-16 text to str
+    template <typename T_WCHAR, typename T_STR>
+    void utf16_to_utf8(const T_WCHAR *src, size_t count, T_STR& str);
+
+    ////////////////////////////////////////////////////////////////////////
+    // UTF-8 to UTF-16
+
+    // convert one character at src[i], which is not ASCII.
+    // a sequence of N bytes becomes N units at most.
+    template <typename T_WCHAR>
+    inline void
+    decode_utf8_char(const unsigned char *src, size_t len, size_t& i, T_WCHAR *& dst)
+    {
+        unsigned int b = src[i];
+        size_t count;
+        unsigned int code;
+        unsigned char lo = 0x80, hi = 0xBF;   // the range of the 2nd byte
+        if (b < 0xC2)
+        {
+            ++i;
+            *dst++ = T_WCHAR(0xFFFD);
+            return;
+        }
+        else if (b < 0xE0)
+        {
+            count = 1;
+            code = b & 0x1F;
+        }
+        else if (b < 0xF0)
+        {
+            count = 2;
+            code = b & 0x0F;
+            if (b == 0xE0)
+                lo = 0xA0;
+            else if (b == 0xED)
+                hi = 0x9F;
+        }
+        else if (b < 0xF5)
+        {
+            count = 3;
+            code = b & 0x07;
+            if (b == 0xF0)
+                lo = 0x90;
+            else if (b == 0xF4)
+                hi = 0x8F;
+        }
+        else
+        {
+            ++i;
+            *dst++ = T_WCHAR(0xFFFD);
+            return;
+        }
+
+        // the maximal valid prefix of an ill-formed sequence becomes U+FFFD
+        size_t k;
+        for (k = 1; k <= count; ++k)
+        {
+            if (i + k >= len)
+                break;
+            unsigned int c = src[i + k];
+            if (k == 1 ? (c < lo || hi < c) : ((c & 0xC0) != 0x80))
+                break;
+            code = (code << 6) | (c & 0x3F);
+        }
+        if (k <= count)
+        {
+            i += k;
+            *dst++ = T_WCHAR(0xFFFD);
+            return;
+        }
+
+        i += count + 1;
+        if (code >= 0x10000)
+        {
+            code -= 0x10000;
+            *dst++ = T_WCHAR(0xD800 | (code >> 10));
+            *dst++ = T_WCHAR(0xDC00 | (code & 0x3FF));
+        }
+        else
+        {
+            *dst++ = T_WCHAR(code);
+        }
+    }
+
+    template <typename T_WCHAR>
+    inline size_t
+    utf8_to_utf16_scalar(const char *str, size_t len, T_WCHAR *dst)
+    {
+        const unsigned char *src = (const unsigned char *)str;
+        T_WCHAR *start = dst;
+        size_t i = 0;
+        while (i < len)
+        {
+            if (src[i] < 0x80)
+                *dst++ = T_WCHAR(src[i++]);
+            else
+                decode_utf8_char(src, len, i, dst);
+        }
+        return size_t(dst - start);
+    }
+
+#ifdef MCPU_X86
+    // NOTE: the whole 16 units are stored even if only a part of them are
+    // ASCII. That's safe because dst has one unit per remaining byte.
+    template <typename T_WCHAR>
+    MCPU_TARGET("sse2")
+    inline size_t
+    utf8_to_utf16_sse2(const char *str, size_t len, T_WCHAR *dst)
+    {
+        const unsigned char *src = (const unsigned char *)str;
+        const __m128i zero = _mm_setzero_si128();
+        T_WCHAR *start = dst;
+        size_t i = 0;
+        while (i + 16 <= len)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+            unsigned int mask = unsigned(_mm_movemask_epi8(v));
+            _mm_storeu_si128((__m128i *)dst, _mm_unpacklo_epi8(v, zero));
+            _mm_storeu_si128((__m128i *)(dst + 8), _mm_unpackhi_epi8(v, zero));
+            if (mask == 0)
+            {
+                i += 16;
+                dst += 16;
+                continue;
+            }
+
+            // skip the ASCII prefix, then convert the non-ASCII run
+            unsigned int n = 0;
+            while (!(mask & (1u << n)))
+                ++n;
+            i += n;
+            dst += n;
+            do
+            {
+                decode_utf8_char(src, len, i, dst);
+            } while (i < len && src[i] >= 0x80);
+        }
+        return size_t(dst - start) + utf8_to_utf16_scalar(str + i, len - i, dst);
+    }
+
+    template <typename T_WCHAR>
+    MCPU_TARGET("avx2")
+    inline size_t
+    utf8_to_utf16_avx2(const char *str, size_t len, T_WCHAR *dst)
+    {
+        const unsigned char *src = (const unsigned char *)str;
+        T_WCHAR *start = dst;
+        size_t i = 0;
+        while (i + 32 <= len)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+            unsigned int mask = unsigned(_mm256_movemask_epi8(v));
+            __m128i lo = _mm256_castsi256_si128(v);
+            __m128i hi = _mm256_extracti128_si256(v, 1);
+            _mm256_storeu_si256((__m256i *)dst, _mm256_cvtepu8_epi16(lo));
+            _mm256_storeu_si256((__m256i *)(dst + 16), _mm256_cvtepu8_epi16(hi));
+            if (mask == 0)
+            {
+                i += 32;
+                dst += 32;
+                continue;
+            }
+
+            unsigned int n = 0;
+            while (!(mask & (1u << n)))
+                ++n;
+            i += n;
+            dst += n;
+            do
+            {
+                decode_utf8_char(src, len, i, dst);
+            } while (i < len && src[i] >= 0x80);
+        }
+        return size_t(dst - start) + utf8_to_utf16_sse2(str + i, len - i, dst);
+    }
+#endif  // def MCPU_X86
+
+    // convert and return the number of units written.
+    // dst must have room for len units.
+    template <typename T_WCHAR>
+    inline size_t
+    utf8_to_utf16(const char *src, size_t len, T_WCHAR *dst)
+    {
+        // selected on each call. a static pointer isn't initialized
+        // thread-safely before C++11
+#ifdef MCPU_X86
+        const unsigned int features = mcpu_features();
+        if (features & MCPU_AVX2)
+            return utf8_to_utf16_avx2<T_WCHAR>(src, len, dst);
+        if (features & MCPU_SSE2)
+            return utf8_to_utf16_sse2<T_WCHAR>(src, len, dst);
+#endif
+        return utf8_to_utf16_scalar<T_WCHAR>(src, len, dst);
+    }
+
+    template <typename T_WSTR>
+    inline void
+    utf8_to_utf16(const char *src, size_t len, T_WSTR& str)
+    {
+        if (len == 0)
+            return;
+
+        size_t old_size = str.size();
+        str.resize(old_size + len);
+        size_t count = utf8_to_utf16(src, len, &str[old_size]);
+        str.resize(old_size + count);
+    }
+
+    ////////////////////////////////////////////////////////////////////////
+    // UTF-16 to UTF-8
+
+    // the room for the UTF-8 text. a surrogate is counted as 3 bytes.
+    template <typename T_WCHAR>
+    inline size_t
+    utf8_length_bound(const T_WCHAR *src, size_t count)
+    {
+        size_t ret = count;
+        for (size_t i = 0; i < count; ++i)
+        {
+            unsigned int unit = (unsigned int)src[i] & 0xFFFF;
+            ret += (unit >= 0x80) + (unit >= 0x800);
+        }
+        return ret;
+    }
+
+    // convert one unit at src[i], which is not ASCII.
+    // N units become 3 * N bytes at most.
+    template <typename T_WCHAR>
+    inline void
+    encode_utf8_char(const T_WCHAR *src, size_t count, size_t& i, unsigned char *& dst)
+    {
+        unsigned int code = (unsigned int)src[i++] & 0xFFFF;
+        if (code < 0x800)
+        {
+            *dst++ = (unsigned char)(0xC0 | (code >> 6));
+            *dst++ = (unsigned char)(0x80 | (code & 0x3F));
+            return;
+        }
+
+        if ((code & 0xF800) == 0xD800)
+        {
+            unsigned int low = (i < count) ? ((unsigned int)src[i] & 0xFFFF) : 0;
+            if (code < 0xDC00 && (low & 0xFC00) == 0xDC00)
+            {
+                ++i;
+                code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                *dst++ = (unsigned char)(0xF0 | (code >> 18));
+                *dst++ = (unsigned char)(0x80 | ((code >> 12) & 0x3F));
+                *dst++ = (unsigned char)(0x80 | ((code >> 6) & 0x3F));
+                *dst++ = (unsigned char)(0x80 | (code & 0x3F));
+                return;
+            }
+            code = 0xFFFD;      // an unpaired surrogate
+        }
+
+        *dst++ = (unsigned char)(0xE0 | (code >> 12));
+        *dst++ = (unsigned char)(0x80 | ((code >> 6) & 0x3F));
+        *dst++ = (unsigned char)(0x80 | (code & 0x3F));
+    }
+
+    template <typename T_WCHAR>
+    inline size_t
+    utf16_to_utf8_scalar(const T_WCHAR *src, size_t count, char *str)
+    {
+        unsigned char *dst = (unsigned char *)str;
+        size_t i = 0;
+        while (i < count)
+        {
+            unsigned int unit = (unsigned int)src[i] & 0xFFFF;
+            if (unit < 0x80)
+            {
+                *dst++ = (unsigned char)unit;
+                ++i;
+            }
+            else
+            {
+                encode_utf8_char(src, count, i, dst);
+            }
+        }
+        return size_t(dst - (unsigned char *)str);
+    }
+
+#ifdef MCPU_X86
+    // NOTE: the whole 8 bytes are stored even if only a part of them are
+    // ASCII. That's safe because dst has one byte per remaining unit.
+    template <typename T_WCHAR>
+    MCPU_TARGET("sse2")
+    inline size_t
+    utf16_to_utf8_sse2(const T_WCHAR *src, size_t count, char *str)
+    {
+        const __m128i not_ascii = _mm_set1_epi16(short(0xFF80));
+        const __m128i zero = _mm_setzero_si128();
+        unsigned char *dst = (unsigned char *)str;
+        size_t i = 0;
+        while (i + 8 <= count)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+            unsigned int mask = unsigned(_mm_movemask_epi8(
+                _mm_cmpeq_epi16(_mm_and_si128(v, not_ascii), zero)));
+            _mm_storel_epi64((__m128i *)dst, _mm_packus_epi16(v, v));
+            if (mask == 0xFFFF)
+            {
+                i += 8;
+                dst += 8;
+                continue;
+            }
+
+            unsigned int n = 0;
+            while (mask & (1u << (2 * n)))
+                ++n;
+            i += n;
+            dst += n;
+            do
+            {
+                encode_utf8_char(src, count, i, dst);
+            } while (i < count && ((unsigned int)src[i] & 0xFFFF) >= 0x80);
+        }
+        return size_t(dst - (unsigned char *)str) +
+               utf16_to_utf8_scalar(src + i, count - i, (char *)dst);
+    }
+#endif  // def MCPU_X86
+
+    // convert and return the number of bytes written.
+    // dst must have room for utf8_length_bound(src, count) bytes.
+    template <typename T_WCHAR>
+    inline size_t
+    utf16_to_utf8(const T_WCHAR *src, size_t count, char *dst)
+    {
+#ifdef MCPU_X86
+        if (mcpu_features() & MCPU_SSE2)
+            return utf16_to_utf8_sse2<T_WCHAR>(src, count, dst);
+#endif
+        return utf16_to_utf8_scalar<T_WCHAR>(src, count, dst);
+    }
+
+    template <typename T_WCHAR, typename T_STR>
+    inline void
+    utf16_to_utf8(const T_WCHAR *src, size_t count, T_STR& str)
+    {
+        if (count == 0)
+            return;
+
+        size_t old_size = str.size();
+        str.resize(old_size + utf8_length_bound(src, count));
+        size_t len = utf16_to_utf8(src, count, &str[old_size]);
+        str.resize(old_size + len);
+    }
+} // namespace text_transcoder
+
+////////////////////////////////////////////////////////////////////////////
+
+#endif  // ndef MZC4_MTEXTTRANSCODER_HPP_
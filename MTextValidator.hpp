@@ -0,0 +1,539 @@
+// MTextValidator.hpp -- ASCII, UTF-8 and UTF-16 validation    -*- C++ -*-
+// This file is part of MZC4.  See file "ReadMe.txt" and "License.txt".
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef MZC4_MTEXTVALIDATOR_HPP_
+#define MZC4_MTEXTVALIDATOR_HPP_    1   /* Version 1 */
+
+// text_validator::is_ascii
+// text_validator::is_utf8
+// text_validator::is_utf16
+
+////////////////////////////////////////////////////////////////////////////
+
+#include "MCpuFeatures.hpp"
+#include <cstddef>      // for size_t
+#include <cstring>      // for std::memcpy
+
+////////////////////////////////////////////////////////////////////////////
+
+namespace text_validator
+{
+    // is it 7-bit ASCII?
+    bool is_ascii(const char *str, size_t len);
+    // is it well-formed UTF-8? (no overlongs, no surrogates, <= U+10FFFF)
+    bool is_utf8(const char *str, size_t len);
+    // is it UTF-16 LE without any unpaired surrogates?
+    bool is_utf16(const void *ptr, size_t len);
+
+    ////////////////////////////////////////////////////////////////////////
+    // scalar versions
+
+    inline bool is_ascii_scalar(const char *str, size_t len)
+    {
+        const unsigned char *pb = (const unsigned char *)str;
+        size_t i = 0;
+        for (; i + 8 <= len; i += 8)
+        {
+            unsigned long long qw;
+            std::memcpy(&qw, pb + i, 8);
+            if (qw & 0x8080808080808080ULL)
+                return false;
+        }
+        for (; i < len; ++i)
+        {
+            if (pb[i] & 0x80)
+                return false;
+        }
+        return true;
+    }
+
+    inline bool is_utf8_scalar(const char *str, size_t len)
+    {
+        const unsigned char *pb = (const unsigned char *)str;
+        size_t i = 0;
+        while (i < len)
+        {
+            // skip ASCII quickly
+            if (i + 8 <= len)
+            {
+                unsigned long long qw;
+                std::memcpy(&qw, pb + i, 8);
+                if (!(qw & 0x8080808080808080ULL))
+                {
+                    i += 8;
+                    continue;
+                }
+            }
+
+            unsigned char b = pb[i];
+            if (b < 0x80)
+            {
+                ++i;
+                continue;
+            }
+
+            size_t count;
+            unsigned char lo = 0x80, hi = 0xBF;   // the range of 2nd byte
+            if (b < 0xC2)
+                return false;
+            else if (b < 0xE0)
+                count = 1;
+            else if (b < 0xF0)
+            {
+                count = 2;
+                if (b == 0xE0)
+                    lo = 0xA0;      // overlong
+                else if (b == 0xED)
+                    hi = 0x9F;      // surrogate
+            }
+            else if (b < 0xF5)
+            {
+                count = 3;
+                if (b == 0xF0)
+                    lo = 0x90;      // overlong
+                else if (b == 0xF4)
+                    hi = 0x8F;      // > U+10FFFF
+            }
+            else
+                return false;
+
+            if (i + count >= len)
+                return false;
+            if (pb[i + 1] < lo || hi < pb[i + 1])
+                return false;
+            for (size_t k = 2; k <= count; ++k)
+            {
+                if ((pb[i + k] & 0xC0) != 0x80)
+                    return false;
+            }
+            i += count + 1;
+        }
+        return true;
+    }
+
+    inline bool is_utf16_scalar(const void *ptr, size_t len)
+    {
+        if (len % 2)
+            return false;
+
+        const unsigned char *pb = (const unsigned char *)ptr;
+        bool need_low = false;
+        for (size_t i = 0; i < len; i += 2)
+        {
+            unsigned int unit = pb[i] | (pb[i + 1] << 8);
+            bool is_high = (unit & 0xFC00) == 0xD800;
+            bool is_low = (unit & 0xFC00) == 0xDC00;
+            if (need_low != is_low)
+                return false;
+            need_low = is_high;
+        }
+        return !need_low;
+    }
+
+    ////////////////////////////////////////////////////////////////////////
+    // x86 versions
+
+#ifdef MCPU_X86
+    MCPU_TARGET("sse2")
+    inline bool is_ascii_sse2(const char *str, size_t len)
+    {
+        size_t i = 0;
+        for (; i + 64 <= len; i += 64)
+        {
+            __m128i v0 = _mm_loadu_si128((const __m128i *)(str + i));
+            __m128i v1 = _mm_loadu_si128((const __m128i *)(str + i + 16));
+            __m128i v2 = _mm_loadu_si128((const __m128i *)(str + i + 32));
+            __m128i v3 = _mm_loadu_si128((const __m128i *)(str + i + 48));
+            __m128i v = _mm_or_si128(_mm_or_si128(v0, v1), _mm_or_si128(v2, v3));
+            if (_mm_movemask_epi8(v))
+                return false;
+        }
+        for (; i + 16 <= len; i += 16)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(str + i));
+            if (_mm_movemask_epi8(v))
+                return false;
+        }
+        return is_ascii_scalar(str + i, len - i);
+    }
+
+    MCPU_TARGET("avx2")
+    inline bool is_ascii_avx2(const char *str, size_t len)
+    {
+        size_t i = 0;
+        for (; i + 128 <= len; i += 128)
+        {
+            __m256i v0 = _mm256_loadu_si256((const __m256i *)(str + i));
+            __m256i v1 = _mm256_loadu_si256((const __m256i *)(str + i + 32));
+            __m256i v2 = _mm256_loadu_si256((const __m256i *)(str + i + 64));
+            __m256i v3 = _mm256_loadu_si256((const __m256i *)(str + i + 96));
+            __m256i v = _mm256_or_si256(_mm256_or_si256(v0, v1),
+                                        _mm256_or_si256(v2, v3));
+            if (_mm256_movemask_epi8(v))
+                return false;
+        }
+        for (; i + 32 <= len; i += 32)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(str + i));
+            if (_mm256_movemask_epi8(v))
+                return false;
+        }
+        return is_ascii_scalar(str + i, len - i);
+    }
+
+    // The UTF-8 kernels use the lookup algorithm of Keiser and Lemire,
+    // "Validating UTF-8 In Less Than One Instruction Per Byte" (2020).
+    // Three table lookups classify the errors of each pair of bytes,
+    // and the 3rd and 4th bytes of a character are checked separately.
+    enum
+    {
+        UTF8_TOO_SHORT      = 1 << 0,
+        UTF8_TOO_LONG       = 1 << 1,
+        UTF8_OVERLONG_3     = 1 << 2,
+        UTF8_TOO_LARGE      = 1 << 3,
+        UTF8_SURROGATE      = 1 << 4,
+        UTF8_OVERLONG_2     = 1 << 5,
+        UTF8_TOO_LARGE_1000 = 1 << 6,
+        UTF8_OVERLONG_4     = 1 << 6,
+        UTF8_TWO_CONTS      = 1 << 7,
+        UTF8_CARRY          = UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS
+    };
+
+    #define MTV_BYTE_1_HIGH \
+        char(UTF8_TOO_LONG), char(UTF8_TOO_LONG), \
+        char(UTF8_TOO_LONG), char(UTF8_TOO_LONG), \
+        char(UTF8_TOO_LONG), char(UTF8_TOO_LONG), \
+        char(UTF8_TOO_LONG), char(UTF8_TOO_LONG), \
+        char(UTF8_TWO_CONTS), char(UTF8_TWO_CONTS), \
+        char(UTF8_TWO_CONTS), char(UTF8_TWO_CONTS), \
+        char(UTF8_TOO_SHORT | UTF8_OVERLONG_2), \
+        char(UTF8_TOO_SHORT), \
+        char(UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE), \
+        char(UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | \
+             UTF8_OVERLONG_4)
+
+    #define MTV_BYTE_1_LOW \
+        char(UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4), \
+        char(UTF8_CARRY | UTF8_OVERLONG_2), \
+        char(UTF8_CARRY), char(UTF8_CARRY), \
+        char(UTF8_CARRY | UTF8_TOO_LARGE), \
+        char(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000), \
+        char(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000), \
+        char(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000), \
+        char(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000), \
+        char(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000), \
+        char(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000), \
+        char(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000), \
+        char(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000), \
+        char(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE), \
+        char(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000), \
+        char(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000)
+
+    #define MTV_BYTE_2_HIGH \
+        char(UTF8_TOO_SHORT), char(UTF8_TOO_SHORT), \
+        char(UTF8_TOO_SHORT), char(UTF8_TOO_SHORT), \
+        char(UTF8_TOO_SHORT), char(UTF8_TOO_SHORT), \
+        char(UTF8_TOO_SHORT), char(UTF8_TOO_SHORT), \
+        char(UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | \
+             UTF8_OVERLONG_3 | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4), \
+        char(UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | \
+             UTF8_OVERLONG_3 | UTF8_TOO_LARGE), \
+        char(UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | \
+             UTF8_SURROGATE | UTF8_TOO_LARGE), \
+        char(UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | \
+             UTF8_SURROGATE | UTF8_TOO_LARGE), \
+        char(UTF8_TOO_SHORT), char(UTF8_TOO_SHORT), \
+        char(UTF8_TOO_SHORT), char(UTF8_TOO_SHORT)
+
+    // the last 3 bytes must not start a character that needs more bytes
+    #define MTV_MAX_INCOMPLETE \
+        char(0xFF), char(0xFF), char(0xFF), char(0xFF), \
+        char(0xFF), char(0xFF), char(0xFF), char(0xFF), \
+        char(0xFF), char(0xFF), char(0xFF), char(0xFF), \
+        char(0xFF), char(0xF0 - 1), char(0xE0 - 1), char(0xC0 - 1)
+
+    struct utf8_state_sse
+    {
+        __m128i error;
+        __m128i prev_input;
+        __m128i prev_incomplete;
+    };
+
+    MCPU_TARGET("ssse3")
+    inline void utf8_check_sse(utf8_state_sse& state, __m128i input)
+    {
+        if (_mm_movemask_epi8(input) == 0)
+        {
+            // ASCII: just check the previous block was complete
+            state.error = _mm_or_si128(state.error, state.prev_incomplete);
+            state.prev_input = input;
+            return;
+        }
+
+        const __m128i byte_1_high = _mm_setr_epi8(MTV_BYTE_1_HIGH);
+        const __m128i byte_1_low = _mm_setr_epi8(MTV_BYTE_1_LOW);
+        const __m128i byte_2_high = _mm_setr_epi8(MTV_BYTE_2_HIGH);
+        const __m128i max_incomplete = _mm_setr_epi8(MTV_MAX_INCOMPLETE);
+        const __m128i mask0f = _mm_set1_epi8(0x0F);
+
+        __m128i prev1 = _mm_alignr_epi8(input, state.prev_input, 15);
+        __m128i prev2 = _mm_alignr_epi8(input, state.prev_input, 14);
+        __m128i prev3 = _mm_alignr_epi8(input, state.prev_input, 13);
+
+        __m128i sc = _mm_shuffle_epi8(byte_1_high,
+            _mm_and_si128(_mm_srli_epi16(prev1, 4), mask0f));
+        sc = _mm_and_si128(sc, _mm_shuffle_epi8(byte_1_low,
+            _mm_and_si128(prev1, mask0f)));
+        sc = _mm_and_si128(sc, _mm_shuffle_epi8(byte_2_high,
+            _mm_and_si128(_mm_srli_epi16(input, 4), mask0f)));
+
+        // only 111_____ and 1111____ become >= 0x80
+        __m128i is_third = _mm_subs_epu8(prev2, _mm_set1_epi8(char(0xE0 - 0x80)));
+        __m128i is_fourth = _mm_subs_epu8(prev3, _mm_set1_epi8(char(0xF0 - 0x80)));
+        __m128i must23 = _mm_and_si128(_mm_or_si128(is_third, is_fourth),
+                                       _mm_set1_epi8(char(0x80)));
+
+        state.error = _mm_or_si128(state.error, _mm_xor_si128(must23, sc));
+        state.prev_incomplete = _mm_subs_epu8(input, max_incomplete);
+        state.prev_input = input;
+    }
+
+    MCPU_TARGET("ssse3")
+    inline bool is_utf8_ssse3(const char *str, size_t len)
+    {
+        utf8_state_sse state;
+        state.error = state.prev_input = state.prev_incomplete = _mm_setzero_si128();
+
+        size_t i = 0;
+        for (; i + 16 <= len; i += 16)
+        {
+            utf8_check_sse(state, _mm_loadu_si128((const __m128i *)(str + i)));
+        }
+        if (i < len)
+        {
+            // the zeros after the end reveal a truncated character
+            char buf[16] = { 0 };
+            std::memcpy(buf, str + i, len - i);
+            utf8_check_sse(state, _mm_loadu_si128((const __m128i *)buf));
+        }
+
+        __m128i error = _mm_or_si128(state.error, state.prev_incomplete);
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) == 0xFFFF;
+    }
+
+    struct utf8_state_avx
+    {
+        __m256i error;
+        __m256i prev_input;
+        __m256i prev_incomplete;
+    };
+
+    MCPU_TARGET("avx2")
+    inline void utf8_check_avx(utf8_state_avx& state, __m256i input)
+    {
+        if (_mm256_movemask_epi8(input) == 0)
+        {
+            state.error = _mm256_or_si256(state.error, state.prev_incomplete);
+            state.prev_input = input;
+            return;
+        }
+
+        const __m256i byte_1_high = _mm256_setr_epi8(MTV_BYTE_1_HIGH, MTV_BYTE_1_HIGH);
+        const __m256i byte_1_low = _mm256_setr_epi8(MTV_BYTE_1_LOW, MTV_BYTE_1_LOW);
+        const __m256i byte_2_high = _mm256_setr_epi8(MTV_BYTE_2_HIGH, MTV_BYTE_2_HIGH);
+        const __m256i max_incomplete = _mm256_setr_epi8(
+            char(0xFF), char(0xFF), char(0xFF), char(0xFF),
+            char(0xFF), char(0xFF), char(0xFF), char(0xFF),
+            char(0xFF), char(0xFF), char(0xFF), char(0xFF),
+            char(0xFF), char(0xFF), char(0xFF), char(0xFF),
+            MTV_MAX_INCOMPLETE);
+        const __m256i mask0f = _mm256_set1_epi8(0x0F);
+
+        // the previous 16 bytes for each lane
+        __m256i prev = _mm256_permute2x128_si256(state.prev_input, input, 0x21);
+        __m256i prev1 = _mm256_alignr_epi8(input, prev, 15);
+        __m256i prev2 = _mm256_alignr_epi8(input, prev, 14);
+        __m256i prev3 = _mm256_alignr_epi8(input, prev, 13);
+
+        __m256i sc = _mm256_shuffle_epi8(byte_1_high,
+            _mm256_and_si256(_mm256_srli_epi16(prev1, 4), mask0f));
+        sc = _mm256_and_si256(sc, _mm256_shuffle_epi8(byte_1_low,
+            _mm256_and_si256(prev1, mask0f)));
+        sc = _mm256_and_si256(sc, _mm256_shuffle_epi8(byte_2_high,
+            _mm256_and_si256(_mm256_srli_epi16(input, 4), mask0f)));
+
+        __m256i is_third = _mm256_subs_epu8(prev2, _mm256_set1_epi8(char(0xE0 - 0x80)));
+        __m256i is_fourth = _mm256_subs_epu8(prev3, _mm256_set1_epi8(char(0xF0 - 0x80)));
+        __m256i must23 = _mm256_and_si256(_mm256_or_si256(is_third, is_fourth),
+                                          _mm256_set1_epi8(char(0x80)));
+
+        state.error = _mm256_or_si256(state.error, _mm256_xor_si256(must23, sc));
+        state.prev_incomplete = _mm256_subs_epu8(input, max_incomplete);
+        state.prev_input = input;
+    }
+
+    MCPU_TARGET("avx2")
+    inline bool is_utf8_avx2(const char *str, size_t len)
+    {
+        utf8_state_avx state;
+        state.error = state.prev_input = state.prev_incomplete = _mm256_setzero_si256();
+
+        size_t i = 0;
+        for (; i + 32 <= len; i += 32)
+        {
+            utf8_check_avx(state, _mm256_loadu_si256((const __m256i *)(str + i)));
+        }
+        if (i < len)
+        {
+            char buf[32] = { 0 };
+            std::memcpy(buf, str + i, len - i);
+            utf8_check_avx(state, _mm256_loadu_si256((const __m256i *)buf));
+        }
+
+        __m256i error = _mm256_or_si256(state.error, state.prev_incomplete);
+        return _mm256_testz_si256(error, error) != 0;
+    }
+
+    #undef MTV_BYTE_1_HIGH
+    #undef MTV_BYTE_1_LOW
+    #undef MTV_BYTE_2_HIGH
+    #undef MTV_MAX_INCOMPLETE
+
+    // A high surrogate must be followed by a low surrogate, and a low
+    // surrogate must follow a high one. With the masks of the high and
+    // the low surrogates, this is (low == high shifted by one unit).
+    MCPU_TARGET("sse2")
+    inline bool is_utf16_sse2(const void *ptr, size_t len)
+    {
+        if (len % 2)
+            return false;
+
+        const char *pb = (const char *)ptr;
+        const __m128i mask = _mm_set1_epi16(short(0xFC00));
+        const __m128i high = _mm_set1_epi16(short(0xD800));
+        const __m128i low = _mm_set1_epi16(short(0xDC00));
+        unsigned int carry = 0;
+        size_t i = 0;
+        for (; i + 16 <= len; i += 16)
+        {
+            __m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i *)(pb + i)), mask);
+            unsigned int h = _mm_movemask_epi8(_mm_cmpeq_epi16(v, high));
+            unsigned int l = _mm_movemask_epi8(_mm_cmpeq_epi16(v, low));
+            if (l != (((h << 2) | carry) & 0xFFFF))
+                return false;
+            carry = h >> 14;
+        }
+
+        // the rest, with the pending high surrogate
+        if (carry)
+        {
+            if (i == len)
+                return false;
+            unsigned int unit = (unsigned char)pb[i] | ((unsigned char)pb[i + 1] << 8);
+            if ((unit & 0xFC00) != 0xDC00)
+                return false;
+            i += 2;
+        }
+        return is_utf16_scalar(pb + i, len - i);
+    }
+
+    MCPU_TARGET("avx2")
+    inline bool is_utf16_avx2(const void *ptr, size_t len)
+    {
+        if (len % 2)
+            return false;
+
+        const char *pb = (const char *)ptr;
+        const __m256i mask = _mm256_set1_epi16(short(0xFC00));
+        const __m256i high = _mm256_set1_epi16(short(0xD800));
+        const __m256i low = _mm256_set1_epi16(short(0xDC00));
+        unsigned int carry = 0;
+        size_t i = 0;
+        for (; i + 32 <= len; i += 32)
+        {
+            __m256i v = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(pb + i)), mask);
+            unsigned int h = unsigned(_mm256_movemask_epi8(_mm256_cmpeq_epi16(v, high)));
+            unsigned int l = unsigned(_mm256_movemask_epi8(_mm256_cmpeq_epi16(v, low)));
+            if (l != ((h << 2) | carry))
+                return false;
+            carry = h >> 30;
+        }
+
+        if (carry)
+        {
+            if (i == len)
+                return false;
+            unsigned int unit = (unsigned char)pb[i] | ((unsigned char)pb[i + 1] << 8);
+            if ((unit & 0xFC00) != 0xDC00)
+                return false;
+            i += 2;
+        }
+        return is_utf16_scalar(pb + i, len - i);
+    }
+#endif  // def MCPU_X86
+
+    ////////////////////////////////////////////////////////////////////////
+    // dispatchers
+
+    typedef bool (*text_fn)(const char *, size_t);
+    typedef bool (*binary_fn)(const void *, size_t);
+
+    inline text_fn select_is_ascii(void)
+    {
+#ifdef MCPU_X86
+        unsigned int features = mcpu_features();
+        if (features & MCPU_AVX2)
+            return is_ascii_avx2;
+        if (features & MCPU_SSE2)
+            return is_ascii_sse2;
+#endif
+        return is_ascii_scalar;
+    }
+
+    inline text_fn select_is_utf8(void)
+    {
+#ifdef MCPU_X86
+        unsigned int features = mcpu_features();
+        if (features & MCPU_AVX2)
+            return is_utf8_avx2;
+        if (features & MCPU_SSSE3)
+            return is_utf8_ssse3;
+#endif
+        return is_utf8_scalar;
+    }
+
+    inline binary_fn select_is_utf16(void)
+    {
+#ifdef MCPU_X86
+        unsigned int features = mcpu_features();
+        if (features & MCPU_AVX2)
+            return is_utf16_avx2;
+        if (features & MCPU_SSE2)
+            return is_utf16_sse2;
+#endif
+        return is_utf16_scalar;
+    }
+
+    // no static function pointers, whose initialization isn't thread-safe
+    // before C++11. mcpu_features() is cheap and safe on any thread
+
+    inline bool is_ascii(const char *str, size_t len)
+    {
+        return select_is_ascii()(str, len);
+    }
+
+    inline bool is_utf8(const char *str, size_t len)
+    {
+        return select_is_utf8()(str, len);
+    }
+
+    inline bool is_utf16(const void *ptr, size_t len)
+    {
+        return select_is_utf16()(ptr, len);
+    }
+} // namespace text_validator
+
+////////////////////////////////////////////////////////////////////////////
+
+#endif  // ndef MZC4_MTEXTVALIDATOR_HPP_
@@ -0,0 +1,469 @@
+// MThread.hpp -- threads, locks and a thread pool              -*- C++ -*-
+// This file is part of MZC4.  See file "ReadMe.txt" and "License.txt".
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef MZC4_MTHREAD_HPP_
+#define MZC4_MTHREAD_HPP_       1   /* Version 1 */
+
+// class MMutex; class MScopedLock; class MCondition;
+// class MThread; class MTask; class MThreadPool;
+// mthread_cpu_count
+
+////////////////////////////////////////////////////////////////////////////
+
+#include <cstddef>      // for size_t
+#include <deque>        // for std::deque
+#include <vector>       // for std::vector
+
+#if defined(_WIN32) && !defined(WONVER)
+    #ifndef _INC_WINDOWS
+        #include <windows.h>    // needs Vista or later for CONDITION_VARIABLE
+    #endif
+    #include <process.h>        // for _beginthreadex
+#else
+    #include <pthread.h>
+    #include <unistd.h>         // for sysconf
+#endif
+
+////////////////////////////////////////////////////////////////////////////
+
+// the number of the logical processors
+int mthread_cpu_count(void);
+
+class MMutex
+{
+public:
+    MMutex();
+    ~MMutex();
+
+    void lock();
+    void unlock();
+
+protected:
+#if defined(_WIN32) && !defined(WONVER)
+    CRITICAL_SECTION m_cs;
+#else
+    pthread_mutex_t m_mutex;
+#endif
+    friend class MCondition;
+
+private:
+    // NOTE: MMutex is not copyable.
+    MMutex(const MMutex&);
+    MMutex& operator=(const MMutex&);
+};
+
+class MScopedLock
+{
+public:
+    MScopedLock(MMutex& mutex) : m_mutex(mutex)
+    {
+        m_mutex.lock();
+    }
+    ~MScopedLock()
+    {
+        m_mutex.unlock();
+    }
+
+protected:
+    MMutex& m_mutex;
+
+private:
+    // NOTE: MScopedLock is not copyable.
+    MScopedLock(const MScopedLock&);
+    MScopedLock& operator=(const MScopedLock&);
+};
+
+class MCondition
+{
+public:
+    MCondition();
+    ~MCondition();
+
+    // the mutex must be locked
+    void wait(MMutex& mutex);
+    void signal();
+    void broadcast();
+
+protected:
+#if defined(_WIN32) && !defined(WONVER)
+    CONDITION_VARIABLE m_cv;
+#else
+    pthread_cond_t m_cond;
+#endif
+
+private:
+    // NOTE: MCondition is not copyable.
+    MCondition(const MCondition&);
+    MCondition& operator=(const MCondition&);
+};
+
+class MThread
+{
+public:
+    typedef void (*proc_t)(void *arg);
+
+    MThread();
+    ~MThread();
+
+    bool create(proc_t proc, void *arg);
+    void join();
+
+    bool is_running() const
+    {
+        return m_running;
+    }
+
+protected:
+#if defined(_WIN32) && !defined(WONVER)
+    HANDLE m_hThread;
+#else
+    pthread_t m_thread;
+#endif
+    bool m_running;
+    proc_t m_proc;
+    void *m_arg;
+
+#if defined(_WIN32) && !defined(WONVER)
+    static unsigned __stdcall thread_proc(void *self);
+#else
+    static void *thread_proc(void *self);
+#endif
+
+private:
+    // NOTE: MThread is not copyable.
+    MThread(const MThread&);
+    MThread& operator=(const MThread&);
+};
+
+// a unit of work of MThreadPool
+class MTask
+{
+public:
+    MTask() : m_done(false)
+    {
+    }
+    virtual ~MTask()
+    {
+    }
+
+    virtual void run() = 0;
+
+protected:
+    bool m_done;
+    friend class MThreadPool;
+};
+
+// MThreadPool runs the tasks on the worker threads in the order of
+// submit(). wait() waits for a task; the waiting thread runs the task by
+// itself if no worker has started it yet. With no worker, submit() runs
+// the task at once.
+class MThreadPool
+{
+public:
+    MThreadPool();
+    ~MThreadPool();
+
+    // threads is the number of the workers, or 0 for one per processor
+    bool start(int threads = 0);
+    void stop();
+
+    int threads() const
+    {
+        return int(m_threads.size());
+    }
+
+    // the task must live until wait() returns
+    void submit(MTask *task);
+    void wait(MTask *task);
+
+protected:
+    std::vector<MThread *> m_threads;
+    std::deque<MTask *> m_queue;
+    MMutex m_mutex;
+    MCondition m_work;      // a task is submitted
+    MCondition m_finished;  // a task is done
+    bool m_quit;
+
+    static void worker_proc(void *self);
+    void run(MTask *task);
+};
+
+////////////////////////////////////////////////////////////////////////////
+
+#if defined(_WIN32) && !defined(WONVER)
+    inline int mthread_cpu_count(void)
+    {
+        SYSTEM_INFO info;
+        ::GetSystemInfo(&info);
+        return info.dwNumberOfProcessors ? int(info.dwNumberOfProcessors) : 1;
+    }
+
+    inline MMutex::MMutex()
+    {
+        ::InitializeCriticalSection(&m_cs);
+    }
+    inline MMutex::~MMutex()
+    {
+        ::DeleteCriticalSection(&m_cs);
+    }
+    inline void MMutex::lock()
+    {
+        ::EnterCriticalSection(&m_cs);
+    }
+    inline void MMutex::unlock()
+    {
+        ::LeaveCriticalSection(&m_cs);
+    }
+
+    inline MCondition::MCondition()
+    {
+        ::InitializeConditionVariable(&m_cv);
+    }
+    inline MCondition::~MCondition()
+    {
+    }
+    inline void MCondition::wait(MMutex& mutex)
+    {
+        ::SleepConditionVariableCS(&m_cv, &mutex.m_cs, INFINITE);
+    }
+    inline void MCondition::signal()
+    {
+        ::WakeConditionVariable(&m_cv);
+    }
+    inline void MCondition::broadcast()
+    {
+        ::WakeAllConditionVariable(&m_cv);
+    }
+
+    inline MThread::MThread() : m_hThread(NULL), m_running(false)
+    {
+    }
+
+    inline bool MThread::create(proc_t proc, void *arg)
+    {
+        m_proc = proc;
+        m_arg = arg;
+        m_hThread = (HANDLE)_beginthreadex(NULL, 0, thread_proc, this, 0, NULL);
+        m_running = (m_hThread != NULL);
+        return m_running;
+    }
+
+    inline void MThread::join()
+    {
+        if (!m_running)
+            return;
+        ::WaitForSingleObject(m_hThread, INFINITE);
+        ::CloseHandle(m_hThread);
+        m_hThread = NULL;
+        m_running = false;
+    }
+
+    inline unsigned __stdcall MThread::thread_proc(void *self)
+    {
+        MThread *pThis = (MThread *)self;
+        pThis->m_proc(pThis->m_arg);
+        return 0;
+    }
+#else
+    inline int mthread_cpu_count(void)
+    {
+        long count = sysconf(_SC_NPROCESSORS_ONLN);
+        return (count > 0) ? int(count) : 1;
+    }
+
+    inline MMutex::MMutex()
+    {
+        pthread_mutex_init(&m_mutex, NULL);
+    }
+    inline MMutex::~MMutex()
+    {
+        pthread_mutex_destroy(&m_mutex);
+    }
+    inline void MMutex::lock()
+    {
+        pthread_mutex_lock(&m_mutex);
+    }
+    inline void MMutex::unlock()
+    {
+        pthread_mutex_unlock(&m_mutex);
+    }
+
+    inline MCondition::MCondition()
+    {
+        pthread_cond_init(&m_cond, NULL);
+    }
+    inline MCondition::~MCondition()
+    {
+        pthread_cond_destroy(&m_cond);
+    }
+    inline void MCondition::wait(MMutex& mutex)
+    {
+        pthread_cond_wait(&m_cond, &mutex.m_mutex);
+    }
+    inline void MCondition::signal()
+    {
+        pthread_cond_signal(&m_cond);
+    }
+    inline void MCondition::broadcast()
+    {
+        pthread_cond_broadcast(&m_cond);
+    }
+
+    inline MThread::MThread() : m_running(false)
+    {
+    }
+
+    inline bool MThread::create(proc_t proc, void *arg)
+    {
+        m_proc = proc;
+        m_arg = arg;
+        m_running = (pthread_create(&m_thread, NULL, thread_proc, this) == 0);
+        return m_running;
+    }
+
+    inline void MThread::join()
+    {
+        if (!m_running)
+            return;
+        pthread_join(m_thread, NULL);
+        m_running = false;
+    }
+
+    inline void *MThread::thread_proc(void *self)
+    {
+        MThread *pThis = (MThread *)self;
+        pThis->m_proc(pThis->m_arg);
+        return NULL;
+    }
+#endif
+
+inline MThread::~MThread()
+{
+    join();
+}
+
+////////////////////////////////////////////////////////////////////////////
+
+inline MThreadPool::MThreadPool() : m_quit(false)
+{
+}
+
+inline MThreadPool::~MThreadPool()
+{
+    stop();
+}
+
+inline bool MThreadPool::start(int threads)
+{
+    stop();
+    if (threads <= 0)
+        threads = mthread_cpu_count();
+
+    m_quit = false;
+    for (int i = 0; i < threads; ++i)
+    {
+        MThread *thread = new MThread;
+        if (!thread->create(worker_proc, this))
+        {
+            delete thread;
+            break;
+        }
+        m_threads.push_back(thread);
+    }
+    return !m_threads.empty();
+}
+
+inline void MThreadPool::stop()
+{
+    {
+        MScopedLock lock(m_mutex);
+        m_quit = true;
+        m_work.broadcast();
+    }
+    for (size_t i = 0; i < m_threads.size(); ++i)
+    {
+        m_threads[i]->join();
+        delete m_threads[i];
+    }
+    m_threads.clear();
+
+    // run the rest here
+    while (!m_queue.empty())
+    {
+        MTask *task = m_queue.front();
+        m_queue.pop_front();
+        run(task);
+    }
+}
+
+inline void MThreadPool::submit(MTask *task)
+{
+    task->m_done = false;
+    if (m_threads.empty())
+    {
+        run(task);
+        return;
+    }
+
+    MScopedLock lock(m_mutex);
+    m_queue.push_back(task);
+    m_work.signal();
+}
+
+inline void MThreadPool::wait(MTask *task)
+{
+    MScopedLock lock(m_mutex);
+    if (task->m_done)
+        return;
+
+    // run it here if it's still in the queue
+    for (size_t i = 0; i < m_queue.size(); ++i)
+    {
+        if (m_queue[i] == task)
+        {
+            m_queue.erase(m_queue.begin() + i);
+            m_mutex.unlock();
+            task->run();
+            m_mutex.lock();
+            task->m_done = true;
+            return;
+        }
+    }
+
+    while (!task->m_done)
+        m_finished.wait(m_mutex);
+}
+
+inline void MThreadPool::run(MTask *task)
+{
+    task->run();
+    task->m_done = true;
+}
+
+inline void MThreadPool::worker_proc(void *self)
+{
+    MThreadPool *pThis = (MThreadPool *)self;
+    MScopedLock lock(pThis->m_mutex);
+    for (;;)
+    {
+        while (!pThis->m_quit && pThis->m_queue.empty())
+            pThis->m_work.wait(pThis->m_mutex);
+        if (pThis->m_queue.empty())
+            break;
+
+        MTask *task = pThis->m_queue.front();
+        pThis->m_queue.pop_front();
+
+        pThis->m_mutex.unlock();
+        task->run();
+        pThis->m_mutex.lock();
+
+        task->m_done = true;
+        pThis->m_finished.broadcast();
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////
+
+#endif  // ndef MZC4_MTHREAD_HPP_
@@ -0,0 +1,773 @@
+// MWaveWriter.hpp -- buffered RIFF/RF64 WAVE file writer       -*- C++ -*-
+// This file is part of MZC4.  See file "ReadMe.txt" and "License.txt".
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef MZC4_MWAVEWRITER_HPP_
+#define MZC4_MWAVEWRITER_HPP_       8   /* Version 8 */
+
+// class MWaveWriter;
+
+////////////////////////////////////////////////////////////////////////////
+
+#if __cplusplus >= 201103L          /* C++11 */
+    #include <cstdint>
+#else
+    #include "pstdint.h"
+#endif
+
+#include <cstddef>      // for size_t
+#include <cstdio>       // for std::fflush
+#include <cstdlib>      // for std::free
+#include <cstring>      // for std::memcpy
+
+#if defined(_WIN32) && !defined(WONVER)
+    #ifndef _INC_WINDOWS
+        #include <windows.h>
+    #endif
+    #include <malloc.h>     // for _aligned_malloc
+    #include <io.h>         // for _setmode
+    #include <fcntl.h>      // for _O_BINARY
+#else
+    #include <sys/types.h>
+    #include <sys/stat.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <cerrno>
+#endif
+
+////////////////////////////////////////////////////////////////////////////
+
+// MWaveWriter writes PCM into a WAVE file through a large aligned buffer.
+//
+// The header reserves a "JUNK" chunk of the size of the "ds64" chunk of
+// RF64 (EBU Tech 3306). close() patches the sizes into the header. If the
+// file exceeds 4 GB, the JUNK chunk becomes the ds64 chunk and the file
+// becomes RF64; otherwise it stays an ordinary RIFF WAVE file.
+//
+// open() can preallocate the disk space for the expected data size so that
+// a long file isn't fragmented. The unused space is released at close().
+//
+// open_stdout() writes into the standard output. If it is a pipe or a
+// terminal, the sizes in the header are 0xFFFFFFFF as they are unknown, and
+// each write() goes out at once. On Linux, the pipe buffer is enlarged, so
+// the reader wakes up less often. The data is copied into the pipe by
+// write(), not passed by vmsplice, as the reader may splice the pages on
+// and hold them after the pipe is drained.
+//
+// open_stream() passes the data to a function instead. With the function
+// to write at an offset, such as into memory, the sizes are patched at
+// close(); otherwise it's a stream of the unknown sizes.
+//
+// The format is WAVE_FORMAT_EXTENSIBLE for more than two channels or more
+// than 16 bits per sample, with the speaker positions of the channels in
+// the standard order.
+//
+// The compressed formats such as G.711 and IMA ADPCM have a "fact" chunk
+// of the number of the sample frames after the "fmt " chunk.
+class MWaveWriter
+{
+public:
+    enum { HEADER_SIZE = 80, EXTENSIBLE_HEADER_SIZE = 104,
+           MAX_HEADER_SIZE = 104, DEFAULT_BUFFER_SIZE = 1024 * 1024 };
+
+    // the format tags
+    enum { TAG_PCM = 1, TAG_FLOAT = 3, TAG_ALAW = 6, TAG_MULAW = 7,
+           TAG_IMA_ADPCM = 0x11 };
+
+    // the functions of open_stream(). return false on error
+    typedef bool (*write_proc_t)(void *context, const void *data, size_t size);
+    typedef bool (*write_at_proc_t)(void *context, uint64_t offset,
+                                    const void *data, size_t size);
+
+    MWaveWriter(size_t buffer_size = DEFAULT_BUFFER_SIZE);
+    ~MWaveWriter();
+
+    // format_tag is one of TAG_*. bits_per_sample is 4 for TAG_IMA_ADPCM.
+    bool open(const char *filename, int samples_per_sec, int channels,
+              int bits_per_sample, int format_tag = 1,
+              uint64_t expected_size = 0);
+    bool open_stdout(int samples_per_sec, int channels, int bits_per_sample,
+                     int format_tag = 1, uint64_t expected_size = 0);
+    // write_at_proc can be NULL
+    bool open_stream(write_proc_t proc, write_at_proc_t write_at_proc,
+                     void *context, int samples_per_sec, int channels,
+                     int bits_per_sample, int format_tag = 1);
+    bool write(const void *data, size_t size);
+    bool close();
+
+    // overwrite the bytes at offset, such as the header of another format
+    // written in the raw mode. call just before close(). fails on a stream.
+    bool write_at(uint64_t offset, const void *data, size_t size);
+
+    // write the PCM only, without the header. call before open.
+    void set_raw(bool raw)
+    {
+        m_raw = raw;
+    }
+
+    // the bytes and the sample frames of a block of a compressed format,
+    // or zeros for the PCM. call before open.
+    void set_block(int block_align, int frames_per_block)
+    {
+        m_block_align = block_align;
+        m_frames_per_block = frames_per_block;
+    }
+
+    // the number of the sample frames for the "fact" chunk if it's not of
+    // the full blocks, such as the short last block of IMA ADPCM. call
+    // before close().
+    void set_frames(uint64_t frames)
+    {
+        m_frames = frames;
+        m_frames_set = true;
+    }
+
+    bool is_open() const
+    {
+        return m_is_open;
+    }
+
+    // the bytes of the PCM written
+    uint64_t data_size() const
+    {
+        return m_data_size;
+    }
+
+    // the offset of the PCM in the file
+    size_t header_size() const
+    {
+        return m_raw ? 0 : m_header_size;
+    }
+
+    // not seekable?
+    bool is_streaming() const
+    {
+        return m_streaming;
+    }
+
+protected:
+#if defined(_WIN32) && !defined(WONVER)
+    HANDLE m_hFile;
+#else
+    int m_fd;
+#endif
+    bool m_is_open;
+    bool m_failed;
+    bool m_preallocated;
+    bool m_own;             // close the file at close()
+    bool m_streaming;       // not seekable
+    bool m_raw;
+    write_proc_t m_proc;    // of open_stream()
+    write_at_proc_t m_write_at_proc;
+    void *m_context;
+    unsigned char *m_buf;
+    size_t m_buf_size;
+    size_t m_buf_used;
+    uint64_t m_data_size;
+    int m_samples_per_sec;
+    int m_channels;
+    int m_bits_per_sample;
+    int m_format_tag;
+    int m_block_align;
+    int m_frames_per_block;
+    uint64_t m_frames;
+    bool m_frames_set;
+    size_t m_header_size;
+
+    bool start(int samples_per_sec, int channels, int bits_per_sample,
+               int format_tag, uint64_t expected_size);
+    bool flush();
+    bool stream_write(const void *data, size_t size);
+    bool sys_open(const char *filename);
+    bool sys_open_stdout();
+    void sys_setup_pipe();
+    bool sys_write(const void *data, size_t size);
+    bool sys_write_at(uint64_t offset, const void *data, size_t size);
+
+    // into the file or the functions of open_stream()
+    bool write_out(const void *data, size_t size)
+    {
+        return m_proc ? m_proc(m_context, data, size) : sys_write(data, size);
+    }
+    bool write_out_at(uint64_t offset, const void *data, size_t size)
+    {
+        if (m_proc)
+            return m_write_at_proc && m_write_at_proc(m_context, offset, data, size);
+        return sys_write_at(offset, data, size);
+    }
+    void sys_preallocate(uint64_t size);
+    bool sys_truncate(uint64_t size);
+    bool sys_close();
+
+    void make_header(unsigned char *header, bool rf64) const;
+
+    bool is_compressed() const
+    {
+        return m_format_tag != TAG_PCM && m_format_tag != TAG_FLOAT;
+    }
+    int get_block_align() const
+    {
+        if (m_block_align)
+            return m_block_align;
+        return m_channels * ((m_bits_per_sample + 7) / 8);
+    }
+    uint64_t get_frames() const
+    {
+        if (m_frames_set)
+            return m_frames;
+        const int block_align = get_block_align();
+        const int frames_per_block = m_frames_per_block ? m_frames_per_block : 1;
+        return block_align ? m_data_size / block_align * frames_per_block : 0;
+    }
+
+    static unsigned char *alloc_pages(size_t size);
+    static void free_pages(unsigned char *ptr);
+
+    static void put16(unsigned char *p, uint32_t value)
+    {
+        p[0] = (unsigned char)value;
+        p[1] = (unsigned char)(value >> 8);
+    }
+    static void put32(unsigned char *p, uint32_t value)
+    {
+        put16(p, value);
+        put16(p + 2, value >> 16);
+    }
+    static void put64(unsigned char *p, uint64_t value)
+    {
+        put32(p, uint32_t(value));
+        put32(p + 4, uint32_t(value >> 32));
+    }
+
+private:
+    // not copyable
+    MWaveWriter(const MWaveWriter&);
+    MWaveWriter& operator=(const MWaveWriter&);
+};
+
+////////////////////////////////////////////////////////////////////////////
+
+inline MWaveWriter::MWaveWriter(size_t buffer_size)
+    : m_is_open(false), m_failed(false), m_preallocated(false),
+      m_own(true), m_streaming(false), m_raw(false), m_proc(NULL),
+      m_write_at_proc(NULL), m_context(NULL), m_buf(NULL), m_buf_size(0),
+      m_buf_used(0), m_data_size(0),
+      m_samples_per_sec(0), m_channels(0), m_bits_per_sample(0),
+      m_format_tag(TAG_PCM), m_block_align(0), m_frames_per_block(0),
+      m_frames(0), m_frames_set(false), m_header_size(HEADER_SIZE)
+{
+#if defined(_WIN32) && !defined(WONVER)
+    m_hFile = INVALID_HANDLE_VALUE;
+#else
+    m_fd = -1;
+#endif
+
+    // a multiple of the page size
+    buffer_size = (buffer_size + 4095) / 4096 * 4096;
+    if (buffer_size == 0)
+        buffer_size = 4096;
+    m_buf = alloc_pages(buffer_size);
+    if (m_buf)
+        m_buf_size = buffer_size;
+}
+
+inline MWaveWriter::~MWaveWriter()
+{
+    close();
+    free_pages(m_buf);
+}
+
+// page-aligned memory
+inline unsigned char *MWaveWriter::alloc_pages(size_t size)
+{
+#if defined(_WIN32) && !defined(WONVER)
+    return (unsigned char *)_aligned_malloc(size, 4096);
+#else
+    void *ptr = NULL;
+    if (posix_memalign(&ptr, 4096, size) != 0)
+        return NULL;
+    return (unsigned char *)ptr;
+#endif
+}
+
+inline void MWaveWriter::free_pages(unsigned char *ptr)
+{
+#if defined(_WIN32) && !defined(WONVER)
+    _aligned_free(ptr);
+#else
+    std::free(ptr);
+#endif
+}
+
+inline bool
+MWaveWriter::open(const char *filename, int samples_per_sec, int channels,
+                  int bits_per_sample, int format_tag, uint64_t expected_size)
+{
+    close();
+    if (!m_buf || !sys_open(filename))
+        return false;
+
+    m_own = true;
+    m_streaming = false;
+    return start(samples_per_sec, channels, bits_per_sample, format_tag,
+                 expected_size);
+}
+
+inline bool
+MWaveWriter::open_stdout(int samples_per_sec, int channels, int bits_per_sample,
+                         int format_tag, uint64_t expected_size)
+{
+    close();
+    std::fflush(stdout);
+    if (!m_buf || !sys_open_stdout())
+        return false;
+
+    m_own = false;
+    if (m_streaming)
+    {
+        sys_setup_pipe();
+        expected_size = 0;
+    }
+    return start(samples_per_sec, channels, bits_per_sample, format_tag,
+                 expected_size);
+}
+
+inline bool
+MWaveWriter::open_stream(write_proc_t proc, write_at_proc_t write_at_proc,
+                         void *context, int samples_per_sec, int channels,
+                         int bits_per_sample, int format_tag)
+{
+    close();
+    if (!m_buf || !proc)
+        return false;
+
+    m_proc = proc;
+    m_write_at_proc = write_at_proc;
+    m_context = context;
+    m_own = false;
+    m_streaming = !write_at_proc;
+    return start(samples_per_sec, channels, bits_per_sample, format_tag, 0);
+}
+
+inline bool
+MWaveWriter::start(int samples_per_sec, int channels, int bits_per_sample,
+                   int format_tag, uint64_t expected_size)
+{
+    m_is_open = true;
+    m_failed = false;
+    m_preallocated = false;
+    m_data_size = 0;
+    m_buf_used = 0;
+    m_samples_per_sec = samples_per_sec;
+    m_channels = channels;
+    m_bits_per_sample = bits_per_sample;
+    m_format_tag = format_tag;
+    m_frames = 0;
+    m_frames_set = false;
+    if (is_compressed())
+    {
+        // "fmt " of 18 bytes (20 with the frames per block) and "fact"
+        m_header_size = HEADER_SIZE + 2 + (m_frames_per_block > 1 ? 2 : 0) + 12;
+    }
+    else
+    {
+        m_header_size = (channels > 2 || bits_per_sample > 16)
+                      ? EXTENSIBLE_HEADER_SIZE : HEADER_SIZE;
+    }
+
+    if (expected_size)
+    {
+        sys_preallocate((m_raw ? 0 : m_header_size) + expected_size);
+        m_preallocated = true;
+    }
+
+    if (m_raw)
+        return true;
+
+    // the sizes are patched at close, or unknown in a stream
+    make_header(m_buf, false);
+    m_buf_used = m_header_size;
+    if (m_streaming)
+        return flush();
+    return true;
+}
+
+inline bool MWaveWriter::write(const void *data, size_t size)
+{
+    if (!m_is_open || m_failed)
+        return false;
+
+    m_data_size += size;
+    if (m_streaming)
+    {
+        if (!stream_write(data, size))
+        {
+            m_failed = true;
+            return false;
+        }
+        return true;
+    }
+
+    const unsigned char *ptr = (const unsigned char *)data;
+    while (size > 0)
+    {
+        // a big block goes to the file directly if the buffer is empty
+        if (m_buf_used == 0 && size >= m_buf_size)
+        {
+            size_t len = size - size % m_buf_size;
+            if (!write_out(ptr, len))
+            {
+                m_failed = true;
+                return false;
+            }
+            ptr += len;
+            size -= len;
+            continue;
+        }
+
+        size_t len = m_buf_size - m_buf_used;
+        if (len > size)
+            len = size;
+        std::memcpy(m_buf + m_buf_used, ptr, len);
+        m_buf_used += len;
+        ptr += len;
+        size -= len;
+
+        if (m_buf_used == m_buf_size && !flush())
+            return false;
+    }
+    return true;
+}
+
+inline bool MWaveWriter::flush()
+{
+    if (m_buf_used == 0)
+        return true;
+    if (!write_out(m_buf, m_buf_used))
+    {
+        m_failed = true;
+        return false;
+    }
+    m_buf_used = 0;
+    return true;
+}
+
+inline bool MWaveWriter::close()
+{
+    if (!m_is_open)
+        return true;
+
+    bool ok = !m_failed;
+    uint64_t file_size = m_data_size;
+    if (!m_raw && !m_streaming)
+    {
+        // a pad byte after the odd-sized data
+        if (ok && (m_data_size & 1))
+        {
+            unsigned char pad = 0;
+            ok = write(&pad, 1);
+            --m_data_size;
+        }
+        ok = ok && flush();
+
+        // RF64 if the RIFF size doesn't fit in 32 bits
+        unsigned char header[MAX_HEADER_SIZE];
+        make_header(header, m_header_size - 8 + m_data_size + 1 > 0xFFFFFFFF);
+        ok = ok && write_out_at(0, header, m_header_size);
+        file_size = m_header_size + m_data_size + (m_data_size & 1);
+    }
+    else
+    {
+        ok = ok && flush();
+    }
+
+    if (ok && m_preallocated)
+        ok = sys_truncate(file_size);
+
+    ok = (m_proc || sys_close()) && ok;
+    m_proc = NULL;
+    m_write_at_proc = NULL;
+    m_is_open = false;
+    m_streaming = false;
+    m_buf_used = 0;
+    return ok;
+}
+
+inline bool MWaveWriter::write_at(uint64_t offset, const void *data, size_t size)
+{
+    if (!m_is_open || m_failed || m_streaming || !flush())
+        return false;
+    if (!write_out_at(offset, data, size))
+    {
+        m_failed = true;
+        return false;
+    }
+    return true;
+}
+
+inline void MWaveWriter::make_header(unsigned char *header, bool rf64) const
+{
+    const uint64_t riff_size = m_header_size - 8 + m_data_size + (m_data_size & 1);
+    const int block_align = get_block_align();
+    const int frames_per_block = m_frames_per_block ? m_frames_per_block : 1;
+    const uint64_t frames = get_frames();
+
+    const bool unknown = rf64 || m_streaming;
+
+    std::memcpy(&header[0], (rf64 ? "RF64" : "RIFF"), 4);
+    put32(&header[4], unknown ? 0xFFFFFFFF : uint32_t(riff_size));
+    std::memcpy(&header[8], "WAVE", 4);
+
+    // "ds64" or "JUNK" of the same size
+    std::memcpy(&header[12], (rf64 ? "ds64" : "JUNK"), 4);
+    put32(&header[16], 28);
+    std::memset(&header[20], 0, 28);
+    if (rf64)
+    {
+        put64(&header[20], riff_size);
+        put64(&header[28], m_data_size);
+        put64(&header[36], frames);
+        put32(&header[44], 0);  // no table
+    }
+
+    const bool compressed = is_compressed();
+    const bool extensible = !compressed && (m_header_size == EXTENSIBLE_HEADER_SIZE);
+    std::memcpy(&header[48], "fmt ", 4);
+    put32(&header[52], extensible ? 40 : 16);
+    put16(&header[56], extensible ? 0xFFFE : m_format_tag);
+    put16(&header[58], m_channels);
+    put32(&header[60], m_samples_per_sec);
+    put32(&header[64], uint32_t(uint64_t(m_samples_per_sec) * block_align /
+                                frames_per_block));
+    put16(&header[68], block_align);
+    put16(&header[70], m_bits_per_sample);
+
+    unsigned char *data = &header[72];
+    if (compressed)
+    {
+        // cbSize and wSamplesPerBlock if any
+        const int extra = (m_frames_per_block > 1) ? 2 : 0;
+        put32(&header[52], 18 + extra);
+        put16(&header[72], extra);
+        if (extra)
+            put16(&header[74], m_frames_per_block);
+        data = &header[74 + extra];
+
+        std::memcpy(&data[0], "fact", 4);
+        put32(&data[4], 4);
+        put32(&data[8], (unknown || frames > 0xFFFFFFFF) ? 0xFFFFFFFF
+                                                         : uint32_t(frames));
+        data += 12;
+    }
+    else if (extensible)
+    {
+        // FL FR FC LFE BL BR ... as KSAUDIO_SPEAKER_* of the channels
+        static const uint32_t s_masks[] =
+        {
+            0x4, 0x3, 0x7, 0x33, 0x37, 0x3F, 0x70F, 0x63F
+        };
+        // the GUID of KSDATAFORMAT_SUBTYPE_PCM without the first 2 bytes
+        static const unsigned char s_guid_tail[] =
+        {
+            0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00,
+            0x00, 0xAA, 0x00, 0x38, 0x9B, 0x71
+        };
+        put16(&header[72], 22);
+        put16(&header[74], m_bits_per_sample);
+        put32(&header[76], (m_channels <= 8) ? s_masks[m_channels - 1] : 0);
+        put16(&header[80], m_format_tag);
+        std::memcpy(&header[82], s_guid_tail, sizeof(s_guid_tail));
+        data = &header[96];
+    }
+
+    std::memcpy(&data[0], "data", 4);
+    put32(&data[4], unknown ? 0xFFFFFFFF : uint32_t(m_data_size));
+}
+
+// write through without buffering, as soon as the data comes
+inline bool MWaveWriter::stream_write(const void *data, size_t size)
+{
+    if (!flush())
+        return false;
+    if (m_proc)
+        return m_proc(m_context, data, size);
+    return sys_write(data, size);
+}
+
+////////////////////////////////////////////////////////////////////////////
+
+#if defined(_WIN32) && !defined(WONVER)
+    inline bool MWaveWriter::sys_open(const char *filename)
+    {
+        m_hFile = ::CreateFileA(filename, GENERIC_WRITE, FILE_SHARE_READ, NULL,
+                                CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        return m_hFile != INVALID_HANDLE_VALUE;
+    }
+
+    inline bool MWaveWriter::sys_open_stdout()
+    {
+        _setmode(_fileno(stdout), _O_BINARY);
+        m_hFile = ::GetStdHandle(STD_OUTPUT_HANDLE);
+        if (m_hFile == INVALID_HANDLE_VALUE || m_hFile == NULL)
+            return false;
+
+        // only a disk file at its beginning can be patched at close
+        LARGE_INTEGER zero, pos;
+        zero.QuadPart = 0;
+        m_streaming = !(::GetFileType(m_hFile) == FILE_TYPE_DISK &&
+                        ::SetFilePointerEx(m_hFile, zero, &pos, FILE_CURRENT) &&
+                        pos.QuadPart == 0);
+        return true;
+    }
+
+    inline void MWaveWriter::sys_setup_pipe()
+    {
+    }
+
+    inline bool MWaveWriter::sys_write(const void *data, size_t size)
+    {
+        const char *ptr = (const char *)data;
+        while (size > 0)
+        {
+            DWORD len = (size > 0x40000000) ? 0x40000000 : DWORD(size);
+            DWORD written = 0;
+            if (!::WriteFile(m_hFile, ptr, len, &written, NULL) || written == 0)
+                return false;
+            ptr += written;
+            size -= written;
+        }
+        return true;
+    }
+
+    inline bool MWaveWriter::sys_write_at(uint64_t offset, const void *data, size_t size)
+    {
+        LARGE_INTEGER pos;
+        pos.QuadPart = LONGLONG(offset);
+        if (!::SetFilePointerEx(m_hFile, pos, NULL, FILE_BEGIN))
+            return false;
+        return sys_write(data, size);
+    }
+
+    inline void MWaveWriter::sys_preallocate(uint64_t size)
+    {
+    #if _WIN32_WINNT >= 0x0600
+        FILE_ALLOCATION_INFO info;
+        info.AllocationSize.QuadPart = LONGLONG(size);
+        ::SetFileInformationByHandle(m_hFile, FileAllocationInfo, &info, sizeof(info));
+    #else
+        (void)size;
+    #endif
+    }
+
+    inline bool MWaveWriter::sys_truncate(uint64_t size)
+    {
+        LARGE_INTEGER pos;
+        pos.QuadPart = LONGLONG(size);
+        return ::SetFilePointerEx(m_hFile, pos, NULL, FILE_BEGIN) &&
+               ::SetEndOfFile(m_hFile);
+    }
+
+    inline bool MWaveWriter::sys_close()
+    {
+        BOOL ret = m_own ? ::CloseHandle(m_hFile) : TRUE;
+        m_hFile = INVALID_HANDLE_VALUE;
+        return !!ret;
+    }
+#else   // ndef _WIN32
+    inline bool MWaveWriter::sys_open(const char *filename)
+    {
+        m_fd = ::open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        return m_fd != -1;
+    }
+
+    inline bool MWaveWriter::sys_open_stdout()
+    {
+        m_fd = STDOUT_FILENO;
+
+        // only a regular file at its beginning can be patched at close
+        struct stat st;
+        if (fstat(m_fd, &st) != 0)
+            return false;
+        m_streaming = !(S_ISREG(st.st_mode) &&
+                        !(fcntl(m_fd, F_GETFL) & O_APPEND) &&
+                        lseek(m_fd, 0, SEEK_CUR) == 0);
+        return true;
+    }
+
+    // enlarge the pipe buffer
+    inline void MWaveWriter::sys_setup_pipe()
+    {
+    #if defined(__linux__) && defined(F_SETPIPE_SZ)
+        struct stat st;
+        if (fstat(m_fd, &st) != 0 || !S_ISFIFO(st.st_mode))
+            return;
+
+        static const int s_sizes[] = { 1024 * 1024, 256 * 1024, 64 * 1024 };
+        for (size_t i = 0; i < sizeof(s_sizes) / sizeof(s_sizes[0]); ++i)
+        {
+            if (fcntl(m_fd, F_SETPIPE_SZ, s_sizes[i]) != -1)
+                break;
+        }
+    #endif
+    }
+
+    inline bool MWaveWriter::sys_write(const void *data, size_t size)
+    {
+        const char *ptr = (const char *)data;
+        while (size > 0)
+        {
+            ssize_t ret = ::write(m_fd, ptr, size);
+            if (ret < 0 && errno == EINTR)
+                continue;
+            if (ret <= 0)
+                return false;
+            ptr += ret;
+            size -= size_t(ret);
+        }
+        return true;
+    }
+
+    inline bool MWaveWriter::sys_write_at(uint64_t offset, const void *data, size_t size)
+    {
+        const char *ptr = (const char *)data;
+        while (size > 0)
+        {
+            ssize_t ret = ::pwrite(m_fd, ptr, size, off_t(offset));
+            if (ret < 0 && errno == EINTR)
+                continue;
+            if (ret <= 0)
+                return false;
+            ptr += ret;
+            size -= size_t(ret);
+            offset += uint64_t(ret);
+        }
+        return true;
+    }
+
+    // reserve the blocks without changing the file size. it's only a hint.
+    inline void MWaveWriter::sys_preallocate(uint64_t size)
+    {
+    #if defined(__linux__) && defined(FALLOC_FL_KEEP_SIZE)
+        ::fallocate(m_fd, FALLOC_FL_KEEP_SIZE, 0, off_t(size));
+    #else
+        (void)size;
+    #endif
+    }
+
+    // truncating releases the reserved blocks beyond the end
+    inline bool MWaveWriter::sys_truncate(uint64_t size)
+    {
+        return ::ftruncate(m_fd, off_t(size)) == 0;
+    }
+
+    inline bool MWaveWriter::sys_close()
+    {
+        int ret = m_own ? ::close(m_fd) : 0;
+        m_fd = -1;
+        return ret == 0;
+    }
+#endif  // ndef _WIN32
+
+////////////////////////////////////////////////////////////////////////////
+
+#endif  // ndef MZC4_MWAVEWRITER_HPP_
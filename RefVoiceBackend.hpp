@@ -0,0 +1,409 @@
+// RefVoiceBackend.hpp --- the deterministic reference synthesizer
+// Copyright (C) 2018 Katayama Hirofumi MZ <katayama.hirofumi.mz@gmail.com>
+// This file is public domain software.
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef REF_VOICE_BACKEND_HPP_
+#define REF_VOICE_BACKEND_HPP_      4   // Version 4
+
+#include <cmath>        // for std::pow
+#include <cstdlib>      // for std::strtod
+#include <vector>
+#include "VoiceBackend.hpp"
+
+#if defined(_WIN32) && !defined(WONVER)
+    #ifndef _INC_WINDOWS
+        #include <windows.h>
+    #endif
+#else
+    #include <time.h>   // for clock_gettime, nanosleep
+#endif
+
+////////////////////////////////////////////////////////////////////////////
+
+// RefVoiceBackend makes the same PCM from the same text on every platform.
+// Each character becomes a short triangle tone or a silence, so the text,
+// the scheduling and the output paths can be tested and measured without
+// a real synthesizer. It has no audio device; speaking only takes time.
+//
+// The options are "latency=MS,rtf=X,chunk=MS,rate=HZ,startup=MS". latency
+// is the delay of the first chunk and rtf is the real-time factor, the
+// rendering time per audio time. Both are zero by default, i.e. as fast as
+// possible. rate is the only sample rate to render at, like a real
+// synthesizer; by default, any sample rate is rendered directly. startup is
+// the time to load the engine, spent by Configure().
+class RefVoiceBackend : public VoiceBackend
+{
+public:
+    RefVoiceBackend()
+        : m_base_hz(220), m_rate(0), m_latency(0), m_rtf(0), m_chunk(20),
+          m_native_rate(0)
+    {
+        m_source.m_stamp = "reference 1";
+        m_source.AddVoice(WIDE("Alto"), WIDE("Female"), WIDE("409"), WIDE("Adult"));
+        m_source.AddVoice(WIDE("Bass"), WIDE("Male"), WIDE("409"), WIDE("Adult"));
+        m_source.AddVoice(WIDE("Sakura"), WIDE("Female"), WIDE("411"), WIDE("Adult"));
+    }
+
+    virtual const char *GetName() const
+    {
+        return "reference";
+    }
+
+    virtual bool Configure(const std::string& options);
+
+    virtual VoiceSource *GetVoiceSource()
+    {
+        return &m_source;
+    }
+
+    virtual bool SetVoice(const VOICE_TOKEN *token)
+    {
+        static const int s_base_hz[] = { 220, 110, 262 };
+        if (!token)
+        {
+            m_base_hz = s_base_hz[0];
+            return true;
+        }
+        for (size_t i = 0; i < m_source.m_tokens.size(); ++i)
+        {
+            if (m_source.m_tokens[i].id == token->id)
+            {
+                m_base_hz = s_base_hz[i];
+                return true;
+            }
+        }
+        return false;
+    }
+
+    virtual bool SetRate(int rate)
+    {
+        if (rate < -10 || rate > 10)
+            return false;
+        m_rate = rate;
+        return true;
+    }
+
+    virtual int GetRenderRate(int samples_per_sec) const
+    {
+        return m_native_rate ? m_native_rate : samples_per_sec;
+    }
+
+    virtual bool Speak(const MStringW& text)
+    {
+        NullSink sink;
+        return Render(text, VOICE_FORMAT(), sink);
+    }
+
+    // there is no device to play in the background
+    virtual bool Enqueue(const MStringW& text)
+    {
+        return Speak(text);
+    }
+
+    virtual bool WaitUntilDone()
+    {
+        return true;
+    }
+
+    // stops between the chunks
+    virtual bool SpeakCancelable(const MStringW& text, VoiceCancel& cancel)
+    {
+        NullSink null_sink;
+        VoiceCancelSink sink(null_sink, &cancel);
+        return Render(text, VOICE_FORMAT(), sink);
+    }
+
+    virtual bool Render(const MStringW& text, const VOICE_FORMAT& format,
+                        VoiceSink& sink);
+
+protected:
+    FakeVoiceSource m_source;
+    int m_base_hz;
+    int m_rate;
+    double m_latency;   // in milliseconds
+    double m_rtf;
+    int m_chunk;        // in milliseconds
+    int m_native_rate;  // in Hz, or zero for any
+
+    class NullSink : public VoiceSink
+    {
+    public:
+        virtual bool OnAudio(const void * /*data*/, size_t /*size*/)
+        {
+            return true;
+        }
+    };
+
+    // the state of a rendering
+    struct render_type
+    {
+        const VOICE_FORMAT *format;
+        VoiceSink *sink;
+        std::vector<unsigned char> buf;
+        size_t chunk_size;
+        uint64_t frames;        // the frames in buf and before
+        uint32_t phase;
+        double start;
+    };
+
+    static bool IsSpace(WCHAR ch)
+    {
+        return ch <= 0x20 || ch == 0x3000;
+    }
+    static bool IsSentenceEnd(WCHAR ch)
+    {
+        return ch == '.' || ch == '!' || ch == '?' ||
+               ch == 0x3002 || ch == 0xFF01 || ch == 0xFF1F;
+    }
+    static bool IsPause(WCHAR ch)
+    {
+        return (ch < 0x80 && !IsSpace(ch) && !IsSentenceEnd(ch) &&
+                !(('0' <= ch && ch <= '9') || ('A' <= ch && ch <= 'Z') ||
+                  ('a' <= ch && ch <= 'z'))) ||
+               ch == 0x3001 || ch == 0xFF0C;
+    }
+    static bool IsWordChar(WCHAR ch)
+    {
+        return !IsSpace(ch) && !IsSentenceEnd(ch) && !IsPause(ch);
+    }
+
+    static double GetMsec();
+    static void SleepMsec(double msec);
+
+    void Emit(render_type& r, VOICE_EVENT_TYPE type, size_t offset,
+              size_t length, int viseme = 0, int duration = 0) const
+    {
+        VOICE_EVENT event;
+        event.type = type;
+        event.sample = r.frames;
+        event.text_offset = offset;
+        event.text_length = length;
+        event.viseme = viseme;
+        event.duration = duration;
+        r.sink->OnEvent(event);
+    }
+
+    bool Flush(render_type& r) const;
+    bool Generate(render_type& r, int msec, int hz) const;
+};
+
+////////////////////////////////////////////////////////////////////////////
+
+inline bool RefVoiceBackend::Configure(const std::string& options)
+{
+    size_t pos = 0;
+    while (pos < options.size())
+    {
+        size_t comma = options.find(',', pos);
+        if (comma == std::string::npos)
+            comma = options.size();
+        std::string item = options.substr(pos, comma - pos);
+        pos = comma + 1;
+
+        size_t equal = item.find('=');
+        if (equal == std::string::npos)
+            return false;
+        std::string key = item.substr(0, equal);
+        std::string value = item.substr(equal + 1);
+
+        char *endptr;
+        double number = std::strtod(value.c_str(), &endptr);
+        if (value.empty() || *endptr || number < 0)
+            return false;
+
+        if (key == "latency")
+            m_latency = number;
+        else if (key == "rtf")
+            m_rtf = number;
+        else if (key == "chunk" && number >= 1)
+            m_chunk = int(number);
+        else if (key == "rate" && number >= 1000 && number <= 384000)
+            m_native_rate = int(number);
+        else if (key == "startup")
+            SleepMsec(number);
+        else
+            return false;
+    }
+    return true;
+}
+
+inline double RefVoiceBackend::GetMsec()
+{
+#if defined(_WIN32) && !defined(WONVER)
+    LARGE_INTEGER freq, count;
+    ::QueryPerformanceFrequency(&freq);
+    ::QueryPerformanceCounter(&count);
+    return double(count.QuadPart) * 1000.0 / double(freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return double(ts.tv_sec) * 1000.0 + double(ts.tv_nsec) / 1000000.0;
+#endif
+}
+
+inline void RefVoiceBackend::SleepMsec(double msec)
+{
+#if defined(_WIN32) && !defined(WONVER)
+    ::Sleep(DWORD(msec + 0.5));
+#else
+    struct timespec ts;
+    ts.tv_sec = time_t(msec / 1000);
+    ts.tv_nsec = long((msec - ts.tv_sec * 1000.0) * 1000000.0);
+    while (nanosleep(&ts, &ts) != 0)
+        ;
+#endif
+}
+
+// pass the buffered audio to the sink on time
+inline bool RefVoiceBackend::Flush(render_type& r) const
+{
+    if (r.buf.empty())
+        return true;
+
+    if (m_latency > 0 || m_rtf > 0)
+    {
+        double audio = double(r.frames) * 1000.0 / r.format->samples_per_sec;
+        double wait = r.start + m_latency + m_rtf * audio - GetMsec();
+        if (wait > 0)
+            SleepMsec(wait);
+    }
+
+    bool ok = r.sink->OnAudio(&r.buf[0], r.buf.size());
+    r.buf.clear();
+    return ok;
+}
+
+// append a tone of hz, or a silence if hz is zero
+inline bool RefVoiceBackend::Generate(render_type& r, int msec, int hz) const
+{
+    const int rate = r.format->samples_per_sec;
+    const int bits = r.format->bits_per_sample;
+    const uint32_t step = uint32_t(double(hz) * 4294967296.0 / rate);
+    const uint32_t count = uint32_t(uint64_t(msec) * rate / 1000);
+    const uint32_t fade = rate / 200 + 1;   // 5 ms
+
+    if (hz == 0)
+        r.phase = 0;
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        int value = 0;
+        if (hz)
+        {
+            // a triangle wave of the amplitude 8192
+            int saw = int(r.phase >> 17);   // 0 to 32767
+            value = (saw < 16384 ? saw : 32767 - saw) - 8192;
+            r.phase += step;
+
+            uint32_t edge = (i < count - 1 - i) ? i : count - 1 - i;
+            if (edge < fade)
+                value = int(int64_t(value) * edge / fade);
+        }
+
+        for (int ch = 0; ch < r.format->channels; ++ch)
+        {
+            if (bits == 8)
+            {
+                r.buf.push_back((unsigned char)((value >> 8) + 128));
+            }
+            else
+            {
+                r.buf.push_back((unsigned char)value);
+                r.buf.push_back((unsigned char)(value >> 8));
+            }
+        }
+        ++r.frames;
+
+        if (r.buf.size() >= r.chunk_size && !Flush(r))
+            return false;
+    }
+    return true;
+}
+
+inline bool
+RefVoiceBackend::Render(const MStringW& text, const VOICE_FORMAT& format,
+                        VoiceSink& sink)
+{
+    if ((format.bits_per_sample != 8 && format.bits_per_sample != 16) ||
+        format.channels < 1 || format.samples_per_sec < 1000)
+    {
+        return false;
+    }
+
+    render_type r;
+    r.format = &format;
+    r.sink = &sink;
+    r.chunk_size = size_t(format.samples_per_sec) * m_chunk / 1000 * format.BlockAlign();
+    if (r.chunk_size == 0)
+        r.chunk_size = format.BlockAlign();
+    r.buf.reserve(r.chunk_size);
+    r.frames = 0;
+    r.phase = 0;
+    r.start = GetMsec();
+
+    // the rate 10 is three times as fast as the rate 0
+    const double scale = std::pow(3.0, -m_rate / 10.0);
+    const int letter_ms = int(90 * scale), space_ms = int(60 * scale);
+    const int pause_ms = int(120 * scale), period_ms = int(250 * scale);
+
+    bool in_sentence = false, in_word = false;
+    for (size_t i = 0; i < text.size(); ++i)
+    {
+        const WCHAR ch = text[i];
+
+        if (!in_sentence && !IsSpace(ch))
+        {
+            size_t k = i;
+            while (k < text.size() && !IsSentenceEnd(text[k]))
+                ++k;
+            while (k < text.size() && IsSentenceEnd(text[k]))
+                ++k;
+            Emit(r, VOICE_EVENT_SENTENCE, i, k - i);
+            in_sentence = true;
+        }
+
+        bool word_char = IsWordChar(ch);
+        if (word_char && !in_word)
+        {
+            size_t k = i;
+            while (k < text.size() && IsWordChar(text[k]))
+                ++k;
+            Emit(r, VOICE_EVENT_WORD, i, k - i);
+        }
+        in_word = word_char;
+
+        int msec, hz = 0, viseme = 0;
+        if (word_char)
+        {
+            // a semitone-like step from the base pitch per letter
+            msec = letter_ms;
+            hz = m_base_hz + int(ch % 12) * m_base_hz / 12;
+            viseme = 1 + int(ch % 21);
+        }
+        else if (IsSentenceEnd(ch))
+        {
+            msec = period_ms;
+            if (i + 1 == text.size() || !IsSentenceEnd(text[i + 1]))
+                in_sentence = false;
+        }
+        else if (IsPause(ch))
+        {
+            msec = pause_ms;
+        }
+        else
+        {
+            msec = space_ms;
+        }
+
+        Emit(r, VOICE_EVENT_VISEME, i, 1, viseme, msec);
+        if (!Generate(r, msec, hz))
+            return false;
+    }
+
+    return Flush(r);
+}
+
+////////////////////////////////////////////////////////////////////////////
+
+#endif  // ndef REF_VOICE_BACKEND_HPP_
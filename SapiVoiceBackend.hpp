@@ -0,0 +1,511 @@
+// SapiVoiceBackend.hpp --- the speech synthesizer of SAPI
+// Copyright (C) 2018 Katayama Hirofumi MZ <katayama.hirofumi.mz@gmail.com>
+// This file is public domain software.
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef SAPI_VOICE_BACKEND_HPP_
+#define SAPI_VOICE_BACKEND_HPP_     2   // Version 2
+
+#include <map>
+#include "WinVoice.hpp"
+#include "VoiceBackend.hpp"
+#include <sphelper.h>   // This may needs ATL.
+
+////////////////////////////////////////////////////////////////////////////
+
+// TODO: Please call CoInitialize[Ex] before usage.
+
+inline std::wstring
+SapiGetRegPathFromId(HKEY& hKeyBase, const WCHAR *pszID)
+{
+    static const WCHAR *pszHKLM = L"HKEY_LOCAL_MACHINE\\";
+    static const WCHAR *pszHKCU = L"HKEY_CURRENT_USER\\";
+    std::wstring key_path;
+    hKeyBase = NULL;
+    if (memcmp(pszID, pszHKLM, lstrlenW(pszHKLM)) == 0)
+    {
+        hKeyBase = HKEY_LOCAL_MACHINE;
+        key_path = &pszID[lstrlenW(pszHKLM)];
+    }
+    else if (memcmp(pszID, pszHKLM, lstrlenW(pszHKCU)) == 0)
+    {
+        hKeyBase = HKEY_CURRENT_USER;
+        key_path = &pszID[lstrlenW(pszHKCU)];
+    }
+    key_path += L"\\Attributes";
+    return key_path;
+}
+
+inline VOICE_TOKEN
+SapiGetVoiceTokenInfo(LPCWSTR pszID, HKEY hSubKey)
+{
+    WCHAR szAge[MAX_PATH] = {};
+    WCHAR szGender[MAX_PATH] = {};
+    WCHAR szLanguage[MAX_PATH] = {};
+    WCHAR szName[MAX_PATH] = {};
+    DWORD cbValue;
+
+    cbValue = sizeof(szAge);
+    RegQueryValueExW(hSubKey, L"Age", NULL, NULL, LPBYTE(szAge), &cbValue);
+    cbValue = sizeof(szGender);
+    RegQueryValueExW(hSubKey, L"Gender", NULL, NULL, LPBYTE(szGender), &cbValue);
+    cbValue = sizeof(szLanguage);
+    RegQueryValueExW(hSubKey, L"Language", NULL, NULL, LPBYTE(szLanguage), &cbValue);
+    cbValue = sizeof(szName);
+    RegQueryValueExW(hSubKey, L"Name", NULL, NULL, LPBYTE(szName), &cbValue);
+
+    std::wstring name = szName;
+
+    static const WCHAR szMicrosoftSp[] = L"Microsoft ";
+    size_t cchMicrosoftSp = wcslen(szMicrosoftSp);
+    if (name.size() > cchMicrosoftSp &&
+        name.substr(0, cchMicrosoftSp) == szMicrosoftSp)
+    {
+        name.erase(0, cchMicrosoftSp);
+    }
+
+    static const WCHAR szSpDesktop[] = L" Desktop";
+    size_t cchSpDesktop = wcslen(szSpDesktop);
+    if (name.size() > cchSpDesktop &&
+        name.substr(name.size() - cchSpDesktop, cchSpDesktop) == szSpDesktop)
+    {
+        name = name.substr(0, name.size() - cchSpDesktop);
+    }
+
+    VOICE_TOKEN token =
+    {
+        pszID,
+        name,
+        szName,
+        szAge,
+        szGender,
+        szLanguage
+    };
+    return token;
+}
+
+inline bool
+SapiGetVoices(const WCHAR *pszRequest, std::vector<VOICE_TOKEN>& tokens)
+{
+    // get voice category
+    ISpObjectTokenCategory *pCategory = NULL;
+    HRESULT hr = SpGetCategoryFromId(SPCAT_VOICES, &pCategory);
+    if (SUCCEEDED(hr) && pCategory)
+    {
+        // get object tokens
+        IEnumSpObjectTokens *pTokens = NULL;
+        hr = pCategory->EnumTokens(pszRequest, NULL, &pTokens);
+        if (SUCCEEDED(hr) && pTokens)
+        {
+            // for each token
+            for (;;)
+            {
+                // get token
+                ISpObjectToken *pToken = NULL;
+                hr = pTokens->Next(1, &pToken, NULL);
+                if (FAILED(hr) || !pToken)
+                    break;
+
+                // get token id
+                LPWSTR pszID = NULL;
+                pToken->GetId(&pszID);
+                if (pszID)
+                {
+                    // read voice info from registry
+                    HKEY hKeyBase = NULL;
+                    std::wstring key_path = SapiGetRegPathFromId(hKeyBase, pszID);
+                    if (hKeyBase)
+                    {
+                        HKEY hSubKey = NULL;
+                        RegOpenKeyExW(hKeyBase, key_path.c_str(), 0, KEY_READ, &hSubKey);
+                        if (hSubKey)
+                        {
+                            VOICE_TOKEN token = SapiGetVoiceTokenInfo(pszID, hSubKey);
+                            tokens.push_back(token);
+
+                            RegCloseKey(hSubKey);
+                        }
+                    }
+                    CoTaskMemFree(pszID);
+                    pszID = NULL;
+                }
+                pToken->Release();
+                pToken = NULL;
+            }
+            pTokens->Release();
+            pTokens = NULL;
+        }
+        pCategory->Release();
+        pCategory = NULL;
+    }
+
+    return !tokens.empty();
+}
+
+////////////////////////////////////////////////////////////////////////////
+
+// the voices of SAPI
+class SapiVoiceSource : public VoiceSource
+{
+public:
+    // adding or removing a voice updates the last write time and the
+    // number of the subkeys of the token keys
+    virtual bool GetStamp(std::string& stamp)
+    {
+        static const WCHAR s_szTokens[] = L"SOFTWARE\\Microsoft\\Speech\\Voices\\Tokens";
+        HKEY ahKeys[] = { HKEY_LOCAL_MACHINE, HKEY_CURRENT_USER };
+
+        stamp.clear();
+        for (size_t i = 0; i < ARRAYSIZE(ahKeys); ++i)
+        {
+            HKEY hKey = NULL;
+            DWORD cSubKeys = 0;
+            FILETIME ft = { 0, 0 };
+            if (RegOpenKeyExW(ahKeys[i], s_szTokens, 0, KEY_READ, &hKey) == ERROR_SUCCESS)
+            {
+                RegQueryInfoKeyW(hKey, NULL, NULL, NULL, &cSubKeys, NULL, NULL,
+                                 NULL, NULL, NULL, NULL, &ft);
+                RegCloseKey(hKey);
+            }
+
+            char buf[64];
+            sprintf(buf, "%lu:%08lX%08lX;", (unsigned long)cSubKeys,
+                    (unsigned long)ft.dwHighDateTime, (unsigned long)ft.dwLowDateTime);
+            stamp += buf;
+        }
+        return true;
+    }
+
+    virtual bool Enumerate(std::vector<VOICE_TOKEN>& tokens)
+    {
+        return SapiGetVoices(NULL, tokens);
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////
+
+// an IStream that passes the written PCM to a VoiceSink
+class SapiSinkStream : public IStream
+{
+public:
+    SapiSinkStream(VoiceSink& sink) : m_cRefs(1), m_sink(sink), m_pos(0)
+    {
+    }
+
+    // IUnknown
+    STDMETHODIMP QueryInterface(REFIID riid, void **ppvObject)
+    {
+        if (riid == IID_IUnknown || riid == IID_ISequentialStream ||
+            riid == IID_IStream)
+        {
+            *ppvObject = static_cast<IStream *>(this);
+            AddRef();
+            return S_OK;
+        }
+        *ppvObject = NULL;
+        return E_NOINTERFACE;
+    }
+    STDMETHODIMP_(ULONG) AddRef()
+    {
+        return ++m_cRefs;
+    }
+    STDMETHODIMP_(ULONG) Release()
+    {
+        ULONG cRefs = --m_cRefs;
+        if (cRefs == 0)
+            delete this;
+        return cRefs;
+    }
+
+    // ISequentialStream
+    STDMETHODIMP Read(void *, ULONG, ULONG *)
+    {
+        return E_NOTIMPL;
+    }
+    STDMETHODIMP Write(const void *pv, ULONG cb, ULONG *pcbWritten)
+    {
+        if (pcbWritten)
+            *pcbWritten = 0;
+        if (!m_sink.OnAudio(pv, cb))
+            return STG_E_WRITEFAULT;
+        m_pos += cb;
+        if (pcbWritten)
+            *pcbWritten = cb;
+        return S_OK;
+    }
+
+    // IStream. only the current position can be sought.
+    STDMETHODIMP Seek(LARGE_INTEGER dlibMove, DWORD dwOrigin,
+                      ULARGE_INTEGER *plibNewPosition)
+    {
+        if (!((dwOrigin == STREAM_SEEK_CUR && dlibMove.QuadPart == 0) ||
+              (dwOrigin == STREAM_SEEK_SET && ULONGLONG(dlibMove.QuadPart) == m_pos)))
+        {
+            return STG_E_INVALIDFUNCTION;
+        }
+        if (plibNewPosition)
+            plibNewPosition->QuadPart = m_pos;
+        return S_OK;
+    }
+    STDMETHODIMP SetSize(ULARGE_INTEGER)
+    {
+        return E_NOTIMPL;
+    }
+    STDMETHODIMP CopyTo(IStream *, ULARGE_INTEGER, ULARGE_INTEGER *, ULARGE_INTEGER *)
+    {
+        return E_NOTIMPL;
+    }
+    STDMETHODIMP Commit(DWORD)
+    {
+        return S_OK;
+    }
+    STDMETHODIMP Revert()
+    {
+        return E_NOTIMPL;
+    }
+    STDMETHODIMP LockRegion(ULARGE_INTEGER, ULARGE_INTEGER, DWORD)
+    {
+        return STG_E_INVALIDFUNCTION;
+    }
+    STDMETHODIMP UnlockRegion(ULARGE_INTEGER, ULARGE_INTEGER, DWORD)
+    {
+        return STG_E_INVALIDFUNCTION;
+    }
+    STDMETHODIMP Stat(STATSTG *pstatstg, DWORD)
+    {
+        ZeroMemory(pstatstg, sizeof(*pstatstg));
+        pstatstg->type = STGTY_STREAM;
+        pstatstg->cbSize.QuadPart = m_pos;
+        return S_OK;
+    }
+    STDMETHODIMP Clone(IStream **ppstm)
+    {
+        *ppstm = NULL;
+        return E_NOTIMPL;
+    }
+
+protected:
+    ULONG m_cRefs;
+    VoiceSink& m_sink;
+    ULONGLONG m_pos;
+
+    virtual ~SapiSinkStream()
+    {
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////
+
+// the SAPI synthesizer. the voice object is created at the first use.
+class SapiVoiceBackend : public VoiceBackend
+{
+public:
+    SapiVoiceBackend() : m_pVoice(NULL)
+    {
+    }
+
+    virtual ~SapiVoiceBackend()
+    {
+        std::map<MStringW, ISpObjectToken *>::iterator it;
+        for (it = m_tokens.begin(); it != m_tokens.end(); ++it)
+        {
+            if (it->second)
+                it->second->Release();
+        }
+        delete m_pVoice;
+    }
+
+    virtual const char *GetName() const
+    {
+        return "sapi";
+    }
+
+    virtual VoiceSource *GetVoiceSource()
+    {
+        return &m_source;
+    }
+
+    virtual bool SetVoice(const VOICE_TOKEN *token)
+    {
+        ISpObjectToken *pToken = NULL;
+        if (token)
+        {
+            pToken = GetToken(token->id);
+            if (!pToken)
+                return false;
+        }
+        return SUCCEEDED(Voice().SetVoice(pToken));
+    }
+
+    virtual bool SetRate(int rate)
+    {
+        return SUCCEEDED(Voice().SetRate(rate));
+    }
+
+    // SAPI converts into its standard rates only, with a simple converter.
+    // the other rates are converted from the next higher standard rate.
+    virtual int GetRenderRate(int samples_per_sec) const
+    {
+        static const int s_rates[] =
+        {
+            8000, 11025, 12000, 16000, 22050, 24000, 32000, 44100, 48000
+        };
+        for (size_t i = 0; i < ARRAYSIZE(s_rates); ++i)
+        {
+            if (s_rates[i] >= samples_per_sec)
+                return s_rates[i];
+        }
+        return 48000;
+    }
+
+    virtual bool Speak(const MStringW& text)
+    {
+        return SUCCEEDED(Voice().Speak(text, false));
+    }
+
+    virtual bool Enqueue(const MStringW& text)
+    {
+        return SUCCEEDED(Voice().Enqueue(text));
+    }
+
+    virtual bool WaitUntilDone()
+    {
+        return SUCCEEDED(Voice().WaitUntilDone(INFINITE));
+    }
+
+    // speak in the background and purge the speech when cancelled
+    virtual bool SpeakCancelable(const MStringW& text, VoiceCancel& cancel)
+    {
+        if (cancel.IsCancelled() || FAILED(Voice().Speak(text, true)))
+            return false;
+        for (;;)
+        {
+            HRESULT hr = Voice().WaitUntilDone(20);
+            if (hr != S_FALSE)
+                return SUCCEEDED(hr);
+            if (cancel.IsCancelled())
+            {
+                Voice().Speak(MStringW(), false);
+                return false;
+            }
+        }
+    }
+
+    virtual bool Render(const MStringW& text, const VOICE_FORMAT& format,
+                        VoiceSink& sink);
+
+protected:
+    WinVoice *m_pVoice;
+    SapiVoiceSource m_source;
+    std::map<MStringW, ISpObjectToken *> m_tokens;  // by token id
+
+    WinVoice& Voice()
+    {
+        if (!m_pVoice)
+            m_pVoice = new WinVoice;
+        return *m_pVoice;
+    }
+
+    ISpObjectToken *GetToken(const MStringW& id)
+    {
+        std::map<MStringW, ISpObjectToken *>::iterator it = m_tokens.find(id);
+        if (it != m_tokens.end())
+            return it->second;
+
+        ISpObjectToken *pToken = NULL;
+        ::CoCreateInstance(CLSID_SpObjectToken, NULL, CLSCTX_ALL,
+                           IID_ISpObjectToken, (void **)&pToken);
+        if (pToken && FAILED(pToken->SetId(NULL, id.c_str(), FALSE)))
+        {
+            pToken->Release();
+            pToken = NULL;
+        }
+        m_tokens[id] = pToken;
+        return pToken;
+    }
+};
+
+// speak into the sink, then pass the events of the speech
+inline bool
+SapiVoiceBackend::Render(const MStringW& text, const VOICE_FORMAT& format,
+                         VoiceSink& sink)
+{
+    ISpVoice *pSpVoice = Voice().SpVoice();
+    if (!pSpVoice)
+        return false;
+
+    ISpStream *pStream = NULL;
+    ::CoCreateInstance(CLSID_SpStream, NULL, CLSCTX_ALL,
+                       IID_ISpStream, (void **)&pStream);
+    if (!pStream)
+        return false;
+
+    WAVEFORMATEX fmt;
+    fmt.wFormatTag = WAVE_FORMAT_PCM;
+    fmt.nChannels = WORD(format.channels);
+    fmt.wBitsPerSample = WORD(format.bits_per_sample);
+    fmt.nSamplesPerSec = format.samples_per_sec;
+    fmt.nBlockAlign = WORD(format.BlockAlign());
+    fmt.nAvgBytesPerSec = fmt.nSamplesPerSec * fmt.nBlockAlign;
+    fmt.cbSize = 0;
+
+    GUID GUID_SPDFID_WaveFormatEx;
+    IIDFromString(L"{C31ADBAE-527F-4ff5-A230-F62BB61FF70C}", &GUID_SPDFID_WaveFormatEx);
+
+    SapiSinkStream *pSinkStream = new SapiSinkStream(sink);
+    HRESULT hr = pStream->SetBaseStream(pSinkStream, GUID_SPDFID_WaveFormatEx, &fmt);
+    pSinkStream->Release();
+
+    const ULONGLONG interest = SPFEI(SPEI_WORD_BOUNDARY) |
+                               SPFEI(SPEI_SENTENCE_BOUNDARY) | SPFEI(SPEI_VISEME);
+    if (SUCCEEDED(hr))
+        hr = pSpVoice->SetInterest(interest, interest);
+    if (SUCCEEDED(hr))
+        hr = pSpVoice->SetOutput(pStream, TRUE);
+    if (SUCCEEDED(hr))
+        hr = Voice().Speak(text, false);
+
+    // the offsets of the events are in bytes
+    SPEVENT event;
+    ULONG cFetched;
+    while (pSpVoice->GetEvents(1, &event, &cFetched) == S_OK && cFetched == 1)
+    {
+        VOICE_EVENT ev;
+        ev.sample = event.ullAudioStreamOffset / fmt.nBlockAlign;
+        ev.text_offset = size_t(event.lParam);
+        ev.text_length = size_t(event.wParam);
+        ev.viseme = 0;
+        ev.duration = 0;
+        switch (event.eEventId)
+        {
+        case SPEI_WORD_BOUNDARY:
+            ev.type = VOICE_EVENT_WORD;
+            break;
+        case SPEI_SENTENCE_BOUNDARY:
+            ev.type = VOICE_EVENT_SENTENCE;
+            break;
+        case SPEI_VISEME:
+            ev.type = VOICE_EVENT_VISEME;
+            ev.text_offset = ev.text_length = 0;
+            ev.viseme = LOWORD(event.lParam);
+            ev.duration = HIWORD(event.wParam);
+            break;
+        default:
+            SpClearEvent(&event);
+            continue;
+        }
+        SpClearEvent(&event);
+        if (SUCCEEDED(hr))
+            sink.OnEvent(ev);
+    }
+
+    pSpVoice->SetInterest(0, 0);
+    pSpVoice->SetOutput(NULL, TRUE);
+    pStream->Close();
+    pStream->Release();
+    return SUCCEEDED(hr);
+}
+
+////////////////////////////////////////////////////////////////////////////
+
+#endif  // ndef SAPI_VOICE_BACKEND_HPP_
@@ -0,0 +1,660 @@
+// VoiceBackend.hpp --- the interface of the speech synthesizers
+// Copyright (C) 2018 Katayama Hirofumi MZ <katayama.hirofumi.mz@gmail.com>
+// This file is public domain software.
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef VOICE_BACKEND_HPP_
+#define VOICE_BACKEND_HPP_      11  // Version 11
+
+#include <cstring>      // for strcmp, memcpy
+#include <string>
+#include <vector>
+#include "MString.hpp"
+#include "MWaveWriter.hpp"
+#include "MFlacWriter.hpp"
+#include "MImaAdpcm.hpp"
+#include "MResampler.hpp"
+#include "MSampleConverter.hpp"
+#include "VoiceCatalog.hpp"
+
+////////////////////////////////////////////////////////////////////////////
+
+// the PCM format of the rendered audio
+struct VOICE_FORMAT
+{
+    int samples_per_sec;
+    int channels;
+    int bits_per_sample;
+    int format_tag;         // MWaveWriter::TAG_*
+
+    VOICE_FORMAT() : samples_per_sec(44100), channels(2), bits_per_sample(16),
+                     format_tag(MWaveWriter::TAG_PCM)
+    {
+    }
+
+    VOICE_FORMAT(int rate, int ch, int bits, int tag = MWaveWriter::TAG_PCM)
+        : samples_per_sec(rate), channels(ch), bits_per_sample(bits),
+          format_tag(tag)
+    {
+    }
+
+    // the bytes of a sample frame
+    int BlockAlign() const
+    {
+        return channels * bits_per_sample / 8;
+    }
+};
+
+enum VOICE_EVENT_TYPE
+{
+    VOICE_EVENT_SENTENCE,
+    VOICE_EVENT_WORD,
+    VOICE_EVENT_VISEME
+};
+
+// an event of the rendering, such as a word boundary
+struct VOICE_EVENT
+{
+    VOICE_EVENT_TYPE type;
+    uint64_t sample;        // the offset in the audio, in sample frames
+    size_t text_offset;     // the position in the text, in WCHARs
+    size_t text_length;
+    int viseme;             // the SAPI viseme for VOICE_EVENT_VISEME
+    int duration;           // in milliseconds for VOICE_EVENT_VISEME
+};
+
+// VoiceSink receives the audio and the events of a rendering
+class VoiceSink
+{
+public:
+    virtual ~VoiceSink()
+    {
+    }
+
+    // a block of PCM data. return false to stop the rendering.
+    virtual bool OnAudio(const void *data, size_t size) = 0;
+
+    virtual void OnEvent(const VOICE_EVENT& /*event*/)
+    {
+    }
+};
+
+// VoiceCancel tells a rendering or a speech to stop, such as by another
+// thread. once IsCancelled() returns true, it must keep returning true.
+class VoiceCancel
+{
+public:
+    virtual ~VoiceCancel()
+    {
+    }
+
+    virtual bool IsCancelled() = 0;
+};
+
+////////////////////////////////////////////////////////////////////////////
+
+// VoiceBackend is a speech synthesizer, such as SAPI
+class VoiceBackend
+{
+public:
+    virtual ~VoiceBackend()
+    {
+    }
+
+    virtual const char *GetName() const = 0;
+
+    // the options of "--backend=name:options". no option by default.
+    virtual bool Configure(const std::string& options)
+    {
+        return options.empty();
+    }
+
+    // the voices of this backend
+    virtual VoiceSource *GetVoiceSource() = 0;
+
+    // NULL for the default voice
+    virtual bool SetVoice(const VOICE_TOKEN *token) = 0;
+
+    // -10 (slowest) to 10 (fastest)
+    virtual bool SetRate(int rate) = 0;
+
+    // the sample rate to render at for the output of samples_per_sec.
+    // the caller converts the rate if it differs.
+    virtual int GetRenderRate(int samples_per_sec) const
+    {
+        return samples_per_sec;
+    }
+
+    // speak aloud and wait
+    virtual bool Speak(const MStringW& text) = 0;
+
+    // speak aloud after the queued text, without waiting
+    virtual bool Enqueue(const MStringW& text) = 0;
+    virtual bool WaitUntilDone() = 0;
+
+    // speak aloud and wait, but stop as soon as cancelled. false if
+    // cancelled. by default, it's only asked before speaking
+    virtual bool SpeakCancelable(const MStringW& text, VoiceCancel& cancel)
+    {
+        return !cancel.IsCancelled() && Speak(text);
+    }
+
+    // synthesize PCM into the sink
+    virtual bool Render(const MStringW& text, const VOICE_FORMAT& format,
+                        VoiceSink& sink) = 0;
+
+};
+
+////////////////////////////////////////////////////////////////////////////
+
+// keeps the audio and the events of a rendering in memory
+class VoiceBufferSink : public VoiceSink
+{
+public:
+    virtual bool OnAudio(const void *data, size_t size)
+    {
+        const unsigned char *ptr = (const unsigned char *)data;
+        m_audio.insert(m_audio.end(), ptr, ptr + size);
+        return true;
+    }
+
+    virtual void OnEvent(const VOICE_EVENT& event)
+    {
+        m_events.push_back(event);
+    }
+
+    std::vector<unsigned char>& Audio()
+    {
+        return m_audio;
+    }
+    std::vector<VOICE_EVENT>& Events()
+    {
+        return m_events;
+    }
+
+protected:
+    std::vector<unsigned char> m_audio;
+    std::vector<VOICE_EVENT> m_events;
+};
+
+// stops the rendering into another sink when cancelled. no cancel is
+// never cancelled
+class VoiceCancelSink : public VoiceSink
+{
+public:
+    VoiceCancelSink(VoiceSink& sink, VoiceCancel *cancel = NULL)
+        : m_sink(sink), m_cancel(cancel)
+    {
+    }
+
+    void SetCancel(VoiceCancel *cancel)
+    {
+        m_cancel = cancel;
+    }
+
+    virtual bool OnAudio(const void *data, size_t size)
+    {
+        if (m_cancel && m_cancel->IsCancelled())
+            return false;
+        return m_sink.OnAudio(data, size);
+    }
+
+    virtual void OnEvent(const VOICE_EVENT& event)
+    {
+        m_sink.OnEvent(event);
+    }
+
+protected:
+    VoiceSink& m_sink;
+    VoiceCancel *m_cancel;
+};
+
+// converts the sample rate of 16-bit PCM for another sink
+class VoiceResampleSink : public VoiceSink
+{
+public:
+    VoiceResampleSink(VoiceSink& sink) : m_sink(sink)
+    {
+    }
+
+    bool Init(int in_rate, int out_rate, int channels, int quality)
+    {
+        m_partial.clear();
+        return m_resampler.init(in_rate, out_rate, channels, quality);
+    }
+
+    virtual bool OnAudio(const void *data, size_t size)
+    {
+        // keep a partial frame for the next time
+        const size_t frame_size = m_resampler.channels() * sizeof(int16_t);
+        const unsigned char *ptr = (const unsigned char *)data;
+        m_partial.insert(m_partial.end(), ptr, ptr + size);
+        size_t frames = m_partial.size() / frame_size;
+        if (frames == 0)
+            return true;
+
+        m_input.resize(frames * m_resampler.channels());
+        memcpy(&m_input[0], &m_partial[0], frames * frame_size);
+        m_partial.erase(m_partial.begin(), m_partial.begin() + frames * frame_size);
+
+        m_output.clear();
+        m_resampler.process(&m_input[0], frames, m_output);
+        return Send();
+    }
+
+    virtual void OnEvent(const VOICE_EVENT& event)
+    {
+        VOICE_EVENT converted = event;
+        converted.sample = m_resampler.output_frame(event.sample);
+        m_sink.OnEvent(converted);
+    }
+
+    // pass the rest of the output at the end
+    bool Finish()
+    {
+        m_output.clear();
+        m_resampler.flush(m_output);
+        return Send();
+    }
+
+protected:
+    VoiceSink& m_sink;
+    MResampler m_resampler;
+    std::vector<unsigned char> m_partial;
+    std::vector<int16_t> m_input;
+    std::vector<int16_t> m_output;
+
+    bool Send()
+    {
+        if (m_output.empty())
+            return true;
+        return m_sink.OnAudio(&m_output[0], m_output.size() * sizeof(int16_t));
+    }
+};
+
+// converts the 16-bit PCM into another sample format and channel layout,
+// and passes it to the next sink
+class VoiceConvertSink : public VoiceSink
+{
+public:
+    VoiceConvertSink(VoiceSink& sink) : m_sink(sink), m_in_channels(0)
+    {
+    }
+
+    // matrix is out_channels rows of in_channels, or empty for the default
+    bool Init(int in_channels, int out_channels, const MSampleFormat& format,
+              const std::vector<float>& matrix = std::vector<float>())
+    {
+        m_partial.clear();
+        m_in_channels = in_channels;
+        return m_converter.init(in_channels, out_channels, format, matrix);
+    }
+
+    virtual bool OnAudio(const void *data, size_t size)
+    {
+        if (m_converter.is_identity())
+            return m_sink.OnAudio(data, size);
+
+        // keep a partial frame for the next time
+        const size_t frame_size = m_in_channels * sizeof(int16_t);
+        const unsigned char *ptr = (const unsigned char *)data;
+        size_t frames;
+        if (m_partial.empty() && size % frame_size == 0 &&
+            size_t(ptr) % sizeof(int16_t) == 0)
+        {
+            frames = size / frame_size;
+        }
+        else
+        {
+            m_partial.insert(m_partial.end(), ptr, ptr + size);
+            frames = m_partial.size() / frame_size;
+            m_input.resize(frames * m_in_channels);
+            if (frames)
+                memcpy(&m_input[0], &m_partial[0], frames * frame_size);
+            m_partial.erase(m_partial.begin(), m_partial.begin() + frames * frame_size);
+            ptr = (const unsigned char *)(m_input.empty() ? NULL : &m_input[0]);
+        }
+        if (frames == 0)
+            return true;
+
+        m_output.resize(m_converter.output_size(frames));
+        m_converter.convert((const int16_t *)ptr, frames, &m_output[0]);
+        return m_sink.OnAudio(&m_output[0], m_output.size());
+    }
+
+    virtual void OnEvent(const VOICE_EVENT& event)
+    {
+        m_sink.OnEvent(event);
+    }
+
+protected:
+    VoiceSink& m_sink;
+    MSampleConverter m_converter;
+    int m_in_channels;
+    std::vector<unsigned char> m_partial;
+    std::vector<int16_t> m_input;
+    std::vector<unsigned char> m_output;
+};
+
+// joins the pieces of the audio in the output format, such as the new
+// renderings and the ranges of the previous output. the piece after Join()
+// overlaps the last fade frames with a linear crossfade, so the last fade
+// frames are held back until the next piece or Finish().
+class VoiceSpliceSink : public VoiceSink
+{
+public:
+    VoiceSpliceSink(VoiceSink& sink)
+        : m_sink(sink), m_frame_size(0), m_fade_frames(0), m_joining(false),
+          m_position(0)
+    {
+    }
+
+    // no fade frames for passing the audio through
+    bool Init(const MSampleFormat& format, int channels, size_t fade_frames)
+    {
+        m_format = format;
+        m_frame_size = channels * format.bits() / 8;
+        m_fade_frames = fade_frames;
+        m_held.clear();
+        m_head.clear();
+        m_joining = false;
+        m_position = 0;
+        return m_converter.init(channels, channels, format);
+    }
+
+    // the next piece crossfades with the end of the last one. returns the
+    // frame where the next piece begins.
+    uint64_t Join()
+    {
+        if (m_joining)
+            Crossfade();
+        m_joining = !m_held.empty();
+        return m_position - m_held.size() / m_frame_size;
+    }
+
+    // the frames of the output so far
+    uint64_t Position() const
+    {
+        if (!m_joining)
+            return m_position;
+        size_t overlap = (m_head.size() < m_held.size()) ? m_head.size() : m_held.size();
+        return m_position + (m_head.size() - overlap) / m_frame_size;
+    }
+
+    virtual bool OnAudio(const void *data, size_t size)
+    {
+        if (m_fade_frames == 0)
+            return m_sink.OnAudio(data, size);
+
+        const unsigned char *ptr = (const unsigned char *)data;
+        if (!m_joining)
+            return Pass(ptr, size);
+
+        m_head.insert(m_head.end(), ptr, ptr + size);
+        if (m_head.size() < m_held.size())
+            return true;
+        return Crossfade();
+    }
+
+    virtual void OnEvent(const VOICE_EVENT& event)
+    {
+        m_sink.OnEvent(event);
+    }
+
+    // pass the held frames at the end
+    bool Finish()
+    {
+        bool ok = !m_joining || Crossfade();
+        if (ok && m_held.size())
+            ok = m_sink.OnAudio(&m_held[0], m_held.size());
+        m_held.clear();
+        return ok;
+    }
+
+protected:
+    VoiceSink& m_sink;
+    MSampleFormat m_format;
+    MSampleConverter m_converter;
+    size_t m_frame_size;
+    size_t m_fade_frames;
+    bool m_joining;
+    uint64_t m_position;                // the frames passed or held
+    std::vector<unsigned char> m_held;  // the last frames
+    std::vector<unsigned char> m_head;  // the first frames of the next piece
+    std::vector<float> m_tail_samples;
+    std::vector<float> m_head_samples;
+
+    // pass all but the last fade frames
+    bool Pass(const unsigned char *ptr, size_t size)
+    {
+        const size_t keep = m_fade_frames * m_frame_size;
+        m_position += size / m_frame_size;
+        if (m_held.size() + size <= keep)
+        {
+            m_held.insert(m_held.end(), ptr, ptr + size);
+            return true;
+        }
+
+        const size_t out = m_held.size() + size - keep;
+        bool ok = true;
+        if (out <= m_held.size())
+        {
+            ok = m_sink.OnAudio(&m_held[0], out);
+            m_held.erase(m_held.begin(), m_held.begin() + out);
+            m_held.insert(m_held.end(), ptr, ptr + size);
+            return ok;
+        }
+
+        // a large piece goes without copying
+        const size_t from_data = out - m_held.size();
+        if (m_held.size())
+            ok = m_sink.OnAudio(&m_held[0], m_held.size());
+        ok = ok && m_sink.OnAudio(ptr, from_data);
+        m_held.assign(ptr + from_data, ptr + size);
+        return ok;
+    }
+
+    // mix the held frames and the head, and pass the rest of the head
+    bool Crossfade()
+    {
+        m_joining = false;
+        const size_t frames = ((m_head.size() < m_held.size()) ? m_head.size()
+                                                               : m_held.size()) / m_frame_size;
+        const size_t bytes = frames * m_frame_size;
+        if (frames)
+        {
+            const size_t samples = bytes / (m_format.bits() / 8);
+            const size_t channels = samples / frames;
+            unsigned char *tail = &m_held[m_held.size() - bytes];
+            m_tail_samples.resize(samples);
+            m_head_samples.resize(samples);
+            msample_decode(m_format, tail, samples, &m_tail_samples[0]);
+            msample_decode(m_format, &m_head[0], samples, &m_head_samples[0]);
+            for (size_t i = 0; i < frames; ++i)
+            {
+                const float w = (i + 0.5f) / frames;
+                for (size_t ch = 0; ch < channels; ++ch)
+                {
+                    float& a = m_tail_samples[i * channels + ch];
+                    a += (m_head_samples[i * channels + ch] - a) * w;
+                }
+            }
+            m_converter.encode(&m_tail_samples[0], samples, tail);
+        }
+
+        std::vector<unsigned char> head;
+        head.swap(m_head);
+        if (head.size() == bytes)
+            return true;
+        return Pass(&head[bytes], head.size() - bytes);
+    }
+};
+
+// writes the PCM into a WAVE or FLAC file, or into the standard output if
+// the filename is "-"
+class VoiceFileSink : public VoiceSink
+{
+public:
+    VoiceFileSink() : m_adpcm_open(false), m_channels(0), m_frames(0),
+                      m_proc(NULL), m_write_at_proc(NULL), m_context(NULL)
+    {
+    }
+
+    // write "-" into the functions instead of the standard output. see
+    // MWaveWriter::open_stream
+    void SetStream(MWaveWriter::write_proc_t proc,
+                   MWaveWriter::write_at_proc_t write_at_proc, void *context)
+    {
+        m_proc = proc;
+        m_write_at_proc = write_at_proc;
+        m_context = context;
+    }
+
+    // expected_size is the estimated bytes of the data, or zero if unknown.
+    // raw is for the data without the header. for IMA ADPCM, the sink takes
+    // the 16-bit PCM and encodes it.
+    bool Open(const char *filename, const VOICE_FORMAT& format,
+              uint64_t expected_size = 0, bool raw = false)
+    {
+        m_adpcm_open = false;
+        m_pending.clear();
+        m_channels = format.channels;
+        m_frames = 0;
+        if (format.format_tag == MWaveWriter::TAG_IMA_ADPCM)
+        {
+            int block_align = MImaAdpcmEncoder::standard_block_align(
+                format.samples_per_sec, format.channels);
+            if (!m_adpcm.init(format.channels, block_align))
+                return false;
+            m_writer.set_block(block_align, m_adpcm.frames_per_block());
+        }
+        else
+        {
+            m_writer.set_block(0, 0);
+        }
+
+        m_writer.set_raw(raw);
+        bool ok;
+        if (strcmp(filename, "-") == 0 && m_proc)
+        {
+            ok = m_writer.open_stream(m_proc, m_write_at_proc, m_context,
+                                      format.samples_per_sec, format.channels,
+                                      format.bits_per_sample, format.format_tag);
+        }
+        else if (strcmp(filename, "-") == 0)
+        {
+            ok = m_writer.open_stdout(format.samples_per_sec, format.channels,
+                                      format.bits_per_sample, format.format_tag,
+                                      expected_size);
+        }
+        else
+        {
+            ok = m_writer.open(filename, format.samples_per_sec, format.channels,
+                               format.bits_per_sample, format.format_tag,
+                               expected_size);
+        }
+        m_adpcm_open = ok && format.format_tag == MWaveWriter::TAG_IMA_ADPCM;
+        return ok;
+    }
+
+    // level is the compression level from 0 to 8. the PCM is signed.
+    bool OpenFlac(const char *filename, const VOICE_FORMAT& format, int level,
+                  uint64_t expected_size = 0)
+    {
+        m_flac.set_level(level);
+        if (strcmp(filename, "-") == 0 && m_proc)
+        {
+            return m_flac.open_stream(m_proc, m_write_at_proc, m_context,
+                                      format.samples_per_sec, format.channels,
+                                      format.bits_per_sample);
+        }
+        if (strcmp(filename, "-") == 0)
+        {
+            return m_flac.open_stdout(format.samples_per_sec, format.channels,
+                                      format.bits_per_sample, expected_size);
+        }
+        return m_flac.open(filename, format.samples_per_sec, format.channels,
+                           format.bits_per_sample, expected_size);
+    }
+
+    virtual bool OnAudio(const void *data, size_t size)
+    {
+        if (m_flac.is_open())
+            return m_flac.write(data, size);
+        if (m_adpcm_open)
+            return WriteAdpcm(data, size);
+        return m_writer.write(data, size);
+    }
+
+    // the offset of the PCM in the file
+    uint64_t HeaderSize() const
+    {
+        return m_writer.header_size();
+    }
+
+    // fix the sizes in the header and close
+    bool Close()
+    {
+        if (m_flac.is_open())
+            return m_flac.close();
+        if (m_adpcm_open)
+        {
+            // the short last block
+            const size_t frame_size = m_channels * sizeof(int16_t);
+            bool ok = true;
+            if (m_pending.size() >= frame_size)
+                ok = WriteAdpcmBlock(&m_pending[0], m_pending.size() / frame_size);
+            m_pending.clear();
+            m_adpcm_open = false;
+            m_writer.set_frames(m_frames);
+            return m_writer.close() && ok;
+        }
+        return m_writer.close();
+    }
+
+protected:
+    MWaveWriter m_writer;
+    MFlacWriter m_flac;
+    MImaAdpcmEncoder m_adpcm;
+    bool m_adpcm_open;
+    int m_channels;
+    uint64_t m_frames;                      // the frames encoded
+    std::vector<unsigned char> m_pending;   // the PCM of the next block
+    std::vector<int16_t> m_block_pcm;
+    std::vector<unsigned char> m_block;
+    MWaveWriter::write_proc_t m_proc;       // for "-"
+    MWaveWriter::write_at_proc_t m_write_at_proc;
+    void *m_context;
+
+    // encode the full blocks and keep the rest
+    bool WriteAdpcm(const void *data, size_t size)
+    {
+        const unsigned char *ptr = (const unsigned char *)data;
+        m_pending.insert(m_pending.end(), ptr, ptr + size);
+
+        const size_t frames = m_adpcm.frames_per_block();
+        const size_t block_bytes = frames * m_channels * sizeof(int16_t);
+        size_t pos = 0;
+        bool ok = true;
+        for (; ok && m_pending.size() - pos >= block_bytes; pos += block_bytes)
+        {
+            ok = WriteAdpcmBlock(&m_pending[pos], frames);
+        }
+        m_pending.erase(m_pending.begin(), m_pending.begin() + pos);
+        return ok;
+    }
+
+    bool WriteAdpcmBlock(const unsigned char *pcm, size_t frames)
+    {
+        m_block_pcm.resize(frames * m_channels);
+        memcpy(&m_block_pcm[0], pcm, m_block_pcm.size() * sizeof(int16_t));
+        m_block.resize(m_adpcm.block_size(frames));
+        m_adpcm.encode(&m_block_pcm[0], frames, &m_block[0]);
+        m_frames += frames;
+        return m_writer.write(&m_block[0], m_block.size());
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////
+
+#endif  // ndef VOICE_BACKEND_HPP_
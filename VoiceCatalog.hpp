@@ -0,0 +1,499 @@
+// VoiceCatalog.hpp --- the catalog of the installed voices
+// Copyright (C) 2018 Katayama Hirofumi MZ <katayama.hirofumi.mz@gmail.com>
+// This file is public domain software.
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef VOICE_CATALOG_HPP_
+#define VOICE_CATALOG_HPP_      2   // Version 2
+
+#include <string>
+#include <vector>
+#include <algorithm>    // for std::sort, std::binary_search
+#if __cplusplus >= 201103L
+    #include <unordered_map>
+#else
+    #include <map>
+#endif
+#include "MString.hpp"
+#include "MTextToText.hpp"
+#include "MFileMapping.hpp"
+#include "MFileUtils.hpp"
+
+////////////////////////////////////////////////////////////////////////////
+
+struct VOICE_TOKEN
+{
+    MStringW id;
+    MStringW name;
+    MStringW full_name;
+    MStringW age;
+    MStringW gender;
+    MStringW language;
+};
+
+////////////////////////////////////////////////////////////////////////////
+// the language of a voice
+
+// the language ID of the Language attribute of a voice token,
+// such as "411" or "409;9". zero if none.
+inline unsigned int VoiceLangIdFromAttribute(MStringViewW language)
+{
+    unsigned int langid = 0;
+    for (size_t i = 0; i < language.size(); ++i)
+    {
+        WCHAR ch = language[i];
+        unsigned int digit;
+        if (WCHAR('0') <= ch && ch <= WCHAR('9'))
+            digit = ch - WCHAR('0');
+        else if (WCHAR('a') <= ch && ch <= WCHAR('f'))
+            digit = ch - WCHAR('a') + 10;
+        else if (WCHAR('A') <= ch && ch <= WCHAR('F'))
+            digit = ch - WCHAR('A') + 10;
+        else
+            break;
+        langid = (langid << 4) | digit;
+        if (langid > 0xFFFF)
+            return 0;
+    }
+    return langid;
+}
+
+// the ISO 639 name of a language ID, as LOCALE_SISO639LANGNAME does.
+// empty if unknown.
+inline const char *VoiceIso639FromLangId(unsigned int langid)
+{
+    // the languages that depend on the sublanguage
+    static const struct { unsigned short langid; char name[4]; } s_special[] =
+    {
+        { 0x0814, "nn" }, { 0x081A, "sr" }, { 0x0C1A, "sr" }, { 0x141A, "bs" },
+        { 0x181A, "sr" }, { 0x1C1A, "sr" }, { 0x201A, "bs" }, { 0x241A, "sr" },
+        { 0x281A, "sr" }, { 0x2C1A, "sr" }, { 0x301A, "sr" },
+    };
+    for (size_t i = 0; i < sizeof(s_special) / sizeof(s_special[0]); ++i)
+    {
+        if (s_special[i].langid == langid)
+            return s_special[i].name;
+    }
+
+    // indexed by the primary language ID
+    static const char s_names[][4] =
+    {
+        "",    "ar",  "bg",  "ca",  "zh",  "cs",  "da",  "de",    // 0x00
+        "el",  "en",  "es",  "fi",  "fr",  "he",  "hu",  "is",    // 0x08
+        "it",  "ja",  "ko",  "nl",  "nb",  "pl",  "pt",  "rm",    // 0x10
+        "ro",  "ru",  "hr",  "sk",  "sq",  "sv",  "th",  "tr",    // 0x18
+        "ur",  "id",  "uk",  "be",  "sl",  "et",  "lv",  "lt",    // 0x20
+        "tg",  "fa",  "vi",  "hy",  "az",  "eu",  "hsb", "mk",    // 0x28
+        "st",  "ts",  "tn",  "",    "xh",  "zu",  "af",  "ka",    // 0x30
+        "fo",  "hi",  "mt",  "se",  "ga",  "",    "ms",  "kk",    // 0x38
+        "ky",  "sw",  "tk",  "uz",  "tt",  "bn",  "pa",  "gu",    // 0x40
+        "or",  "ta",  "te",  "kn",  "ml",  "as",  "mr",  "sa",    // 0x48
+        "mn",  "bo",  "cy",  "km",  "lo",  "",    "gl",  "kok",   // 0x50
+        "",    "",    "syr", "si",  "",    "iu",  "am",  "",      // 0x58
+        "",    "ne",  "fy",  "ps",  "fil", "dv",  "",    "",      // 0x60
+        "ha",  "",    "yo",  "quz", "nso", "ba",  "lb",  "kl",    // 0x68
+        "ig",  "",    "",    "",    "",    "",    "",    "",      // 0x70
+        "ii",  "",    "arn", "",    "moh", "",    "br",  "",      // 0x78
+        "ug",  "mi",  "oc",  "co",  "gsw", "sah", "",    "rw",    // 0x80
+        "wo",  "",    "",    "",    "prs", "",    "",    "",      // 0x88
+        "",    "gd",  "ku",                                       // 0x90
+    };
+    unsigned int primary = langid & 0x3FF;
+    if (primary < sizeof(s_names) / sizeof(s_names[0]))
+        return s_names[primary];
+    return "";
+}
+
+////////////////////////////////////////////////////////////////////////////
+// the index of the voices
+
+// VoiceIndex finds voices by a query such as "lang=ja,gender=female".
+// The terms are separated by commas and all of them must match. The keys
+// are name, lang (ISO 639 or hexadecimal language ID), gender and age.
+// A term without a key is a name. Matching is case-insensitive.
+class VoiceIndex
+{
+public:
+    void Build(const std::vector<VOICE_TOKEN>& tokens);
+
+    // the indexes of the matching voices in the order of the tokens.
+    // returns false if the query is malformed.
+    bool Query(MStringViewW query, std::vector<size_t>& found) const;
+
+    // the first matching voice
+    bool Find(MStringViewW query, size_t& index) const
+    {
+        std::vector<size_t> found;
+        if (!Query(query, found) || found.empty())
+            return false;
+        index = found[0];
+        return true;
+    }
+
+    void clear()
+    {
+        m_map.clear();
+    }
+
+    // lowercase for ASCII and Latin-1
+    static MStringW Fold(MStringViewW str)
+    {
+        MStringW ret(str.data(), str.size());
+        for (size_t i = 0; i < ret.size(); ++i)
+        {
+            WCHAR ch = ret[i];
+            if ((WCHAR('A') <= ch && ch <= WCHAR('Z')) ||
+                (0xC0 <= ch && ch <= 0xDE && ch != 0xD7))
+            {
+                ret[i] = WCHAR(ch + 0x20);
+            }
+        }
+        return ret;
+    }
+
+protected:
+    // "key=value" to the indexes of the tokens
+#if __cplusplus >= 201103L
+    typedef std::unordered_map<MStringW, std::vector<size_t> > map_type;
+#else
+    typedef std::map<MStringW, std::vector<size_t> > map_type;
+#endif
+    map_type m_map;
+
+    void Add(const char *key, MStringViewW value, size_t index)
+    {
+        value = mstr_trim_view(value);
+        if (value.empty())
+            return;
+
+        MStringW k;
+        for (; *key; ++key)
+            k += WCHAR(*key);
+        k += WCHAR('=');
+        k += Fold(value);
+
+        std::vector<size_t>& list = m_map[k];
+        if (list.empty() || list.back() != index)
+            list.push_back(index);
+    }
+};
+
+inline void VoiceIndex::Build(const std::vector<VOICE_TOKEN>& tokens)
+{
+    m_map.clear();
+    for (size_t i = 0; i < tokens.size(); ++i)
+    {
+        const VOICE_TOKEN& token = tokens[i];
+        Add("name", token.name, i);
+        Add("name", token.full_name, i);
+        Add("gender", token.gender, i);
+        Add("age", token.age, i);
+
+        // "409;9" is English and some more
+        MStringSplitterW langs(token.language, WIDE(";"));
+        MStringViewW lang;
+        while (langs.next(lang))
+        {
+            Add("lang", lang, i);
+            const char *iso639 = VoiceIso639FromLangId(VoiceLangIdFromAttribute(lang));
+            MStringW name;
+            for (; *iso639; ++iso639)
+                name += WCHAR(*iso639);
+            Add("lang", name, i);
+        }
+    }
+}
+
+inline bool VoiceIndex::Query(MStringViewW query, std::vector<size_t>& found) const
+{
+    found.clear();
+
+    std::vector<const std::vector<size_t> *> lists;
+    bool missing = false;
+
+    MStringSplitterW terms(query, WIDE(","));
+    MStringViewW term;
+    while (terms.next(term))
+    {
+        term = mstr_trim_view(term);
+        if (term.empty())
+            return false;
+
+        MStringW key = WIDE("name"), value;
+        size_t equal = term.find(WCHAR('='));
+        if (equal == MStringViewW::npos)
+        {
+            value = Fold(term);
+        }
+        else
+        {
+            key = Fold(mstr_trim_view(term.substr(0, equal)));
+            value = Fold(mstr_trim_view(term.substr(equal + 1)));
+            if (key == WIDE("language"))
+                key = WIDE("lang");
+            if (key != WIDE("name") && key != WIDE("lang") &&
+                key != WIDE("gender") && key != WIDE("age"))
+            {
+                return false;
+            }
+            if (value.empty())
+                return false;
+        }
+
+        map_type::const_iterator it = m_map.find(key + WCHAR('=') + value);
+        if (it == m_map.end())
+            missing = true;
+        else
+            lists.push_back(&it->second);
+    }
+
+    if (missing || lists.empty())
+        return true;
+
+    // walk the shortest list and look up the others
+    size_t shortest = 0;
+    for (size_t i = 1; i < lists.size(); ++i)
+    {
+        if (lists[i]->size() < lists[shortest]->size())
+            shortest = i;
+    }
+    const std::vector<size_t>& first = *lists[shortest];
+    for (size_t k = 0; k < first.size(); ++k)
+    {
+        bool all = true;
+        for (size_t i = 0; i < lists.size() && all; ++i)
+        {
+            if (i != shortest)
+                all = std::binary_search(lists[i]->begin(), lists[i]->end(), first[k]);
+        }
+        if (all)
+            found.push_back(first[k]);
+    }
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////
+
+// where the voices come from
+class VoiceSource
+{
+public:
+    virtual ~VoiceSource()
+    {
+    }
+
+    // a cheap fingerprint that changes whenever the voices may change.
+    // returns false if the source cannot tell, then nothing is cached.
+    virtual bool GetStamp(std::string& stamp) = 0;
+
+    // the expensive part
+    virtual bool Enumerate(std::vector<VOICE_TOKEN>& tokens) = 0;
+};
+
+// a fixed set of voices, for testing without SAPI
+class FakeVoiceSource : public VoiceSource
+{
+public:
+    std::vector<VOICE_TOKEN> m_tokens;
+    std::string m_stamp;
+    int m_enumerate_count;
+
+    FakeVoiceSource() : m_stamp("fake"), m_enumerate_count(0)
+    {
+    }
+
+    void AddVoice(const MStringW& name, const MStringW& gender,
+                  const MStringW& language, const MStringW& age = MStringW())
+    {
+        VOICE_TOKEN token;
+        token.id = WIDE("FAKE\\") + name;
+        token.name = name;
+        token.full_name = name;
+        token.age = age;
+        token.gender = gender;
+        token.language = language;
+        m_tokens.push_back(token);
+    }
+
+    virtual bool GetStamp(std::string& stamp)
+    {
+        stamp = m_stamp;
+        return true;
+    }
+
+    virtual bool Enumerate(std::vector<VOICE_TOKEN>& tokens)
+    {
+        ++m_enumerate_count;
+        tokens = m_tokens;
+        return true;
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////
+
+// VoiceCatalog enumerates the voices at the first use only. The result is
+// kept in a cache file with the stamp of the source, and the cache is used
+// while the stamp stays the same.
+//
+// The cache file is UTF-8 text. The first line is the version, the second
+// line is the stamp, and then each line is a voice with the tab-separated
+// id, name, full name, age, gender and language.
+class VoiceCatalog
+{
+public:
+    VoiceCatalog(VoiceSource *source, const std::string& cache_file = "")
+        : m_source(source), m_cache_file(cache_file), m_loaded(false),
+          m_from_cache(false), m_indexed(false)
+    {
+    }
+
+    const std::vector<VOICE_TOKEN>& Voices()
+    {
+        if (!m_loaded)
+            Load();
+        return m_tokens;
+    }
+
+    // built at the first use
+    const VoiceIndex& Index()
+    {
+        if (!m_indexed)
+        {
+            m_index.Build(Voices());
+            m_indexed = true;
+        }
+        return m_index;
+    }
+
+    bool IsLoaded() const
+    {
+        return m_loaded;
+    }
+
+    bool FromCache() const
+    {
+        return m_from_cache;
+    }
+
+    // forget the voices. the next Voices() checks the source again.
+    void Reset()
+    {
+        m_tokens.clear();
+        m_index.clear();
+        m_loaded = m_from_cache = m_indexed = false;
+    }
+
+protected:
+    VoiceSource *m_source;
+    std::string m_cache_file;
+    std::vector<VOICE_TOKEN> m_tokens;
+    bool m_loaded;
+    bool m_from_cache;
+    VoiceIndex m_index;
+    bool m_indexed;
+
+    void Load()
+    {
+        m_loaded = true;
+
+        std::string stamp;
+        bool has_stamp = m_cache_file.size() && m_source->GetStamp(stamp);
+        if (has_stamp && LoadCache(stamp))
+        {
+            m_from_cache = true;
+            return;
+        }
+
+        m_tokens.clear();
+        m_source->Enumerate(m_tokens);
+
+        // the cache is only an optimization
+        if (has_stamp && m_tokens.size())
+            SaveCache(stamp);
+    }
+
+    bool LoadCache(const std::string& stamp);
+    bool SaveCache(const std::string& stamp) const;
+};
+
+#define VOICE_CATALOG_CACHE_VERSION     "winsay-voices 1"
+
+inline bool VoiceCatalog::LoadCache(const std::string& stamp)
+{
+    MFileMapping mapping;
+    if (!mapping.open(m_cache_file.c_str()) || !mapping.data())
+        return false;
+
+    MStringSplitterA lines(MStringViewA((const char *)mapping.data(),
+                                        mapping.size()), "\n");
+    MStringViewA line;
+    if (!lines.next(line) || line != VOICE_CATALOG_CACHE_VERSION ||
+        !lines.next(line) || line != MStringViewA(stamp))
+    {
+        return false;
+    }
+
+    std::vector<VOICE_TOKEN> tokens;
+    while (lines.next(line))
+    {
+        if (line.empty())
+            continue;
+
+        MStringW fields[6];
+        MStringSplitterA splitter(line, "\t");
+        MStringViewA field;
+        size_t count = 0;
+        while (splitter.next(field))
+        {
+            if (count == 6)
+                return false;
+            fields[count++] = MAnsiToWide(CP_UTF8, field.data(), field.size()).c_str();
+        }
+        if (count != 6)
+            return false;
+
+        VOICE_TOKEN token;
+        token.id = fields[0];
+        token.name = fields[1];
+        token.full_name = fields[2];
+        token.age = fields[3];
+        token.gender = fields[4];
+        token.language = fields[5];
+        tokens.push_back(token);
+    }
+
+    m_tokens.swap(tokens);
+    return m_tokens.size() > 0;
+}
+
+inline bool VoiceCatalog::SaveCache(const std::string& stamp) const
+{
+    std::string text = VOICE_CATALOG_CACHE_VERSION;
+    text += '\n';
+    text += stamp;
+    text += '\n';
+    for (size_t i = 0; i < m_tokens.size(); ++i)
+    {
+        const VOICE_TOKEN& token = m_tokens[i];
+        const MStringW *fields[6] =
+        {
+            &token.id, &token.name, &token.full_name,
+            &token.age, &token.gender, &token.language
+        };
+        for (size_t k = 0; k < 6; ++k)
+        {
+            std::string field = MWideToAnsi(CP_UTF8, fields[k]->c_str(), fields[k]->size()).c_str();
+            if (field.find_first_of("\t\r\n") != std::string::npos)
+                return false;
+            if (k)
+                text += '\t';
+            text += field;
+        }
+        text += '\n';
+    }
+    return mfile_write_atomic(m_cache_file.c_str(), text.data(), text.size());
+}
+
+////////////////////////////////////////////////////////////////////////////
+
+#endif  // ndef VOICE_CATALOG_HPP_
@@ -4,7 +4,7 @@
 ////////////////////////////////////////////////////////////////////////////
 
 #ifndef WIN_VOICE_HPP_
-#define WIN_VOICE_HPP_      3   // Version 3
+#define WIN_VOICE_HPP_      4   // Version 4
 
 #undef INITGUID
 #define INITGUID
@@ -83,6 +83,25 @@ public:
                               &wide[0], len);
         return Speak(wide, async);
     }
+    // queue the text after the current speech without waiting
+    HRESULT Enqueue(const std::wstring& str)
+    {
+        if (m_mute)
+        {
+            return 0;
+        }
+        return m_pSpVoice->Speak(str.c_str(), SPF_ASYNC, NULL);
+    }
+    HRESULT Enqueue(const std::string& str)
+    {
+        std::wstring wide;
+        int len = ::MultiByteToWideChar(CP_ACP, 0, str.c_str(), -1,
+                                        NULL, 0);
+        wide.resize(len);
+        ::MultiByteToWideChar(CP_ACP, 0, str.c_str(), -1,
+                              &wide[0], len);
+        return Enqueue(wide);
+    }
     HRESULT Speak(UINT id, bool async = true)
     {
         WCHAR szText[256];
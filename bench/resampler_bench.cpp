@@ -0,0 +1,123 @@
+// resampler_bench.cpp --- the throughput of MResampler per quality
+// This file is public domain software.
+
+// converts a minute of a sweep at each quality, three times, and reports
+// the input frames per second of the fastest time, and how many times
+// faster than real time it is.
+
+#include <cstdio>       // standard C I/O
+#include <cstdlib>      // for EXIT_SUCCESS
+#include <cmath>        // for std::sin
+#include <vector>       // for std::vector
+#ifdef _WIN32
+    #include <windows.h>    // for QueryPerformanceCounter
+#else
+    #include <time.h>       // for clock_gettime
+#endif
+
+#include "MResampler.hpp"
+
+static double
+bench_get_msec(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return double(count.QuadPart) * 1000.0 / double(freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return double(ts.tv_sec) * 1000.0 + double(ts.tv_nsec) / 1000000.0;
+#endif
+}
+
+// a sweep from 100 Hz up to the half of the input rate
+static void
+bench_make_sweep(std::vector<int16_t>& samples, int rate, int channels, int seconds)
+{
+    const size_t frames = size_t(rate) * seconds;
+    samples.resize(frames * channels);
+    double phase = 0;
+    for (size_t i = 0; i < frames; ++i)
+    {
+        double hz = 100 + (rate / 2 - 100) * double(i) / double(frames);
+        phase += 2 * 3.14159265358979 * hz / rate;
+        int16_t value = int16_t(16000 * std::sin(phase));
+        for (int ch = 0; ch < channels; ++ch)
+            samples[i * channels + ch] = value;
+    }
+}
+
+struct bench_case
+{
+    int in_rate;
+    int out_rate;
+    int channels;
+};
+
+int main(void)
+{
+    static const bench_case s_cases[] =
+    {
+        { 22050, 48000, 1 },    // a voice to the common output rate
+        { 16000, 44100, 1 },
+        { 44100, 48000, 2 },
+        { 48000, 16000, 1 },    // down to the telephony rate
+    };
+    const int seconds = 60;
+    const size_t block = 4096;  // the frames per call, as from a voice
+
+    unsigned int features = mcpu_features();
+    printf("dot product: %s\n",
+           ((features & MCPU_AVX2) && (features & MCPU_FMA)) ? "AVX2+FMA" :
+           (features & MCPU_SSE2) ? "SSE2" : "scalar");
+    printf("%-22s  %-7s  %14s  %10s\n",
+           "conversion", "quality", "frames/sec", "realtime");
+
+    for (size_t i = 0; i < sizeof(s_cases) / sizeof(s_cases[0]); ++i)
+    {
+        const bench_case& c = s_cases[i];
+        std::vector<int16_t> input, output;
+        bench_make_sweep(input, c.in_rate, c.channels, seconds);
+        const size_t frames = input.size() / c.channels;
+
+        for (int quality = MRESAMPLER_LOW; quality <= MRESAMPLER_BEST; ++quality)
+        {
+            double msec = 0;
+            for (int run = 0; run < 3; ++run)
+            {
+                MResampler resampler;
+                if (!resampler.init(c.in_rate, c.out_rate, c.channels, quality))
+                {
+                    fprintf(stderr, "ERROR: unable to convert %d Hz to %d Hz.\n",
+                            c.in_rate, c.out_rate);
+                    return EXIT_FAILURE;
+                }
+                output.clear();
+                output.reserve(size_t(double(frames) * c.out_rate / c.in_rate + 1024) *
+                               c.channels);
+
+                double start = bench_get_msec();
+                for (size_t pos = 0; pos < frames; pos += block)
+                {
+                    size_t count = (frames - pos < block) ? frames - pos : block;
+                    resampler.process(&input[pos * c.channels], count, output);
+                }
+                resampler.flush(output);
+                double elapsed = bench_get_msec() - start;
+                if (run == 0 || elapsed < msec)
+                    msec = elapsed;
+            }
+            if (msec <= 0)
+                msec = 0.001;
+
+            char conversion[64];
+            sprintf(conversion, "%d -> %d Hz, %dch", c.in_rate, c.out_rate, c.channels);
+            printf("%-22s  %-7s  %14.0f  %9.1fx\n", conversion,
+                   MResampler::quality_name(quality), frames * 1000.0 / msec,
+                   seconds * 1000.0 / msec);
+        }
+    }
+    return EXIT_SUCCESS;
+}
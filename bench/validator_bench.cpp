@@ -0,0 +1,181 @@
+// validator_bench.cpp --- the throughput of the text validators
+// This file is public domain software.
+
+// runs the scalar, SSE and AVX2 kernels of MTextValidator.hpp on 16 MB of
+// ASCII, of mixed text and of the mixed text with an error at the end, so
+// the whole input is checked. the kernels that this CPU lacks are skipped.
+
+#include <cstdio>       // standard C I/O
+#include <cstdlib>      // for EXIT_SUCCESS
+#include <string>       // for std::string
+#ifdef _WIN32
+    #include <windows.h>    // for QueryPerformanceCounter
+#else
+    #include <time.h>       // for clock_gettime
+#endif
+
+#include "MTextValidator.hpp"
+
+#define BENCH_SIZE      (16 * 1024 * 1024)
+
+using namespace text_validator;
+
+static double
+bench_get_msec(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return double(count.QuadPart) * 1000.0 / double(freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return double(ts.tv_sec) * 1000.0 + double(ts.tv_nsec) / 1000000.0;
+#endif
+}
+
+// repeat the piece up to BENCH_SIZE bytes, on a whole piece
+static std::string
+bench_repeat(const std::string& piece)
+{
+    std::string str;
+    while (str.size() + piece.size() <= BENCH_SIZE)
+        str += piece;
+    return str;
+}
+
+// the little-endian UTF-16 of the code points
+static std::string
+bench_utf16(const unsigned int *units, size_t count)
+{
+    std::string piece;
+    for (size_t i = 0; i < count; ++i)
+    {
+        piece += char(units[i] & 0xFF);
+        piece += char(units[i] >> 8);
+    }
+    return bench_repeat(piece);
+}
+
+struct bench_kernel
+{
+    const char *isa;
+    unsigned int features;  // the MCpuFeature flags it needs
+    text_fn text;
+    binary_fn binary;
+};
+
+// the GB/s of the fastest of three runs, or zero if the result is wrong
+static double
+bench_run(const bench_kernel& kernel, const std::string& input, bool expected)
+{
+    double best = 0;
+    for (int run = 0; run < 3; ++run)
+    {
+        double start = bench_get_msec();
+        bool ret;
+        if (kernel.text)
+            ret = kernel.text(input.data(), input.size());
+        else
+            ret = kernel.binary(input.data(), input.size());
+        double msec = bench_get_msec() - start;
+        if (ret != expected)
+            return 0;
+        if (msec <= 0)
+            msec = 0.001;
+        double rate = input.size() / (msec * 1000000.0);
+        if (rate > best)
+            best = rate;
+    }
+    return best;
+}
+
+static void
+bench_row(const char *validator, const char *name, const bench_kernel *kernels,
+          const std::string& input, bool expected)
+{
+    printf("%-6s  %-8s", validator, name);
+    const unsigned int features = mcpu_features();
+    for (int i = 0; i < 3; ++i)
+    {
+        if (!kernels[i].text && !kernels[i].binary)
+        {
+            printf("  %-14s", "-");
+            continue;
+        }
+        if ((kernels[i].features & features) != kernels[i].features)
+        {
+            printf("  %-5s %8s", kernels[i].isa, "n/a");
+            continue;
+        }
+        double rate = bench_run(kernels[i], input, expected);
+        if (rate == 0)
+            printf("  %-5s %8s", kernels[i].isa, "WRONG");
+        else
+            printf("  %-5s %8.2f", kernels[i].isa, rate);
+    }
+    printf("\n");
+}
+
+int main(void)
+{
+    static const bench_kernel s_ascii[3] =
+    {
+        { "C", 0, is_ascii_scalar, NULL },
+#ifdef MCPU_X86
+        { "SSE2", MCPU_SSE2, is_ascii_sse2, NULL },
+        { "AVX2", MCPU_AVX2, is_ascii_avx2, NULL },
+#endif
+    };
+    static const bench_kernel s_utf8[3] =
+    {
+        { "C", 0, is_utf8_scalar, NULL },
+#ifdef MCPU_X86
+        { "SSSE3", MCPU_SSSE3, is_utf8_ssse3, NULL },
+        { "AVX2", MCPU_AVX2, is_utf8_avx2, NULL },
+#endif
+    };
+    static const bench_kernel s_utf16[3] =
+    {
+        { "C", 0, NULL, is_utf16_scalar },
+#ifdef MCPU_X86
+        { "SSE2", MCPU_SSE2, NULL, is_utf16_sse2 },
+        { "AVX2", MCPU_AVX2, NULL, is_utf16_avx2 },
+#endif
+    };
+
+    // ASCII, and the same with a byte of 0x80 at the end
+    std::string ascii = bench_repeat("The quick brown fox jumps over the lazy dog. ");
+    std::string ascii_bad = ascii;
+    ascii_bad[ascii_bad.size() - 1] = char(0x80);
+
+    // Latin-1, Japanese and an emoji in UTF-8, and a bad last byte
+    std::string mixed = bench_repeat("Caf\xC3\xA9 na\xC3\xAFve, "
+                                     "\xE6\x97\xA5\xE6\x9C\xAC\xE8\xAA\x9E "
+                                     "\xF0\x9F\x98\x80 text. ");
+    std::string mixed_bad = mixed;
+    mixed_bad[mixed_bad.size() - 1] = char(0xFF);
+
+    // the same in UTF-16 LE, and an unpaired high surrogate at the end
+    static const unsigned int s_ascii16[] = { 'T', 'h', 'e', ' ', 'f', 'o', 'x', '.' };
+    static const unsigned int s_mixed16[] =
+    {
+        'C', 'a', 'f', 0xE9, ' ', 0x65E5, 0x672C, 0x8A9E, ' ', 0xD83D, 0xDE00, '.'
+    };
+    std::string ascii16 = bench_utf16(s_ascii16, sizeof(s_ascii16) / sizeof(s_ascii16[0]));
+    std::string mixed16 = bench_utf16(s_mixed16, sizeof(s_mixed16) / sizeof(s_mixed16[0]));
+    std::string mixed16_bad = mixed16;
+    mixed16_bad[mixed16_bad.size() - 1] = char(0xD8);   // 0xD8xx
+
+    printf("GB/s of %u MB, the fastest of three runs\n", BENCH_SIZE / (1024 * 1024));
+    bench_row("ascii", "ascii", s_ascii, ascii, true);
+    bench_row("ascii", "invalid", s_ascii, ascii_bad, false);
+    bench_row("utf8", "ascii", s_utf8, ascii, true);
+    bench_row("utf8", "mixed", s_utf8, mixed, true);
+    bench_row("utf8", "invalid", s_utf8, mixed_bad, false);
+    bench_row("utf16", "ascii", s_utf16, ascii16, true);
+    bench_row("utf16", "mixed", s_utf16, mixed16, true);
+    bench_row("utf16", "invalid", s_utf16, mixed16_bad, false);
+    return EXIT_SUCCESS;
+}
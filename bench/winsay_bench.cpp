@@ -0,0 +1,154 @@
+// winsay_bench.cpp --- the time to the first audio of winsay
+// This file is public domain software.
+
+// renders a generated text through the library twice, with the whole text
+// and with --stream, and reports the time to the first block of audio and
+// the total time. the reference backend stands in for a real synthesizer,
+// so it runs on every platform.
+
+#include <cstdio>       // standard C I/O
+#include <cstdlib>      // for atoi
+#include <string>       // for std::string
+#ifndef _WIN32
+    #include <time.h>   // for clock_gettime
+#endif
+
+#include "winsay.hpp"
+
+#define BENCH_INPUT_FILE    "winsay_bench.txt"
+
+static double
+bench_get_msec(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return double(count.QuadPart) * 1000.0 / double(freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return double(ts.tv_sec) * 1000.0 + double(ts.tv_nsec) / 1000000.0;
+#endif
+}
+
+// write the sentences of the pseudo-random words
+static bool
+bench_write_text(const char *filename, int sentences)
+{
+    static const char *s_words[] =
+    {
+        "alpha", "bravo", "charlie", "delta", "echo", "foxtrot", "golf",
+        "hotel", "india", "juliett", "kilo", "lima", "mike", "november"
+    };
+    const int count = int(sizeof(s_words) / sizeof(s_words[0]));
+
+    FILE *fp = fopen(filename, "wb");
+    if (!fp)
+        return false;
+
+    unsigned int seed = 1;
+    for (int i = 0; i < sentences; ++i)
+    {
+        for (int k = 0; k < 8; ++k)
+        {
+            seed = seed * 1103515245 + 12345;
+            fputs(s_words[(seed >> 16) % count], fp);
+            fputs((k == 7) ? ".\n" : " ", fp);
+        }
+    }
+    return fclose(fp) == 0;
+}
+
+struct bench_result
+{
+    double start;
+    double first;           // the time to the first audio, in msec
+    double total;           // in msec
+    size_t bytes;
+};
+
+static int
+bench_proc(void *context, const void * /*data*/, size_t size)
+{
+    bench_result *result = (bench_result *)context;
+    if (result->bytes == 0 && size > 0)
+        result->first = bench_get_msec() - result->start;
+    result->bytes += size;
+    return 1;
+}
+
+static bool
+bench_run(const char *backend, bool stream, bench_result& result)
+{
+    WINSAY_DATA *data = winsay_create();
+    if (!data)
+        return false;
+
+    int ret = EXIT_SUCCESS;
+    if (winsay_set_option(data, "input-file", BENCH_INPUT_FILE) != EXIT_SUCCESS ||
+        winsay_set_option(data, "output-file", "-") != EXIT_SUCCESS ||
+        winsay_set_option(data, "file-format", "raw") != EXIT_SUCCESS ||
+        winsay_set_option(data, "bit-rate", "8000") != EXIT_SUCCESS ||
+        winsay_set_option(data, "channels", "1") != EXIT_SUCCESS ||
+        winsay_set_option(data, "backend", backend) != EXIT_SUCCESS ||
+        (stream && winsay_set_option(data, "stream", NULL) != EXIT_SUCCESS))
+    {
+        ret = EXIT_FAILURE;
+    }
+
+    static char s_buffer[64 * 1024];
+    result.first = result.total = 0;
+    result.bytes = 0;
+    result.start = bench_get_msec();
+    if (ret == EXIT_SUCCESS)
+        ret = winsay_render_stream(data, s_buffer, sizeof(s_buffer), bench_proc, &result);
+    result.total = bench_get_msec() - result.start;
+
+    winsay_destroy(data);
+    return ret == EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv)
+{
+    int sentences = (argc > 1) ? atoi(argv[1]) : 20000;
+    std::string backend = (argc > 2) ? argv[2] : "reference";
+    if (sentences < 100)
+    {
+        fprintf(stderr, "usage: winsay_bench [sentences [backend]]\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("backend: %s\n", backend.c_str());
+    printf("%10s  %-6s  %12s  %12s  %10s\n",
+           "sentences", "mode", "first (ms)", "total (ms)", "bytes");
+
+    // the time to the first audio of --stream doesn't grow with the input
+    const int sizes[] = { sentences / 100, sentences / 10, sentences };
+    bool ok = true;
+    for (int i = 0; ok && i < 3; ++i)
+    {
+        if (!bench_write_text(BENCH_INPUT_FILE, sizes[i]))
+        {
+            fprintf(stderr, "ERROR: unable to write '%s'.\n", BENCH_INPUT_FILE);
+            return EXIT_FAILURE;
+        }
+
+        for (int stream = 0; stream < 2; ++stream)
+        {
+            bench_result result;
+            if (!bench_run(backend.c_str(), stream != 0, result))
+            {
+                fprintf(stderr, "ERROR: unable to render.\n");
+                ok = false;
+                break;
+            }
+            printf("%10d  %-6s  %12.1f  %12.1f  %10lu\n", sizes[i],
+                   stream ? "stream" : "whole", result.first, result.total,
+                   (unsigned long)result.bytes);
+        }
+    }
+
+    remove(BENCH_INPUT_FILE);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -3,31 +3,82 @@
 // This file is public domain software.
 
 #include <cstdio>       // standard C I/O
+#include <cstdlib>      // for getenv, strtol
+#include <cstring>      // for strcmp
+#include <cctype>       // for tolower
+#include <cerrno>       // for errno, EINTR
+#include <cassert>      // for assert
 #include <vector>       // for std::vector
+#include <map>          // for std::map
+#include <set>          // for std::set
+#include <deque>        // for std::deque
+#ifdef _WIN32
+    #include <io.h>     // for _read
+    #include <fcntl.h>  // for _O_BINARY
+#else
+    #include <unistd.h> // for read
+    #include <time.h>   // for clock_gettime
+#endif
 #ifdef USE_GETOPT_PORT
     #include "getopt.h" // for portable getopt_long
 #else
     #include <getopt.h> // for GNU getopt_long
 #endif
 
-#include "WinVoice.hpp"
+#ifndef _WIN32
+    #define WonGetACP()     65001   // the command line and the files are UTF-8
+#endif
+
+#include "MLocalSocket.hpp"     // before <windows.h>
 #include "MString.hpp"
 #include "MTextToText.hpp"
-#include <sphelper.h>   // This may needs ATL.
+#include "MTextSegmenter.hpp"
+#include "MTextDecoder.hpp"
+#include "MFileMapping.hpp"
+#include "MFileCache.hpp"
+#include "MThread.hpp"
+#include "MLockFreeRing.hpp"
+#include "MLexicon.hpp"
+#include "VoiceCatalog.hpp"
+#include "VoiceBackend.hpp"
+#include "RefVoiceBackend.hpp"
+#ifdef _WIN32
+    #include "SapiVoiceBackend.hpp"
+#endif
 
 #include "winsay.hpp"
 
-// TODO: rate, progress, mp3, data-format
+// TODO: mp3
 
 using std::printf;
 using std::fprintf;
 using std::exit;
 
-// bit-rates in Hz
-static const INT s_bit_rates[] =
+#ifndef ARRAYSIZE
+    #define ARRAYSIZE(array)    (sizeof(array) / sizeof(array[0]))
+#endif
+
+// common bit-rates in Hz. any rate in the range can be used
+static const int s_bit_rates[] =
+{
+    8000, 11025, 16000, 22050, 24000, 32000, 44100, 48000
+};
+#define WINSAY_MIN_BIT_RATE     4000
+#define WINSAY_MAX_BIT_RATE     384000
+
+// the speaker positions of the channels, as in WAVE files
+static const char *s_channel_layouts[] =
 {
-    8000, 11025, 22050, 44100
+    "mono (FC)",
+    "stereo (FL FR)",
+    "3.0 (FL FR FC)",
+    "quad (FL FR BL BR)",
+    "5.0 (FL FR FC BL BR)",
+    "5.1 (FL FR FC LFE BL BR)",
+    "6.1 (FL FR FC LFE BC SL SR)",
+    "7.1 (FL FR FC LFE BL BR SL SR)"
 };
+#define WINSAY_MAX_CHANNELS     8
 
 // show version info
 extern "C" void
@@ -54,26 +105,101 @@ winsay_show_help(void)
     printf("                        is specified, read from standard input.\n");
     printf("\n");
     printf("-o file                 \n");
-    printf("--output-file=file      An output file.\n");
+    printf("--output-file=file      An output file. If file is -, write to standard\n");
+    printf("                        output while speaking.\n");
+    printf("\n");
+    printf("--stream                Speak the input sentence by sentence while reading.\n");
+    printf("\n");
+    printf("--marks=file            Write the sentences, the words and the visemes of\n");
+    printf("                        the output file into file, with the sample offsets.\n");
+    printf("                        file is JSON lines, or the subtitles of the\n");
+    printf("                        sentences if file is .srt or .vtt.\n");
+    printf("\n");
+    printf("--lexicon=file          A pronunciation lexicon. Each line of file is\n");
+    printf("                        a word, a tab and its pronunciation.\n");
+    printf("\n");
+    printf("--batch=manifest        Speak many utterances in one process. Each line of\n");
+    printf("                        manifest is text, output-file, voice, rate and\n");
+    printf("                        file-format separated by tabs. Text can be @file\n");
+    printf("                        to read an input file. Empty fields default to\n");
+    printf("                        the options. The timings are shown at the end.\n");
+    printf("\n");
+    printf("--cache[=dir]           Keep the rendered files in the cache directory and\n");
+    printf("                        reuse them for the same text, voice and format.\n");
+    printf("                        The default dir is \"renders\" in the cache folder.\n");
+    printf("\n");
+    printf("--cache-size=MB         The size limit of the cache (256 by default). The\n");
+    printf("                        least recently used files go first.\n");
+    printf("\n");
+    printf("--incremental           Render only the sentences changed since the last\n");
+    printf("                        output, keeping the others from the output file.\n");
+    printf("                        The sentences are listed in output-file.segments.\n");
+    printf("                        Not for FLAC or IMA ADPCM.\n");
+    printf("\n");
+    printf("--parallel[=N]          Render the text on N voices in parallel (one per\n");
+    printf("                        processor by default), split into sentences or\n");
+    printf("                        paragraphs, and join them in order into the output.\n");
+    printf("\n");
+    printf("--split=unit            sentence (default) or paragraph for --parallel.\n");
+    printf("\n");
+    printf("--gap=MS                The silence between the pieces of --parallel (300\n");
+    printf("                        by default). The silence at their ends is removed.\n");
+    printf("\n");
+    printf("--serve=socket          Stay and serve the clients at the socket path,\n");
+    printf("                        keeping the voices ready. The other options are\n");
+    printf("                        of the server, such as --backend and --cache.\n");
+    printf("\n");
+    printf("--client=socket         Let the server at the socket speak, with the text\n");
+    printf("                        and the options. Output file - is streamed back.\n");
     printf("\n");
     printf("-v voice                \n");
-    printf("--voice=voice           A voice to be used.\n");
+    printf("--voice=voice           A voice to be used. voice is a name or a query\n");
+    printf("                        such as \"lang=ja,gender=female\". The keys are\n");
+    printf("                        name, lang, gender and age.\n");
     printf("\n");
     printf("--voice=?               List all available voices.\n");
     printf("\n");
+    printf("--rate=rate             The speaking rate (-10 to 10).\n");
+    printf("\n");
+    printf("--backend=name[:options]\n");
+    printf("                        The speech synthesizer. name is sapi (the default\n");
+    printf("                        on Windows) or reference. The reference synthesizer\n");
+    printf("                        makes simple tones for testing. Its options are\n");
+    printf("                        latency=MS,rtf=X,chunk=MS,rate=HZ,startup=MS.\n");
+    printf("\n");
     printf("--file-format=format    The format of the output file to write.\n");
     printf("\n");
     printf("--file-format=?         List all file formats.\n");
     printf("\n");
-    printf("--bit-rate=rate         Bit-rate (in Hz).\n");
+    printf("--bit-rate=rate         Bit-rate (in Hz), from 4000 to 384000.\n");
     printf("\n");
-    printf("--bit-rate=?            List all available bit-rates (in Hz).\n");
+    printf("--bit-rate=?            List the common bit-rates (in Hz).\n");
     printf("\n");
-    printf("--channels=number       The number of channels (1 or 2).\n");
+    printf("--channels=number       The number of channels (1 to 8).\n");
     printf("\n");
-    printf("--quality=quality       The audio converter quality.\n");
+    printf("--channels=?            List the channel layouts.\n");
+    printf("\n");
+    printf("--data-format=format    The sample format: uint8, int8, int16 (the default),\n");
+    printf("                        int24, int32 or float32, with the suffix le (the\n");
+    printf("                        default) or be for the byte order. The WAVE files\n");
+    printf("                        are little-endian and their 8-bit data is unsigned.\n");
+    printf("                        mulaw and alaw are G.711 and ima-adpcm is 4-bit\n");
+    printf("                        IMA ADPCM, for the telephony.\n");
+    printf("\n");
+    printf("--data-format=?         List all sample formats.\n");
+    printf("\n");
+    printf("--mix=matrix            The channel mixing. The rows of the output channels\n");
+    printf("                        are separated by '/', the coefficients of the\n");
+    printf("                        rendered channels (1 or 2) by ','. For example,\n");
+    printf("                        --channels=3 --mix=1,0/0,1/0.5,0.5\n");
+    printf("\n");
+    printf("--quality=quality       The audio converter quality: low, medium, high\n");
+    printf("                        (the default) or best.\n");
     printf("\n");
     printf("--quality=?             List all the audio converter qualities.\n");
+    printf("\n");
+    printf("--compression=level     The FLAC compression level, from 0 (the fastest)\n");
+    printf("                        to 8 (the smallest). The default is 5.\n");
 }
 
 // option info for getopt_long
@@ -88,6 +214,23 @@ static struct option winsay_opts[] =
     { "file-format", required_argument, NULL, 0 },
     { "bit-rate", required_argument, NULL, 0 },
     { "channels", required_argument, NULL, 0 },
+    { "data-format", required_argument, NULL, 0 },
+    { "mix", required_argument, NULL, 0 },
+    { "compression", required_argument, NULL, 0 },
+    { "cache", optional_argument, NULL, 0 },
+    { "cache-size", required_argument, NULL, 0 },
+    { "stream", no_argument, NULL, 0 },
+    { "incremental", no_argument, NULL, 0 },
+    { "parallel", optional_argument, NULL, 0 },
+    { "split", required_argument, NULL, 0 },
+    { "gap", required_argument, NULL, 0 },
+    { "serve", required_argument, NULL, 0 },
+    { "client", required_argument, NULL, 0 },
+    { "lexicon", required_argument, NULL, 0 },
+    { "marks", required_argument, NULL, 0 },
+    { "batch", required_argument, NULL, 0 },
+    { "rate", required_argument, NULL, 0 },
+    { "backend", required_argument, NULL, 0 },
     { NULL, 0, NULL, 0 },
 };
 
@@ -98,387 +241,2467 @@ extern "C"
     extern int optind, opterr, optopt;
 }
 
-// parse the command line
-extern "C" int
-winsay_command_line(WINSAY_DATA *data, int argc, char **argv)
+// read the available bytes without waiting for the buffer to be filled.
+// len is 0 at the end. returns false on error
+static bool
+winsay_read(FILE *fp, void *buf, size_t size, size_t& len)
 {
-    int opt, opt_index;
-    std::string arg;
+    for (;;)
+    {
+#ifdef _WIN32
+        int ret = _read(_fileno(fp), buf, (unsigned int)size);
+#else
+        ssize_t ret = read(fileno(fp), buf, size);
+#endif
+        if (ret >= 0)
+        {
+            len = size_t(ret);
+            return true;
+        }
+        if (errno != EINTR)
+            break;
+    }
+    fprintf(stderr, "ERROR: unable to read the input: %s\n", strerror(errno));
+    len = 0;
+    return false;
+}
 
-    data->clear();
+// the input bytes, mapped from a regular file or read from a stream
+class winsay_input
+{
+public:
+    winsay_input() : m_fp(NULL), m_pos(0), m_failed(false)
+    {
+    }
 
-    opterr = 0;  /* NOTE: opterr == 1 is not compatible to getopt_port */
+    ~winsay_input()
+    {
+        close();
+    }
 
-    // for each command line option
-    while ((opt = getopt_long(argc, argv, "hv:i:o:", winsay_opts, &opt_index)) != -1)
+    bool open(const std::string& input_file)
     {
-        switch (opt)
+        close();
+        if (input_file == "-" || input_file.empty())
         {
-        case 0:     // no short option
-            arg = winsay_opts[opt_index].name;
-
-            if (arg == "version")
-            {
-                winsay_show_version();
-                exit(EXIT_SUCCESS);
-            }
+#ifdef _WIN32
+            _setmode(_fileno(stdin), _O_BINARY);
+#endif
+            m_fp = stdin;
+            return true;
+        }
+        if (m_mapping.open(input_file.c_str()))
+            return true;
+        m_fp = fopen(input_file.c_str(), "rb");
+        return m_fp != NULL;
+    }
 
-            if (arg == "file-format")
-            {
-                data->file_format = optarg;
-                if (data->file_format == "?")
-                {
-                    data->mode = WINSAY_ENUMFILEFORMATS;
-                }
-            }
+    void close()
+    {
+        m_mapping.close();
+        if (m_fp && m_fp != stdin)
+            fclose(m_fp);
+        m_fp = NULL;
+        m_pos = 0;
+        m_failed = false;
+    }
 
-            if (arg == "bit-rate")
-            {
-                if (strcmp(optarg, "?") == 0)
-                {
-                    data->mode = WINSAY_ENUMBITRATES;
-                    data->bit_rate = 0;
-                    break;
-                }
+    bool is_mapped() const
+    {
+        return m_mapping.is_open();
+    }
 
-                data->bit_rate = strtol(optarg, NULL, 0);
+    const MFileMapping& mapping() const
+    {
+        return m_mapping;
+    }
 
-                bool found = false;
-                for (size_t i = 0; i < ARRAYSIZE(s_bit_rates); ++i)
-                {
-                    if (s_bit_rates[i] == data->bit_rate)
-                    {
-                        found = true;
-                    }
-                }
+    // a read failed before the end
+    bool failed() const
+    {
+        return m_failed;
+    }
 
-                if (!found)
-                {
-                    fprintf(stderr, "ERROR: invalid bit-rate.\n");
-                    return EXIT_FAILURE;
-                }
-            }
+    // get the next chunk of the input. returns NULL at the end or on error.
+    const char *next(size_t& len)
+    {
+        if (m_mapping.is_open())
+        {
+            len = m_mapping.size() - m_pos;
+            if (len > sizeof(m_buf))
+                len = sizeof(m_buf);
+            if (len == 0)
+                return NULL;
+            const char *ptr = (const char *)m_mapping.data() + m_pos;
+            m_pos += len;
+            return ptr;
+        }
 
-            if (arg == "channels")
-            {
-                if (strcmp(optarg, "?") == 0)
-                {
-                    data->mode = WINSAY_ENUMCHANNELS;
-                    break;
-                }
+        if (!m_fp)
+            return NULL;
+        if (!winsay_read(m_fp, m_buf, sizeof(m_buf), len))
+            m_failed = true;
+        return (len > 0) ? m_buf : NULL;
+    }
 
-                data->channels = strtol(optarg, NULL, 0);
-                if (data->channels != 1 && data->channels != 2)
-                {
-                    fprintf(stderr, "ERROR: invalid channels.\n");
-                    return EXIT_FAILURE;
-                }
-            }
+protected:
+    MFileMapping m_mapping;
+    FILE *m_fp;
+    size_t m_pos;
+    bool m_failed;
+    char m_buf[64 * 1024];
+};
 
-            if (arg == "quality")
-            {
-                if (strcmp(optarg, "?") == 0)
-                {
-                    data->mode = WINSAY_ENUMQUALITIES;
-                    break;
-                }
-                // simply ignored
-            }
+// read the whole input and detect its encoding
+static bool
+winsay_load_input(const std::string& input_file, MStringW& text)
+{
+    winsay_input input;
+    if (!input.open(input_file))
+        return false;
 
-            break;
+    MTextType type;
+    type.nNewLine = MNEWLINE_NOCHANGE;
 
-        case 'h':
-            winsay_show_help();
-            exit(EXIT_SUCCESS);
-            break;
+    if (input.is_mapped())
+    {
+        // no copy before the conversion
+        text = mstr_from_bin(input.mapping().data(), input.mapping().size(), &type);
+        return true;
+    }
 
-        case 'f':
-            if (optarg)
-                data->input_file = optarg;
-            else
-                data->input_file = "-";
-            break;
+    std::string bin;
+    const char *ptr;
+    size_t len;
+    while ((ptr = input.next(len)) != NULL)
+    {
+        bin.append(ptr, len);
+    }
+    if (input.failed())
+        return false;
+    text = mstr_from_bin(bin, &type);
+    return true;
+}
 
-        case 'o':
-            data->output_file = optarg;
-            data->mode = WINSAY_OUTPUT;
-            break;
+// a voice name or a voice query such as "lang=ja,gender=female"?
+static bool
+winsay_is_voice_query(const char *voice)
+{
+    MAnsiToWide wVoice(CP_ACP, voice);
+    std::vector<size_t> found;
+    return VoiceIndex().Query(MStringViewW(wVoice.c_str(), wVoice.size()), found);
+}
 
-        case 'v':
-            if (strcmp(optarg, "?") == 0)
-                data->mode = WINSAY_ENUMVOICES;
-            data->voice = optarg;
-            break;
+// parse a mixing matrix such as "1,0/0,1/0.5,0.5". a row per output
+// channel, a coefficient per rendered channel
+static bool
+winsay_parse_mix(const std::string& mix, int out_channels,
+                 std::vector<float>& matrix, int& in_channels)
+{
+    matrix.clear();
+    in_channels = 0;
 
-        case '?':
-        default:
-            // error
-            switch (optopt)
-            {
-            case 'f':
-                if (!optarg)
-                {
-                    data->input_file = "-";
-                    continue;
-                }
+    int rows = 0;
+    const char *ptr = mix.c_str();
+    for (;;)
+    {
+        int columns = 0;
+        for (;;)
+        {
+            char *endptr;
+            double value = strtod(ptr, &endptr);
+            if (endptr == ptr)
+                return false;
+            matrix.push_back(float(value));
+            ++columns;
+            ptr = endptr;
+            if (*ptr != ',')
                 break;
+            ++ptr;
+        }
 
-            case 'o':
-                if (!optarg)
-                {
-                    fprintf(stderr, "ERROR: option '-%c' requires a parameter.\n", optopt);
-                }
-                break;
+        if (rows == 0)
+            in_channels = columns;
+        else if (columns != in_channels)
+            return false;
+        ++rows;
 
-            case 'v':
-                if (optarg)
-                {
-                    data->voice = "?";
-                    data->mode = WINSAY_ENUMVOICES;
-                }
-                else
-                {
-                    fprintf(stderr, "ERROR: option '-%c' requires a parameter.\n", optopt);
-                }
-                break;
+        if (*ptr == 0)
+            break;
+        if (*ptr != '/')
+            return false;
+        ++ptr;
+    }
 
-            case 0:
-                fprintf(stderr, "ERROR: invalid option.\n");
-                break;
+    return rows == out_channels && 1 <= in_channels && in_channels <= 2;
+}
 
-            default:
-                fprintf(stderr, "ERROR: invalid option '-%c'.\n", optopt);
-                break;
-            }
+// parse an option of the long name. optarg is NULL if no argument
+static int
+winsay_parse_option(WINSAY_DATA *data, const std::string& arg, const char *optarg)
+{
+    if (arg == "input-file")
+    {
+        if (optarg)
+            data->input_file = optarg;
+        else
+            data->input_file = "-";
+    }
+
+    if (arg == "output-file")
+    {
+        data->output_file = optarg;
+        data->mode = WINSAY_OUTPUT;
+    }
+
+    if (arg == "voice")
+    {
+        if (strcmp(optarg, "?") == 0)
+            data->mode = WINSAY_ENUMVOICES;
+        else if (!winsay_is_voice_query(optarg))
+        {
+            fprintf(stderr, "ERROR: invalid voice '%s'.\n", optarg);
             return EXIT_FAILURE;
         }
+        data->voice = optarg;
     }
 
-    for (int i = optind; i < argc; ++i)
+    if (arg == "file-format")
     {
-        data->text += ' ';
-        data->text += argv[i];
+        data->file_format = optarg;
+        if (data->file_format == "?")
+        {
+            data->mode = WINSAY_ENUMFILEFORMATS;
+        }
     }
 
-    switch (data->mode)
+    if (arg == "bit-rate")
     {
-    case WINSAY_SAY:
-    case WINSAY_OUTPUT:
-        // need input
-        if (data->text.empty())
+        if (strcmp(optarg, "?") == 0)
         {
-            // no text. input now
-            FILE *fp;
-            if (data->input_file != "-" && data->input_file.size())
-            {
-                fp = fopen(data->input_file.c_str(), "rb");
-            }
-            else
-            {
-                fp = stdin;
-            }
-            if (fp)
-            {
-                char buf[256];
-                while (fgets(buf, ARRAYSIZE(buf), fp))
-                {
-                    data->text += buf;
-                }
-
-                if (fp != stdin)
-                    fclose(fp);
-            }
+            data->mode = WINSAY_ENUMBITRATES;
+            data->bit_rate = 0;
+            return EXIT_SUCCESS;
         }
-        break;
 
-    default:
-        break;
+        char *endptr;
+        data->bit_rate = strtol(optarg, &endptr, 0);
+        if (*endptr || data->bit_rate < WINSAY_MIN_BIT_RATE ||
+            data->bit_rate > WINSAY_MAX_BIT_RATE)
+        {
+            fprintf(stderr, "ERROR: invalid bit-rate.\n");
+            return EXIT_FAILURE;
+        }
     }
 
-    mstr_trim(data->text);
-
-    return EXIT_SUCCESS;
-}
+    if (arg == "channels")
+    {
+        if (strcmp(optarg, "?") == 0)
+        {
+            data->mode = WINSAY_ENUMCHANNELS;
+            return EXIT_SUCCESS;
+        }
 
-struct AUDIO_TOKEN
-{
-    std::wstring id;
-};
+        char *endptr;
+        data->channels = strtol(optarg, &endptr, 0);
+        if (*endptr || data->channels < 1 ||
+            data->channels > WINSAY_MAX_CHANNELS)
+        {
+            fprintf(stderr, "ERROR: invalid channels.\n");
+            return EXIT_FAILURE;
+        }
+    }
 
-static std::wstring
-winsay_get_reg_path_from_id(HKEY& hKeyBase, const WCHAR *pszID)
-{
-    static const WCHAR *pszHKLM = L"HKEY_LOCAL_MACHINE\\";
-    static const WCHAR *pszHKCU = L"HKEY_CURRENT_USER\\";
-    std::wstring key_path;
-    hKeyBase = NULL;
-    if (memcmp(pszID, pszHKLM, lstrlenW(pszHKLM)) == 0)
+    if (arg == "data-format")
     {
-        hKeyBase = HKEY_LOCAL_MACHINE;
-        key_path = &pszID[lstrlenW(pszHKLM)];
+        if (strcmp(optarg, "?") == 0)
+        {
+            data->mode = WINSAY_ENUMDATAFORMATS;
+            return EXIT_SUCCESS;
+        }
+
+        MSampleFormat format;
+        if (strcmp(optarg, "ima-adpcm") != 0 &&
+            !msample_parse_format(optarg, format))
+        {
+            fprintf(stderr, "ERROR: invalid data-format.\n");
+            return EXIT_FAILURE;
+        }
+        data->data_format = optarg;
     }
-    else if (memcmp(pszID, pszHKLM, lstrlenW(pszHKCU)) == 0)
+
+    if (arg == "mix")
     {
-        hKeyBase = HKEY_CURRENT_USER;
-        key_path = &pszID[lstrlenW(pszHKCU)];
+        data->mix = optarg;
     }
-    key_path += L"\\Attributes";
-    return key_path;
-}
-
-struct VOICE_TOKEN
-{
-    std::wstring id;
-    std::wstring name;
-    std::wstring full_name;
-    std::wstring age;
-    std::wstring gender;
-    std::wstring language;
-};
-
-static VOICE_TOKEN
-winsay_get_voice_token_info(LPCWSTR pszID, HKEY hSubKey)
-{
-    WCHAR szAge[MAX_PATH] = {};
-    WCHAR szGender[MAX_PATH] = {};
-    WCHAR szLanguage[MAX_PATH] = {};
-    WCHAR szName[MAX_PATH] = {};
-    DWORD cbValue;
 
-    cbValue = sizeof(szAge);
-    RegQueryValueExW(hSubKey, L"Age", NULL, NULL, LPBYTE(szAge), &cbValue);
-    cbValue = sizeof(szGender);
-    RegQueryValueExW(hSubKey, L"Gender", NULL, NULL, LPBYTE(szGender), &cbValue);
-    cbValue = sizeof(szLanguage);
-    RegQueryValueExW(hSubKey, L"Language", NULL, NULL, LPBYTE(szLanguage), &cbValue);
-    cbValue = sizeof(szName);
-    RegQueryValueExW(hSubKey, L"Name", NULL, NULL, LPBYTE(szName), &cbValue);
+    if (arg == "cache")
+    {
+        data->cache = true;
+        if (optarg)
+            data->cache_dir = optarg;
+    }
 
-    std::wstring name = szName;
+    if (arg == "cache-size")
+    {
+        char *endptr;
+        data->cache_size = strtol(optarg, &endptr, 10);
+        if (*endptr || data->cache_size < 0)
+        {
+            fprintf(stderr, "ERROR: invalid cache-size.\n");
+            return EXIT_FAILURE;
+        }
+    }
 
-    static const WCHAR szMicrosoftSp[] = L"Microsoft ";
-    size_t cchMicrosoftSp = wcslen(szMicrosoftSp);
-    if (name.size() > cchMicrosoftSp &&
-        name.substr(0, cchMicrosoftSp) == szMicrosoftSp)
+    if (arg == "compression")
     {
-        name.erase(0, cchMicrosoftSp);
+        char *endptr;
+        data->compression = strtol(optarg, &endptr, 10);
+        if (*endptr || data->compression < 0 || data->compression > 8)
+        {
+            fprintf(stderr, "ERROR: invalid compression.\n");
+            return EXIT_FAILURE;
+        }
     }
 
-    static const WCHAR szSpDesktop[] = L" Desktop";
-    size_t cchSpDesktop = wcslen(szSpDesktop);
-    if (name.size() > cchSpDesktop &&
-        name.substr(name.size() - cchSpDesktop, cchSpDesktop) == szSpDesktop)
+    if (arg == "stream")
     {
-        name = name.substr(0, name.size() - cchSpDesktop);
+        data->stream = true;
     }
 
-    if (0)
+    if (arg == "incremental")
     {
-        printf("age: %ls\n", szAge);
-        printf("gender: %ls\n", szGender);
-        printf("language: %ls\n", szLanguage);
-        printf("name: %ls\n", name.c_str());
+        data->incremental = true;
     }
 
-    VOICE_TOKEN token =
+    if (arg == "marks")
     {
-        pszID,
-        name,
-        szName,
-        szAge,
-        szGender,
-        szLanguage
-    };
-    return token;
-}
+        data->marks_file = optarg;
+    }
 
-static bool
-winsay_get_voices(const WCHAR *pszRequest,
-                  std::vector<VOICE_TOKEN>& tokens)
-{
-    // get voice category
-    ISpObjectTokenCategory *pCategory = NULL;
-    HRESULT hr = SpGetCategoryFromId(SPCAT_VOICES, &pCategory);
-    if (SUCCEEDED(hr) && pCategory)
+    if (arg == "parallel")
     {
-        // get object tokens
-        IEnumSpObjectTokens *pTokens = NULL;
-        hr = pCategory->EnumTokens(pszRequest, NULL, &pTokens);
-        if (SUCCEEDED(hr) && pTokens)
+        data->parallel = true;
+        data->jobs = 0;
+        if (optarg)
         {
-            // for each token
-            for (;;)
+            char *endptr;
+            data->jobs = strtol(optarg, &endptr, 10);
+            if (*endptr || data->jobs < 1 || data->jobs > 64)
             {
-                // get token
-                ISpObjectToken *pToken = NULL;
-                hr = pTokens->Next(1, &pToken, NULL);
-                if (FAILED(hr) || !pToken)
-                    break;
-
-                // get token id
-                LPWSTR pszID = NULL;
-                pToken->GetId(&pszID);
-                if (pszID)
-                {
-                    //printf("pszID: %ls\n", pszID);
-
-                    // read voice info from registry
-                    HKEY hKeyBase = NULL;
-                    std::wstring key_path = winsay_get_reg_path_from_id(hKeyBase, pszID);
-                    if (hKeyBase)
-                    {
-                        //printf("%ls\n", key_path.c_str());
-                        HKEY hSubKey = NULL;
-                        RegOpenKeyExW(hKeyBase, key_path.c_str(), 0, KEY_READ, &hSubKey);
-                        if (hSubKey)
-                        {
-                            VOICE_TOKEN token = winsay_get_voice_token_info(pszID, hSubKey);
-                            tokens.push_back(token);
-
-                            RegCloseKey(hSubKey);
-                        }
-                    }
-                    CoTaskMemFree(pszID);
-                    pszID = NULL;
-                }
-                pToken->Release();
-                pToken = NULL;
+                fprintf(stderr, "ERROR: invalid parallel.\n");
+                return EXIT_FAILURE;
             }
-            pTokens->Release();
-            pTokens = NULL;
         }
-        pCategory->Release();
-        pCategory = NULL;
     }
 
-    return !tokens.empty();
-}
-
-// make windows say
-extern "C" int
-winsay_say(WINSAY_DATA *data)
-{
-    if (0)
+    if (arg == "serve")
     {
-        printf("input-file: %s\n", data->input_file.c_str());
-        printf("output-file: %s\n", data->output_file.c_str());
-        printf("text: %s\n", data->text.c_str());
-        printf("voice: %s\n", data->voice.c_str());
+        data->serve_socket = optarg;
     }
 
-    // get available voices
-    std::vector<VOICE_TOKEN> voice_tokens;
-    if (!winsay_get_voices(NULL, voice_tokens))
+    if (arg == "client")
     {
-        fprintf(stderr, "ERROR: unable to enumerate voices.\n");
-        return EXIT_FAILURE;
+        data->client_socket = optarg;
     }
 
-    switch (data->mode)
+    if (arg == "split")
     {
-    case WINSAY_ENUMFILEFORMATS:
+        data->split = optarg;
+        if (data->split != "sentence" && data->split != "paragraph")
+        {
+            fprintf(stderr, "ERROR: invalid split.\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (arg == "gap")
+    {
+        char *endptr;
+        data->gap = strtol(optarg, &endptr, 10);
+        if (*endptr || data->gap < 0 || data->gap > 10000)
+        {
+            fprintf(stderr, "ERROR: invalid gap.\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (arg == "lexicon")
+    {
+        data->lexicon = optarg;
+    }
+
+    if (arg == "batch")
+    {
+        data->batch_file = optarg;
+    }
+
+    if (arg == "rate")
+    {
+        char *endptr;
+        data->rate = strtol(optarg, &endptr, 10);
+        if (*endptr || data->rate < -10 || data->rate > 10)
+        {
+            fprintf(stderr, "ERROR: invalid rate.\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (arg == "backend")
+    {
+        data->backend = optarg;
+    }
+
+    if (arg == "quality")
+    {
+        if (strcmp(optarg, "?") == 0)
+        {
+            data->mode = WINSAY_ENUMQUALITIES;
+            return EXIT_SUCCESS;
+        }
+
+        data->quality = -1;
+        for (int i = MRESAMPLER_LOW; i <= MRESAMPLER_BEST; ++i)
+        {
+            if (strcmp(optarg, MResampler::quality_name(i)) == 0 ||
+                (optarg[0] == char('0' + i) && optarg[1] == 0))
+            {
+                data->quality = i;
+            }
+        }
+        if (data->quality == -1)
+        {
+            fprintf(stderr, "ERROR: invalid quality.\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+
+    return EXIT_SUCCESS;
+}
+
+// parse the command line
+extern "C" int
+winsay_command_line(WINSAY_DATA *data, int argc, char **argv)
+{
+    int opt, opt_index;
+    std::string arg;
+
+    data->clear();
+
+    opterr = 0;  /* NOTE: opterr == 1 is not compatible to getopt_port */
+
+    // for each command line option
+    while ((opt = getopt_long(argc, argv, "hf:v:o:", winsay_opts, &opt_index)) != -1)
+    {
+        switch (opt)
+        {
+        case 0:     // no short option
+            arg = winsay_opts[opt_index].name;
+
+            if (arg == "version")
+            {
+                winsay_show_version();
+                exit(EXIT_SUCCESS);
+            }
+
+            if (winsay_parse_option(data, arg, optarg) != EXIT_SUCCESS)
+                return EXIT_FAILURE;
+            break;
+
+        case 'h':
+            winsay_show_help();
+            exit(EXIT_SUCCESS);
+            break;
+
+        case 'f':
+            winsay_parse_option(data, "input-file", optarg);
+            break;
+
+        case 'o':
+            winsay_parse_option(data, "output-file", optarg);
+            break;
+
+        case 'v':
+            if (winsay_parse_option(data, "voice", optarg) != EXIT_SUCCESS)
+                return EXIT_FAILURE;
+            break;
+
+        case '?':
+        default:
+            // error
+            switch (optopt)
+            {
+            case 'f':
+                if (!optarg)
+                {
+                    data->input_file = "-";
+                    continue;
+                }
+                break;
+
+            case 'o':
+                if (!optarg)
+                {
+                    fprintf(stderr, "ERROR: option '-%c' requires a parameter.\n", optopt);
+                }
+                break;
+
+            case 'v':
+                if (optarg)
+                {
+                    data->voice = "?";
+                    data->mode = WINSAY_ENUMVOICES;
+                }
+                else
+                {
+                    fprintf(stderr, "ERROR: option '-%c' requires a parameter.\n", optopt);
+                }
+                break;
+
+            case 0:
+                fprintf(stderr, "ERROR: invalid option.\n");
+                break;
+
+            default:
+                fprintf(stderr, "ERROR: invalid option '-%c'.\n", optopt);
+                break;
+            }
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (data->mix.size())
+    {
+        std::vector<float> matrix;
+        int in_channels;
+        if (!winsay_parse_mix(data->mix, data->channels, matrix, in_channels))
+        {
+            fprintf(stderr, "ERROR: invalid mix.\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    for (int i = optind; i < argc; ++i)
+    {
+        data->text += WCHAR(' ');
+        data->text += MAnsiToWide(CP_ACP, argv[i]).c_str();
+    }
+
+    if (data->batch_file.size() &&
+        (data->mode == WINSAY_SAY || data->mode == WINSAY_OUTPUT))
+    {
+        data->mode = WINSAY_BATCH;
+    }
+
+    if (data->serve_socket.size())
+    {
+        data->mode = WINSAY_SERVE;
+    }
+
+    switch (data->mode)
+    {
+    case WINSAY_SAY:
+    case WINSAY_OUTPUT:
+        // need input. the stream mode reads it later
+        if (data->text.empty() && !data->stream)
+        {
+            // no text. input now
+            if (!winsay_load_input(data->input_file, data->text))
+            {
+                fprintf(stderr, "ERROR: unable to open '%s'.\n", data->input_file.c_str());
+                return EXIT_FAILURE;
+            }
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    mstr_trim(data->text);
+
+    return EXIT_SUCCESS;
+}
+
+// the path of a cache file, or empty if there is no place for it.
+// the directory is $WINSAY_CACHE_DIR, or the per-user cache directory.
+static std::string
+winsay_get_cache_file(const char *name)
+{
+    std::string dir;
+    const char *env = getenv("WINSAY_CACHE_DIR");
+    if (env && *env)
+    {
+        dir = env;
+    }
+    else
+    {
+#ifdef _WIN32
+        env = getenv("LOCALAPPDATA");
+        if (!env || !*env)
+            return "";
+        dir = env;
+        dir += "\\winsay";
+#else
+        env = getenv("XDG_CACHE_HOME");
+        if (env && *env)
+        {
+            dir = env;
+        }
+        else
+        {
+            env = getenv("HOME");
+            if (!env || !*env)
+                return "";
+            dir = env;
+            dir += "/.cache";
+            mfile_make_dir(dir.c_str());
+        }
+        dir += "/winsay";
+#endif
+    }
+
+    if (!mfile_make_dir(dir.c_str()))
+        return "";
+
+#ifdef _WIN32
+    dir += '\\';
+#else
+    dir += '/';
+#endif
+    dir += name;
+    return dir;
+}
+
+// create the backend of "name[:options]". NULL if invalid
+static VoiceBackend *
+winsay_create_backend(const std::string& spec)
+{
+    std::string name = spec, options;
+    size_t colon = spec.find(':');
+    if (colon != std::string::npos)
+    {
+        name = spec.substr(0, colon);
+        options = spec.substr(colon + 1);
+    }
+
+    VoiceBackend *backend = NULL;
+#ifdef _WIN32
+    if (name == "sapi")
+        backend = new SapiVoiceBackend;
+#endif
+    if (name == "reference" || name == "ref")
+        backend = new RefVoiceBackend;
+
+    if (backend && !backend->Configure(options))
+    {
+        delete backend;
+        backend = NULL;
+    }
+    return backend;
+}
+
+// speak the segment aloud, or render it into the sink
+static bool
+winsay_speak_segment(VoiceBackend& backend, const MLexicon& lexicon,
+                     MStringW& segment, const VOICE_FORMAT& format,
+                     VoiceSink *sink)
+{
+    lexicon.apply(segment);
+    mstr_trim(segment);
+    if (segment.empty())
+        return true;
+    if (sink)
+        return backend.Render(segment, format, *sink);
+    return backend.Enqueue(segment);
+}
+
+// speak the input sentence by sentence while reading it
+static int
+winsay_say_stream(WINSAY_DATA *data, VoiceBackend& backend,
+                  const MLexicon& lexicon, const VOICE_FORMAT& format,
+                  VoiceSink *sink)
+{
+    winsay_input input;
+    if (!input.open(data->input_file))
+    {
+        fprintf(stderr, "ERROR: unable to open '%s'.\n", data->input_file.c_str());
+        return EXIT_FAILURE;
+    }
+
+    MTextDecoder decoder;
+    MTextSegmenter<WCHAR> segmenter;
+    MStringW text, segment;
+    const char *ptr;
+    size_t len;
+    bool ok = true;
+    while (ok && (ptr = input.next(len)) != NULL)
+    {
+        decoder.decode(ptr, len, text);
+        segmenter.feed(text);
+        text.clear();
+        while (ok && segmenter.next(segment))
+        {
+            ok = !(data->cancel && data->cancel->IsCancelled()) &&
+                 winsay_speak_segment(backend, lexicon, segment, format, sink);
+        }
+    }
+    if (input.failed())
+        ok = false;
+    decoder.decode(NULL, 0, text, true);
+    segmenter.feed(text);
+    while (ok && segmenter.flush(segment))
+    {
+        ok = !(data->cancel && data->cancel->IsCancelled()) &&
+             winsay_speak_segment(backend, lexicon, segment, format, sink);
+    }
+
+    ok = backend.WaitUntilDone() && ok;
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// renders the segments of a text on the voices of the worker threads, and
+// passes them to the sink in order. each worker has its own backend, and
+// renders up to a window ahead of the sink. the silence at the both ends of
+// the segments is replaced with the gap, so the output doesn't depend on the
+// number of the workers.
+class winsay_parallel
+{
+public:
+    winsay_parallel(const std::string& backend, const VOICE_TOKEN *pVoice,
+                    int rate, const VOICE_FORMAT& format)
+        : m_backend(backend), m_pVoice(pVoice), m_rate(rate), m_format(format),
+          m_next(0), m_written(0), m_window(0), m_quit(false)
+    {
+    }
+
+    // jobs is the number of the workers, or 0 for one per processor
+    bool render(const MStringW& text, MTextSegmentMode mode, int jobs,
+                int gap_ms, VoiceSink& sink);
+
+protected:
+    enum STATE
+    {
+        WAITING,
+        DONE,
+        FAILED
+    };
+    struct segment
+    {
+        MStringW text;
+        size_t offset;      // in the whole text
+        VoiceBufferSink buffer;
+        STATE state;
+    };
+
+    std::string m_backend;
+    const VOICE_TOKEN *m_pVoice;
+    int m_rate;
+    VOICE_FORMAT m_format;
+    std::vector<segment> m_segments;
+    size_t m_next;          // the next segment to render
+    size_t m_written;       // the segments passed to the sink
+    size_t m_window;
+    bool m_quit;
+    MMutex m_mutex;
+    MCondition m_done;      // a segment is rendered
+    MCondition m_room;      // a segment is passed
+
+    static void worker_proc(void *self);
+    void work(VoiceBackend *backend);
+    void trim(VoiceBufferSink& buffer) const;
+};
+
+void
+winsay_parallel::worker_proc(void *self)
+{
+    winsay_parallel *pThis = (winsay_parallel *)self;
+    winsay_co_init co_init;
+    VoiceBackend *backend = winsay_create_backend(pThis->m_backend);
+    if (backend && (!backend->SetVoice(pThis->m_pVoice) || !backend->SetRate(pThis->m_rate)))
+    {
+        delete backend;
+        backend = NULL;
+    }
+    pThis->work(backend);
+    delete backend;
+}
+
+// render the segments one by one. all fail without the backend
+void
+winsay_parallel::work(VoiceBackend *backend)
+{
+    MScopedLock lock(m_mutex);
+    for (;;)
+    {
+        while (!m_quit && m_next < m_segments.size() && m_next >= m_written + m_window)
+            m_room.wait(m_mutex);
+        if (m_quit || m_next >= m_segments.size())
+            break;
+
+        segment& seg = m_segments[m_next++];
+        m_mutex.unlock();
+        bool ok = backend && backend->Render(seg.text, m_format, seg.buffer);
+        if (ok)
+            trim(seg.buffer);
+        m_mutex.lock();
+
+        seg.state = ok ? DONE : FAILED;
+        m_done.broadcast();
+    }
+}
+
+// remove the silence at the both ends, moving the events
+void
+winsay_parallel::trim(VoiceBufferSink& buffer) const
+{
+    std::vector<unsigned char>& audio = buffer.Audio();
+    const size_t frame_size = m_format.BlockAlign();
+    const size_t frames = audio.size() / frame_size;
+    const bool bits8 = (m_format.bits_per_sample == 8);
+
+    // the first and the last frames louder than about -72 dB
+    size_t first = frames, last = 0;
+    for (size_t i = 0; i < frames; ++i)
+    {
+        const unsigned char *ptr = &audio[i * frame_size];
+        for (int ch = 0; ch < m_format.channels; ++ch)
+        {
+            int value = bits8 ? (ptr[ch] - 128) * 256
+                              : int16_t(ptr[ch * 2] | (ptr[ch * 2 + 1] << 8));
+            if (value > 8 || value < -8)
+            {
+                if (first == frames)
+                    first = i;
+                last = i + 1;
+                break;
+            }
+        }
+    }
+    if (first == frames)
+        first = last = 0;
+
+    audio.resize(last * frame_size);
+    audio.erase(audio.begin(), audio.begin() + first * frame_size);
+
+    std::vector<VOICE_EVENT>& events = buffer.Events();
+    for (size_t i = 0; i < events.size(); ++i)
+    {
+        uint64_t sample = events[i].sample;
+        sample = (sample > first) ? sample - first : 0;
+        events[i].sample = (sample < last - first) ? sample : last - first;
+    }
+}
+
+bool
+winsay_parallel::render(const MStringW& text, MTextSegmentMode mode, int jobs,
+                        int gap_ms, VoiceSink& sink)
+{
+    // the segments and their places in the text
+    MTextSegmenter<WCHAR> segmenter(mode);
+    MStringW str;
+    size_t offset = 0;
+    segmenter.feed(text);
+    while (segmenter.next(str) || segmenter.flush(str))
+    {
+        mstr_trim(str);
+        if (str.empty())
+            continue;
+        segment seg;
+        seg.text = str;
+        seg.offset = text.find(str, offset);
+        if (seg.offset == MStringW::npos)
+            seg.offset = offset;
+        offset = seg.offset + str.size();
+        seg.state = WAITING;
+        m_segments.push_back(seg);
+    }
+    if (m_segments.empty())
+        return true;
+
+    // start the workers
+    if (jobs <= 0)
+        jobs = mthread_cpu_count();
+    if (size_t(jobs) > m_segments.size())
+        jobs = int(m_segments.size());
+    m_window = size_t(jobs) * 4;
+    std::vector<MThread *> threads;
+    for (int i = 0; i < jobs; ++i)
+    {
+        MThread *thread = new MThread;
+        if (!thread->create(worker_proc, this))
+        {
+            delete thread;
+            break;
+        }
+        threads.push_back(thread);
+    }
+
+    // pass the segments in order
+    const size_t frame_size = m_format.BlockAlign();
+    std::vector<unsigned char> gap(size_t(m_format.samples_per_sec) * gap_ms / 1000 * frame_size,
+                                   (m_format.bits_per_sample == 8) ? 0x80 : 0);
+    uint64_t position = 0;
+    bool ok = !threads.empty();
+    for (size_t i = 0; ok && i < m_segments.size(); ++i)
+    {
+        segment& seg = m_segments[i];
+        {
+            MScopedLock lock(m_mutex);
+            while (seg.state == WAITING)
+                m_done.wait(m_mutex);
+        }
+        if (seg.state == FAILED)
+        {
+            ok = false;
+            break;
+        }
+
+        if (i > 0 && gap.size())
+        {
+            ok = sink.OnAudio(&gap[0], gap.size());
+            position += gap.size() / frame_size;
+        }
+
+        std::vector<VOICE_EVENT>& events = seg.buffer.Events();
+        for (size_t k = 0; k < events.size(); ++k)
+        {
+            VOICE_EVENT event = events[k];
+            event.sample += position;
+            event.text_offset += seg.offset;
+            sink.OnEvent(event);
+        }
+
+        std::vector<unsigned char>& audio = seg.buffer.Audio();
+        if (ok && audio.size())
+            ok = sink.OnAudio(&audio[0], audio.size());
+        position += audio.size() / frame_size;
+        std::vector<unsigned char>().swap(audio);
+
+        MScopedLock lock(m_mutex);
+        ++m_written;
+        m_room.broadcast();
+    }
+
+    // stop the workers
+    {
+        MScopedLock lock(m_mutex);
+        m_quit = true;
+        m_room.broadcast();
+    }
+    for (size_t i = 0; i < threads.size(); ++i)
+    {
+        threads[i]->join();
+        delete threads[i];
+    }
+    return ok;
+}
+
+// the current time in milliseconds
+static double
+winsay_get_msec(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return double(count.QuadPart) * 1000.0 / double(freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return double(ts.tv_sec) * 1000.0 + double(ts.tv_nsec) / 1000000.0;
+#endif
+}
+
+// an event for the marks file, or the end of the audio
+struct winsay_mark
+{
+    VOICE_EVENT event;
+    bool end;
+};
+
+// writes the events of the rendering into the file of --marks: the JSON
+// lines of the sentences, the words and the visemes, or the sentences as
+// the SRT or WebVTT subtitles. the events go through a lock-free ring to
+// the writer thread, so the rendering thread doesn't format or write them.
+// if the ring is full, the rendering thread keeps them in its backlog.
+class winsay_marks : public VoiceSink
+{
+public:
+    winsay_marks(VoiceSink& sink)
+        : m_sink(sink), m_fp(NULL), m_type(JSONL), m_text(NULL), m_rate(0),
+          m_frame_size(1), m_bytes(0), m_closing(false), m_ok(true), m_cue(0),
+          m_cue_open(false), m_cue_start(0), m_cue_offset(0), m_cue_length(0)
+    {
+    }
+
+    ~winsay_marks()
+    {
+        Close();
+    }
+
+    // the format is of the extension .srt, .vtt or else JSON lines. the
+    // text of the events must live until Close()
+    bool Open(const std::string& filename, const MStringW& text,
+              int samples_per_sec, int frame_size);
+    // write the rest and close. false on error
+    bool Close();
+
+    virtual bool OnAudio(const void *data, size_t size)
+    {
+        m_bytes += size;
+        return m_sink.OnAudio(data, size);
+    }
+
+    virtual void OnEvent(const VOICE_EVENT& event)
+    {
+        if (m_fp)
+            Push(event);
+        m_sink.OnEvent(event);
+    }
+
+protected:
+    enum TYPE { JSONL, SRT, VTT };
+
+    VoiceSink& m_sink;
+    FILE *m_fp;
+    TYPE m_type;
+    const MStringW *m_text;
+    int m_rate;
+    size_t m_frame_size;
+    uint64_t m_bytes;
+    MLockFreeRing<winsay_mark> m_ring;
+    std::deque<winsay_mark> m_backlog;
+    MThread m_thread;
+    MMutex m_mutex;         // of the waiting of the writer
+    MCondition m_cond;      // the ring is not empty, or Close()
+    bool m_closing;
+
+    // of the writer thread
+    bool m_ok;
+    int m_cue;              // the number of the cues
+    bool m_cue_open;        // the sentence waits for the end
+    uint64_t m_cue_start;
+    size_t m_cue_offset;
+    size_t m_cue_length;
+
+    void Push(const VOICE_EVENT& event);
+    bool PushRing(const winsay_mark& mark);
+    static void WriterProc(void *self);
+    void Write(const winsay_mark& mark);
+    void WriteCue(uint64_t end);
+    std::string GetText(size_t offset, size_t length) const;
+    std::string GetTime(uint64_t sample) const;
+};
+
+bool
+winsay_marks::Open(const std::string& filename, const MStringW& text,
+                   int samples_per_sec, int frame_size)
+{
+    Close();
+
+    std::string ext;
+    size_t i = filename.find_last_of("./\\");
+    if (i != std::string::npos && filename[i] == '.')
+        ext = filename.substr(i);
+    for (i = 0; i < ext.size(); ++i)
+        ext[i] = char(tolower((unsigned char)ext[i]));
+    m_type = (ext == ".srt") ? SRT : ((ext == ".vtt") ? VTT : JSONL);
+
+    if (!m_ring.init(4096))
+        return false;
+    m_fp = fopen(filename.c_str(), "wb");
+    if (!m_fp)
+        return false;
+
+    m_text = &text;
+    m_rate = samples_per_sec;
+    m_frame_size = (frame_size > 0) ? size_t(frame_size) : 1;
+    m_bytes = 0;
+    m_closing = false;
+    m_ok = true;
+    m_cue = 0;
+    m_cue_open = false;
+    if (m_type == VTT)
+        m_ok = fputs("WEBVTT\n\n", m_fp) >= 0;
+
+    if (!m_thread.create(WriterProc, this))
+    {
+        fclose(m_fp);
+        m_fp = NULL;
+        return false;
+    }
+    return true;
+}
+
+bool
+winsay_marks::Close()
+{
+    if (!m_fp)
+        return true;
+
+    // the writer empties the ring and quits
+    {
+        MScopedLock lock(m_mutex);
+        m_closing = true;
+        m_cond.signal();
+    }
+    m_thread.join();
+
+    // the rest of the backlog and the end, after the ring
+    while (!m_backlog.empty())
+    {
+        Write(m_backlog.front());
+        m_backlog.pop_front();
+    }
+    winsay_mark mark;
+    memset(&mark, 0, sizeof(mark));
+    mark.event.sample = m_bytes / m_frame_size;
+    mark.end = true;
+    Write(mark);
+
+    bool ok = m_ok;
+    ok = (fclose(m_fp) == 0) && ok;
+    m_fp = NULL;
+    return ok;
+}
+
+// keep the order after the backlog
+void
+winsay_marks::Push(const VOICE_EVENT& event)
+{
+    winsay_mark mark;
+    mark.event = event;
+    mark.end = false;
+    while (!m_backlog.empty() && PushRing(m_backlog.front()))
+        m_backlog.pop_front();
+    if (!m_backlog.empty() || !PushRing(mark))
+        m_backlog.push_back(mark);
+}
+
+// wake the writer only if the ring was empty
+bool
+winsay_marks::PushRing(const winsay_mark& mark)
+{
+    bool was_empty;
+    if (!m_ring.push(mark, was_empty))
+        return false;
+    if (was_empty)
+    {
+        MScopedLock lock(m_mutex);
+        m_cond.signal();
+    }
+    return true;
+}
+
+void
+winsay_marks::WriterProc(void *self)
+{
+    winsay_marks *pThis = (winsay_marks *)self;
+    winsay_mark mark;
+    for (;;)
+    {
+        if (pThis->m_ring.pop(mark))
+        {
+            pThis->Write(mark);
+            continue;
+        }
+
+        MScopedLock lock(pThis->m_mutex);
+        if (!pThis->m_ring.empty())
+            continue;
+        if (pThis->m_closing)
+            break;
+        pThis->m_cond.wait(pThis->m_mutex);
+    }
+}
+
+void
+winsay_marks::Write(const winsay_mark& mark)
+{
+    static const char *s_types[] = { "sentence", "word", "viseme" };
+    const VOICE_EVENT& event = mark.event;
+
+    if (m_type != JSONL)
+    {
+        // a sentence ends at the next one or at the end
+        if (mark.end || event.type == VOICE_EVENT_SENTENCE)
+        {
+            if (m_cue_open)
+                WriteCue(event.sample);
+            m_cue_open = !mark.end;
+            m_cue_start = event.sample;
+            m_cue_offset = event.text_offset;
+            m_cue_length = event.text_length;
+        }
+        return;
+    }
+
+    std::string line = "{\"type\":\"";
+    line += mark.end ? "end" : s_types[event.type];
+    char buf[128];
+    sprintf(buf, "\",\"sample\":%llu,\"time\":%s", (unsigned long long)event.sample,
+            GetTime(event.sample).c_str());
+    line += buf;
+    if (!mark.end)
+    {
+        sprintf(buf, ",\"offset\":%llu,\"length\":%llu",
+                (unsigned long long)event.text_offset, (unsigned long long)event.text_length);
+        line += buf;
+    }
+    if (mark.end)
+    {
+        line += "}\n";
+    }
+    else if (event.type == VOICE_EVENT_VISEME)
+    {
+        sprintf(buf, ",\"viseme\":%d,\"duration\":%d}\n", event.viseme, event.duration);
+        line += buf;
+    }
+    else
+    {
+        // the text in a JSON string
+        std::string text = GetText(event.text_offset, event.text_length);
+        line += ",\"text\":\"";
+        for (size_t i = 0; i < text.size(); ++i)
+        {
+            unsigned char ch = (unsigned char)text[i];
+            if (ch == '"' || ch == '\\')
+            {
+                line += '\\';
+                line += char(ch);
+            }
+            else if (ch < 0x20)
+            {
+                sprintf(buf, "\\u%04x", ch);
+                line += buf;
+            }
+            else
+            {
+                line += char(ch);
+            }
+        }
+        line += "\"}\n";
+    }
+
+    if (fwrite(line.data(), 1, line.size(), m_fp) != line.size())
+        m_ok = false;
+}
+
+// write a subtitle of the sentence
+void
+winsay_marks::WriteCue(uint64_t end)
+{
+    std::string text = GetText(m_cue_offset, m_cue_length);
+    if (end < m_cue_start)
+        end = m_cue_start;
+
+    // one line of the words
+    std::string cue;
+    for (size_t i = 0; i < text.size(); ++i)
+    {
+        char ch = text[i];
+        if ((unsigned char)ch <= ' ')
+        {
+            if (cue.size() && cue[cue.size() - 1] != ' ')
+                cue += ' ';
+        }
+        else if (m_type == VTT && ch == '&')
+            cue += "&amp;";
+        else if (m_type == VTT && ch == '<')
+            cue += "&lt;";
+        else if (m_type == VTT && ch == '>')
+            cue += "&gt;";
+        else
+            cue += ch;
+    }
+    if (cue.size() && cue[cue.size() - 1] == ' ')
+        cue.resize(cue.size() - 1);
+    if (cue.empty())
+        return;
+
+    // hh:mm:ss,mmm for SRT and hh:mm:ss.mmm for WebVTT
+    std::string times[2];
+    uint64_t samples[2] = { m_cue_start, end };
+    for (int k = 0; k < 2; ++k)
+    {
+        uint64_t msec = (samples[k] * 1000 + m_rate / 2) / m_rate;
+        char buf[32];
+        sprintf(buf, "%02u:%02u:%02u%c%03u", unsigned(msec / 3600000),
+                unsigned(msec / 60000 % 60), unsigned(msec / 1000 % 60),
+                (m_type == SRT) ? ',' : '.', unsigned(msec % 1000));
+        times[k] = buf;
+    }
+
+    ++m_cue;
+    if (m_type == SRT && fprintf(m_fp, "%d\n", m_cue) < 0)
+        m_ok = false;
+    if (fprintf(m_fp, "%s --> %s\n%s\n\n", times[0].c_str(), times[1].c_str(),
+                cue.c_str()) < 0)
+    {
+        m_ok = false;
+    }
+}
+
+// the text of the event in UTF-8
+std::string
+winsay_marks::GetText(size_t offset, size_t length) const
+{
+    const MStringW& text = *m_text;
+    if (offset > text.size())
+        return std::string();
+    if (length > text.size() - offset)
+        length = text.size() - offset;
+    return MWideToAnsi(CP_UTF8, text.data() + offset, length).c_str();
+}
+
+// the seconds of the sample
+std::string
+winsay_marks::GetTime(uint64_t sample) const
+{
+    char buf[32];
+    sprintf(buf, "%.6f", double(sample) / m_rate);
+    return buf;
+}
+
+// a segment of the text in the output of --incremental
+struct winsay_segment
+{
+    std::string hash;   // of the render key and the text
+    uint64_t start;     // the first frame
+    uint64_t frames;
+};
+
+// the sidecar manifest of the output, "output-file.segments". the first
+// line has the hash of the render key and the layout of the output file.
+// a segment follows per line.
+struct winsay_manifest
+{
+    std::string key;
+    uint64_t header_size;
+    uint64_t frame_size;
+    uint64_t file_size;
+    std::vector<winsay_segment> segments;
+
+    winsay_manifest() : header_size(0), frame_size(0), file_size(0)
+    {
+    }
+};
+
+static bool
+winsay_load_manifest(const std::string& filename, winsay_manifest& manifest)
+{
+    FILE *fp = fopen(filename.c_str(), "rb");
+    if (!fp)
+        return false;
+
+    // the sizes of RF64 are beyond 32 bits
+    char line[256], hash[33];
+    unsigned long long values[3];
+    bool ok = fgets(line, sizeof(line), fp) &&
+              sscanf(line, "winsay-segments\t1\t%32s\t%llu\t%llu\t%llu", hash,
+                     &values[0], &values[1], &values[2]) == 4;
+    if (ok)
+    {
+        manifest.key = hash;
+        manifest.header_size = values[0];
+        manifest.frame_size = values[1];
+        manifest.file_size = values[2];
+    }
+    while (ok && fgets(line, sizeof(line), fp))
+    {
+        winsay_segment segment;
+        ok = sscanf(line, "%32s\t%llu\t%llu", hash, &values[0], &values[1]) == 3;
+        segment.hash = hash;
+        segment.start = values[0];
+        segment.frames = values[1];
+        manifest.segments.push_back(segment);
+    }
+    fclose(fp);
+    return ok;
+}
+
+static bool
+winsay_save_manifest(const std::string& filename, const winsay_manifest& manifest)
+{
+    char buf[128];
+    sprintf(buf, "winsay-segments\t1\t%s\t%llu\t%llu\t%llu\n", manifest.key.c_str(),
+            (unsigned long long)manifest.header_size,
+            (unsigned long long)manifest.frame_size,
+            (unsigned long long)manifest.file_size);
+    std::string text = buf;
+    for (size_t i = 0; i < manifest.segments.size(); ++i)
+    {
+        const winsay_segment& segment = manifest.segments[i];
+        sprintf(buf, "%s\t%llu\t%llu\n", segment.hash.c_str(),
+                (unsigned long long)segment.start, (unsigned long long)segment.frames);
+        text += buf;
+    }
+    return mfile_write_atomic(filename.c_str(), text.data(), text.size());
+}
+
+// the objects shared by the utterances of one process
+class winsay_session
+{
+public:
+    winsay_session(VoiceBackend& backend, VoiceCatalog& catalog)
+        : m_backend(backend), m_catalog(catalog), m_pCurrentVoice(NULL),
+          m_voice_set(false)
+    {
+    }
+
+    bool load_lexicon(const std::string& lexicon_file)
+    {
+        if (m_lexicon_file == lexicon_file)
+            return true;
+        m_lexicon_file = lexicon_file;
+        if (lexicon_file.empty())
+        {
+            m_lexicon.clear();
+            return true;
+        }
+        return m_lexicon.load(lexicon_file.c_str());
+    }
+
+    bool open_cache(const std::string& dir, int size_mb)
+    {
+        return m_cache.open(dir.c_str(), uint64_t(size_mb) * 1024 * 1024);
+    }
+
+    const MFileCache& cache() const
+    {
+        return m_cache;
+    }
+
+    // speak the text or the input file of data
+    int render(WINSAY_DATA *data);
+
+protected:
+    VoiceBackend& m_backend;
+    VoiceCatalog& m_catalog;
+    MLexicon m_lexicon;
+    MFileCache m_cache;
+    std::string m_lexicon_file;
+    std::map<std::string, const VOICE_TOKEN *> m_voices;  // by voice query
+    const VOICE_TOKEN *m_pCurrentVoice;
+    bool m_voice_set;
+
+    const VOICE_TOKEN *find_voice(const std::string& voice);
+    bool render_segments(WINSAY_DATA *data, const std::string& key,
+                         const VOICE_FORMAT& format, VoiceSink& sink,
+                         VoiceResampleSink *resampler, VoiceSpliceSink& splice,
+                         winsay_manifest& manifest);
+};
+
+// the text in UTF-8 for the keys. the text is canonicalized so that the
+// spaces and the newlines don't make another key.
+static std::string
+winsay_canonical_text(const MStringW& str)
+{
+    MStringW text;
+    bool space = false;
+    for (size_t i = 0; i < str.size(); ++i)
+    {
+        WCHAR ch = str[i];
+        if (ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n' ||
+            ch == '\f' || ch == '\v' || ch == 0x3000)
+        {
+            space = true;
+            continue;
+        }
+        if (space && text.size())
+            text += WCHAR(' ');
+        space = false;
+        text += ch;
+    }
+    return MWideToAnsi(CP_UTF8, text.c_str()).c_str();
+}
+
+// the parameters of the rendering but the text, for the cache and the
+// segments of --incremental
+static std::string
+winsay_render_key(const WINSAY_DATA *data, const VOICE_TOKEN *pVoice,
+                  const std::string& ext)
+{
+    char buf[128];
+    sprintf(buf, "%d\n%d\n%d\n%d\n%d\n", data->rate, data->bit_rate,
+            data->channels, data->quality, (ext == ".flac") ? data->compression : 0);
+
+    std::string key = "winsay render 1\n";
+    key += data->backend + "\n";
+    if (pVoice)
+        key += MWideToAnsi(CP_UTF8, pVoice->id.c_str()).c_str();
+    key += "\n";
+    key += buf;
+    key += data->data_format + "\n" + data->mix + "\n" + ext + "\n";
+    if (data->parallel)
+    {
+        sprintf(buf, "%d\n", data->gap);
+        key += "parallel\n" + data->split + "\n" + buf;
+    }
+    return key;
+}
+
+// render the text sentence by sentence. the sentences in the manifest of
+// the last output are copied from the output file. the others are rendered
+// and crossfade with the copied ones.
+bool
+winsay_session::render_segments(WINSAY_DATA *data, const std::string& key,
+                                const VOICE_FORMAT& format, VoiceSink& sink,
+                                VoiceResampleSink *resampler, VoiceSpliceSink& splice,
+                                winsay_manifest& manifest)
+{
+    // the sentences
+    MTextSegmenter<WCHAR> segmenter;
+    std::vector<MStringW> texts;
+    MStringW segment;
+    segmenter.feed(data->text);
+    while (segmenter.next(segment) || segmenter.flush(segment))
+    {
+        mstr_trim(segment);
+        if (segment.size())
+            texts.push_back(segment);
+    }
+
+    // the last output and its segments by hash
+    winsay_manifest old;
+    MFileMapping mapping;
+    std::map<std::string, size_t> old_index;
+    const unsigned char *old_data = NULL;
+    const std::string manifest_file = data->output_file + ".segments";
+    if (winsay_load_manifest(manifest_file, old) && old.key == manifest.key &&
+        old.header_size == manifest.header_size && old.frame_size == manifest.frame_size &&
+        mapping.open(data->output_file.c_str()) && mapping.size() == old.file_size &&
+        old.file_size > old.header_size)
+    {
+        old_data = (const unsigned char *)mapping.data() + old.header_size;
+        const uint64_t old_frames = (old.file_size - old.header_size) / old.frame_size;
+        for (size_t i = 0; i < old.segments.size(); ++i)
+        {
+            if (old.segments[i].start + old.segments[i].frames <= old_frames)
+                old_index.insert(std::make_pair(old.segments[i].hash, i));
+        }
+    }
+
+    const size_t frame_size = size_t(manifest.frame_size);
+    size_t last = size_t(-1);   // the last segment copied, or -1
+    uint64_t last_end = 0;      // its end in the last output
+    bool ok = true;
+    for (size_t i = 0; ok && i < texts.size(); ++i)
+    {
+        winsay_segment seg;
+        seg.hash = MFileCache::make_name(key + winsay_canonical_text(texts[i]));
+
+        std::map<std::string, size_t>::iterator it = old_index.find(seg.hash);
+        if (it == old_index.end())
+        {
+            // a new one. the new ones join as rendered all at once
+            seg.start = (last != size_t(-1)) ? splice.Join() : splice.Position();
+            ok = m_backend.Render(texts[i], format, sink);
+            if (ok && resampler)
+                ok = resampler->Finish();
+            seg.frames = splice.Position() - seg.start;
+            last = size_t(-1);
+        }
+        else
+        {
+            const winsay_segment& prev = old.segments[it->second];
+            const uint64_t end = prev.start + prev.frames;
+            if (last != size_t(-1) && it->second == last + 1 &&
+                prev.start <= last_end && last_end <= end)
+            {
+                // the sequel in the last output, crossfaded already
+                seg.start = splice.Position() - (last_end - prev.start);
+                ok = splice.OnAudio(old_data + last_end * frame_size,
+                                    size_t(end - last_end) * frame_size);
+            }
+            else
+            {
+                seg.start = splice.Join();
+                ok = splice.OnAudio(old_data + prev.start * frame_size,
+                                    size_t(prev.frames) * frame_size);
+            }
+            seg.frames = prev.frames;
+            last = it->second;
+            last_end = end;
+        }
+        manifest.segments.push_back(seg);
+    }
+    return ok;
+}
+
+// NULL if no such voice
+const VOICE_TOKEN *
+winsay_session::find_voice(const std::string& voice)
+{
+    std::map<std::string, const VOICE_TOKEN *>::iterator it = m_voices.find(voice);
+    if (it != m_voices.end())
+        return it->second;
+
+    const VOICE_TOKEN *token = NULL;
+    MAnsiToWide wVoice(CP_ACP, voice.c_str());
+    size_t index;
+    if (m_catalog.Index().Find(MStringViewW(wVoice.c_str(), wVoice.size()), index))
+    {
+        token = &m_catalog.Voices()[index];
+    }
+    else
+    {
+        fprintf(stderr, "WARNING: no voice matches '%s'.\n", voice.c_str());
+    }
+
+    m_voices[voice] = token;
+    return token;
+}
+
+int
+winsay_session::render(WINSAY_DATA *data)
+{
+    // set the voice. NULL is the default voice
+    const VOICE_TOKEN *pVoice = NULL;
+    if (data->voice.size())
+        pVoice = find_voice(data->voice);
+    if (!m_voice_set || pVoice != m_pCurrentVoice)
+    {
+        m_backend.SetVoice(pVoice);
+        m_pCurrentVoice = pVoice;
+        m_voice_set = true;
+    }
+    m_backend.SetRate(data->rate);
+
+    // the whole text, or the input read while speaking
+    const bool whole = !(data->stream && data->text.empty());
+    if (whole)
+        m_lexicon.apply(data->text);
+
+    // take care of output file
+    std::string cache_name, cache_temp, render_file;
+    std::string render_key;
+    winsay_manifest manifest;
+    bool incremental = false;
+    VOICE_FORMAT format(data->bit_rate, data->channels, 16);
+    VOICE_FORMAT render_format = format;
+    VoiceFileSink file_sink;
+    winsay_marks marks(file_sink);
+    VoiceCancelSink cancel_sink(marks, data->cancel);
+    VoiceSpliceSink splice_sink(cancel_sink);
+    VoiceConvertSink convert_sink(splice_sink);
+    VoiceResampleSink resample_sink(convert_sink);
+    VoiceSink *sink = NULL;
+    if (data->output_file.size())
+    {
+        // add dot
+        if (data->file_format.size() && data->file_format[0] != '.')
+        {
+            data->file_format = "." + data->file_format;
+        }
+
+        // get the extension
+        std::string ext;
+        if (data->output_file == "-")
+        {
+            // the standard output has no extension
+            ext = data->file_format;
+        }
+        else
+        {
+            size_t i = data->output_file.find_last_of("./\\");
+            if (i != std::string::npos && data->output_file[i] == '.')
+                ext = data->output_file.substr(i);
+        }
+        for (size_t i = 0; i < ext.size(); ++i)
+        {
+            ext[i] = char(tolower((unsigned char)ext[i]));
+        }
+
+        if (ext != ".wav" && ext != ".flac" && ext != ".raw" && ext != ".pcm" &&
+            ext != data->file_format && data->output_file != "-")
+        {
+            data->output_file += data->file_format;
+            ext = data->file_format;
+        }
+        render_file = data->output_file;
+        bool raw = (ext == ".raw" || ext == ".pcm");
+        bool flac = (ext == ".flac");
+
+        // the sample format. the WAVE and FLAC files are little-endian.
+        // the 8-bit samples of WAVE are unsigned, of FLAC signed
+        // IMA ADPCM is encoded from the 16-bit PCM by the file sink
+        MSampleFormat sample_format;
+        bool adpcm = (data->data_format == "ima-adpcm");
+        if (!msample_parse_format(adpcm ? "int16" : data->data_format.c_str(),
+                                  sample_format))
+        {
+            fprintf(stderr, "ERROR: invalid data-format.\n");
+            return EXIT_FAILURE;
+        }
+        if (!raw)
+        {
+            if (sample_format.big_endian)
+            {
+                fprintf(stderr, "ERROR: big-endian data needs the raw file format.\n");
+                return EXIT_FAILURE;
+            }
+            if (sample_format.type == MSAMPLE_INT8 && !flac)
+                sample_format.type = MSAMPLE_UINT8;
+            if (sample_format.type == MSAMPLE_UINT8 && flac)
+                sample_format.type = MSAMPLE_INT8;
+        }
+        if (flac && (sample_format.is_float() || sample_format.bits() > 24 ||
+                     sample_format.is_g711() || adpcm))
+        {
+            fprintf(stderr, "ERROR: FLAC needs 8-, 16- or 24-bit integer data.\n");
+            return EXIT_FAILURE;
+        }
+        format.bits_per_sample = sample_format.bits();
+        if (sample_format.is_float())
+            format.format_tag = MWaveWriter::TAG_FLOAT;
+        else if (sample_format.type == MSAMPLE_MULAW)
+            format.format_tag = MWaveWriter::TAG_MULAW;
+        else if (sample_format.type == MSAMPLE_ALAW)
+            format.format_tag = MWaveWriter::TAG_ALAW;
+        if (adpcm)
+        {
+            format.bits_per_sample = 4;
+            format.format_tag = MWaveWriter::TAG_IMA_ADPCM;
+        }
+
+        // render one or two channels and mix them into the others
+        std::vector<float> matrix;
+        int in_channels = (format.channels <= 2) ? format.channels : 1;
+        if (data->mix.size() &&
+            !winsay_parse_mix(data->mix, format.channels, matrix, in_channels))
+        {
+            fprintf(stderr, "ERROR: invalid mix.\n");
+            return EXIT_FAILURE;
+        }
+        render_format.channels = in_channels;
+
+        // render the changed sentences only into a new file, and replace
+        // the output with it
+        if (data->incremental)
+        {
+            if (whole && !flac && !adpcm && data->output_file != "-")
+            {
+                incremental = true;
+                render_key = winsay_render_key(data, pVoice, ext);
+                render_file = mfile_temp_name(data->output_file.c_str());
+            }
+            else
+            {
+                fprintf(stderr, "WARNING: --incremental needs the text and an output file "
+                                "of neither FLAC nor IMA ADPCM.\n");
+            }
+        }
+
+        // the same rendering in the cache skips the backend
+        if (m_cache.is_open() && whole && !incremental && data->marks_file.empty())
+        {
+            cache_name = MFileCache::make_name(winsay_render_key(data, pVoice, ext) +
+                                               winsay_canonical_text(data->text),
+                                               ext.c_str());
+            // once a part of a hit has gone into the stream, the stream
+            // can't take a new rendering from the beginning
+            MFileMapping mapping;
+            if (data->output_file == "-" && m_cache.fetch(cache_name, mapping))
+            {
+                bool ok;
+                if (data->output_proc)
+                {
+                    ok = data->output_proc(data->output_context, mapping.data(),
+                                           mapping.size());
+                }
+                else
+                {
+#ifdef _WIN32
+                    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+                    ok = fwrite(mapping.data(), 1, mapping.size(), stdout) == mapping.size() &&
+                         fflush(stdout) == 0;
+                }
+                if (!ok)
+                {
+                    fprintf(stderr, "ERROR: unable to write the output.\n");
+                    return EXIT_FAILURE;
+                }
+                return EXIT_SUCCESS;
+            }
+            if (data->output_file != "-" &&
+                m_cache.fetch(cache_name, data->output_file.c_str()))
+            {
+                return EXIT_SUCCESS;
+            }
+
+            // render into a new entry and copy it, as the output file may
+            // be changed by another process
+            if (data->output_file != "-")
+                render_file = cache_temp = m_cache.begin_store(cache_name);
+        }
+
+        // preallocate the file for about 10 characters per second
+        uint64_t chars = data->text.size(), input_size, mtime;
+        if (data->stream && chars == 0 &&
+            mfile_get_stat(data->input_file.c_str(), input_size, mtime))
+        {
+            chars = input_size;
+        }
+        uint64_t expected_size = chars * format.samples_per_sec / 10 *
+                                 format.channels * format.bits_per_sample / 8;
+
+        // convert the samples and the channels if needed, and the sample
+        // rate if the backend can't render at it. check before any file
+        if (!convert_sink.Init(in_channels, format.channels, sample_format, matrix))
+        {
+            fprintf(stderr, "ERROR: unable to convert the samples.\n");
+            return EXIT_FAILURE;
+        }
+        render_format.samples_per_sec = m_backend.GetRenderRate(format.samples_per_sec);
+        if (render_format.samples_per_sec != format.samples_per_sec &&
+            !resample_sink.Init(render_format.samples_per_sec, format.samples_per_sec,
+                                in_channels, data->quality))
+        {
+            fprintf(stderr, "ERROR: unable to convert %d Hz to %d Hz.\n",
+                    render_format.samples_per_sec, format.samples_per_sec);
+            return EXIT_FAILURE;
+        }
+
+        // the events into the marks file
+        if (data->marks_file.size())
+        {
+            if (!whole || incremental)
+            {
+                fprintf(stderr, "WARNING: --marks needs the text, without --incremental.\n");
+            }
+            else if (!marks.Open(data->marks_file, data->text, format.samples_per_sec,
+                                 format.channels * sample_format.bits() / 8))
+            {
+                fprintf(stderr, "ERROR: unable to open '%s'.\n", data->marks_file.c_str());
+                return EXIT_FAILURE;
+            }
+        }
+
+        bool opened;
+        file_sink.SetStream(data->output_proc, data->output_at_proc,
+                            data->output_context);
+        if (flac)
+        {
+            // the file will be about half of the PCM
+            opened = file_sink.OpenFlac(render_file.c_str(), format,
+                                        data->compression, expected_size / 2);
+        }
+        else
+        {
+            opened = file_sink.Open(render_file.c_str(), format, expected_size, raw);
+        }
+        if (!opened)
+        {
+            fprintf(stderr, "ERROR: unable to open '%s'.\n", data->output_file.c_str());
+            return EXIT_FAILURE;
+        }
+        sink = &convert_sink;
+
+        // the new sentences crossfade with the old ones for 10 milliseconds
+        if (incremental)
+        {
+            manifest.key = MFileCache::make_name(render_key);
+            manifest.header_size = file_sink.HeaderSize();
+            manifest.frame_size = format.channels * format.bits_per_sample / 8;
+            splice_sink.Init(sample_format, format.channels, format.samples_per_sec / 100);
+        }
+
+        if (render_format.samples_per_sec != format.samples_per_sec)
+            sink = &resample_sink;
+    }
+
+    // render the segments on many voices
+    bool parallel = false;
+    if (data->parallel)
+    {
+        parallel = (whole && sink && !incremental);
+        if (!parallel)
+            fprintf(stderr, "WARNING: --parallel needs the text and an output file.\n");
+    }
+
+    // speak now
+    int ret = EXIT_SUCCESS;
+    if (!whole)
+        ret = winsay_say_stream(data, m_backend, m_lexicon, render_format, sink);
+    else if (parallel)
+    {
+        winsay_parallel renderer(data->backend, pVoice, data->rate, render_format);
+        MTextSegmentMode mode = (data->split == "paragraph") ? MSEG_PARAGRAPH : MSEG_SENTENCE;
+        if (!renderer.render(data->text, mode, data->jobs, data->gap, *sink))
+            ret = EXIT_FAILURE;
+    }
+    else if (incremental)
+    {
+        if (!render_segments(data, render_key, render_format, *sink,
+                             (sink == &resample_sink) ? &resample_sink : NULL,
+                             splice_sink, manifest))
+        {
+            ret = EXIT_FAILURE;
+        }
+    }
+    else
+    {
+        bool ok;
+        if (sink)
+            ok = m_backend.Render(data->text, render_format, *sink);
+        else if (data->cancel)
+            ok = m_backend.SpeakCancelable(data->text, *data->cancel);
+        else
+            ok = m_backend.Speak(data->text);
+        if (!ok)
+            ret = EXIT_FAILURE;
+    }
+    if (sink == &resample_sink && !resample_sink.Finish())
+        ret = EXIT_FAILURE;
+    if (sink && !splice_sink.Finish())
+        ret = EXIT_FAILURE;
+
+    // close the output file
+    if (sink && !file_sink.Close())
+    {
+        fprintf(stderr, "ERROR: unable to write '%s'.\n", data->output_file.c_str());
+        ret = EXIT_FAILURE;
+    }
+    if (!marks.Close())
+    {
+        fprintf(stderr, "ERROR: unable to write '%s'.\n", data->marks_file.c_str());
+        ret = EXIT_FAILURE;
+    }
+    if (data->marks_file.size() && !sink)
+        fprintf(stderr, "WARNING: --marks needs an output file.\n");
+
+    // no part of a cancelled output
+    if (sink && data->cancel && data->cancel->IsCancelled() &&
+        render_file != "-" && !incremental && cache_temp.empty())
+    {
+        std::remove(render_file.c_str());
+        if (data->marks_file.size())
+            std::remove(data->marks_file.c_str());
+    }
+
+    // replace the output and its manifest. the stale manifest goes first
+    if (incremental)
+    {
+        const std::string manifest_file = data->output_file + ".segments";
+        uint64_t mtime;
+        if (ret == EXIT_SUCCESS)
+        {
+            std::remove(manifest_file.c_str());
+            if (!mfile_replace(render_file.c_str(), data->output_file.c_str()) ||
+                !mfile_get_stat(data->output_file.c_str(), manifest.file_size, mtime))
+            {
+                fprintf(stderr, "ERROR: unable to write '%s'.\n", data->output_file.c_str());
+                ret = EXIT_FAILURE;
+            }
+        }
+        if (ret != EXIT_SUCCESS)
+            std::remove(render_file.c_str());
+        else if (!winsay_save_manifest(manifest_file, manifest))
+            fprintf(stderr, "WARNING: unable to write '%s'.\n", manifest_file.c_str());
+    }
+
+    // add the new entry to the cache
+    if (cache_temp.size())
+    {
+        if (ret == EXIT_SUCCESS &&
+            !mfile_copy_atomic(cache_temp.c_str(), data->output_file.c_str()))
+        {
+            fprintf(stderr, "ERROR: unable to write '%s'.\n", data->output_file.c_str());
+            ret = EXIT_FAILURE;
+        }
+        if (ret == EXIT_SUCCESS)
+            m_cache.commit(cache_temp, cache_name);
+        else
+            m_cache.cancel(cache_temp);
+    }
+
+    return ret;
+}
+
+// parse a line of the batch manifest:
+// text, output-file, voice, rate and file-format separated by tabs
+static bool
+winsay_parse_batch_item(MStringViewW line, WINSAY_DATA& item)
+{
+    MStringSplitterW fields(line, WIDE("\t"));
+    MStringViewW field;
+    for (int column = 0; fields.next(field); ++column)
+    {
+        field = mstr_trim_view(field);
+        if (field.empty())
+            continue;   // use the default
+
+        if (column == 0)
+        {
+            if (field[0] == WCHAR('@'))
+            {
+                field.remove_prefix(1);
+                item.input_file = MWideToAnsi(CP_ACP, field.data(), field.size()).c_str();
+            }
+            else
+            {
+                item.text.assign(field.data(), field.size());
+            }
+            continue;
+        }
+
+        std::string value = MWideToAnsi(CP_ACP, field.data(), field.size()).c_str();
+        char *endptr;
+        switch (column)
+        {
+        case 1:
+            item.output_file = value;
+            break;
+
+        case 2:
+            if (!winsay_is_voice_query(value.c_str()))
+                return false;
+            item.voice = value;
+            break;
+
+        case 3:
+            item.rate = strtol(value.c_str(), &endptr, 10);
+            if (*endptr || item.rate < -10 || item.rate > 10)
+                return false;
+            break;
+
+        case 4:
+            item.file_format = value;
+            break;
+
+        default:
+            return false;
+        }
+    }
+
+    return item.text.size() || item.input_file.size();
+}
+
+// render all the utterances of the manifest in one session
+static int
+winsay_batch(WINSAY_DATA *data, winsay_session& session)
+{
+    MStringW manifest;
+    if (!winsay_load_input(data->batch_file, manifest))
+    {
+        fprintf(stderr, "ERROR: unable to open '%s'.\n", data->batch_file.c_str());
+        return EXIT_FAILURE;
+    }
+    mstr_normalize_newlines(manifest, MNEWLINE_LF);
+
+    unsigned int count = 0, failed = 0, line_number = 0;
+    double total = 0;
+    MStringSplitterW lines(manifest, WIDE("\n"));
+    MStringViewW line;
+    while (lines.next(line))
+    {
+        ++line_number;
+        if (mstr_trim_view(line).empty() || line[0] == WCHAR('#'))
+            continue;
+
+        ++count;
+        WINSAY_DATA item = *data;
+        item.mode = WINSAY_SAY;
+        item.input_file.clear();
+        item.text.clear();
+        item.marks_file.clear();    // of a single output
+        if (!winsay_parse_batch_item(line, item))
+        {
+            fprintf(stderr, "ERROR: %s:%u: invalid item.\n",
+                    data->batch_file.c_str(), line_number);
+            ++failed;
+            continue;
+        }
+
+        double start = winsay_get_msec();
+        int ret = EXIT_SUCCESS;
+        if (item.text.empty() && !item.stream &&
+            !winsay_load_input(item.input_file, item.text))
+        {
+            fprintf(stderr, "ERROR: unable to open '%s'.\n", item.input_file.c_str());
+            ret = EXIT_FAILURE;
+        }
+        if (ret == EXIT_SUCCESS)
+        {
+            mstr_trim(item.text);
+            ret = session.render(&item);
+        }
+        double msec = winsay_get_msec() - start;
+        total += msec;
+
+        if (ret != EXIT_SUCCESS)
+            ++failed;
+        fprintf(stderr, "%u\t%s\t%.1f ms\t%s\n", line_number,
+                (ret == EXIT_SUCCESS ? "ok" : "FAILED"), msec,
+                item.output_file.c_str());
+    }
+
+    fprintf(stderr, "%u items, %u failed, %.1f ms in total, %.1f ms per item\n",
+            count, failed, total, (count ? total / count : 0.0));
+    const MFileCache& cache = session.cache();
+    if (cache.is_open())
+    {
+        fprintf(stderr, "cache: %lu hits, %lu misses, %lu stored, %lu evicted\n",
+                (unsigned long)cache.hits(), (unsigned long)cache.misses(),
+                (unsigned long)cache.stores(), (unsigned long)cache.evictions());
+    }
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// the frames of --serve and --client: a type byte, the size of the payload
+// in 4 bytes (little-endian) and the payload
+enum WINSAY_FRAME
+{
+    WINSAY_FRAME_REQUEST = 'R',     // the fields of WINSAY_DATA
+    WINSAY_FRAME_AUDIO = 'A',       // a piece of the output file "-"
+    WINSAY_FRAME_END = 'E'          // the exit code in 4 bytes
+};
+#define WINSAY_MAX_REQUEST      (64 * 1024 * 1024)  // the bytes of a request
+
+static bool
+winsay_send_frame(MLocalSocket& sock, char type, const void *data, size_t size)
+{
+    unsigned char header[5];
+    header[0] = (unsigned char)type;
+    for (int i = 0; i < 4; ++i)
+        header[1 + i] = (unsigned char)(uint32_t(size) >> (8 * i));
+    return size <= 0xFFFFFFFF && sock.send(header, sizeof(header)) &&
+           (size == 0 || sock.send(data, size));
+}
+
+// fails if the payload is larger than max_size
+static bool
+winsay_recv_frame(MLocalSocket& sock, char& type, std::string& payload,
+                  uint32_t max_size = 0xFFFFFFFF)
+{
+    unsigned char header[5];
+    if (!sock.recv(header, sizeof(header)))
+        return false;
+    type = char(header[0]);
+    uint32_t size = 0;
+    for (int i = 0; i < 4; ++i)
+        size |= uint32_t(header[1 + i]) << (8 * i);
+    if (size > max_size)
+        return false;
+    payload.resize(size);
+    return size == 0 || sock.recv(&payload[0], size);
+}
+
+static bool
+winsay_send_audio(void *context, const void *data, size_t size)
+{
+    return winsay_send_frame(*(MLocalSocket *)context, WINSAY_FRAME_AUDIO, data, size);
+}
+
+// the fields of a request. the input file, the backend and the cache are
+// of the server
+static const struct
+{
+    const char *name;
+    std::string WINSAY_DATA::*member;
+} s_string_fields[] =
+{
+    { "output-file", &WINSAY_DATA::output_file },
+    { "voice", &WINSAY_DATA::voice },
+    { "lexicon", &WINSAY_DATA::lexicon },
+    { "file-format", &WINSAY_DATA::file_format },
+    { "data-format", &WINSAY_DATA::data_format },
+    { "mix", &WINSAY_DATA::mix },
+    { "split", &WINSAY_DATA::split },
+    { "marks", &WINSAY_DATA::marks_file },
+};
+static const struct
+{
+    const char *name;
+    int WINSAY_DATA::*member;
+} s_int_fields[] =
+{
+    { "bit-rate", &WINSAY_DATA::bit_rate },
+    { "channels", &WINSAY_DATA::channels },
+    { "rate", &WINSAY_DATA::rate },
+    { "quality", &WINSAY_DATA::quality },
+    { "compression", &WINSAY_DATA::compression },
+    { "jobs", &WINSAY_DATA::jobs },
+    { "gap", &WINSAY_DATA::gap },
+};
+static const struct
+{
+    const char *name;
+    bool WINSAY_DATA::*member;
+} s_bool_fields[] =
+{
+    { "incremental", &WINSAY_DATA::incremental },
+    { "parallel", &WINSAY_DATA::parallel },
+};
+
+// "name=value" strings terminated by NULs. the text is in UTF-8
+static std::string
+winsay_encode_request(const WINSAY_DATA *data)
+{
+    std::string request;
+    char buf[32];
+    for (size_t i = 0; i < ARRAYSIZE(s_string_fields); ++i)
+    {
+        request += s_string_fields[i].name;
+        request += '=';
+        request += data->*s_string_fields[i].member;
+        request += '\0';
+    }
+    for (size_t i = 0; i < ARRAYSIZE(s_int_fields); ++i)
+    {
+        sprintf(buf, "=%d", data->*s_int_fields[i].member);
+        request += s_int_fields[i].name;
+        request += buf;
+        request += '\0';
+    }
+    for (size_t i = 0; i < ARRAYSIZE(s_bool_fields); ++i)
+    {
+        request += s_bool_fields[i].name;
+        request += (data->*s_bool_fields[i].member) ? "=1" : "=0";
+        request += '\0';
+    }
+    request += "text=";
+    request += MWideToAnsi(CP_UTF8, data->text.c_str()).c_str();
+    request += '\0';
+    return request;
+}
+
+static bool
+winsay_decode_request(const std::string& request, WINSAY_DATA *data)
+{
+    size_t pos = 0;
+    while (pos < request.size())
+    {
+        size_t end = request.find('\0', pos);
+        if (end == std::string::npos)
+            return false;
+        std::string field = request.substr(pos, end - pos);
+        pos = end + 1;
+
+        size_t equal = field.find('=');
+        if (equal == std::string::npos)
+            return false;
+        std::string name = field.substr(0, equal), value = field.substr(equal + 1);
+
+        bool found = false, checked = false;
+        if (name == "text")
+        {
+            data->text = MAnsiToWide(CP_UTF8, value.c_str()).c_str();
+            found = true;
+        }
+        for (size_t i = 0; !found && i < ARRAYSIZE(s_string_fields); ++i)
+        {
+            if (name == s_string_fields[i].name)
+            {
+                data->*s_string_fields[i].member = value;
+                found = checked = true;
+            }
+        }
+        for (size_t i = 0; !found && i < ARRAYSIZE(s_int_fields); ++i)
+        {
+            if (name == s_int_fields[i].name)
+            {
+                data->*s_int_fields[i].member = atoi(value.c_str());
+                found = checked = true;
+            }
+        }
+        for (size_t i = 0; !found && i < ARRAYSIZE(s_bool_fields); ++i)
+        {
+            if (name == s_bool_fields[i].name)
+            {
+                data->*s_bool_fields[i].member = (value == "1");
+                found = true;
+            }
+        }
+        // an unknown field is of a newer client
+
+        // the same checks as the options of the command line
+        if (!checked || (name == "voice" && value.empty()))
+            continue;
+        if (value == "?" || (name == "jobs" && (data->jobs < 0 || data->jobs > 64)))
+        {
+            fprintf(stderr, "ERROR: invalid %s.\n", name.c_str());
+            return false;
+        }
+        if (name != "jobs" &&
+            winsay_parse_option(data, name, value.c_str()) != EXIT_SUCCESS)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// the path from the current directory, for the server
+static std::string
+winsay_absolute_path(const std::string& path)
+{
+    if (path.empty() || path == "-")
+        return path;
+#ifdef _WIN32
+    char buf[MAX_PATH];
+    DWORD len = GetFullPathNameA(path.c_str(), MAX_PATH, buf, NULL);
+    if (len == 0 || len >= MAX_PATH)
+        return path;
+    return buf;
+#else
+    if (path[0] == '/')
+        return path;
+    char buf[4096];
+    if (!getcwd(buf, sizeof(buf)))
+        return path;
+    return std::string(buf) + '/' + path;
+#endif
+}
+
+// serve a request of a client
+static void
+winsay_serve_client(const WINSAY_DATA *data, winsay_session& session,
+                    MLocalSocket& client)
+{
+    char type;
+    std::string payload;
+    bool received = winsay_recv_frame(client, type, payload, WINSAY_MAX_REQUEST);
+
+    // the options of the server, and the request
+    WINSAY_DATA request = *data;
+    request.serve_socket.clear();
+    request.output_file.clear();
+    request.lexicon.clear();
+    request.stream = false;
+    int ret = EXIT_FAILURE;
+    if (!received || type != WINSAY_FRAME_REQUEST ||
+        !winsay_decode_request(payload, &request))
+    {
+        fprintf(stderr, "ERROR: invalid request.\n");
+    }
+    else if (!session.load_lexicon(request.lexicon))
+    {
+        fprintf(stderr, "ERROR: unable to load lexicon '%s'.\n", request.lexicon.c_str());
+    }
+    else
+    {
+        request.mode = request.output_file.empty() ? WINSAY_SAY : WINSAY_OUTPUT;
+        if (request.output_file == "-")
+        {
+            request.output_proc = winsay_send_audio;
+            request.output_context = &client;
+        }
+        ret = session.render(&request);
+    }
+
+    unsigned char code[4];
+    for (int i = 0; i < 4; ++i)
+        code[i] = (unsigned char)(uint32_t(ret) >> (8 * i));
+    winsay_send_frame(client, WINSAY_FRAME_END, code, sizeof(code));
+}
+
+// serve the clients one by one
+static int
+winsay_serve(WINSAY_DATA *data, winsay_session& session)
+{
+    MLocalSocket server;
+    if (!server.listen(data->serve_socket.c_str()))
+    {
+        fprintf(stderr, "ERROR: unable to listen at '%s'.\n", data->serve_socket.c_str());
+        return EXIT_FAILURE;
+    }
+
+    for (;;)
+    {
+        MLocalSocket client;
+        if (!server.accept(client))
+        {
+            fprintf(stderr, "ERROR: unable to accept a client.\n");
+            return EXIT_FAILURE;
+        }
+        winsay_serve_client(data, session, client);
+    }
+}
+
+// let the server speak
+static int
+winsay_client(WINSAY_DATA *data)
+{
+    if (data->batch_file.size())
+    {
+        fprintf(stderr, "ERROR: --client can't take --batch.\n");
+        return EXIT_FAILURE;
+    }
+    if (data->text.empty() && data->stream &&
+        !winsay_load_input(data->input_file, data->text))
+    {
+        fprintf(stderr, "ERROR: unable to open '%s'.\n", data->input_file.c_str());
+        return EXIT_FAILURE;
+    }
+
+    MLocalSocket sock;
+    if (!sock.connect(data->client_socket.c_str()))
+    {
+        fprintf(stderr, "ERROR: unable to connect to '%s'.\n", data->client_socket.c_str());
+        return EXIT_FAILURE;
+    }
+
+    // the paths are of this process
+    data->output_file = winsay_absolute_path(data->output_file);
+    data->lexicon = winsay_absolute_path(data->lexicon);
+    data->marks_file = winsay_absolute_path(data->marks_file);
+    std::string request = winsay_encode_request(data);
+    if (!winsay_send_frame(sock, WINSAY_FRAME_REQUEST, request.data(), request.size()))
+    {
+        fprintf(stderr, "ERROR: unable to send the request.\n");
+        return EXIT_FAILURE;
+    }
+
+#ifdef _WIN32
+    if (data->output_file == "-")
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    char type;
+    std::string payload;
+    while (winsay_recv_frame(sock, type, payload))
+    {
+        if (type == WINSAY_FRAME_AUDIO)
+        {
+            if (fwrite(payload.data(), 1, payload.size(), stdout) != payload.size())
+                return EXIT_FAILURE;
+            fflush(stdout);
+        }
+        else if (type == WINSAY_FRAME_END && payload.size() == 4)
+        {
+            uint32_t code = 0;
+            for (int i = 0; i < 4; ++i)
+                code |= uint32_t((unsigned char)payload[i]) << (8 * i);
+            if (code != EXIT_SUCCESS)
+                fprintf(stderr, "ERROR: the server failed.\n");
+            return int(code);
+        }
+    }
+
+    fprintf(stderr, "ERROR: the server closed the connection.\n");
+    return EXIT_FAILURE;
+}
+
+// make windows say with the backend
+static int
+winsay_say_with(WINSAY_DATA *data, VoiceBackend& backend)
+{
+    // the voices are enumerated only when needed
+    std::string cache_name = std::string("voices-") + backend.GetName() + ".cache";
+    VoiceCatalog catalog(backend.GetVoiceSource(),
+                         winsay_get_cache_file(cache_name.c_str()));
+
+    switch (data->mode)
+    {
+    case WINSAY_ENUMFILEFORMATS:
         // dump available file formats
         printf("wav      WAVE format\n");
+        printf("raw      raw PCM (no header)\n");
+        printf("flac     FLAC (lossless compression)\n");
         return EXIT_SUCCESS;
 
     case WINSAY_ENUMBITRATES:
@@ -491,27 +2714,46 @@ winsay_say(WINSAY_DATA *data)
 
     case WINSAY_ENUMVOICES:
         // dump voices
-        for (size_t i = 0; i < voice_tokens.size(); ++i)
+        if (catalog.Voices().empty())
         {
-            VOICE_TOKEN& token = voice_tokens[i];
-            WCHAR *endptr;
-            WORD wLangID = (WORD)wcstoul(token.language.c_str(), &endptr, 16);
-            if (*endptr == 0)
-            {
-                LCID lcid = MAKELCID(wLangID, SORT_DEFAULT);
-                char szData[64] = {};
-                GetLocaleInfoA(lcid, LOCALE_SISO639LANGNAME, szData, ARRAYSIZE(szData));
-                printf("%-20ls%s\n", token.name.c_str(), szData);
-            }
+            fprintf(stderr, "ERROR: unable to enumerate voices.\n");
+            return EXIT_FAILURE;
+        }
+        for (size_t i = 0; i < catalog.Voices().size(); ++i)
+        {
+            const VOICE_TOKEN& token = catalog.Voices()[i];
+            unsigned int langid = VoiceLangIdFromAttribute(token.language);
+            printf("%-20s%-4s%s\n", MWideToAnsi(CP_ACP, token.name.c_str()).c_str(),
+                   VoiceIso639FromLangId(langid),
+                   MWideToAnsi(CP_ACP, token.gender.c_str()).c_str());
         }
         return EXIT_SUCCESS;
 
     case WINSAY_ENUMCHANNELS:
-        printf("1\n2\n");
+        for (int i = 0; i < WINSAY_MAX_CHANNELS; ++i)
+        {
+            printf("%d        %s\n", i + 1, s_channel_layouts[i]);
+        }
+        return EXIT_SUCCESS;
+
+    case WINSAY_ENUMDATAFORMATS:
+        printf("uint8    8-bit unsigned\n");
+        printf("int8     8-bit signed\n");
+        printf("int16    16-bit signed (default)\n");
+        printf("int24    24-bit signed\n");
+        printf("int32    32-bit signed\n");
+        printf("float32  32-bit floating-point\n");
+        printf("(add le or be for the byte order, e.g. int24be)\n");
+        printf("mulaw    G.711 mu-law, 8 bits\n");
+        printf("alaw     G.711 A-law, 8 bits\n");
+        printf("ima-adpcm IMA ADPCM, 4 bits\n");
         return EXIT_SUCCESS;
 
     case WINSAY_ENUMQUALITIES:
-        printf("No quality available.\n");
+        printf("low      8 taps, passband 80%%\n");
+        printf("medium   16 taps, passband 88%%\n");
+        printf("high     32 taps, passband 92%% (default)\n");
+        printf("best     64 taps, passband 95%%\n");
         return EXIT_SUCCESS;
 
     default:
@@ -519,113 +2761,697 @@ winsay_say(WINSAY_DATA *data)
     }
 
     // the working objects
-    WinVoice voice;
-    ISpObjectToken *pVoiceToken = NULL;
-    ISpStream *pStream = NULL;
+    winsay_session session(backend, catalog);
+    if (!session.load_lexicon(data->lexicon))
+    {
+        fprintf(stderr, "ERROR: unable to load lexicon '%s'.\n", data->lexicon.c_str());
+        return EXIT_FAILURE;
+    }
 
-    if (data->voice.size())
+    if (data->cache)
     {
-        // select a voice
-        for (size_t i = 0; i < voice_tokens.size(); ++i)
-        {
-            VOICE_TOKEN& token = voice_tokens[i];
-            MAnsiToWide wVoice(CP_ACP, data->voice.c_str());
+        std::string dir = data->cache_dir;
+        if (dir.empty())
+            dir = winsay_get_cache_file("renders");
+        if (!session.open_cache(dir, data->cache_size))
+            fprintf(stderr, "WARNING: unable to use the cache '%s'.\n", dir.c_str());
+    }
 
-            if (lstrcmpiW(wVoice.c_str(), token.name.c_str()) == 0 ||
-                lstrcmpiW(wVoice.c_str(), token.full_name.c_str()) == 0)
-            {
-                ::CoCreateInstance(CLSID_SpObjectToken, NULL, CLSCTX_ALL,
-                                   IID_ISpObjectToken, (void **)&pVoiceToken);
-                if (pVoiceToken)
-                    pVoiceToken->SetId(NULL, token.id.c_str(), FALSE);
-            }
+    if (data->mode == WINSAY_BATCH)
+        return winsay_batch(data, session);
+    if (data->mode == WINSAY_SERVE)
+        return winsay_serve(data, session);
+
+    return session.render(data);
+}
+
+// make windows say
+extern "C" int
+winsay_say(WINSAY_DATA *data)
+{
+    if (0)
+    {
+        printf("input-file: %s\n", data->input_file.c_str());
+        printf("output-file: %s\n", data->output_file.c_str());
+        printf("text: %s\n", MWideToAnsi(CP_ACP, data->text.c_str()).c_str());
+        printf("voice: %s\n", data->voice.c_str());
+    }
+
+    // the server speaks instead
+    if (data->client_socket.size() &&
+        (data->mode == WINSAY_SAY || data->mode == WINSAY_OUTPUT))
+    {
+        return winsay_client(data);
+    }
+
+    VoiceBackend *backend = winsay_create_backend(data->backend);
+    if (!backend)
+    {
+        fprintf(stderr, "ERROR: invalid backend '%s'.\n", data->backend.c_str());
+        return EXIT_FAILURE;
+    }
+    int ret = winsay_say_with(data, *backend);
+    delete backend;
+    return ret;
+}
+
+// create WINSAY_DATA structure
+extern "C" WINSAY_DATA *
+winsay_create(void)
+{
+    return new WINSAY_DATA;
+}
+
+// destroy WINSAY_DATA structure
+extern "C" void
+winsay_destroy(WINSAY_DATA *data)
+{
+    delete data;
+}
+
+// set an option of the long name
+extern "C" int
+winsay_set_option(WINSAY_DATA *data, const char *name, const char *value)
+{
+    const struct option *opt;
+    for (opt = winsay_opts; opt->name; ++opt)
+    {
+        if (strcmp(opt->name, name) == 0)
+            break;
+    }
+    if (!opt->name || (opt->has_arg == required_argument && !value) ||
+        (opt->has_arg == no_argument && value))
+    {
+        fprintf(stderr, "ERROR: invalid option '%s'.\n", name);
+        return EXIT_FAILURE;
+    }
+
+    std::string arg = name;
+    if (arg == "help" || arg == "version")
+    {
+        fprintf(stderr, "ERROR: invalid option '%s'.\n", name);
+        return EXIT_FAILURE;
+    }
+    return winsay_parse_option(data, arg, value);
+}
+
+// set the text to say, in UTF-8
+extern "C" int
+winsay_set_text(WINSAY_DATA *data, const char *text)
+{
+    data->text = MAnsiToWide(CP_UTF8, text).c_str();
+    mstr_trim(data->text);
+    return EXIT_SUCCESS;
+}
+
+// load the input file if no text, as winsay_command_line
+static bool
+winsay_load_text(WINSAY_DATA *data)
+{
+    if (data->text.size() || data->stream)
+        return true;
+
+    if (!winsay_load_input(data->input_file, data->text))
+    {
+        fprintf(stderr, "ERROR: unable to open '%s'.\n", data->input_file.c_str());
+        return false;
+    }
+    mstr_trim(data->text);
+    return true;
+}
+
+// render the output file "-" into the functions, keeping the options.
+// backend is NULL for a new one
+static int
+winsay_render_with(WINSAY_DATA *data, WINSAY_WRITE_PROC proc,
+                   WINSAY_WRITE_AT_PROC write_at_proc, void *context,
+                   VoiceBackend *backend = NULL)
+{
+    if (data->batch_file.size() || data->serve_socket.size())
+    {
+        fprintf(stderr, "ERROR: unable to render --batch or --serve.\n");
+        return EXIT_FAILURE;
+    }
+
+    WINSAY_DATA saved = *data;
+    if (!winsay_load_text(data))
+        return EXIT_FAILURE;
+
+    // in this process
+    data->output_file = "-";
+    data->mode = WINSAY_OUTPUT;
+    data->client_socket.clear();
+    data->output_proc = proc;
+    data->output_at_proc = write_at_proc;
+    data->output_context = context;
+    int ret = backend ? winsay_say_with(data, *backend) : winsay_say(data);
+
+    // the lexicon changes the text
+    data->text.swap(saved.text);
+    data->output_file.swap(saved.output_file);
+    data->client_socket.swap(saved.client_socket);
+    data->mode = saved.mode;
+    data->output_proc = saved.output_proc;
+    data->output_at_proc = saved.output_at_proc;
+    data->output_context = saved.output_context;
+    return ret;
+}
+
+// the growing buffer of winsay_render_to_buffer
+struct winsay_buffer
+{
+    unsigned char *data;
+    size_t size;
+    size_t capacity;
+};
+
+static bool
+winsay_buffer_write_at(void *context, uint64_t offset, const void *data, size_t size)
+{
+    winsay_buffer *buffer = (winsay_buffer *)context;
+    if (offset > size_t(-1) - size)
+        return false;
+
+    size_t end = size_t(offset) + size;
+    if (end > buffer->capacity)
+    {
+        size_t capacity = buffer->capacity ? buffer->capacity : 64 * 1024;
+        while (capacity < end)
+            capacity = (capacity > size_t(-1) / 2) ? end : capacity * 2;
+        void *ptr = realloc(buffer->data, capacity);
+        if (!ptr)
+            return false;
+        buffer->data = (unsigned char *)ptr;
+        buffer->capacity = capacity;
+    }
+
+    memcpy(buffer->data + size_t(offset), data, size);
+    if (end > buffer->size)
+        buffer->size = end;
+    return true;
+}
+
+static bool
+winsay_buffer_write(void *context, const void *data, size_t size)
+{
+    winsay_buffer *buffer = (winsay_buffer *)context;
+    return winsay_buffer_write_at(context, buffer->size, data, size);
+}
+
+// render the output file into a new buffer
+extern "C" int
+winsay_render_to_buffer(WINSAY_DATA *data, void **buffer, size_t *size)
+{
+    *buffer = NULL;
+    *size = 0;
+
+    winsay_buffer output = { NULL, 0, 0 };
+    int ret = winsay_render_with(data, winsay_buffer_write,
+                                 winsay_buffer_write_at, &output);
+    if (ret != EXIT_SUCCESS)
+    {
+        free(output.data);
+        return ret;
+    }
+
+    *buffer = output.data;
+    *size = output.size;
+    return EXIT_SUCCESS;
+}
+
+extern "C" void
+winsay_free(void *buffer)
+{
+    free(buffer);
+}
+
+// the caller's buffer and function of winsay_render_stream
+struct winsay_stream
+{
+    unsigned char *buffer;
+    size_t buffer_size;
+    WINSAY_STREAM_PROC proc;
+    void *context;
+};
+
+static bool
+winsay_stream_write(void *context, const void *data, size_t size)
+{
+    winsay_stream *stream = (winsay_stream *)context;
+    const unsigned char *ptr = (const unsigned char *)data;
+    while (size > 0)
+    {
+        size_t len = (size < stream->buffer_size) ? size : stream->buffer_size;
+        memcpy(stream->buffer, ptr, len);
+        if (!stream->proc(stream->context, stream->buffer, len))
+            return false;
+        ptr += len;
+        size -= len;
+    }
+    return true;
+}
+
+// render the output file as a stream
+extern "C" int
+winsay_render_stream(WINSAY_DATA *data, void *buffer, size_t buffer_size,
+                     WINSAY_STREAM_PROC proc, void *context)
+{
+    if (!buffer || buffer_size == 0 || !proc)
+        return EXIT_FAILURE;
+
+    winsay_stream stream = { (unsigned char *)buffer, buffer_size, proc, context };
+    return winsay_render_with(data, winsay_stream_write, NULL, &stream);
+}
+
+////////////////////////////////////////////////////////////////////////////
+// the job queue
+
+// a job of WINSAY_QUEUE. the fields are guarded by the mutex of the queue
+struct WINSAY_JOB : public VoiceCancel
+{
+    WINSAY_QUEUE *queue;
+    WINSAY_DATA data;
+    int priority;
+    double deadline;        // of winsay_get_msec, or zero for none
+    uint64_t serial;        // the order of submission
+    size_t chars;           // to estimate the time
+    WINSAY_JOB_PROC proc;
+    void *context;
+    int state;
+    int stop;               // the state to stop the running job into, or zero
+    bool preempted;         // stopped by an urgent job, to do it again
+    int refs;
+    winsay_buffer output;   // of the output file "-"
+
+    virtual bool IsCancelled();
+};
+
+// the higher priority, the earlier deadline, then the earlier job first
+struct winsay_job_less
+{
+    bool operator()(const WINSAY_JOB *a, const WINSAY_JOB *b) const
+    {
+        if (a->priority != b->priority)
+            return a->priority < b->priority;
+        if (a->deadline != b->deadline)
+        {
+            if (a->deadline == 0 || b->deadline == 0)
+                return b->deadline == 0;
+            return a->deadline < b->deadline;
         }
+        return a->serial < b->serial;
     }
+};
+
+struct WINSAY_QUEUE
+{
+    MMutex mutex;
+    MCondition work;        // a job is queued, or quit
+    MCondition finished;    // a job is finished
+    std::set<WINSAY_JOB *, winsay_job_less> queued;
+    std::vector<WINSAY_JOB *> running;
+    std::vector<MThread *> threads;
+    uint64_t serial;
+    double msec_per_char;   // the average rendering time, or zero if unknown
+    int refs;               // of the caller and the jobs
+    bool quit;
+};
 
-    // set the voice
-    if (pVoiceToken)
-        voice.SetVoice(pVoiceToken);
+// the deadline passes while running, too
+bool WINSAY_JOB::IsCancelled()
+{
+    MScopedLock lock(queue->mutex);
+    if (!stop && deadline && winsay_get_msec() > deadline)
+        stop = WINSAY_JOB_EXPIRED;
+    return stop || preempted;
+}
 
-    // take care of output file
-    if (data->output_file.size())
+// the mutex must be locked. returns true if the queue is to be deleted
+static bool
+winsay_queue_unref(WINSAY_QUEUE *queue)
+{
+    return --queue->refs == 0;
+}
+
+// the mutex must be locked. returns true if the queue is to be deleted
+static bool
+winsay_job_unref(WINSAY_JOB *job)
+{
+    if (--job->refs > 0)
+        return false;
+
+    WINSAY_QUEUE *queue = job->queue;
+    free(job->output.data);
+    delete job;
+    return winsay_queue_unref(queue);
+}
+
+// the mutex must be locked. the callback is called without the lock
+static void
+winsay_job_finish(WINSAY_JOB *job, int state)
+{
+    WINSAY_QUEUE *queue = job->queue;
+    job->state = state;
+    if (state != WINSAY_JOB_DONE)
     {
-        // add dot
-        if (data->file_format.size() && data->file_format[0] != '.')
+        free(job->output.data);
+        job->output.data = NULL;
+        job->output.size = job->output.capacity = 0;
+    }
+    queue->finished.broadcast();
+
+    if (job->proc)
+    {
+        queue->mutex.unlock();
+        job->proc(job->context, job, state);
+        queue->mutex.lock();
+    }
+    // the caller and the queue keep each a reference of the job. release
+    // the queue's one here and only here. the queue outlives it, because
+    // the workers are joined and the remaining jobs are finished before
+    // winsay_queue_destroy releases the reference of the caller
+    bool last = winsay_job_unref(job);
+    assert(!last);
+    (void)last;
+}
+
+// say or render a job on the backend of the worker
+static int
+winsay_run_job(WINSAY_JOB *job, VoiceBackend& backend)
+{
+    WINSAY_DATA data = job->data;
+    data.cancel = job;
+    if (data.output_file == "-")
+    {
+        return winsay_render_with(&data, winsay_buffer_write,
+                                  winsay_buffer_write_at, &job->output, &backend);
+    }
+
+    if (!winsay_load_text(&data))
+        return EXIT_FAILURE;
+    return winsay_say_with(&data, backend);
+}
+
+// a worker thread of the queue, with its own backend
+static void
+winsay_queue_worker(void *arg)
+{
+    WINSAY_QUEUE *queue = (WINSAY_QUEUE *)arg;
+    winsay_co_init co_init;
+    std::string backend_name;
+    VoiceBackend *backend = NULL;
+
+    MScopedLock lock(queue->mutex);
+    for (;;)
+    {
+        while (!queue->quit && queue->queued.empty())
+            queue->work.wait(queue->mutex);
+        if (queue->quit)
+            break;
+
+        WINSAY_JOB *job = *queue->queued.begin();
+        queue->queued.erase(queue->queued.begin());
+
+        // shed the job that will miss the deadline
+        double now = winsay_get_msec();
+        if (job->deadline && now + job->chars * queue->msec_per_char > job->deadline)
         {
-            data->file_format = "." + data->file_format;
+            winsay_job_finish(job, WINSAY_JOB_EXPIRED);
+            continue;
+        }
+
+        job->state = WINSAY_JOB_RUNNING;
+        job->preempted = false;
+        queue->running.push_back(job);
+        queue->mutex.unlock();
+
+        int ret = EXIT_FAILURE;
+        if (!backend || backend_name != job->data.backend)
+        {
+            delete backend;
+            backend_name = job->data.backend;
+            backend = winsay_create_backend(backend_name);
+        }
+        if (backend)
+            ret = winsay_run_job(job, *backend);
+        else
+            fprintf(stderr, "ERROR: invalid backend '%s'.\n", backend_name.c_str());
+        double msec = winsay_get_msec() - now;
+
+        queue->mutex.lock();
+        for (size_t i = 0; i < queue->running.size(); ++i)
+        {
+            if (queue->running[i] == job)
+            {
+                queue->running.erase(queue->running.begin() + i);
+                break;
+            }
         }
 
-        // get last 4 characters
-        std::string four_chars;
-        if (data->output_file.size() >= 4)
+        // an urgent job stopped it. do it again later
+        if (job->preempted && !job->stop)
         {
-            four_chars = data->output_file.substr(data->output_file.size() - 4, 4);
+            job->state = WINSAY_JOB_QUEUED;
+            job->output.size = 0;
+            queue->queued.insert(job);
+            continue;
         }
-        CharLowerA(&four_chars[0]);
 
-        if (four_chars != ".wav")
+        int state = job->stop;
+        if (!state)
+            state = (ret == EXIT_SUCCESS) ? WINSAY_JOB_DONE : WINSAY_JOB_FAILED;
+        if (state == WINSAY_JOB_DONE && job->chars)
         {
-            data->output_file += data->file_format;
+            // the moving average of the last jobs
+            double rate = msec / job->chars;
+            if (queue->msec_per_char == 0)
+                queue->msec_per_char = rate;
+            else
+                queue->msec_per_char += (rate - queue->msec_per_char) / 8;
         }
+        winsay_job_finish(job, state);
+    }
+
+    delete backend;
+}
 
-        ::CoCreateInstance(CLSID_SpStream, NULL, CLSCTX_ALL,
-                           IID_ISpStream, (void **)&pStream);
-        if (pStream)
+// create the job queue
+extern "C" WINSAY_QUEUE *
+winsay_queue_create(int workers)
+{
+    if (workers <= 0)
+        workers = 1;
+
+    WINSAY_QUEUE *queue = new WINSAY_QUEUE;
+    queue->serial = 0;
+    queue->msec_per_char = 0;
+    queue->refs = 1;
+    queue->quit = false;
+    for (int i = 0; i < workers; ++i)
+    {
+        MThread *thread = new MThread;
+        if (!thread->create(winsay_queue_worker, queue))
         {
-            MAnsiToWide wOutputFile(CP_ACP, data->output_file.c_str());
+            delete thread;
+            break;
+        }
+        queue->threads.push_back(thread);
+    }
+
+    if (queue->threads.empty())
+    {
+        delete queue;
+        return NULL;
+    }
+    return queue;
+}
 
-            WAVEFORMATEX fmt;
-            fmt.wFormatTag = WAVE_FORMAT_PCM;
-            fmt.nChannels = data->channels;
-            fmt.wBitsPerSample = 16;
-            fmt.nSamplesPerSec = data->bit_rate;
-            fmt.nBlockAlign = 2;
-            fmt.nAvgBytesPerSec = fmt.nSamplesPerSec * fmt.nChannels * fmt.wBitsPerSample / 8;
-            fmt.cbSize = 0;
+// destroy the job queue
+extern "C" void
+winsay_queue_destroy(WINSAY_QUEUE *queue)
+{
+    if (!queue)
+        return;
 
-            GUID GUID_SPDFID_WaveFormatEx;
-            IIDFromString(L"{C31ADBAE-527F-4ff5-A230-F62BB61FF70C}", &GUID_SPDFID_WaveFormatEx);
+    {
+        MScopedLock lock(queue->mutex);
+        queue->quit = true;
+        for (size_t i = 0; i < queue->running.size(); ++i)
+            queue->running[i]->stop = WINSAY_JOB_CANCELLED;
+        queue->work.broadcast();
+    }
+    for (size_t i = 0; i < queue->threads.size(); ++i)
+    {
+        queue->threads[i]->join();
+        delete queue->threads[i];
+    }
+    queue->threads.clear();
 
-            pStream->BindToFile(wOutputFile.c_str(), SPFM_CREATE_ALWAYS,
-                                &GUID_SPDFID_WaveFormatEx, &fmt, 0);
-            if (voice.SpVoice())
-                voice.SpVoice()->SetOutput(pStream, TRUE);
+    bool last;
+    {
+        MScopedLock lock(queue->mutex);
+        while (!queue->queued.empty())
+        {
+            WINSAY_JOB *job = *queue->queued.begin();
+            queue->queued.erase(queue->queued.begin());
+            winsay_job_finish(job, WINSAY_JOB_CANCELLED);
         }
+        last = winsay_queue_unref(queue);
     }
+    if (last)
+        delete queue;
+}
 
-    // speak now
-    voice.Speak(data->text, false);
+// submit a job
+extern "C" WINSAY_JOB *
+winsay_queue_submit(WINSAY_QUEUE *queue, const WINSAY_DATA *data,
+                    int priority, int deadline,
+                    WINSAY_JOB_PROC proc, void *context)
+{
+    if ((data->mode != WINSAY_SAY && data->mode != WINSAY_OUTPUT) ||
+        data->batch_file.size() || priority < WINSAY_PRIORITY_URGENT ||
+        priority > WINSAY_PRIORITY_BULK || deadline < 0)
+    {
+        fprintf(stderr, "ERROR: invalid job.\n");
+        return NULL;
+    }
+
+    WINSAY_JOB *job = new WINSAY_JOB;
+    job->queue = queue;
+    job->data = *data;
+    job->data.client_socket.clear();    // in this process
+    job->data.output_proc = NULL;
+    job->data.output_at_proc = NULL;
+    job->data.output_context = NULL;
+    job->data.cancel = NULL;
+    job->priority = priority;
+    job->deadline = deadline ? winsay_get_msec() + deadline : 0;
+    job->chars = data->text.size();
+    job->proc = proc;
+    job->context = context;
+    job->state = WINSAY_JOB_QUEUED;
+    job->stop = 0;
+    job->preempted = false;
+    job->refs = 2;
+    job->output.data = NULL;
+    job->output.size = job->output.capacity = 0;
+
+    uint64_t input_size, mtime;
+    if (job->chars == 0 && mfile_get_stat(data->input_file.c_str(), input_size, mtime))
+        job->chars = size_t(input_size);
+
+    MScopedLock lock(queue->mutex);
+    if (queue->quit)
+    {
+        delete job;
+        return NULL;
+    }
+    job->serial = queue->serial++;
+    ++queue->refs;
+    queue->queued.insert(job);
+    queue->work.signal();
+
+    // stop the lowest job if the urgent ones are more than the free workers
+    if (priority == WINSAY_PRIORITY_URGENT)
+    {
+        size_t urgent = 0;
+        std::set<WINSAY_JOB *, winsay_job_less>::iterator it;
+        for (it = queue->queued.begin(); it != queue->queued.end(); ++it)
+        {
+            if ((*it)->priority != WINSAY_PRIORITY_URGENT)
+                break;
+            ++urgent;
+        }
+
+        size_t stopping = 0;
+        WINSAY_JOB *lowest = NULL;
+        for (size_t i = 0; i < queue->running.size(); ++i)
+        {
+            WINSAY_JOB *other = queue->running[i];
+            if (other->stop || other->preempted)
+                ++stopping;
+            else if (other->priority != WINSAY_PRIORITY_URGENT &&
+                     (!lowest || winsay_job_less()(lowest, other)))
+                lowest = other;
+        }
+
+        size_t free_workers = queue->threads.size() - queue->running.size() + stopping;
+        if (urgent > free_workers && lowest)
+            lowest->preempted = true;
+    }
+    return job;
+}
 
-    // clean up
-    if (pVoiceToken)
+// cancel the job
+extern "C" void
+winsay_job_cancel(WINSAY_JOB *job)
+{
+    WINSAY_QUEUE *queue = job->queue;
+    MScopedLock lock(queue->mutex);
+    if (job->state == WINSAY_JOB_QUEUED)
     {
-        pVoiceToken->Release();
-        pVoiceToken = NULL;
+        queue->queued.erase(job);
+        winsay_job_finish(job, WINSAY_JOB_CANCELLED);
     }
-    if (pStream)
+    else if (job->state == WINSAY_JOB_RUNNING)
     {
-        pStream->Release();
-        pStream = NULL;
+        job->stop = WINSAY_JOB_CANCELLED;
     }
+}
 
-    return EXIT_SUCCESS;
+// wait for the job
+extern "C" int
+winsay_job_wait(WINSAY_JOB *job)
+{
+    WINSAY_QUEUE *queue = job->queue;
+    MScopedLock lock(queue->mutex);
+    while (job->state == WINSAY_JOB_QUEUED || job->state == WINSAY_JOB_RUNNING)
+        queue->finished.wait(queue->mutex);
+    return job->state;
 }
 
-// create WINSAY_DATA structure
-extern "C" WINSAY_DATA *
-winsay_create(void)
+extern "C" int
+winsay_job_state(WINSAY_JOB *job)
 {
-    return new WINSAY_DATA;
+    MScopedLock lock(job->queue->mutex);
+    return job->state;
 }
 
-// destroy WINSAY_DATA structure
+// take the rendered output file "-"
+extern "C" int
+winsay_job_take_buffer(WINSAY_JOB *job, void **buffer, size_t *size)
+{
+    MScopedLock lock(job->queue->mutex);
+    *buffer = NULL;
+    *size = 0;
+    if (job->state != WINSAY_JOB_DONE || !job->output.data)
+        return EXIT_FAILURE;
+
+    *buffer = job->output.data;
+    *size = job->output.size;
+    job->output.data = NULL;
+    job->output.size = job->output.capacity = 0;
+    return EXIT_SUCCESS;
+}
+
+// release the job of the caller
 extern "C" void
-winsay_destroy(WINSAY_DATA *data)
+winsay_job_release(WINSAY_JOB *job)
 {
-    delete data;
+    if (!job)
+        return;
+
+    WINSAY_QUEUE *queue = job->queue;
+    bool last;
+    {
+        MScopedLock lock(queue->mutex);
+        last = winsay_job_unref(job);
+    }
+    if (last)
+        delete queue;
 }
 
-#ifndef WINSPY_LIBRARY
+#ifndef WINSAY_LIBRARY
     // the main function
     int main(int argc, char **argv)
     {
@@ -637,4 +3463,4 @@ winsay_destroy(WINSAY_DATA *data)
 
         return winsay_say(&data);
     }
-#endif  // ndef WINSPY_LIBRARY
+#endif  // ndef WINSAY_LIBRARY
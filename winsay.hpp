@@ -6,11 +6,20 @@
 #ifndef WINSAY_HPP_
 #define WINSAY_HPP_         8   // 0.8
 
-#ifndef _INC_WINDOWS
-    #include <windows.h>    // for Windows API
+#if __cplusplus >= 201103L          /* C++11 */
+    #include <cstdint>
+#else
+    #include "pstdint.h"
 #endif
-#ifndef _OBJBASE_H_
-    #include <objbase.h>
+#include <stddef.h>         // for size_t
+
+#ifdef _WIN32
+    #ifndef _INC_WINDOWS
+        #include <windows.h>    // for Windows API
+    #endif
+    #ifndef _OBJBASE_H_
+        #include <objbase.h>
+    #endif
 #endif
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -23,24 +32,61 @@ enum WINSAY_MODE
     WINSAY_ENUMFILEFORMATS,
     WINSAY_ENUMBITRATES,
     WINSAY_ENUMCHANNELS,
-    WINSAY_ENUMQUALITIES
+    WINSAY_ENUMQUALITIES,
+    WINSAY_ENUMDATAFORMATS,
+    WINSAY_BATCH,
+    WINSAY_SERVE
 };
 
+// the function to receive the output file "-" instead of the standard
+// output. returns false on error
+typedef bool (*WINSAY_WRITE_PROC)(void *context, const void *data, size_t size);
+// the function to write at an offset of the output, to patch the header.
+// returns false on error
+typedef bool (*WINSAY_WRITE_AT_PROC)(void *context, uint64_t offset,
+                                     const void *data, size_t size);
+
 ///////////////////////////////////////////////////////////////////////////////
 // WINSAY_DATA
 
 #ifdef __cplusplus
     #include <string>       // for std::string
+    #include "MString.hpp"  // for MStringW
+    class VoiceCancel;
     struct WINSAY_DATA
     {
         std::string input_file;
         std::string output_file;
         std::string voice;
-        std::string text;
+        std::string lexicon;
+        std::string batch_file;
+        std::string backend;
+        MStringW text;
         std::string file_format;
+        std::string data_format;
+        std::string mix;
+        std::string cache_dir;
+        std::string split;
+        std::string serve_socket;
+        std::string client_socket;
+        std::string marks_file;
         WINSAY_MODE mode;
         int bit_rate;
         int channels;
+        int rate;
+        int quality;
+        int compression;
+        int cache_size;     // in megabytes
+        int jobs;           // 0 for one per processor
+        int gap;            // in milliseconds
+        bool cache;
+        bool stream;
+        bool incremental;
+        bool parallel;
+        WINSAY_WRITE_PROC output_proc;
+        WINSAY_WRITE_AT_PROC output_at_proc;    // can be NULL
+        void *output_context;
+        VoiceCancel *cancel;                    // can be NULL
 
         WINSAY_DATA()
         {
@@ -52,11 +98,39 @@ enum WINSAY_MODE
             input_file = "-";
             output_file.clear();
             voice.clear();
+            lexicon.clear();
+            batch_file.clear();
+#ifdef _WIN32
+            backend = "sapi";
+#else
+            backend = "reference";
+#endif
             text.clear();
             file_format = ".wav";
+            data_format = "int16";
+            mix.clear();
+            cache_dir.clear();
+            split = "sentence";
+            serve_socket.clear();
+            client_socket.clear();
+            marks_file.clear();
             mode = WINSAY_SAY;
             bit_rate = 44100;
             channels = 2;
+            rate = 0;
+            quality = 2;    // MRESAMPLER_HIGH
+            compression = 5;
+            cache_size = 256;
+            jobs = 0;
+            gap = 300;
+            cache = false;
+            stream = false;
+            incremental = false;
+            parallel = false;
+            output_proc = NULL;
+            output_at_proc = NULL;
+            output_context = NULL;
+            cancel = NULL;
         }
     };
 #else
@@ -86,7 +160,80 @@ int winsay_say(WINSAY_DATA *data);
 // destroy WINSAY_DATA structure
 void winsay_destroy(WINSAY_DATA *data);
 
+// set an option of the long name without "--", such as "voice" and
+// "file-format". value is NULL for no argument
+int winsay_set_option(WINSAY_DATA *data, const char *name, const char *value);
+// set the text to say, in UTF-8
+int winsay_set_text(WINSAY_DATA *data, const char *text);
+
+// render the output file into a new buffer in memory, in the file format
+// of the options. free the buffer by winsay_free
+int winsay_render_to_buffer(WINSAY_DATA *data, void **buffer, size_t *size);
+void winsay_free(void *buffer);
+
+// the function to receive the blocks of winsay_render_stream. returns
+// zero to stop
+typedef int (*WINSAY_STREAM_PROC)(void *context, const void *data, size_t size);
+
+// render the output file as a stream, such as the WAVE file of the
+// unknown sizes, or the bare samples of the file format "raw". each block
+// is passed in the caller's buffer as soon as it is produced
+int winsay_render_stream(WINSAY_DATA *data, void *buffer, size_t buffer_size,
+                         WINSAY_STREAM_PROC proc, void *context);
+
+// the queue of the jobs to say or render in the background. the worker
+// threads take the jobs of the higher priority first, then of the earlier
+// deadline, then in the order of submission.
+typedef struct WINSAY_QUEUE WINSAY_QUEUE;
+typedef struct WINSAY_JOB WINSAY_JOB;
+
+enum WINSAY_PRIORITY
+{
+    WINSAY_PRIORITY_URGENT,     // stops a lower job if no worker is free
+    WINSAY_PRIORITY_NORMAL,
+    WINSAY_PRIORITY_BULK
+};
+
+enum WINSAY_JOB_STATE
+{
+    WINSAY_JOB_QUEUED,
+    WINSAY_JOB_RUNNING,
+    WINSAY_JOB_DONE,
+    WINSAY_JOB_FAILED,
+    WINSAY_JOB_CANCELLED,
+    WINSAY_JOB_EXPIRED          // the deadline was or would be missed
+};
+
+// the function called when a job is finished, in the thread that finished
+// it. state is WINSAY_JOB_DONE or later
+typedef void (*WINSAY_JOB_PROC)(void *context, WINSAY_JOB *job, int state);
+
+// workers is the number of the worker threads, or 0 for one. many
+// workers can speak aloud at the same time
+WINSAY_QUEUE *winsay_queue_create(int workers);
+// cancel all the jobs and wait for the workers
+void winsay_queue_destroy(WINSAY_QUEUE *queue);
+
+// submit a copy of data, of WINSAY_SAY or WINSAY_OUTPUT. the output file
+// "-" is rendered into the buffer of winsay_job_take_buffer. deadline is
+// in milliseconds from now, or 0 for none. proc can be NULL. release the
+// job by winsay_job_release. NULL on error
+WINSAY_JOB *winsay_queue_submit(WINSAY_QUEUE *queue, const WINSAY_DATA *data,
+                                int priority, int deadline,
+                                WINSAY_JOB_PROC proc, void *context);
+
+// stop the job, even in the middle of the speech
+void winsay_job_cancel(WINSAY_JOB *job);
+// wait for the job to finish, and return the state
+int winsay_job_wait(WINSAY_JOB *job);
+int winsay_job_state(WINSAY_JOB *job);
+// take the buffer of the output file "-" after WINSAY_JOB_DONE. free it by
+// winsay_free
+int winsay_job_take_buffer(WINSAY_JOB *job, void **buffer, size_t *size);
+void winsay_job_release(WINSAY_JOB *job);
+
 // automatically calls CoInitialize and CoUninitialize functions
+#ifdef _WIN32
 class winsay_co_init
 {
 public:
@@ -106,6 +253,15 @@ public:
         m_hr = S_FALSE;
     }
 };
+#else
+class winsay_co_init
+{
+public:
+    winsay_co_init()
+    {
+    }
+};
+#endif
 
 #ifdef __cplusplus
 } // extern "C"